@@ -13,6 +13,8 @@
   boost,
   gtest,
   capstone,
+  liburing,
+  zstd,
 }: let
   abseil-cpp-17 = abseil-cpp.override {
     cxxStandard = "17";
@@ -44,6 +46,8 @@ in stdenv.mkDerivation {
     boost
     gtest
     capstone
+    liburing
+    zstd
   ];
 
   NIX_CFLAGS_COMPILE = "-march=native";
@@ -7,6 +7,7 @@
 #include "hashtables/cas_kht.hpp"
 #include "hashtables/dlht_kht.hpp"
 #include "hashtables/folklore_kht.hpp"
+#include "hashtables/hybrid_kht.hpp"
 
 
 #ifdef GROWT
@@ -21,6 +22,10 @@
 #ifdef PART_ID
 #include "hashtables/multi_kht.hpp"
 #include "hashtables/simple_kht.hpp"
+// delegation messages carry a value
+#ifndef BQUEUE_KMER_TEST
+#include "hashtables/delegated_kht.hpp"
+#endif
 #endif
 
 #endif
@@ -3,13 +3,22 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <span>
 #include <string>
+#include <vector>
 
 #include "Latency.hpp"
+#include "plog/Log.h"
 #include "types.hpp"
 
 using namespace std;
 namespace kmercounter {
+
+extern Configuration config;
+
 class BaseHashTable {
  public:
   virtual bool insert(const void *data) = 0;
@@ -30,6 +39,96 @@ class BaseHashTable {
 
   virtual size_t flush_find_queue(ValuePairs &vp, collector_type* collector = nullptr) = 0;
 
+  // NEVER NEVER NEVER USE KEY OR ID 0
+  // Look up `keys` and write the value of keys[i] to out[i] and set bit i of
+  // `found_bitmap` if it is found; out[i] is left alone otherwise. Unlike
+  // find_batch(), the results come in request order and all lookups are
+  // complete on return, there is nothing to flush. Returns the number of
+  // keys found. Do not call it while find_batch() results are pending.
+  // The default runs on top of find_batch().
+  virtual size_t multi_get(std::span<const key_type> keys,
+                           std::span<value_type> out,
+                           std::span<uint8_t> found_bitmap,
+                           collector_type* collector = nullptr) {
+    check_multi_get(keys, out, found_bitmap);
+    thread_local std::vector<InsertFindArgument> args;
+    thread_local std::vector<FindResult> results;
+    const size_t chunk = std::max<uint32_t>(config.batch_len, 1);
+    if (args.size() < chunk) {
+      args.resize(chunk);
+      results.resize(chunk);
+    }
+
+    // ids start at 1, see the warning above
+    size_t found = 0;
+    auto scatter = [&](const ValuePairs& vp) {
+      for (uint32_t j = 0; j < vp.first; j++) {
+        out[results[j].id - 1] = results[j].value;
+        set_found(found_bitmap, results[j].id - 1);
+      }
+      found += vp.first;
+    };
+    for (size_t i = 0; i < keys.size(); i += chunk) {
+      size_t n = std::min(chunk, keys.size() - i);
+      for (size_t j = 0; j < n; j++) {
+        args[j] = {.key = keys[i + j], .value = 0, .id = (uint32_t)(i + j + 1)};
+      }
+      ValuePairs vp{0, results.data()};
+      this->find_batch(InsertFindArguments(args.data(), n), vp, collector);
+      scatter(vp);
+    }
+    size_t remaining;
+    do {
+      ValuePairs vp{0, results.data()};
+      remaining = this->flush_find_queue(vp, collector);
+      scatter(vp);
+    } while (remaining > 0);
+    return found;
+  }
+
+  // Erases are queued and prefetched like inserts, they are only guaranteed
+  // to be visible after flush_erase_queue(). They are ordered after this
+  // thread's earlier inserts, but not before its later ones.
+  virtual void erase_batch(const InsertFindArguments &kp, collector_type* collector = nullptr) {
+    PLOG_FATAL << "erase_batch is not implemented for this hashtable";
+    std::terminate();
+  }
+
+  virtual void flush_erase_queue(collector_type* collector = nullptr) {}
+
+  // Insert the keys of `kp` with their value as the count, or add the value
+  // to the stored count, i.e. upsert_batch<AddReducer>() of the tables that
+  // have it. For aggregating tables (Aggr_KV) that are fed counts instead of
+  // single occurrences. Only guaranteed to be visible after
+  // flush_add_queue().
+  virtual void add_batch(const InsertFindArguments &kp, collector_type* collector = nullptr) {
+    PLOG_FATAL << "add_batch is not implemented for this hashtable";
+    std::terminate();
+  }
+
+  virtual void flush_add_queue(collector_type* collector = nullptr) {}
+
+  // Reclaim the slots left behind by erased keys, returns how many were
+  // reclaimed. Must not run concurrently with any other operation.
+  virtual size_t compact() { return 0; }
+
+  // Copy the table to every NUMA node for read-mostly workloads, see
+  // ht_replicas.hpp. Call from one thread while no other operation runs.
+  // Returns false if the hashtable cannot be replicated.
+  virtual bool replicate() { return false; }
+
+  // Route this thread's finds to the replica on `node`, or back to the
+  // shared table if `node` is -1.
+  virtual bool use_replica(int node) { return false; }
+
+  // Change the queue depth and prefetch distance of this thread's insert or
+  // find pipeline. Returns false if the hashtable has no such pipeline or the
+  // values are out of range.
+  virtual bool set_queue_params(QueueType qtype, uint32_t depth,
+                                uint32_t distance) {
+    return false;
+  }
+
   virtual void display() const = 0;
 
   virtual size_t get_fill() const = 0;
@@ -51,6 +150,27 @@ class BaseHashTable {
 
   virtual ~BaseHashTable() {}
 
+ protected:
+  // Validate the spans of a multi_get() and clear the bitmap.
+  static void check_multi_get(std::span<const key_type> keys,
+                              std::span<value_type> out,
+                              std::span<uint8_t> found_bitmap) {
+    if (out.size() < keys.size() ||
+        found_bitmap.size() < (keys.size() + 7) / 8 ||
+        keys.size() >= UINT32_MAX) {
+      PLOG_FATAL.printf("multi_get of %lu keys into %lu values, %lu bitmap "
+                        "bytes", keys.size(), out.size(), found_bitmap.size());
+      std::terminate();
+    }
+    memset(found_bitmap.data(), 0, (keys.size() + 7) / 8);
+  }
+
+  static inline void set_found(std::span<uint8_t> found_bitmap, size_t i) {
+    found_bitmap[i >> 3] |= 1 << (i & 7);
+  }
+
+ public:
+
   uint64_t num_reprobes = 0;
   uint64_t num_soft_reprobes = 0;
   uint64_t num_memcmps = 0;
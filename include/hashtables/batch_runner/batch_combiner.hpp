@@ -0,0 +1,125 @@
+#ifndef BATCH_RUNNER_BATCH_COMBINER_HPP
+#define BATCH_RUNNER_BATCH_COMBINER_HPP
+
+#include <plog/Log.h>
+#include <x86intrin.h>
+
+#include <exception>
+#include <vector>
+
+#include "constants.hpp"
+#include "hashtables/base_kht.hpp"
+#include "types.hpp"
+
+namespace kmercounter {
+/// Counts keys in a small direct-mapped table before they reach an
+/// aggregating hashtable. Repeated keys are merged into one entry, and an
+/// entry is only written out, with its count, when another key takes its
+/// slot or on `flush()`. The entries are added to the hashtable in batches of
+/// `N` with `add_batch()`.
+///
+/// With a few thousand slots the table stays in L1/L2, and a frequent k-mer
+/// costs one shared update per eviction instead of one per occurrence.
+template <size_t N = HT_TESTS_BATCH_LENGTH>
+class HTBatchCombiner {
+ public:
+  struct Stats {
+    // Keys counted with insert().
+    uint64_t inserts = 0;
+    // Inserts merged into an entry that was already there.
+    uint64_t combined = 0;
+    // Entries added to the hashtable.
+    uint64_t spilled = 0;
+  };
+
+  HTBatchCombiner(BaseHashTable* ht, uint32_t num_slots)
+      : ht_(ht), slots_(num_slots), mask_(num_slots - 1) {
+    if (num_slots == 0 || (num_slots & (num_slots - 1))) {
+      PLOG_FATAL.printf("combiner slots (%u) must be a power of two",
+                        num_slots);
+      std::terminate();
+    }
+  }
+  ~HTBatchCombiner() {
+    if (ht_ != nullptr) {
+      flush();
+    }
+  }
+
+  /// Count one occurrence of `key`.
+  inline void insert(const uint64_t key) {
+    stats_.inserts++;
+    Slot& slot = slots_[_mm_crc32_u64(0, key) & mask_];
+    if (slot.count != 0) {
+      if (slot.key == key) {
+        slot.count++;
+        stats_.combined++;
+        return;
+      }
+      spill(slot);
+    }
+    slot.key = key;
+    slot.count = 1;
+  }
+
+  /// Write out every entry and flush the hashtable's add queue.
+  void flush() {
+    for (Slot& slot : slots_) {
+      if (slot.count != 0) {
+        spill(slot);
+      }
+    }
+    if (buffer_size_ > 0) {
+      flush_buffer();
+    }
+    ht_->flush_add_queue();
+  }
+
+  const Stats& stats() const { return stats_; }
+
+  /// Share of the inserts that never reached the hashtable on their own.
+  double combine_ratio() const {
+    return stats_.inserts ? (double)stats_.combined / stats_.inserts : 0.0;
+  }
+
+ private:
+  struct Slot {
+    uint64_t key;
+    // 0 if the slot is free, so that key 0 can be counted too.
+    uint64_t count;
+  };
+
+  inline void spill(Slot& slot) {
+    buffer_[buffer_size_].key = slot.key;
+    buffer_[buffer_size_].value = slot.count;
+    buffer_size_++;
+    slot.count = 0;
+    stats_.spilled++;
+
+    if (buffer_size_ >= N) {
+      flush_buffer();
+    }
+  }
+
+  // Add the buffered entries without checking `buffer_size_`.
+  void flush_buffer() {
+    ht_->add_batch(InsertFindArguments(buffer_, buffer_size_));
+    buffer_size_ = 0;
+  }
+
+  // Target hashtable.
+  BaseHashTable* ht_ = nullptr;
+  // The combining table.
+  std::vector<Slot> slots_;
+  uint64_t mask_;
+  // Entries on their way to the hashtable.
+  __attribute__((aligned(64))) InsertFindArgument buffer_[N] = {};
+  // Current size of the buffer.
+  size_t buffer_size_ = 0;
+  Stats stats_;
+
+  // Sanity checks
+  static_assert(N > 0);
+};
+}  // namespace kmercounter
+#endif  // BATCH_RUNNER_BATCH_COMBINER_HPP
@@ -13,11 +13,13 @@ class HTBatchInserter {
   HTBatchInserter(BaseHashTable* ht) : ht_(ht), buffer_(), buffer_size_(0) {}
   ~HTBatchInserter() { flush(); }
 
-  // Insert one kv pair.
-  inline void insert(const uint64_t key, const uint64_t value) {
+  // Insert one kv pair. `part_id` is only used by tables that route by it.
+  inline void insert(const uint64_t key, const uint64_t value,
+                     const uint32_t part_id = 0) {
     // Append kv to `buffer_`
     buffer_[buffer_size_].key = key;
     buffer_[buffer_size_].value = value;
+    buffer_[buffer_size_].part_id = part_id;
     buffer_size_++;
 
     // Flush if `buffer_` is full.
@@ -30,6 +32,10 @@ class HTBatchInserter {
     ht_->insert_noprefetch((void*) &kv);
   }
 
+  inline void insert_noprefetch(const InsertFindArgument &arg) {
+    ht_->insert_noprefetch((void*) &arg);
+  }
+
   // Flush everything to the hashtable and flush the hashtable insert queue.
   inline void flush() {
     if (buffer_size_ > 0) {
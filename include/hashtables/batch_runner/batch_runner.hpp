@@ -31,6 +31,20 @@ class HTBatchRunner : public HTBatchInserter<N>, public HTBatchFinder<N> {
     }
   }
 
+  /// Insert one kv pair into partition `part_id`, for the tables that let
+  /// the caller pick it (e.g. the delegated table with
+  /// `config.minimizer_len`).
+  void insert(const uint64_t key, const uint64_t value,
+              const uint32_t part_id) {
+    if (config.no_prefetch) {
+      InsertFindArgument arg{.key = key, .value = value, .id = 0,
+                             .part_id = part_id};
+      HTBatchInserter<N>::insert_noprefetch(arg);
+    } else {
+      HTBatchInserter<N>::insert(key, value, part_id);
+    }
+  }
+
   /// Insert one kv pair.
   inline void insert(const KeyValuePair& kv) {
     if (config.no_prefetch) {
@@ -13,8 +13,11 @@
 
 #include <xmmintrin.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -24,8 +27,12 @@
 #include "hasher.hpp"
 #include "helper.hpp"
 #include "ht_helper.hpp"
+#include "hashtables/ht_reclaim.hpp"
+#include "hashtables/ht_replicas.hpp"
+#include "hashtables/reducers.hpp"
 #include "plog/Log.h"
 #include "sync.h"
+#include "utils/coro_executor.hpp"
 #include "xorwow.hpp"
 
 namespace kmercounter {
@@ -58,15 +65,70 @@ class CASHashTable : public BaseHashTable {
   uint32_t FIND_QUEUE_SZ_MASK;
   uint64_t HT_BUCKET_MASK;
 
+  /// Pipeline parameters of this thread, see set_queue_params(). A queue is
+  /// popped once it holds `*_queue_limit` entries.
+  uint32_t insert_queue_limit;
+  uint32_t find_queue_limit;
+  uint32_t insert_prefetch_distance;
+  uint32_t find_prefetch_distance;
+
   const static __mmask8 KEYMSK = 0b01010101;
 // #define KEYMSK ((__mmask8)(0b01010101))
+// default DOUBLE_PREFETCH distances
 #define PREFETCH_INSERT_NEXT_DISTANCE 8
 #define PREFETCH_FIND_NEXT_DISTANCE 8
 
+#if defined(CAS_RESIZE) && defined(UNIFORM_HT_SUPPORT)
+#error "online resize only supports linear probing"
+#endif
+
+// CAS_RECLAIM: without the online resize, reclaim the tombstones left by
+// erases by stopping the world, see ht_reclaim.hpp. It costs every operation
+// a fenced store, so it is opt-in, for runs that erase. Compaction does not
+// support the uniform rehashing.
+#if defined(CAS_RECLAIM) && defined(CAS_RESIZE)
+#error "CAS_RECLAIM and CAS_RESIZE both reclaim the tombstones, pick one"
+#endif
+#if defined(CAS_RECLAIM) && defined(UNIFORM_HT_SUPPORT)
+#error "tombstone reclamation only supports linear probing"
+#endif
+
+#ifdef CAS_RESIZE
+  /// Online resize. Once the number of occupied slots crosses
+  /// RESIZE_LOAD_FACTOR percent of the capacity, the table doubles. The new
+  /// table is allocated while the other threads keep working on the old one;
+  /// the switch only waits for the batches that are already in flight (every
+  /// thread announces the table generation it works on, see `resize_slot`).
+  /// After the switch, the old table is migrated in chunks of
+  /// RESIZE_CHUNK_SLOTS slots by whichever threads call into the hashtable,
+  /// and finds that miss in the new table fall back to the old one until the
+  /// migration is complete (and probe the new one again if it completed in
+  /// the middle of the find). Threads only stall if the table reaches
+  /// RESIZE_HARD_LOAD_FACTOR before the previous resize is done.
+  static_assert(sizeof(KV) == 16, "online resize needs 16B key-value slots");
+  constexpr static uint64_t RESIZE_LOAD_FACTOR = 75;       // percent
+  constexpr static uint64_t RESIZE_HARD_LOAD_FACTOR = 90;  // percent
+  constexpr static uint64_t RESIZE_CHUNK_SLOTS = 1024;
+  constexpr static uint32_t RESIZE_CHUNKS_PER_BATCH = 1;
+  constexpr static uint32_t RESIZE_FILL_BATCH = 64;
+  constexpr static uint32_t RESIZE_MAX_THREADS = 256;
+#endif
+
   CASHashTable(uint64_t c) : CASHashTable(c, 8, 0) {};
 
   CASHashTable(uint64_t c, uint32_t queue_sz, uint8_t tid)
-      : fd(-1), id(1), find_head(0), find_tail(0), ins_head(0), ins_tail(0) {
+      : fd(-1),
+        id(1),
+        find_head(0),
+        find_tail(0),
+        ins_head(0),
+        ins_tail(0),
+        ers_head(0),
+        ers_tail(0),
+        ups_head(0),
+        ups_tail(0),
+        upsert_flush(nullptr),
+        coro(std::min<uint32_t>(queue_sz, CoroExecutor::MAX_GROUP)) {
     this->capacity = kmercounter::utils::next_pow2(c);
     if (capacity % KV_IN_CACHELINE != 0) {
       PLOGE.printf("Capacity %lu is not a multiple of KV_IN_CACHELINE %d\n",
@@ -94,8 +156,28 @@ class CASHashTable : public BaseHashTable {
             (this->capacity * sizeof(KV)) / (1024ULL * 1024ULL * 1024ULL));
         PLOGI.printf("queue sz: %lu, queue item sz: %d", find_queue_sz,
                      sizeof(KVQ));
+#ifdef CAS_RESIZE
+        resize_gen = make_resize_gen(1, this->capacity);
+#endif
       }
       this->ref_cnt++;
+#ifdef CAS_RESIZE
+      if (num_resize_slots >= RESIZE_MAX_THREADS) {
+        PLOGE.printf("online resize supports at most %u threads",
+                     RESIZE_MAX_THREADS);
+        abort();
+      }
+      this->resize_slot_id = num_resize_slots++;
+      // The table might have grown already, pick up its current size on the
+      // first operation.
+      this->local_gen = 0;
+      this->local_fill = 0;
+      this->local_tombstones = 0;
+      this->snap_gen = 0;
+      this->snap_state = RESIZE_IDLE;
+#elif defined(CAS_RECLAIM)
+      this->reclaim_handle = reclaimer.join(this->capacity);
+#endif
     }
 
     this->tid = sched_getcpu();
@@ -108,33 +190,79 @@ class CASHashTable : public BaseHashTable {
     this->insert_queue =
         (KVQ *)(aligned_alloc(64, insert_queue_sz * sizeof(KVQ)));
     this->find_queue = (KVQ *)(aligned_alloc(64, find_queue_sz * sizeof(KVQ)));
+    this->erase_queue =
+        (KVQ *)(aligned_alloc(64, insert_queue_sz * sizeof(KVQ)));
+    this->upsert_queue =
+        (KVQ *)(aligned_alloc(64, insert_queue_sz * sizeof(KVQ)));
     this->FIND_QUEUE_SZ_MASK = this->find_queue_sz - 1;
     this->INSERT_QUEUE_SZ_MASK = this->insert_queue_sz - 1;
+    this->find_queue_limit = this->FIND_QUEUE_SZ_MASK;
+    this->insert_queue_limit = this->INSERT_QUEUE_SZ_MASK;
+    this->find_prefetch_distance = PREFETCH_FIND_NEXT_DISTANCE;
+    this->insert_prefetch_distance = PREFETCH_INSERT_NEXT_DISTANCE;
 
     this->HT_BUCKET_MASK =
         (uint32_t)((this->capacity - 1) & ~(KEYS_IN_CACHELINE_MASK));
+    this->find_table = this->hashtable;
   }
 
   ~CASHashTable() {
     free(find_queue);
     free(insert_queue);
+    free(erase_queue);
+    free(upsert_queue);
 
     // Deallocate the global hashtable if ref_cnt goes down to zero.
     {
       const std::lock_guard<std::mutex> lock(ht_init_mutex);
+#ifdef CAS_RECLAIM
+      reclaimer.leave(this->reclaim_handle);
+#endif
       this->ref_cnt--;
       if (this->ref_cnt == 0) {
-        free_mem<KV>(this->hashtable, this->capacity, this->id, this->fd);
+        replicas.drop();
+        free_mem<KV>(this->hashtable, this->table_capacity(), this->id,
+                     this->fd);
         this->hashtable = nullptr;
+#ifdef CAS_RESIZE
+        if (old_hashtable) {
+          free_mem<KV>(old_hashtable, old_capacity, this->id, this->fd);
+          old_hashtable = nullptr;
+        }
+        old_capacity = 0;
+        resize_gen = 0;
+        resize_fill = 0;
+        resize_tombstones = 0;
+        resize_state = RESIZE_IDLE;
+        num_resize_slots = 0;
+#elif defined(CAS_RECLAIM)
+        reclaimer.reset();
+#endif
       }
     }
   }
 
-  void clear() override { memset(this->hashtable, 0, capacity * sizeof(KV)); }
+  void clear() override {
+    memset(this->hashtable, 0, this->table_capacity() * sizeof(KV));
+#ifdef CAS_RESIZE
+    resize_fill = 0;
+    resize_tombstones = 0;
+#elif defined(CAS_RECLAIM)
+    reclaimer.note_compacted();
+#endif
+  }
 
   void prefetch_queue(QueueType qtype) override {}
 
   void insert_noprefetch(const void *data, collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    if (!insertable_key(reinterpret_cast<const KVQ *>(data)->key)) {
+      return;
+    }
 #ifdef LATENCY_COLLECTION
     const auto timer_start = collector->sync_start();
 #endif
@@ -151,6 +279,9 @@ class CASHashTable : public BaseHashTable {
       if (curr->is_empty()) {
         bool cas_res = curr->insert_cas(elem);
         if (cas_res) {
+#ifdef CAS_RESIZE
+          resize_note_insert();
+#endif
           break;
         } else {
           goto retry;
@@ -188,7 +319,7 @@ class CASHashTable : public BaseHashTable {
 #endif
     while (curr_queue_sz > INS_FLUSH_THRESHOLD) {
 #ifdef DOUBLE_PREFETCH
-      next_tail = (this->ins_tail + PREFETCH_INSERT_NEXT_DISTANCE) &
+      next_tail = (this->ins_tail + this->insert_prefetch_distance) &
                   INSERT_QUEUE_SZ_MASK;
       next_tail_addr = &this->hashtable[this->insert_queue[next_tail].idx];
       __builtin_prefetch(next_tail_addr, true, 3);
@@ -209,7 +340,7 @@ class CASHashTable : public BaseHashTable {
 #endif
     do {
 #ifdef DOUBLE_PREFETCH
-      next_tail = (this->ins_tail + PREFETCH_INSERT_NEXT_DISTANCE) &
+      next_tail = (this->ins_tail + this->insert_prefetch_distance) &
                   INSERT_QUEUE_SZ_MASK;
       next_tail_addr = &this->hashtable[this->insert_queue[next_tail].idx];
       __builtin_prefetch(next_tail_addr, true, 3);
@@ -221,10 +352,139 @@ class CASHashTable : public BaseHashTable {
     } while ((retry));
   }
 
+  /// Pop the entries left above a depth that set_queue_params() lowered.
+  inline void trim_insert_queue(collector_type *collector) {
+    while (get_insert_queue_sz() > this->insert_queue_limit) {
+      pop_insert_queue(collector);
+    }
+  }
+
+  /// Change the depth and DOUBLE_PREFETCH distance of this thread's insert
+  /// or find pipeline. `depth` is capped by the queue size the table was
+  /// created with; a lower depth takes effect as the next batches drain the
+  /// queue. DRAMHiT_2023 flushes at fixed thresholds and only uses the
+  /// distance.
+  bool set_queue_params(QueueType qtype, uint32_t depth,
+                        uint32_t distance) override {
+    if (qtype == QueueType::insert_queue) {
+      if (depth < 2 || depth > this->insert_queue_sz) {
+        return false;
+      }
+      this->insert_queue_limit = depth - 1;
+      this->insert_prefetch_distance = distance;
+    } else {
+      if (depth < 2 || depth > this->find_queue_sz) {
+        return false;
+      }
+      this->find_queue_limit = depth - 1;
+      this->find_prefetch_distance = distance;
+    }
+    return true;
+  }
+
+  /// Coroutine engine, an alternative to the insert/find queues: every key
+  /// is probed by a coroutine (see coro_executor.hpp) and `group` of them
+  /// are interleaved. Unlike insert_batch()/find_batch(), all operations of
+  /// the batch are complete when these return, so there is nothing to flush
+  /// and `vp` receives at most `kp.size()` results. The online resize and
+  /// UNIFORM_HT_SUPPORT rehashing are only implemented by the queue engine,
+  /// which these fall back to.
+  bool set_coro_group(uint32_t group) { return this->coro.set_group(group); }
+
+  void insert_batch_coro(const InsertFindArguments &kp,
+                         collector_type *collector = nullptr) {
+#if defined(CAS_RESIZE) || defined(UNIFORM_HT_SUPPORT)
+    this->insert_batch(kp, collector);
+    this->flush_insert_queue(collector);
+#else
+#ifdef CAS_RECLAIM
+    ReclaimGuard guard(this);
+#endif
+    this->coro.run(kp.size(), [&](size_t i) {
+      return this->insert_coro(kp[i].key, kp[i].value);
+    });
+#endif
+  }
+
+  void find_batch_coro(const InsertFindArguments &kp, ValuePairs &vp,
+                       collector_type *collector = nullptr) {
+#if defined(CAS_RESIZE) || defined(UNIFORM_HT_SUPPORT)
+    this->find_batch(kp, vp, collector);
+    while (this->flush_find_queue(vp, collector) > 0) {
+    }
+#else
+#ifdef CAS_RECLAIM
+    ReclaimGuard guard(this);
+#endif
+    this->coro.run(kp.size(), [&](size_t i) {
+      return this->find_coro(kp[i].key, [&vp, id = kp[i].id](value_type v) {
+        vp.second[vp.first].id = id;
+        vp.second[vp.first].value = v;
+        vp.first++;
+      });
+    });
+#endif
+  }
+
+  /// Native multi_get() on the coroutine engine, the values are written
+  /// straight into `out`.
+  size_t multi_get(std::span<const key_type> keys, std::span<value_type> out,
+                   std::span<uint8_t> found_bitmap,
+                   collector_type *collector = nullptr) override {
+#if defined(CAS_RESIZE) || defined(UNIFORM_HT_SUPPORT)
+    return BaseHashTable::multi_get(keys, out, found_bitmap, collector);
+#else
+#ifdef CAS_RECLAIM
+    ReclaimGuard guard(this);
+#endif
+    this->check_multi_get(keys, out, found_bitmap);
+    size_t found = 0;
+    this->coro.run(keys.size(), [&](size_t i) {
+      return this->find_coro(keys[i], [&, i](value_type v) {
+        out[i] = v;
+        set_found(found_bitmap, i);
+        found++;
+      });
+    });
+    return found;
+#endif
+  }
+
+  /// Snapshot the table to every NUMA node. The replicas are not kept up to
+  /// date with later inserts, and rebuilding them invalidates the ones the
+  /// threads use; call again and re-route the threads after an insert phase.
+  bool replicate() override {
+#ifdef CAS_RESIZE
+    PLOGW.printf("replication is not supported with online resize");
+    return false;
+#else
+    replicas.build(this->hashtable, this->capacity);
+    return true;
+#endif
+  }
+
+  bool use_replica(int node) override {
+    if (node < 0) {
+      this->find_table = this->hashtable;
+      return true;
+    }
+    KV *replica = replicas.get(node);
+    if (!replica) {
+      return false;
+    }
+    this->find_table = replica;
+    return true;
+  }
+
 #if defined(DRAMHiT_2023)
 
   // insert a batch
   void insert_batch(const InsertFindArguments &kp, collector_type *collector) {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
     this->flush_if_needed(collector);
 
     for (auto &data : kp) {
@@ -242,19 +502,25 @@ class CASHashTable : public BaseHashTable {
 #else
   void insert_batch(const InsertFindArguments &kp, collector_type *collector) {
 #endif
-    if ((get_insert_queue_sz() >= INSERT_QUEUE_SZ_MASK)) {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    if ((get_insert_queue_sz() >= this->insert_queue_limit)) {
       for (auto &data : kp) {
         pop_insert_queue(collector);
         add_to_insert_queue(&data, collector);
       }
     } else {
       for (auto &data : kp) {
-        if ((get_insert_queue_sz() >= INSERT_QUEUE_SZ_MASK)) {
+        if ((get_insert_queue_sz() >= this->insert_queue_limit)) {
           pop_insert_queue(collector);
         }
         add_to_insert_queue(&data, collector);
       }
     }
+    trim_insert_queue(collector);
   }
 
 #elif defined(DRAMHiT_2025_INLINED)
@@ -266,22 +532,31 @@ class CASHashTable : public BaseHashTable {
                            collector_type *collector) {
 #else
   void insert_batch(const InsertFindArguments &kp, collector_type *collector) {
+#endif
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
 #endif
     bool fast_path = (((ins_head - ins_tail) & INSERT_QUEUE_SZ_MASK) >=
-                      (insert_queue_sz - 1));
+                      this->insert_queue_limit);
     if (fast_path) {
       // TODo lift head and tail out to local var
 
       uint32_t head = this->ins_head;
       uint32_t tail = this->ins_tail;
       for (auto &data : kp) {
+        // skipped before the pop, so that the queue stays full
+        if (!insertable_key(data.key)) [[unlikely]] {
+          continue;
+        }
         // pop
         {
           uint64_t retry = 0;
           do {
 #ifdef DOUBLE_PREFETCH
             uint32_t next_tail =
-                (tail + PREFETCH_INSERT_NEXT_DISTANCE) & INSERT_QUEUE_SZ_MASK;
+                (tail + this->insert_prefetch_distance) & INSERT_QUEUE_SZ_MASK;
             const void *next_tail_addr =
                 &this->hashtable[this->insert_queue[next_tail].idx];
 
@@ -328,6 +603,9 @@ class CASHashTable : public BaseHashTable {
 #endif
                 if (__sync_bool_compare_and_swap((__int128 *)curr, 0,
                                                  *(__int128 *)q)) {
+#ifdef CAS_RESIZE
+                  resize_note_insert();
+#endif
                   break;
                 }
 
@@ -420,27 +698,43 @@ class CASHashTable : public BaseHashTable {
     } else {
       for (auto &data : kp) {
         if (((ins_head - ins_tail) & INSERT_QUEUE_SZ_MASK) >=
-            (insert_queue_sz - 1)) {
+            this->insert_queue_limit) {
           pop_insert_queue(collector);
         }
         add_to_insert_queue(&data, collector);
       }
     }  // end slow path
+    trim_insert_queue(collector);
   }  // end insert unrolled
 #endif
 
   void flush_insert_queue(collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
     size_t curr_queue_sz = get_insert_queue_sz();
     while (curr_queue_sz > 0) {
       pop_insert_queue(collector);
       curr_queue_sz--;
     }
 
+#ifdef CAS_RESIZE
+    // Nothing may be left in the old table once the inserts are flushed.
+    resize_drain();
+#endif
+
     // all store must be flushed.
     _mm_sfence();
   }
 
   size_t flush_find_queue(ValuePairs &vp, collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
     size_t curr_queue_sz = get_find_queue_sz();
     while ((curr_queue_sz > 0) && (vp.first < config.batch_len)) {
       pop_find_queue(vp, collector);  // gurantee to reduce curr_queue_sz
@@ -464,8 +758,8 @@ class CASHashTable : public BaseHashTable {
            (vp.first < config.batch_len)) {  // 32 64 16
 #ifdef DOUBLE_PREFETCH
       next_tail =
-          (this->find_tail + PREFETCH_FIND_NEXT_DISTANCE) & FIND_QUEUE_SZ_MASK;
-      next_tail_addr = &this->hashtable[this->find_queue[next_tail].idx];
+          (this->find_tail + this->find_prefetch_distance) & FIND_QUEUE_SZ_MASK;
+      next_tail_addr = &this->find_slots()[this->find_queue[next_tail].idx];
       __builtin_prefetch(next_tail_addr, false, 3);
 #endif
 
@@ -486,8 +780,8 @@ class CASHashTable : public BaseHashTable {
     do {
 #ifdef DOUBLE_PREFETCH
       next_tail =
-          (this->find_tail + PREFETCH_FIND_NEXT_DISTANCE) & FIND_QUEUE_SZ_MASK;
-      next_tail_addr = &this->hashtable[this->find_queue[next_tail].idx];
+          (this->find_tail + this->find_prefetch_distance) & FIND_QUEUE_SZ_MASK;
+      next_tail_addr = &this->find_slots()[this->find_queue[next_tail].idx];
       __builtin_prefetch(next_tail_addr, false, 3);
 #endif
       retry = __find_one(&this->find_queue[this->find_tail], vp, collector);
@@ -497,9 +791,22 @@ class CASHashTable : public BaseHashTable {
     } while ((retry));
   }
 
+  /// Like trim_insert_queue(), as long as `vp` has room for the results.
+  inline void trim_find_queue(ValuePairs &vp, collector_type *collector) {
+    while (get_find_queue_sz() > this->find_queue_limit &&
+           vp.first < config.batch_len) {
+      pop_find_queue(vp, collector);
+    }
+  }
+
 #if defined(DRAMHiT_2023)
   void find_batch(const InsertFindArguments &kp, ValuePairs &values,
                   collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
     this->flush_if_needed(values, collector);
 
     //
@@ -528,16 +835,21 @@ class CASHashTable : public BaseHashTable {
   void find_batch(const InsertFindArguments &kp, ValuePairs &values,
                   collector_type *collector) {
 #endif
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
 
 #if defined(FAST_PATH)
-    if ((get_find_queue_sz() >= FIND_QUEUE_SZ_MASK)) {
+    if ((get_find_queue_sz() >= this->find_queue_limit)) {
       for (auto &data : kp) {
         pop_find_queue(values, collector);
         add_to_find_queue(&data, collector);
       }
     } else {
       for (auto &data : kp) {
-        if ((get_find_queue_sz() >= FIND_QUEUE_SZ_MASK)) {
+        if ((get_find_queue_sz() >= this->find_queue_limit)) {
           pop_find_queue(values, collector);
         }
         add_to_find_queue(&data, collector);
@@ -545,12 +857,13 @@ class CASHashTable : public BaseHashTable {
     }
 #else
     for (auto &data : kp) {
-      if ((get_find_queue_sz() >= FIND_QUEUE_SZ_MASK)) {
+      if ((get_find_queue_sz() >= this->find_queue_limit)) {
         pop_find_queue(values, collector);
       }
       add_to_find_queue(&data, collector);
     }
 #endif
+    trim_find_queue(values, collector);
   }
 
 #elif defined(DRAMHiT_2025_INLINED)
@@ -566,9 +879,14 @@ class CASHashTable : public BaseHashTable {
 #else
   void find_batch(const InsertFindArguments &kp, ValuePairs &vp,
                   collector_type *collector) {
+#endif
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
 #endif
     bool fast_path = ((this->find_head - this->find_tail) &
-                      FIND_QUEUE_SZ_MASK) >= (find_queue_sz - 1);
+                      FIND_QUEUE_SZ_MASK) >= this->find_queue_limit;
     // fast path
     if (fast_path) [[likely]] {
       __m512i zero_vector = _mm512_setzero_si512();
@@ -585,20 +903,24 @@ class CASHashTable : public BaseHashTable {
       uint64_t hash;
       // c++ iterator is faster than a regular integer loop.
       for (auto &data : kp) {
+        if (data.key == TOMBSTONE_KEY) [[unlikely]] {
+          not_found++;
+          continue;
+        }
       retry:
 
 #ifdef DOUBLE_PREFETCH
         // Prefetch next tail bucket
-        uint32_t next_tail = (tail + PREFETCH_FIND_NEXT_DISTANCE) & FIND_QUEUE_SZ_MASK;
+        uint32_t next_tail = (tail + this->find_prefetch_distance) & FIND_QUEUE_SZ_MASK;
         const void *next_tail_addr =
-            &this->hashtable[this->find_queue[next_tail].idx];
+            &this->find_slots()[this->find_queue[next_tail].idx];
         __builtin_prefetch(next_tail_addr, false, 3);
 #endif
         q = &this->find_queue[tail];
         uint32_t idx = q->idx;
         key = q->key;
 
-        bucket = (uint64_t *)&this->hashtable[idx];
+        bucket = (uint64_t *)&this->find_slots()[idx];
         key_vector = _mm512_set1_epi64(key);
         cacheline = _mm512_load_si512(bucket);
 
@@ -646,6 +968,12 @@ class CASHashTable : public BaseHashTable {
             goto retry;
           } else {
             not_found++;
+#ifdef CAS_RESIZE
+            if (resize_find_old(key, q->key_id, vp_result)) {
+              vp_result++;
+              not_found--;
+            }
+#endif
           }
         }
 
@@ -684,17 +1012,27 @@ class CASHashTable : public BaseHashTable {
     }  // end of fast path
     else [[unlikely]] {  // slow paths
       for (auto &data : kp) {
-        if ((get_find_queue_sz() >= FIND_QUEUE_SZ_MASK)) {
+        if ((get_find_queue_sz() >= this->find_queue_limit)) {
           pop_find_queue(vp, collector);
         }
         add_to_find_queue(&data, collector);
       }
     }
+    trim_find_queue(vp, collector);
   }  // end unrolled
 
 #endif
 
   void *find_noprefetch(const void *data, collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    if (reinterpret_cast<const InsertFindArgument *>(data)->key ==
+        TOMBSTONE_KEY) {
+      return nullptr;
+    }
 #ifdef CALC_STATS
     uint64_t distance_from_bucket = 0;
 #endif
@@ -714,7 +1052,7 @@ class CASHashTable : public BaseHashTable {
     // this->thread_id, idx);
     for (auto i = 0u; i < this->capacity; i++) {
       idx = idx & (this->capacity - 1);
-      curr = &this->hashtable[idx];
+      curr = &this->find_slots()[idx];
 
       if (curr->is_empty()) {
         found = false;
@@ -740,6 +1078,13 @@ class CASHashTable : public BaseHashTable {
     collector->sync_end(timer_start);
 #endif
 
+#ifdef CAS_RESIZE
+    if (!found) {
+      curr = resize_lookup_old(item->key);
+      found = (curr != nullptr);
+    }
+#endif
+
     // return empty_element if nothing is found
     if (!found) {
       // printf("key %" PRIu64 " not found at idx %" PRIu64 " | hash %" PRIu64
@@ -751,9 +1096,135 @@ class CASHashTable : public BaseHashTable {
     return curr;
   }
 
+  /// Erased keys leave a tombstone behind: the table is shared and
+  /// lock-free, so entries cannot be shifted back while other threads are
+  /// probing. Tombstones are skipped by finds and never reused by inserts.
+  /// With CAS_RECLAIM, the table compacts itself once they take up a share
+  /// of it (see ht_reclaim.hpp); with the online resize, the migration
+  /// reclaims them instead (and rebuilds the table at the same size if it is
+  /// mostly tombstones). Otherwise only compact() reclaims them.
+  void erase_batch(const InsertFindArguments &kp,
+                   collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+    // A key that is still in the old table would come back with the
+    // migration.
+    resize_drain();
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    // Do not overtake this thread's own pending inserts.
+    for (size_t pending = get_insert_queue_sz(); pending > 0; pending--) {
+      pop_insert_queue(collector);
+    }
+    if (this->upsert_flush) {
+      (this->*upsert_flush)(collector);
+    }
+
+    for (auto &data : kp) {
+      if (get_erase_queue_sz() >= INSERT_QUEUE_SZ_MASK) {
+        pop_erase_queue(collector);
+      }
+      add_to_erase_queue(&data, collector);
+    }
+#ifdef CAS_RESIZE
+    resize_note_erase();
+#endif
+  }
+
+  void flush_erase_queue(collector_type *collector) override {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+    resize_drain();
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    while (get_erase_queue_sz() > 0) {
+      pop_erase_queue(collector);
+    }
+#ifdef CAS_RESIZE
+    resize_note_erase();
+#endif
+
+    _mm_sfence();
+  }
+
+  /// Insert the keys of `kp`, or merge their values into the stored ones with
+  /// `Reducer` (see reducers.hpp). Pipelined like insert_batch(), through a
+  /// queue of its own; switching to another reducer flushes the upserts that
+  /// are still pending.
+  template <class Reducer>
+  void upsert_batch(const InsertFindArguments &kp,
+                    collector_type *collector = nullptr) {
+    static_assert(sizeof(KV) == 16, "upserts insert with a 16B CAS");
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+    // The migration cannot merge with `Reducer`.
+    resize_drain();
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    upsert_use<Reducer>(collector);
+
+    for (auto &data : kp) {
+      if (get_upsert_queue_sz() >= INSERT_QUEUE_SZ_MASK) {
+        pop_upsert_queue<Reducer>(collector);
+      }
+      add_to_upsert_queue(&data, collector);
+    }
+  }
+
+  void flush_upsert_queue(collector_type *collector = nullptr) {
+#ifdef CAS_RESIZE
+    ResizeGuard guard(this);
+    resize_drain();
+#elif defined(CAS_RECLAIM)
+    ReclaimGuard guard(this);
+#endif
+    if (this->upsert_flush) {
+      (this->*upsert_flush)(collector);
+    }
+
+    _mm_sfence();
+  }
+
+  void add_batch(const InsertFindArguments &kp,
+                 collector_type *collector = nullptr) override {
+    if constexpr (reducible_kv<KV> && sizeof(KV) == 16) {
+      this->template upsert_batch<AddReducer>(kp, collector);
+    } else {
+      BaseHashTable::add_batch(kp, collector);
+    }
+  }
+
+  void flush_add_queue(collector_type *collector = nullptr) override {
+    if constexpr (reducible_kv<KV> && sizeof(KV) == 16) {
+      this->flush_upsert_queue(collector);
+    }
+  }
+
+  size_t compact() override {
+#ifdef UNIFORM_HT_SUPPORT
+    PLOGE.printf("compaction only supports linear probing");
+    return 0;
+#endif
+    const uint64_t capacity = this->table_capacity();
+    const size_t reclaimed = compact_tombstones(
+        this->hashtable, capacity,
+        [this, capacity](uint64_t key) { return home_slot(key, capacity); });
+#ifdef CAS_RESIZE
+    resize_fill -= std::min<uint64_t>(reclaimed, resize_fill);
+    resize_tombstones -= std::min<uint64_t>(reclaimed, resize_tombstones);
+#elif defined(CAS_RECLAIM)
+    reclaimer.note_compacted();
+#endif
+    PLOGV.printf("compaction reclaimed %lu slots", reclaimed);
+    return reclaimed;
+  }
+
   void display() const override {
-    for (size_t i = 0; i < this->capacity; i++) {
-      if (!this->hashtable[i].is_empty()) {
+    for (size_t i = 0; i < this->table_capacity(); i++) {
+      if (!this->hashtable[i].is_empty() && !this->hashtable[i].is_tombstone()) {
         cout << this->hashtable[i] << endl;
       }
     }
@@ -761,8 +1232,9 @@ class CASHashTable : public BaseHashTable {
 
   size_t get_fill() const override {
     size_t count = 0;
-    for (size_t i = 0; i < this->capacity; i++) {
-      if (!this->hashtable[i].is_empty()) {
+    for (size_t i = 0; i < this->table_capacity(); i++) {
+      if (!this->hashtable[i].is_empty() &&
+          !this->hashtable[i].is_tombstone()) {
         count++;
       }
     }
@@ -770,17 +1242,18 @@ class CASHashTable : public BaseHashTable {
   }
 
   void flush_ht_from_cache() {
-    for (size_t i = 0; i < this->capacity; i += 4) {
+    for (size_t i = 0; i < this->table_capacity(); i += 4) {
       _mm_clflush(&this->hashtable[i]);
     }
   }
 
-  size_t get_capacity() const override { return this->capacity; }
+  size_t get_capacity() const override { return this->table_capacity(); }
 
   size_t get_max_count() const override {
     size_t count = 0;
-    for (size_t i = 0; i < this->capacity; i++) {
-      if (this->hashtable[i].get_value() > count) {
+    for (size_t i = 0; i < this->table_capacity(); i++) {
+      if (!this->hashtable[i].is_tombstone() &&
+          this->hashtable[i].get_value() > count) {
         count = this->hashtable[i].get_value();
       }
     }
@@ -795,7 +1268,8 @@ class CASHashTable : public BaseHashTable {
     }
 
     for (size_t i = 0; i < this->get_capacity(); i++) {
-      if (!this->hashtable[i].is_empty()) {
+      if (!this->hashtable[i].is_empty() &&
+          !this->hashtable[i].is_tombstone()) {
         f << this->hashtable[i] << std::endl;
       }
     }
@@ -811,10 +1285,32 @@ class CASHashTable : public BaseHashTable {
   KV empty_item;
   KVQ *find_queue;
   KVQ *insert_queue;
+  KVQ *erase_queue;
+  KVQ *upsert_queue;
   uint32_t find_head;
   uint32_t find_tail;
   uint32_t ins_head;
   uint32_t ins_tail;
+  uint32_t ers_head;
+  uint32_t ers_tail;
+  uint32_t ups_head;
+  uint32_t ups_tail;
+  /// Flushes the upsert queue with the reducer it was filled with.
+  void (CASHashTable::*upsert_flush)(collector_type *);
+  /// Interleaves the probes of insert_batch_coro() and find_batch_coro().
+  CoroExecutor coro;
+  /// The slots this thread's finds read, see use_replica().
+  KV *find_table;
+  /// Per-node snapshots of `hashtable`, see replicate().
+  static TableReplicas<KV> replicas;
+
+  inline KV *find_slots() const {
+#ifdef CAS_RESIZE
+    return this->hashtable;
+#else
+    return this->find_table;
+#endif
+  }
 
   // const __mmask8 KEYMSK = 0b01010101;
 
@@ -822,6 +1318,359 @@ class CASHashTable : public BaseHashTable {
 
   uint64_t hash(const void *k) { return hasher_(k, this->key_length); }
 
+  /// Home slot of `key` in a table of `capacity` slots.
+  inline size_t home_slot(uint64_t key, uint64_t capacity) {
+    size_t idx = this->hash((const char *)&key) & (capacity - 1);
+#ifdef BUCKETIZATION
+    idx = idx - (size_t)(idx & KEYS_IN_CACHELINE_MASK);
+#endif
+    return idx;
+  }
+
+  /// Capacity of the live `hashtable`. With online resize enabled, this
+  /// thread's `capacity` may lag behind until its next operation.
+  inline uint64_t table_capacity() const {
+#ifdef CAS_RESIZE
+    const uint64_t gen = resize_gen.load(std::memory_order_acquire);
+    return gen ? (1ULL << (gen & 0xff)) : this->capacity;
+#else
+    return this->capacity;
+#endif
+  }
+
+  /// The queued operations carry an index into the table, restart them from
+  /// their home slot after the table was rebuilt.
+  void rehash_queues() {
+    auto rehash = [this](KVQ *q) {
+      q->idx = home_slot(q->key, this->capacity);
+    };
+    for (uint32_t i = this->ins_tail; i != this->ins_head;
+         i = (i + 1) & INSERT_QUEUE_SZ_MASK) {
+      rehash(&this->insert_queue[i]);
+    }
+    for (uint32_t i = this->find_tail; i != this->find_head;
+         i = (i + 1) & FIND_QUEUE_SZ_MASK) {
+      rehash(&this->find_queue[i]);
+    }
+    for (uint32_t i = this->ers_tail; i != this->ers_head;
+         i = (i + 1) & INSERT_QUEUE_SZ_MASK) {
+      rehash(&this->erase_queue[i]);
+    }
+    for (uint32_t i = this->ups_tail; i != this->ups_head;
+         i = (i + 1) & INSERT_QUEUE_SZ_MASK) {
+      rehash(&this->upsert_queue[i]);
+    }
+  }
+
+#ifdef CAS_RECLAIM
+  /// Marks a public entry point, see TombstoneReclaimer.
+  struct ReclaimGuard {
+    CASHashTable *ht;
+    explicit ReclaimGuard(CASHashTable *ht) : ht(ht) {
+      const auto compact = [ht] { return ht->compact(); };
+      if (reclaimer.enter(&ht->reclaim_handle, compact)) {
+        ht->rehash_queues();
+      }
+    }
+    ~ReclaimGuard() { reclaimer.exit(&ht->reclaim_handle); }
+  };
+
+  TombstoneReclaimer::Handle reclaim_handle;
+  static TombstoneReclaimer reclaimer;
+#endif
+
+#ifdef CAS_RESIZE
+  enum resize_state_t : uint32_t {
+    RESIZE_IDLE,
+    /// A thread is allocating the bigger table, everyone else keeps going.
+    RESIZE_ALLOCATING,
+    /// Waiting for the in-flight batches on the old table to finish.
+    RESIZE_GROWING,
+    /// The new table is live, the old one is being copied over.
+    RESIZE_MIGRATING,
+  };
+
+  /// Per-thread announcement of the table generation it is operating on.
+  /// The resizer only waits for threads that are inside an operation
+  /// (`in_op`) on an older generation.
+  struct alignas(CACHELINE_SIZE) resize_slot {
+    std::atomic<uint64_t> gen;
+    std::atomic<bool> in_op;
+  };
+
+  /// Marks a public entry point. Takes care of switching to a new table
+  /// generation and lends a hand with the migration.
+  struct ResizeGuard {
+    CASHashTable *ht;
+    explicit ResizeGuard(CASHashTable *ht) : ht(ht) { ht->resize_enter(); }
+    ~ResizeGuard() { ht->resize_exit(); }
+  };
+
+  /// The generation word packs the generation number with log2(capacity), so
+  /// that both are observed atomically.
+  static inline uint64_t make_resize_gen(uint64_t gen, uint64_t capacity) {
+    return (gen << 8) | __builtin_ctzll(capacity);
+  }
+
+  uint32_t resize_slot_id;
+  uint64_t local_gen;
+  uint32_t local_fill;
+  uint32_t local_tombstones;
+  /// `resize_gen` and `resize_state` from before the oldest probe of this
+  /// thread that may still be in flight, see `resize_lookup_old`.
+  uint64_t snap_gen;
+  uint32_t snap_state;
+
+  void resize_enter() {
+    resize_slots[this->resize_slot_id].in_op.store(true);
+
+    for (;;) {
+      const uint64_t gen = resize_gen.load();
+      if (gen != this->local_gen) {
+        resize_adopt(gen);
+      }
+
+      const uint64_t fill = resize_fill.load(std::memory_order_relaxed) * 100;
+      const uint32_t state = resize_state.load(std::memory_order_acquire);
+      if (state == RESIZE_IDLE && fill >= this->capacity * RESIZE_LOAD_FACTOR) {
+        resize_start();
+        continue;
+      }
+
+      if (state == RESIZE_MIGRATING) {
+        resize_migrate(RESIZE_CHUNKS_PER_BATCH);
+      }
+
+      // Wait for the in-flight batches on the old table to finish, and do not
+      // let the table fill up while the previous resize is still going on.
+      if (state == RESIZE_GROWING ||
+          (state != RESIZE_IDLE &&
+           fill >= this->capacity * RESIZE_HARD_LOAD_FACTOR)) {
+        _mm_pause();
+        continue;
+      }
+      break;
+    }
+
+    // Queued finds started under an older snapshot, keep that one.
+    if (this->find_head == this->find_tail) {
+      this->snap_state = resize_state.load(std::memory_order_acquire);
+      this->snap_gen = resize_gen.load(std::memory_order_acquire);
+    }
+  }
+
+  void resize_exit() {
+    resize_slots[this->resize_slot_id].in_op.store(false,
+                                                   std::memory_order_release);
+  }
+
+  /// Move this thread over to table generation `gen`. Queued operations
+  /// carry an index into the old table, so they are re-hashed in place.
+  void resize_adopt(uint64_t gen) {
+    this->capacity = 1ULL << (gen & 0xff);
+    this->HT_BUCKET_MASK =
+        (uint32_t)((this->capacity - 1) & ~(KEYS_IN_CACHELINE_MASK));
+    rehash_queues();
+
+    this->local_gen = gen;
+    resize_slots[this->resize_slot_id].gen.store(gen);
+  }
+
+  inline void resize_note_insert() {
+    if (++this->local_fill == RESIZE_FILL_BATCH) {
+      resize_fill.fetch_add(this->local_fill, std::memory_order_relaxed);
+      this->local_fill = 0;
+    }
+  }
+
+  /// Tombstones are published before the erasing thread leaves its
+  /// operation, so the migration never drops more than were counted.
+  inline void resize_note_erase() {
+    if (this->local_tombstones) {
+      resize_tombstones.fetch_add(this->local_tombstones,
+                                  std::memory_order_relaxed);
+      this->local_tombstones = 0;
+    }
+  }
+
+  void resize_start() {
+    uint32_t expected = RESIZE_IDLE;
+    if (!resize_state.compare_exchange_strong(expected, RESIZE_ALLOCATING)) {
+      return;
+    }
+
+    // If erases left mostly tombstones behind, the migration alone frees
+    // enough room: rebuild the table at the same size instead of growing it.
+    const uint64_t cur_capacity = this->capacity;
+    const bool rebuild = resize_tombstones.load() * 2 >= resize_fill.load();
+    const uint64_t new_capacity = rebuild ? cur_capacity : cur_capacity << 1;
+
+    // Allocate (and fault in) the new table while the others keep inserting
+    // into the current one.
+    int new_fd;
+    KV *new_table = calloc_ht<KV>(new_capacity, this->id, &new_fd);
+
+    resize_state.store(RESIZE_GROWING);
+    const uint64_t gen =
+        make_resize_gen((resize_gen.load() >> 8) + 1, new_capacity);
+    resize_gen.store(gen);
+    resize_adopt(gen);
+
+    // Grace period: nobody may still be working on the old table.
+    for (uint32_t i = 0; i < num_resize_slots; i++) {
+      while (resize_slots[i].in_op.load() && resize_slots[i].gen.load() != gen) {
+        _mm_pause();
+      }
+    }
+
+    // The table from the previous resize cannot be referenced anymore.
+    if (old_hashtable) {
+      free_mem<KV>(old_hashtable, old_capacity, this->id, this->fd);
+    }
+    old_hashtable = this->hashtable;
+    old_capacity = cur_capacity;
+    this->hashtable = new_table;
+
+    migrate_chunks = std::max<uint64_t>(old_capacity / RESIZE_CHUNK_SLOTS, 1);
+    migrate_cursor.store(0);
+    migrate_done.store(0);
+
+    PLOGI.printf("Hashtable %s from %lu to %lu slots, base: %p",
+                 rebuild ? "is rebuilt" : "grows", old_capacity, new_capacity,
+                 this->hashtable);
+    resize_state.store(RESIZE_MIGRATING, std::memory_order_release);
+  }
+
+  /// Copy up to `max_chunks` chunks of the old table into the live one.
+  void resize_migrate(uint32_t max_chunks) {
+    const uint64_t chunk_slots = std::min(RESIZE_CHUNK_SLOTS, old_capacity);
+
+    for (uint32_t n = 0; n < max_chunks; n++) {
+      const uint64_t chunk = migrate_cursor.fetch_add(1);
+      if (chunk >= migrate_chunks) {
+        return;
+      }
+
+      const KV *src = &old_hashtable[chunk * chunk_slots];
+      uint64_t dropped = 0;
+      for (uint64_t i = 0; i < chunk_slots; i++) {
+        __builtin_prefetch(&src[i + KV_IN_CACHELINE * 4], false, 0);
+        if (src[i].is_tombstone()) {
+          dropped++;
+        } else if (src[i].get_key() != this->empty_item.get_key()) {
+          resize_reinsert(&src[i]);
+        }
+      }
+      if (dropped) {
+        resize_fill.fetch_sub(dropped, std::memory_order_relaxed);
+        resize_tombstones.fetch_sub(dropped, std::memory_order_relaxed);
+      }
+
+      if (migrate_done.fetch_add(1) + 1 == migrate_chunks) {
+        resize_state.store(RESIZE_IDLE, std::memory_order_release);
+      }
+    }
+  }
+
+  /// Help with the migration until it is complete.
+  void resize_drain() {
+    while (resize_state.load(std::memory_order_acquire) == RESIZE_MIGRATING) {
+      if (migrate_cursor.load() < migrate_chunks) {
+        resize_migrate(1);
+      } else {
+        _mm_pause();
+      }
+    }
+  }
+
+  /// Merge one slot of the old table into the live table. A key that is
+  /// already present was written after the switch, so it wins for `Item`;
+  /// `Aggr_KV` counts are added up.
+  void resize_reinsert(const KV *kv) {
+    const uint64_t key = kv->get_key();
+    size_t idx = home_slot(key, this->capacity);
+
+    for (;;) {
+      KV *curr = &this->hashtable[idx];
+      if (__sync_bool_compare_and_swap((__int128 *)curr, 0,
+                                       *(const __int128 *)kv)) {
+        return;
+      }
+      if (curr->get_key() == key) {
+        if constexpr (std::is_same_v<KV, Aggr_KV>) {
+          __sync_fetch_and_add(&curr->count, kv->count);
+        }
+        return;
+      }
+      idx = (idx + 1) & (this->capacity - 1);
+    }
+  }
+
+  /// Look up `key` after the live table missed it. While the old table is
+  /// being migrated, the key may still be only there. If a migration was
+  /// going on when the probe started and has finished since, the key may
+  /// have been moved to a slot the probe had already passed, so the live
+  /// table is probed again; the old table is not up to date anymore.
+  KV *resize_lookup_old(uint64_t key) {
+    const uint32_t state = resize_state.load(std::memory_order_acquire);
+    if (state == RESIZE_MIGRATING) {
+      return resize_probe(old_hashtable, old_capacity, key);
+    }
+    if (state == this->snap_state &&
+        resize_gen.load(std::memory_order_acquire) == this->snap_gen) {
+      return nullptr;
+    }
+    return resize_probe(this->hashtable, this->capacity, key);
+  }
+
+  /// Linear probe for `key` in `table`.
+  KV *resize_probe(KV *table, uint64_t capacity, uint64_t key) {
+    const uint64_t mask = capacity - 1;
+    size_t idx = home_slot(key, capacity);
+    for (uint64_t i = 0; i < capacity; i++) {
+      KV *curr = &table[idx];
+      if (curr->is_empty()) {
+        return nullptr;
+      }
+      if (curr->get_key() == key) {
+        return curr;
+      }
+      idx = (idx + 1) & mask;
+    }
+    return nullptr;
+  }
+
+  inline bool resize_find_old(uint64_t key, uint32_t key_id,
+                              FindResult *result) {
+    KV *curr = resize_lookup_old(key);
+    if (curr) {
+      result->id = key_id;
+      result->value = curr->get_value();
+    }
+    return curr != nullptr;
+  }
+
+  inline bool resize_find_old(KVQ *q, ValuePairs &vp) {
+    if (resize_find_old(q->key, q->key_id, &vp.second[vp.first])) {
+      vp.first++;
+      return true;
+    }
+    return false;
+  }
+
+  static std::atomic<uint64_t> resize_gen;
+  static std::atomic<uint64_t> resize_fill;
+  static std::atomic<uint64_t> resize_tombstones;
+  static std::atomic<uint32_t> resize_state;
+  static std::atomic<uint64_t> migrate_cursor;
+  static std::atomic<uint64_t> migrate_done;
+  static uint64_t migrate_chunks;
+  static KV *old_hashtable;
+  static uint64_t old_capacity;
+  static resize_slot resize_slots[RESIZE_MAX_THREADS];
+  static uint32_t num_resize_slots;
+#endif  // CAS_RESIZE
+
   // void prefetch(uint64_t i) {
   //   prefetch_object<true /* write */>(
   //       &this->hashtable[i & (this->capacity - 1)],
@@ -844,8 +1693,13 @@ class CASHashTable : public BaseHashTable {
     uint64_t retry;
     size_t idx = q->idx;
 
-    KV *curr_cacheline = &this->hashtable[idx];
+    KV *curr_cacheline = &this->find_slots()[idx];
     uint64_t found = curr_cacheline->find_simd(q, &retry, vp);
+#ifdef CAS_RESIZE
+    if (!found && !retry) {
+      resize_find_old(q, vp);
+    }
+#endif
 
     if (retry) {
 #ifdef UNIFORM_HT_SUPPORT
@@ -888,7 +1742,7 @@ class CASHashTable : public BaseHashTable {
     uint64_t found = 0;
 
   try_find:
-    KV *curr = &this->hashtable[idx];
+    KV *curr = &this->find_slots()[idx];
     uint64_t retry;
     found = curr->find(q, &retry, vp);
 
@@ -934,6 +1788,11 @@ class CASHashTable : public BaseHashTable {
       this->num_reprobes++;
 #endif
     } else {
+#ifdef CAS_RESIZE
+      if (!found) {
+        resize_find_old(q, vp);
+      }
+#endif
 #ifdef LATENCY_COLLECTION
       collector->end(q->timer_id);
 #endif
@@ -977,15 +1836,15 @@ class CASHashTable : public BaseHashTable {
 
   inline void prefetch_read(uint64_t idx) {
 #ifdef DOUBLE_PREFETCH
-    __builtin_prefetch(&this->hashtable[idx], false, 1);
+    __builtin_prefetch(&this->find_slots()[idx], false, 1);
 #elif L1_PREFETCH
-    __builtin_prefetch(&this->hashtable[idx], false, 3);
+    __builtin_prefetch(&this->find_slots()[idx], false, 3);
 #elif L2_PREFETCH
-    __builtin_prefetch(&this->hashtable[idx], false, 2);
+    __builtin_prefetch(&this->find_slots()[idx], false, 2);
 #elif L3_PREFETCH
-    __builtin_prefetch(&this->hashtable[idx], false, 1);
+    __builtin_prefetch(&this->find_slots()[idx], false, 1);
 #elif NTA_PREFETCH
-    __builtin_prefetch(&this->hashtable[idx], false, 0);
+    __builtin_prefetch(&this->find_slots()[idx], false, 0);
 #elif NONE_PREFETCH
     // do nothing...
 #endif
@@ -1001,7 +1860,8 @@ class CASHashTable : public BaseHashTable {
     //  The intuition is, we load a snapshot of a cacheline of keys and see
     //  how far ahead we can skip into. It is okay to be outdated with the
     //  world, because, that just means we skip less than we could have. We can
-    //  do this because keys are never deleted in the hashtable.
+    //  do this because a slot never becomes empty again while the hashtable is
+    //  live (erased keys leave a tombstone, see erase_batch()).
 
     // ex. We load a cacheline like this | - , - , 0, 0 |.
     //  The world can update the keys like this during operation | -, -, X, 0|
@@ -1072,6 +1932,9 @@ class CASHashTable : public BaseHashTable {
     if (curr->kvpair.key == 0)
 #endif
       if (__sync_bool_compare_and_swap((__int128 *)curr, 0, *(__int128 *)q)) {
+#ifdef CAS_RESIZE
+        resize_note_insert();
+#endif
         return 0;
       }
 
@@ -1139,6 +2002,72 @@ class CASHashTable : public BaseHashTable {
     empty_slot_exists_ = true;
   }
 
+  /// Straight-line version of __insert_branched() for the coroutine engine.
+  ProbeTask insert_coro(key_type key, value_type value) {
+    KVQ q{};
+    q.key = key;
+    q.value = value;
+    if (key == this->empty_item.get_key()) {
+      __insert_empty(&q);
+      co_return;
+    }
+    if (!insertable_key(key)) {
+      co_return;
+    }
+    __int128 desired;
+    memcpy(&desired, &q, sizeof(desired));
+
+    size_t idx = this->home_slot(key, this->capacity);
+    for (;;) {
+      co_await prefetch_line(&this->hashtable[idx], true);
+      do {
+        KV *curr = &this->hashtable[idx];
+#ifdef READ_BEFORE_CAS
+        if (curr->is_empty())
+#endif
+          if (__sync_bool_compare_and_swap((__int128 *)curr, 0, desired)) {
+            co_return;
+          }
+        if (curr->compare_key(&q)) {
+          curr->update_cas(&q);
+          co_return;
+        }
+        idx = (idx + 1) & (this->capacity - 1);
+      } while ((idx & KEYS_IN_CACHELINE_MASK) != 0);
+    }
+  }
+
+  /// Straight-line version of __find_branched() for the coroutine engine,
+  /// calls `emit(value)` if `key` is found.
+  template <typename Emit>
+  ProbeTask find_coro(key_type key, Emit emit) {
+    if (key == this->empty_item.get_key()) {
+      if (empty_slot_exists_) {
+        emit(empty_slot_);
+      }
+      co_return;
+    }
+    if (key == TOMBSTONE_KEY) {
+      co_return;
+    }
+
+    size_t idx = this->home_slot(key, this->capacity);
+    for (;;) {
+      co_await prefetch_line(&this->find_slots()[idx], false);
+      do {
+        KV *curr = &this->find_slots()[idx];
+        if (curr->is_empty()) {
+          co_return;
+        }
+        if (curr->compare_key(&key)) {
+          emit(curr->get_value());
+          co_return;
+        }
+        idx = (idx + 1) & (this->capacity - 1);
+      } while ((idx & KEYS_IN_CACHELINE_MASK) != 0);
+    }
+  }
+
   uint64_t read_hashtable_element(const void *data) override {
     PLOG_FATAL << "Not implemented";
     assert(false);
@@ -1147,6 +2076,10 @@ class CASHashTable : public BaseHashTable {
 
   void add_to_find_queue(void *data, collector_type *collector) {
     InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    // never stored, see insertable_key()
+    if (key_data->key == TOMBSTONE_KEY) {
+      return;
+    }
 
 #ifdef LATENCY_COLLECTION
     const auto timer = collector->start();
@@ -1179,6 +2112,9 @@ class CASHashTable : public BaseHashTable {
 
   inline void add_to_insert_queue(void *data, collector_type *collector) {
     InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    if (!insertable_key(key_data->key)) {
+      return;
+    }
 
 #ifdef LATENCY_COLLECTION
     const auto timer = collector->start();
@@ -1208,12 +2144,279 @@ class CASHashTable : public BaseHashTable {
     this->ins_head++;
     this->ins_head &= INSERT_QUEUE_SZ_MASK;
   }
+
+  inline uint32_t get_erase_queue_sz() {
+    return (ers_head - ers_tail) & INSERT_QUEUE_SZ_MASK;
+  }
+
+  inline void pop_erase_queue(collector_type *collector) {
+    uint64_t retry = 0;
+    do {
+      retry = __erase_one(&this->erase_queue[this->ers_tail], collector);
+      this->ers_tail++;
+      this->ers_tail &= INSERT_QUEUE_SZ_MASK;
+    } while ((retry));
+  }
+
+  uint64_t __erase_one(KVQ *q, collector_type *collector) {
+    if (q->key == this->empty_item.get_key()) {
+      empty_slot_exists_ = false;
+      empty_slot_ = 0;
+      return 0;
+    }
+    return __erase_branched(q, collector);
+  }
+
+  /// Probe the prefetched cacheline for the key. An empty slot ends the probe
+  /// sequence, otherwise the erase is queued again for the next cacheline.
+  uint64_t __erase_branched(KVQ *q, collector_type *collector) {
+    size_t idx = q->idx;
+    KV *curr;
+
+  try_erase:
+    curr = &this->hashtable[idx];
+
+    if (curr->is_empty()) {
+#ifdef LATENCY_COLLECTION
+      collector->end(q->timer_id);
+#endif
+      return 0;
+    }
+
+    if (curr->compare_key(q)) {
+      // Losing the race means someone else erased it already.
+      if (curr->erase_cas(q->key)) {
+#ifdef CAS_RESIZE
+        this->local_tombstones++;
+#elif defined(CAS_RECLAIM)
+        this->reclaim_handle.tombstones++;
+#endif
+      }
+#ifdef LATENCY_COLLECTION
+      collector->end(q->timer_id);
+#endif
+      return 0;
+    }
+
+    idx++;
+    idx = idx & (this->capacity - 1);  // modulo
+
+    if ((idx & KEYS_IN_CACHELINE_MASK) != 0) {
+      goto try_erase;
+    }
+
+#ifdef UNIFORM_HT_SUPPORT
+    uint64_t old_hash = q->key_hash;
+    uint64_t hash = this->hash(&old_hash);
+    idx = hash & (this->capacity - 1);
+#ifdef BUCKETIZATION
+    idx = idx - (size_t)(idx & KEYS_IN_CACHELINE_MASK);
+#endif
+    this->erase_queue[this->ers_head].key_hash = hash;
+#endif
+
+    prefetch_insert(idx);
+
+    this->erase_queue[this->ers_head].key = q->key;
+    this->erase_queue[this->ers_head].key_id = q->key_id;
+    this->erase_queue[this->ers_head].idx = idx;
+
+#ifdef LATENCY_COLLECTION
+    this->erase_queue[this->ers_head].timer_id = q->timer_id;
+#endif
+
+    this->ers_head++;
+    this->ers_head &= INSERT_QUEUE_SZ_MASK;
+
+    return 1;
+  }
+
+  inline void add_to_erase_queue(void *data, collector_type *collector) {
+    InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    if (key_data->key == TOMBSTONE_KEY) {
+      return;
+    }
+
+#ifdef LATENCY_COLLECTION
+    const auto timer = collector->start();
+#endif
+
+    uint64_t hash = this->hash((const char *)&key_data->key);
+    size_t idx = hash & (this->capacity - 1);
+#ifdef BUCKETIZATION
+    idx = idx - (size_t)(idx & KEYS_IN_CACHELINE_MASK);
+#endif
+
+    prefetch_insert(idx);
+
+    this->erase_queue[this->ers_head].idx = idx;
+    this->erase_queue[this->ers_head].key = key_data->key;
+    this->erase_queue[this->ers_head].key_id = key_data->id;
+
+#ifdef UNIFORM_HT_SUPPORT
+    this->erase_queue[this->ers_head].key_hash = hash;
+#endif
+
+#ifdef LATENCY_COLLECTION
+    this->erase_queue[this->ers_head].timer_id = timer;
+#endif
+
+    this->ers_head++;
+    this->ers_head &= INSERT_QUEUE_SZ_MASK;
+  }
+
+  inline uint32_t get_upsert_queue_sz() {
+    return (ups_head - ups_tail) & INSERT_QUEUE_SZ_MASK;
+  }
+
+  template <class Reducer>
+  inline void upsert_use(collector_type *collector) {
+    constexpr auto flush = &CASHashTable::template __flush_upsert_queue<Reducer>;
+    if (this->upsert_flush != flush) {
+      if (this->upsert_flush) {
+        (this->*upsert_flush)(collector);
+      }
+      this->upsert_flush = flush;
+    }
+  }
+
+  template <class Reducer>
+  void __flush_upsert_queue(collector_type *collector) {
+    for (size_t pending = get_upsert_queue_sz(); pending > 0; pending--) {
+      pop_upsert_queue<Reducer>(collector);
+    }
+  }
+
+  template <class Reducer>
+  inline void pop_upsert_queue(collector_type *collector) {
+    uint64_t retry = 0;
+    do {
+      retry =
+          __upsert_one<Reducer>(&this->upsert_queue[this->ups_tail], collector);
+      this->ups_tail++;
+      this->ups_tail &= INSERT_QUEUE_SZ_MASK;
+    } while ((retry));
+  }
+
+  template <class Reducer>
+  uint64_t __upsert_one(KVQ *q, collector_type *collector) {
+    if (q->key == this->empty_item.get_key()) {
+      empty_slot_ = empty_slot_exists_ ? Reducer::reduce(empty_slot_, q->value)
+                                       : q->value;
+      empty_slot_exists_ = true;
+      return 0;
+    }
+    return __upsert_branched<Reducer>(q, collector);
+  }
+
+  /// Same probing as __insert_branched(), but a key that is already present
+  /// gets its value merged with `Reducer`.
+  template <class Reducer>
+  uint64_t __upsert_branched(KVQ *q, collector_type *collector) {
+    size_t idx = q->idx;
+    KV *curr;
+
+  try_upsert:
+    curr = &this->hashtable[idx];
+
+#ifdef READ_BEFORE_CAS
+    if (curr->get_key() == 0)
+#endif
+      if (__sync_bool_compare_and_swap((__int128 *)curr, 0, *(__int128 *)q)) {
+#ifdef CAS_RESIZE
+        resize_note_insert();
+#endif
+#ifdef LATENCY_COLLECTION
+        collector->end(q->timer_id);
+#endif
+        return 0;
+      }
+
+    if (curr->compare_key(q)) {
+      curr->template reduce_cas<Reducer>(q);
+#ifdef LATENCY_COLLECTION
+      collector->end(q->timer_id);
+#endif
+      return 0;
+    }
+
+    idx++;
+    idx = idx & (this->capacity - 1);  // modulo
+
+    if ((idx & KEYS_IN_CACHELINE_MASK) != 0) {
+      goto try_upsert;
+    }
+
+#ifdef UNIFORM_HT_SUPPORT
+    uint64_t old_hash = q->key_hash;
+    uint64_t hash = this->hash(&old_hash);
+    idx = hash & (this->capacity - 1);
+#ifdef BUCKETIZATION
+    idx = idx - (size_t)(idx & KEYS_IN_CACHELINE_MASK);
+#endif
+    this->upsert_queue[this->ups_head].key_hash = hash;
+#endif
+
+    prefetch_insert(idx);
+
+    this->upsert_queue[this->ups_head].key = q->key;
+    this->upsert_queue[this->ups_head].key_id = q->key_id;
+    this->upsert_queue[this->ups_head].value = q->value;
+    this->upsert_queue[this->ups_head].idx = idx;
+
+#ifdef LATENCY_COLLECTION
+    this->upsert_queue[this->ups_head].timer_id = q->timer_id;
+#endif
+
+    this->ups_head++;
+    this->ups_head &= INSERT_QUEUE_SZ_MASK;
+
+    return 1;
+  }
+
+  inline void add_to_upsert_queue(void *data, collector_type *collector) {
+    InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    if (!insertable_key(key_data->key)) {
+      return;
+    }
+
+#ifdef LATENCY_COLLECTION
+    const auto timer = collector->start();
+#endif
+
+    uint64_t hash = this->hash((const char *)&key_data->key);
+    size_t idx = hash & (this->capacity - 1);
+#ifdef BUCKETIZATION
+    idx = idx - (size_t)(idx & KEYS_IN_CACHELINE_MASK);
+#endif
+
+    prefetch_insert(idx);
+
+    this->upsert_queue[this->ups_head].idx = idx;
+    this->upsert_queue[this->ups_head].key = key_data->key;
+    this->upsert_queue[this->ups_head].key_id = key_data->id;
+    this->upsert_queue[this->ups_head].value = key_data->value;
+
+#ifdef UNIFORM_HT_SUPPORT
+    this->upsert_queue[this->ups_head].key_hash = hash;
+#endif
+
+#ifdef LATENCY_COLLECTION
+    this->upsert_queue[this->ups_head].timer_id = timer;
+#endif
+
+    this->ups_head++;
+    this->ups_head &= INSERT_QUEUE_SZ_MASK;
+  }
 };
 
 /// Static variables
 template <class KV, class KVQ>
 KV *CASHashTable<KV, KVQ>::hashtable = nullptr;
 
+template <class KV, class KVQ>
+TableReplicas<KV> CASHashTable<KV, KVQ>::replicas;
+
 template <class KV, class KVQ>
 uint64_t CASHashTable<KV, KVQ>::empty_slot_ = 0;
 
@@ -1225,5 +2428,46 @@ std::mutex CASHashTable<KV, KVQ>::ht_init_mutex;
 
 template <class KV, class KVQ>
 uint32_t CASHashTable<KV, KVQ>::ref_cnt = 0;
+
+#ifdef CAS_RECLAIM
+template <class KV, class KVQ>
+TombstoneReclaimer CASHashTable<KV, KVQ>::reclaimer;
+#endif
+
+#ifdef CAS_RESIZE
+template <class KV, class KVQ>
+std::atomic<uint64_t> CASHashTable<KV, KVQ>::resize_gen = 0;
+
+template <class KV, class KVQ>
+std::atomic<uint64_t> CASHashTable<KV, KVQ>::resize_fill = 0;
+
+template <class KV, class KVQ>
+std::atomic<uint64_t> CASHashTable<KV, KVQ>::resize_tombstones = 0;
+
+template <class KV, class KVQ>
+std::atomic<uint32_t> CASHashTable<KV, KVQ>::resize_state = RESIZE_IDLE;
+
+template <class KV, class KVQ>
+std::atomic<uint64_t> CASHashTable<KV, KVQ>::migrate_cursor = 0;
+
+template <class KV, class KVQ>
+std::atomic<uint64_t> CASHashTable<KV, KVQ>::migrate_done = 0;
+
+template <class KV, class KVQ>
+uint64_t CASHashTable<KV, KVQ>::migrate_chunks = 0;
+
+template <class KV, class KVQ>
+KV *CASHashTable<KV, KVQ>::old_hashtable = nullptr;
+
+template <class KV, class KVQ>
+uint64_t CASHashTable<KV, KVQ>::old_capacity = 0;
+
+template <class KV, class KVQ>
+typename CASHashTable<KV, KVQ>::resize_slot
+    CASHashTable<KV, KVQ>::resize_slots[RESIZE_MAX_THREADS];
+
+template <class KV, class KVQ>
+uint32_t CASHashTable<KV, KVQ>::num_resize_slots = 0;
+#endif
 }  // namespace kmercounter
 #endif  // HASHTABLES_CAS_KHT_HPP
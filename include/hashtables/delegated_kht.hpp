@@ -0,0 +1,554 @@
+/// Partitioned hashtable behind message queues (delegation).
+/// Every thread owns one partition, and is at the same time a client of all
+/// the partitions: an operation is not executed by the thread that issues
+/// it, but sent to the owner of the key (`owner_of`) over a `SectionQueue`.
+/// The owners run the requests against their local partition in batches and
+/// send the find results back on the reverse queues. Only the owner ever
+/// touches a partition, so the partitions need no atomics and stay in the
+/// cache/NUMA node of their owner.
+///
+/// With `config.minimizer_len`, the caller picks the owner instead, in
+/// `InsertFindArgument::part_id`: k-mer counting sends all the k-mers that
+/// share a minimizer to the same partition, see `SuperKMerReader`.
+///
+/// There are three sets of queues between the n threads, indexed
+/// [producer][consumer]:
+///  - inserts, client -> owner: {key, value}
+///  - finds, client -> owner: {key, id of the find}
+///  - responses, owner -> client: {id | FOUND_BIT, value}
+///
+/// A `SectionQueue` only publishes whole sections, so a flush pads the
+/// current section with `PAD_KEY` (the empty key, which no table stores).
+/// A padded find section also asks the owner to flush its responses.
+///
+/// Since a thread is both a client and an owner, it serves its inbound
+/// queues whenever it would otherwise wait, and the flushes are collective:
+/// all threads have to call `flush_insert_queue` (and `flush_find_queue`
+/// until it returns 0) the same number of times, like the `ZIPFIAN` and
+/// `HASHJOIN` drivers do at the end of each phase. A find only sees the
+/// inserts that were flushed before it.
+
+#ifndef HASHTABLES_DELEGATED_KHT_HPP
+#define HASHTABLES_DELEGATED_KHT_HPP
+
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "fastrange.h"
+#include "hasher.hpp"
+#include "hashtables/base_kht.hpp"
+#include "plog/Log.h"
+#include "queues/section_queues.hpp"
+#include "types.hpp"
+#include "utils/poll_backoff.hpp"
+
+namespace kmercounter {
+
+extern Configuration config;
+
+static_assert(sizeof(data_t) == 2 * sizeof(uint64_t),
+              "delegation messages need a key and a value");
+
+/// Queues and partitions shared by the `DelegatedHashTable`s of a run.
+/// Create it before the threads start, thread `i` runs on `cpus[i]`.
+class DelegationService {
+ public:
+  DelegationService(uint32_t n, const std::vector<uint32_t> &cpus,
+                    size_t num_sections)
+      : n(n),
+        insert_q(n, n, num_sections, cpus),
+        find_q(n, n, num_sections, cpus),
+        resp_q(n, n, num_sections, cpus),
+        parts(n, nullptr),
+        bells(nullptr),
+        insert_arrivals(0),
+        find_arrivals(0) {
+    if (config.consumer_backoff) {
+      // one doorbell per thread for all three queues and the flushes
+      this->bells = new Doorbell[n];
+      this->insert_q.enable_doorbells(this->bells);
+      this->find_q.enable_doorbells(this->bells);
+      this->resp_q.enable_doorbells(this->bells);
+    }
+  }
+
+  ~DelegationService() {
+    for (BaseHashTable *part : this->parts) {
+      delete part;
+    }
+    delete[] this->bells;
+  }
+
+  /// Same mapping as the producers of the queue tests.
+  static inline uint32_t owner_of(key_type key, uint32_t n) {
+    Hasher hasher;
+    uint32_t hash = hasher(&key, sizeof(key));
+    return fastrange32(_mm_crc32_u32(0xffffffff, hash), n);
+  }
+
+  uint32_t get_num_threads() const { return this->n; }
+
+ private:
+  friend class DelegatedHashTable;
+
+  uint32_t n;
+  SectionQueue insert_q;
+  SectionQueue find_q;
+  SectionQueue resp_q;
+  /// Owned, registered by the `DelegatedHashTable` of each thread.
+  std::vector<BaseHashTable *> parts;
+  /// With `config.consumer_backoff`, idle threads wait on these.
+  Doorbell *bells;
+  alignas(64) std::atomic<uint64_t> insert_arrivals;
+  alignas(64) std::atomic<uint64_t> find_arrivals;
+};
+
+/// Per-thread front-end, one instance per thread like the other tables.
+class DelegatedHashTable : public BaseHashTable {
+ public:
+  constexpr static key_type PAD_KEY = 0;
+  constexpr static uint64_t ID_MASK = 0xffffffffULL;
+  constexpr static uint64_t FOUND_BIT = 1ULL << 32;
+  constexpr static uint64_t PAD_RESPONSE = 1ULL << 33;
+
+  /// `part` is the partition of thread `id`, the service takes it over.
+  DelegatedHashTable(DelegationService *svc, uint32_t id, BaseHashTable *part)
+      : svc(svc),
+        id(id),
+        n(svc->n),
+        part(part),
+        outstanding(0),
+        backlog_head(0),
+        insert_epoch(0),
+        find_epoch(0),
+        dirty(false),
+        by_part_id(config.minimizer_len > 0),
+        backoff(svc->bells ? &svc->bells[id] : nullptr) {
+    if (id >= this->n || svc->parts[id]) {
+      PLOGE.printf("partition %u already registered (%u threads)", id,
+                   this->n);
+      abort();
+    }
+    svc->parts[id] = part;
+
+    for (uint32_t i = 0; i < this->n; i++) {
+      this->ins_pq.push_back(&svc->insert_q.all_pqueues[id][i]);
+      this->find_pq.push_back(&svc->find_q.all_pqueues[id][i]);
+      this->resp_pq.push_back(&svc->resp_q.all_pqueues[id][i]);
+      this->ins_cq.push_back(&svc->insert_q.all_cqueues[id][i]);
+      this->find_cq.push_back(&svc->find_q.all_cqueues[id][i]);
+      this->resp_cq.push_back(&svc->resp_q.all_cqueues[id][i]);
+    }
+
+    const uint32_t batch = std::max<uint32_t>(config.batch_len, 1);
+    this->ins_args.resize(batch);
+    this->find_args.resize(batch);
+    this->find_results.resize(batch);
+    this->requests.resize(batch);
+    this->resp_flush.resize(this->n);
+  }
+
+  bool insert(const void *data) override {
+    this->insert_noprefetch(data);
+    return true;
+  }
+
+  void insert_noprefetch(const void *data,
+                         collector_type *collector = nullptr) override {
+    const InsertFindArgument *arg =
+        reinterpret_cast<const InsertFindArgument *>(data);
+    this->send_insert(*arg);
+  }
+
+  void insert_batch(const InsertFindArguments &kp,
+                    collector_type *collector = nullptr) override {
+    for (auto &data : kp) {
+      this->send_insert(data);
+    }
+    this->serve();
+  }
+
+  /// Collective, see the top of the file.
+  void flush_insert_queue(collector_type *collector = nullptr) override {
+    for (uint32_t c = 0; c < this->n; c++) {
+      this->pad(this->svc->insert_q, this->ins_pq[c], this->id, c,
+                data_t(PAD_KEY, 0), true);
+    }
+    this->arrive(this->svc->insert_arrivals, this->insert_epoch);
+
+    // everybody published their inserts, apply the rest of ours
+    this->serve();
+    this->part->flush_insert_queue();
+    this->dirty = false;
+  }
+
+  void find_batch(const InsertFindArguments &kp, ValuePairs &vp,
+                  collector_type *collector = nullptr) override {
+    for (auto &data : kp) {
+      if (data.key == PAD_KEY) {
+        continue;
+      }
+      uint32_t c = this->owner(data);
+      this->push(this->svc->find_q, this->find_pq[c], this->id, c,
+                 data_t(data.key, data.id), true);
+      this->outstanding++;
+    }
+    this->serve();
+    this->poll_responses();
+    this->deliver(vp);
+  }
+
+  void *find_noprefetch(const void *data,
+                        collector_type *collector = nullptr) override {
+    PLOG_FATAL << "find_noprefetch is not supported by the delegated table, "
+                  "use find_batch";
+    std::terminate();
+  }
+
+  /// Returns the number of finds whose results are still to come. Collective:
+  /// the call that returns 0 waits for all the threads to get their results,
+  /// and never returns results itself.
+  size_t flush_find_queue(ValuePairs &vp,
+                          collector_type *collector = nullptr) override {
+    for (uint32_t c = 0; c < this->n; c++) {
+      this->pad(this->svc->find_q, this->find_pq[c], this->id, c,
+                data_t(PAD_KEY, 0), true);
+    }
+    this->serve();
+    this->poll_responses();
+    this->deliver(vp);
+
+    size_t pending =
+        this->outstanding + this->backlog.size() - this->backlog_head;
+    if (pending > 0) {
+      return pending;
+    }
+    if (vp.first > 0) {
+      return 1;
+    }
+    this->arrive(this->svc->find_arrivals, this->find_epoch);
+    return 0;
+  }
+
+  ~DelegatedHashTable() {
+    if (this->svc->bells) {
+      const PollBackoff::Stats &s = this->backoff.get_stats();
+      PLOGI.printf(
+          "[delegation:%u] idle polls %lu, miss ratio %.3f | pauses %lu "
+          "umwaits %lu sleeps %lu",
+          this->id, s.polls, this->backoff.miss_ratio(), s.pauses, s.umwaits,
+          s.sleeps);
+    }
+  }
+
+  /// How often this thread polled, paused and waited in arrive().
+  const PollBackoff::Stats &get_backoff_stats() const {
+    return this->backoff.get_stats();
+  }
+
+  void display() const override { this->part->display(); }
+
+  size_t get_fill() const override {
+    size_t fill = 0;
+    for (BaseHashTable *p : this->svc->parts) {
+      fill += p ? p->get_fill() : 0;
+    }
+    return fill;
+  }
+
+  size_t get_capacity() const override {
+    size_t capacity = 0;
+    for (BaseHashTable *p : this->svc->parts) {
+      capacity += p ? p->get_capacity() : 0;
+    }
+    return capacity;
+  }
+
+  size_t get_max_count() const override {
+    size_t count = 0;
+    for (BaseHashTable *p : this->svc->parts) {
+      count = std::max(count, p ? p->get_max_count() : 0);
+    }
+    return count;
+  }
+
+  /// Prints the local partition only, every thread prints its own.
+  void print_to_file(std::string &outfile) const override {
+    this->part->print_to_file(outfile);
+  }
+
+  uint64_t read_hashtable_element(const void *data) override {
+    return this->part->read_hashtable_element(data);
+  }
+
+  void prefetch_queue(QueueType qtype) override {}
+
+  void clear() override { this->part->clear(); }
+
+  BaseHashTable *get_partition() { return this->part; }
+
+ private:
+  /// A find request taken from the inbound queues.
+  struct Request {
+    uint32_t client;
+    uint32_t id;
+    value_type value;
+    bool found;
+  };
+
+  DelegationService *svc;
+  uint32_t id;
+  uint32_t n;
+  BaseHashTable *part;
+
+  /// Outbound queues, indexed by the owner
+  std::vector<SectionQueue::prod_queue_t *> ins_pq;
+  std::vector<SectionQueue::prod_queue_t *> find_pq;
+  /// Indexed by the client
+  std::vector<SectionQueue::prod_queue_t *> resp_pq;
+  /// Inbound queues, indexed by the client
+  std::vector<SectionQueue::cons_queue_t *> ins_cq;
+  std::vector<SectionQueue::cons_queue_t *> find_cq;
+  /// Indexed by the owner
+  std::vector<SectionQueue::cons_queue_t *> resp_cq;
+
+  /// Finds sent, whose response has not arrived yet.
+  uint64_t outstanding;
+  /// Results that arrived but were not handed out yet.
+  std::vector<FindResult> backlog;
+  size_t backlog_head;
+  uint64_t insert_epoch;
+  uint64_t find_epoch;
+
+  // owner side
+  std::vector<InsertFindArgument> ins_args;
+  std::vector<InsertFindArgument> find_args;
+  std::vector<FindResult> find_results;
+  std::vector<Request> requests;
+  std::vector<uint8_t> resp_flush;
+  /// Inserts were passed to the partition after its last flush.
+  bool dirty;
+  /// The callers pick the owners, see the top of the file.
+  bool by_part_id;
+  /// Waiting for the other threads in arrive()
+  PollBackoff backoff;
+
+  inline uint32_t owner(const InsertFindArgument &arg) const {
+    if (this->by_part_id) {
+      assert(arg.part_id < this->n);
+      return arg.part_id;
+    }
+    return DelegationService::owner_of(arg.key, this->n);
+  }
+
+  inline void send_insert(const InsertFindArgument &arg) {
+    // key 0 is never used (see InsertFindArgument), it pads the sections
+    if (arg.key == PAD_KEY) {
+      return;
+    }
+    uint32_t c = this->owner(arg);
+    this->push(this->svc->insert_q, this->ins_pq[c], this->id, c,
+               data_t(arg.key, arg.value), true);
+  }
+
+  /// Enqueue without blocking the other threads: while the queue is full,
+  /// read our responses and, unless we are answering a request ourselves,
+  /// serve our inbound queues.
+  inline void push(SectionQueue &q, SectionQueue::prod_queue_t *pq,
+                   uint32_t p, uint32_t c, data_t value, bool serve_inbound) {
+    while (q.try_enqueue(pq, p, c, value) == RETRY) {
+      this->poll_responses();
+      if (serve_inbound) {
+        this->serve();
+      }
+      _mm_pause();
+    }
+  }
+
+  /// Publish the current section of `pq`.
+  void pad(SectionQueue &q, SectionQueue::prod_queue_t *pq, uint32_t p,
+           uint32_t c, data_t filler, bool serve_inbound) {
+    while (!q.at_section_start(pq)) {
+      this->push(q, pq, p, c, filler, serve_inbound);
+    }
+  }
+
+  /// Wait, serving, until all the threads arrived. With doorbells, a
+  /// thread that has nothing left to serve backs off, and the last one to
+  /// arrive wakes everybody up.
+  void arrive(std::atomic<uint64_t> &arrivals, uint64_t &epoch) {
+    epoch++;
+    const uint64_t all = epoch * this->n;
+    if (arrivals.fetch_add(1) + 1 == all && this->svc->bells) {
+      for (uint32_t i = 0; i < this->n; i++) {
+        this->svc->bells[i].ring();
+      }
+    }
+    while (arrivals.load(std::memory_order_acquire) < all) {
+      this->poll_responses();
+      size_t served = this->serve();
+      if (!this->svc->bells) {
+        _mm_pause();
+      } else if (served > 0) {
+        this->backoff.hit();
+      } else {
+        this->backoff.miss([&]() {
+          return arrivals.load(std::memory_order_acquire) >= all ||
+                 this->has_inbound();
+        });
+      }
+    }
+  }
+
+  /// Whether any of the inbound or response queues has messages.
+  bool has_inbound() const {
+    for (uint32_t p = 0; p < this->n; p++) {
+      if (this->svc->insert_q.has_data(this->ins_cq[p], p, this->id) ||
+          this->svc->find_q.has_data(this->find_cq[p], p, this->id) ||
+          this->svc->resp_q.has_data(this->resp_cq[p], p, this->id)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void poll_responses() {
+    data_t m;
+    for (uint32_t c = 0; c < this->n; c++) {
+      while (this->svc->resp_q.dequeue(this->resp_cq[c], c, this->id, &m) ==
+             SUCCESS) {
+        if (m.key & PAD_RESPONSE) {
+          continue;
+        }
+        this->outstanding--;
+        if (m.key & FOUND_BIT) {
+          this->backlog.emplace_back(m.key & ID_MASK, m.value);
+        }
+      }
+    }
+  }
+
+  /// Hand out at most `config.batch_len` results in total.
+  void deliver(ValuePairs &vp) {
+    size_t avail = this->backlog.size() - this->backlog_head;
+    size_t room = config.batch_len > vp.first ? config.batch_len - vp.first : 0;
+    size_t cnt = std::min(avail, room);
+    for (size_t i = 0; i < cnt; i++) {
+      vp.second[vp.first++] = this->backlog[this->backlog_head++];
+    }
+    if (this->backlog_head == this->backlog.size()) {
+      this->backlog.clear();
+      this->backlog_head = 0;
+    }
+  }
+
+  /// Owner side: execute the requests of the inbound queues. Returns the
+  /// number of requests executed.
+  size_t serve() {
+    data_t m;
+
+    // take the finds before draining the inserts, so that a find sees all
+    // the inserts published before it
+    uint32_t num_finds = 0;
+    for (uint32_t p = 0; p < this->n; p++) {
+      while (num_finds < this->requests.size() &&
+             this->svc->find_q.dequeue(this->find_cq[p], p, this->id, &m) ==
+                 SUCCESS) {
+        if (m.key == PAD_KEY) {
+          this->resp_flush[p] = true;
+          continue;
+        }
+        this->requests[num_finds] = {.client = p,
+                                     .id = (uint32_t)m.value,
+                                     .value = 0,
+                                     .found = false};
+        // ids start at 1, and a partition finds its keys by part_id
+        this->find_args[num_finds] = {.key = m.key,
+                                      .value = 0,
+                                      .id = num_finds + 1,
+                                      .part_id = this->id};
+        num_finds++;
+      }
+    }
+
+    size_t num_inserts = 0;
+    uint32_t batch = 0;
+    for (uint32_t p = 0; p < this->n; p++) {
+      while (this->svc->insert_q.dequeue(this->ins_cq[p], p, this->id, &m) ==
+             SUCCESS) {
+        if (m.key == PAD_KEY) {
+          continue;
+        }
+        this->ins_args[batch++] = {
+            .key = m.key, .value = m.value, .id = 0, .part_id = this->id};
+        if (batch == this->ins_args.size()) {
+          this->part->insert_batch(
+              InsertFindArguments(this->ins_args.data(), batch));
+          num_inserts += batch;
+          batch = 0;
+        }
+      }
+    }
+    if (batch > 0) {
+      this->part->insert_batch(
+          InsertFindArguments(this->ins_args.data(), batch));
+      num_inserts += batch;
+    }
+    if (num_inserts > 0) {
+      this->dirty = true;
+    }
+
+    if (num_finds > 0) {
+      this->lookup(num_finds);
+    }
+
+    for (uint32_t p = 0; p < this->n; p++) {
+      if (this->resp_flush[p]) {
+        this->resp_flush[p] = false;
+        this->pad(this->svc->resp_q, this->resp_pq[p], this->id, p,
+                  data_t(PAD_RESPONSE, 0), false);
+      }
+    }
+    return num_finds + num_inserts;
+  }
+
+  void lookup(uint32_t num_finds) {
+    if (this->dirty) {
+      this->part->flush_insert_queue();
+      this->dirty = false;
+    }
+
+    auto mark = [this](const ValuePairs &vp) {
+      for (uint32_t i = 0; i < vp.first; i++) {
+        Request &r = this->requests[vp.second[i].id - 1];
+        r.value = vp.second[i].value;
+        r.found = true;
+      }
+    };
+    ValuePairs vp{0, this->find_results.data()};
+    this->part->find_batch(
+        InsertFindArguments(this->find_args.data(), num_finds), vp);
+    mark(vp);
+    size_t remaining;
+    do {
+      vp.first = 0;
+      remaining = this->part->flush_find_queue(vp);
+      mark(vp);
+    } while (remaining > 0 || vp.first > 0);
+
+    for (uint32_t i = 0; i < num_finds; i++) {
+      const Request &r = this->requests[i];
+      this->push(this->svc->resp_q, this->resp_pq[r.client], this->id,
+                 r.client,
+                 data_t(r.id | (r.found ? FOUND_BIT : 0), r.value), false);
+    }
+  }
+};
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_DELEGATED_KHT_HPP
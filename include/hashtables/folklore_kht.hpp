@@ -18,6 +18,9 @@
 #include "hasher.hpp"
 #include "helper.hpp"
 #include "ht_helper.hpp"
+#include "hashtables/ht_reclaim.hpp"
+#include "hashtables/ht_replicas.hpp"
+#include "hashtables/reducers.hpp"
 #include "plog/Log.h"
 #include "sync.h"
 
@@ -51,6 +54,9 @@ class FolkloreHashTable : public BaseHashTable {
                      this->hashtable, this->capacity);
       }
       this->ref_cnt++;
+#ifdef CAS_RECLAIM
+      this->reclaim_handle = reclaimer.join(this->capacity);
+#endif
     }
     this->empty_item = this->empty_item.get_empty_key();
     this->key_length = empty_item.key_length();
@@ -62,6 +68,7 @@ class FolkloreHashTable : public BaseHashTable {
     this->find_queue =
         (KVQ *)(aligned_alloc(64, PREFETCH_FIND_QUEUE_SIZE * sizeof(KVQ)));
 
+    this->find_table = this->hashtable;
     PLOGV.printf("%s, data_length %lu\n", __func__, this->data_length);
   }
 
@@ -71,10 +78,17 @@ class FolkloreHashTable : public BaseHashTable {
     // Deallocate the global hashtable if ref_cnt goes down to zero.
     {
       const std::lock_guard<std::mutex> lock(ht_init_mutex);
+#ifdef CAS_RECLAIM
+      reclaimer.leave(this->reclaim_handle);
+#endif
       this->ref_cnt--;
       if (this->ref_cnt == 0) {
+        replicas.drop();
         free_mem<KV>(this->hashtable, this->capacity, this->id, this->fd);
         this->hashtable = nullptr;
+#ifdef CAS_RECLAIM
+        reclaimer.reset();
+#endif
       }
     }
   }
@@ -85,6 +99,7 @@ class FolkloreHashTable : public BaseHashTable {
 
   void insert_batch(const InsertFindArguments &kp,
                     collector_type *collector) override {
+    ReclaimGuard guard(this);
     for (const auto &data : kp) {
       insert_noprefetch(&data, collector);
     }
@@ -92,6 +107,7 @@ class FolkloreHashTable : public BaseHashTable {
 
   void find_batch(const InsertFindArguments &kp, ValuePairs &vp,
                   collector_type *collector) override {
+    ReclaimGuard guard(this);
     size_t found_count = 0;
 
     for (const auto &data : kp) {
@@ -107,10 +123,56 @@ class FolkloreHashTable : public BaseHashTable {
     vp.first += found_count;
   }
 
+  /// Insert the keys of `kp`, or merge their values into the stored ones with
+  /// `Reducer` (see reducers.hpp).
+  template <class Reducer>
+  void upsert_batch(const InsertFindArguments &kp,
+                    collector_type *collector = nullptr) {
+    ReclaimGuard guard(this);
+    for (const auto &data : kp) {
+      upsert_noprefetch<Reducer>(&data, collector);
+    }
+  }
+
+  void flush_upsert_queue(collector_type *collector = nullptr) {}
+
+  void add_batch(const InsertFindArguments &kp,
+                 collector_type *collector = nullptr) override {
+    if constexpr (reducible_kv<KV> && sizeof(KV) == 16) {
+      this->template upsert_batch<AddReducer>(kp, collector);
+    } else {
+      BaseHashTable::add_batch(kp, collector);
+    }
+  }
+
+  /// Erased keys leave a tombstone behind so that concurrent probes are not
+  /// cut short. compact() reclaims them, with CAS_RECLAIM the table runs it
+  /// on its own once they take up a share of it (see ht_reclaim.hpp).
+  void erase_batch(const InsertFindArguments &kp,
+                   collector_type *collector) override {
+    ReclaimGuard guard(this);
+    for (const auto &data : kp) {
+      erase_noprefetch(&data, collector);
+    }
+  }
+
+  void flush_erase_queue(collector_type *collector) override {}
+
+  size_t compact() override {
+    const size_t reclaimed = compact_tombstones(
+        this->hashtable, this->capacity,
+        [this](uint64_t key) { return crc_hash((const char *)&key); });
+#ifdef CAS_RECLAIM
+    reclaimer.note_compacted();
+#endif
+    return reclaimed;
+  }
+
   size_t get_fill() const override {
     size_t count = 0;
     for (size_t i = 0; i < this->capacity; i++) {
-      if (!this->hashtable[i].is_empty()) {
+      if (!this->hashtable[i].is_empty() &&
+          !this->hashtable[i].is_tombstone()) {
         count++;
       }
     }
@@ -121,6 +183,10 @@ class FolkloreHashTable : public BaseHashTable {
   void prefetch_queue(QueueType qtype) override {}
 
   void insert_noprefetch(const void *data, collector_type *collector) override {
+    ReclaimGuard guard(this);
+    if (!insertable_key(reinterpret_cast<const KVQ *>(data)->key)) {
+      return;
+    }
     uint64_t hash = crc_hash((const char *)data);
 
     size_t idx = hash & (this->capacity - 1);  // modulo
@@ -145,6 +211,116 @@ class FolkloreHashTable : public BaseHashTable {
     }
   }
 
+  template <class Reducer>
+  void upsert_noprefetch(const void *data, collector_type *collector) {
+    ReclaimGuard guard(this);
+    if (!insertable_key(reinterpret_cast<const KVQ *>(data)->key)) {
+      return;
+    }
+    static_assert(sizeof(KV) == 16, "upserts insert with a 16B CAS");
+    uint64_t hash = crc_hash((const char *)data);
+    size_t idx = hash & (this->capacity - 1);
+
+    KVQ *elem = const_cast<KVQ *>(reinterpret_cast<const KVQ *>(data));
+
+    for (auto i = 0u; i < this->capacity; i++) {
+      KV *curr = &this->hashtable[idx];
+      if (curr->is_empty()) {
+        if (__sync_bool_compare_and_swap((__int128 *)curr, 0,
+                                         *(__int128 *)elem))
+          break;
+      }
+
+      if (curr->compare_key(data)) {
+        curr->template reduce_cas<Reducer>(elem);
+        break;
+      }
+
+      idx++;
+      idx = idx & (this->capacity - 1);
+    }
+  }
+
+  void erase_noprefetch(const void *data, collector_type *collector) {
+    ReclaimGuard guard(this);
+    if (reinterpret_cast<const InsertFindArgument *>(data)->key ==
+        TOMBSTONE_KEY) {
+      return;
+    }
+    uint64_t hash = crc_hash((const char *)data);
+    size_t idx = hash & (this->capacity - 1);
+
+    const InsertFindArgument *item =
+        reinterpret_cast<const InsertFindArgument *>(data);
+
+    for (auto i = 0u; i < this->capacity; i++) {
+      KV *curr = &this->hashtable[idx];
+      if (curr->is_empty()) {
+        break;
+      }
+
+      if (curr->compare_key(data)) {
+        if (curr->erase_cas(item->key)) {
+#ifdef CAS_RECLAIM
+          this->reclaim_handle.tombstones++;
+#endif
+        }
+        break;
+      }
+
+      idx++;
+      idx = idx & (this->capacity - 1);
+    }
+  }
+
+  size_t multi_get(std::span<const key_type> keys, std::span<value_type> out,
+                   std::span<uint8_t> found_bitmap,
+                   collector_type *collector = nullptr) override {
+    ReclaimGuard guard(this);
+    this->check_multi_get(keys, out, found_bitmap);
+    size_t found = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] == TOMBSTONE_KEY) {
+        continue;
+      }
+      uint64_t hash = crc_hash((const char *)&keys[i]);
+      size_t idx = hash & (this->capacity - 1);
+      for (auto j = 0u; j < this->capacity; j++) {
+        KV *curr = &this->find_table[idx];
+        if (curr->is_empty()) {
+          break;
+        } else if (curr->compare_key(&keys[i])) {
+          out[i] = curr->get_value();
+          set_found(found_bitmap, i);
+          found++;
+          break;
+        }
+        idx++;
+        idx = idx & (this->capacity - 1);
+      }
+    }
+    return found;
+  }
+
+  /// See CASHashTable::replicate().
+  bool replicate() override {
+    replicas.build(this->hashtable, this->capacity);
+    return true;
+  }
+
+  bool use_replica(int node) override {
+    if (node < 0) {
+      this->find_table = this->hashtable;
+      return true;
+    }
+    KV *replica = replicas.get(node);
+    if (!replica) {
+      return false;
+    }
+    this->find_table = replica;
+    return true;
+  }
+
   bool insert(const void *data) {
     cout << "Not implemented!" << endl;
     assert(false);
@@ -156,6 +332,12 @@ class FolkloreHashTable : public BaseHashTable {
   }
 
   void *find_noprefetch(const void *data, collector_type *collector) override {
+    ReclaimGuard guard(this);
+    // never stored, see insertable_key()
+    if (reinterpret_cast<const InsertFindArgument *>(data)->key ==
+        TOMBSTONE_KEY) {
+      return nullptr;
+    }
     uint64_t hash = crc_hash((const char *)data);
     size_t idx = hash & (this->capacity-1);
 
@@ -165,7 +347,7 @@ class FolkloreHashTable : public BaseHashTable {
     bool found = false;
 
     for (auto i = 0u; i < this->capacity; i++) {
-      curr = &this->hashtable[idx];
+      curr = &this->find_table[idx];
 
       if (curr->is_empty()) {
         found = false;
@@ -192,7 +374,8 @@ class FolkloreHashTable : public BaseHashTable {
 
   void display() const override {
     for (size_t i = 0; i < this->capacity; i++) {
-      if (!this->hashtable[i].is_empty()) {
+      if (!this->hashtable[i].is_empty() &&
+          !this->hashtable[i].is_tombstone()) {
         cout << this->hashtable[i] << endl;
       }
     }
@@ -203,7 +386,8 @@ class FolkloreHashTable : public BaseHashTable {
   size_t get_max_count() const override {
     size_t count = 0;
     for (size_t i = 0; i < this->capacity; i++) {
-      if (this->hashtable[i].get_value() > count) {
+      if (!this->hashtable[i].is_tombstone() &&
+          this->hashtable[i].get_value() > count) {
         count = this->hashtable[i].get_value();
       }
     }
@@ -217,7 +401,15 @@ class FolkloreHashTable : public BaseHashTable {
   static std::mutex ht_init_mutex;
   /// Reference counter of the global `hashtable`.
   static uint32_t ref_cnt;
+  /// Per-node snapshots of `hashtable`, see replicate().
+  static TableReplicas<KV> replicas;
+#ifdef CAS_RECLAIM
+  static TombstoneReclaimer reclaimer;
+  TombstoneReclaimer::Handle reclaim_handle;
+#endif
   uint64_t capacity;
+  /// The slots this thread's finds read, see use_replica().
+  KV *find_table;
   KV empty_item;
   KVQ *find_queue;
   KVQ *insert_queue;
@@ -227,13 +419,33 @@ class FolkloreHashTable : public BaseHashTable {
   uint32_t ins_tail;
   Hasher hasher_;
 
+  /// Marks a public entry point, see TombstoneReclaimer. Does nothing
+  /// without CAS_RECLAIM.
+  struct ReclaimGuard {
+#ifdef CAS_RECLAIM
+    FolkloreHashTable *ht;
+    explicit ReclaimGuard(FolkloreHashTable *ht) : ht(ht) {
+      // There are no queued probes to restart after a compaction.
+      reclaimer.enter(&ht->reclaim_handle, [ht] { return ht->compact(); });
+    }
+    ~ReclaimGuard() { reclaimer.exit(&ht->reclaim_handle); }
+#else
+    explicit ReclaimGuard(FolkloreHashTable *) {}
+#endif
+  };
+
   uint64_t read_hashtable_element(const void *data) override {
     PLOG_FATAL << "Not implemented";
     assert(false);
     return -1;
   }
 
-  void clear() override { memset(this->hashtable, 0, capacity * sizeof(KV)); }
+  void clear() override {
+    memset(this->hashtable, 0, capacity * sizeof(KV));
+#ifdef CAS_RECLAIM
+    reclaimer.note_compacted();
+#endif
+  }
 };
 
 /// Static variables
@@ -251,5 +463,13 @@ std::mutex FolkloreHashTable<KV, KVQ>::ht_init_mutex;
 
 template <class KV, class KVQ>
 uint32_t FolkloreHashTable<KV, KVQ>::ref_cnt = 0;
+
+template <class KV, class KVQ>
+TableReplicas<KV> FolkloreHashTable<KV, KVQ>::replicas;
+
+#ifdef CAS_RECLAIM
+template <class KV, class KVQ>
+TombstoneReclaimer FolkloreHashTable<KV, KVQ>::reclaimer;
+#endif
 }  // namespace kmercounter
 #endif  // HASHTABLES_FOLKLORE_KHT_HPP
@@ -7,6 +7,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 
 #include "hashtables/kvtypes.hpp"
@@ -236,6 +237,42 @@ T *calloc_ht(uint64_t capacity, uint16_t id, int *out_fd) {
   return addr;
 }
 
+/// Like calloc_ht, but the pages are bound to `node` and left uninitialized.
+template <class T>
+T *alloc_ht_on_node(uint64_t capacity, int node) {
+  uint64_t alloc_sz = round_hugepage(capacity * sizeof(T));
+  int flags = alloc_sz <= ONEGB_PAGE_SZ ? MAP_FLAGS_2MB : MAP_FLAGS_1GB;
+
+  T *addr = (T *)mmap(ADDR, alloc_sz, PROT_RW, flags, -1, 0);
+  if (addr == MAP_FAILED) {
+    PLOGE.printf("mmap of %lu bytes for node %d failed", alloc_sz, node);
+    exit(1);
+  }
+
+  unsigned long nodemask = 1UL << node;
+  unsigned long maxnode = sizeof(nodemask) * 8;
+  long ret = mbind(addr, alloc_sz, MPOL_BIND, &nodemask, maxnode,
+                   MPOL_MF_MOVE | MPOL_MF_STRICT);
+  if (ret < 0) {
+    PLOGE.printf("mbind to node %d failed: %s", node, strerror(errno));
+  }
+  return addr;
+}
+
+/// Zero `alloc_sz` bytes at `addr` from the calling thread, so that the
+/// pages are faulted in before the timed phases, and check that they landed
+/// on `node`.
+inline void prefault_on_node(void *addr, uint64_t alloc_sz, int node) {
+  memset(addr, 0, alloc_sz);
+
+  int actual = -1;
+  if (get_mempolicy(&actual, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+    PLOGV.printf("get_mempolicy failed: %s", strerror(errno));
+  } else if (actual != node) {
+    PLOGW.printf("%p was placed on node %d instead of %d", addr, actual, node);
+  }
+}
+
 template <class T>
 void free_mem(T *addr, uint64_t capacity, int id, int fd) {
   uint64_t alloc_sz = capacity * sizeof(T);
@@ -247,6 +284,60 @@ void free_mem(T *addr, uint64_t capacity, int id, int fd) {
   }
 }
 
+/// Reclaim the tombstones of a linear probing table with a power of two
+/// `capacity`. `home(key)` returns the first slot probed for `key`. Once the
+/// tombstones are cleared, every key is moved to the first empty slot on its
+/// probe sequence so that lookups never stop short of it. Starting right
+/// after an empty slot, a single pass settles all keys; the pass is repeated
+/// only if the table had no empty slot besides the tombstones.
+template <class KV, class HomeFn>
+size_t compact_tombstones(KV *ht, uint64_t capacity, HomeFn home) {
+  const uint64_t mask = capacity - 1;
+  size_t reclaimed = 0;
+  uint64_t start = capacity;
+  uint64_t first_tombstone = capacity;
+
+  for (uint64_t i = 0; i < capacity; i++) {
+    if (ht[i].is_tombstone()) {
+      memset(&ht[i], 0, sizeof(KV));
+      first_tombstone = std::min(first_tombstone, i);
+      reclaimed++;
+    } else if (start == capacity && ht[i].is_empty()) {
+      start = i;
+    }
+  }
+
+  if (reclaimed == 0) {
+    return 0;
+  }
+  if (start == capacity) {
+    start = first_tombstone;
+  }
+
+  bool moved;
+  do {
+    moved = false;
+    for (uint64_t n = 1; n <= capacity; n++) {
+      const uint64_t i = (start + n) & mask;
+      if (ht[i].is_empty()) {
+        continue;
+      }
+
+      uint64_t idx = home(ht[i].get_key()) & mask;
+      while (idx != i && !ht[idx].is_empty()) {
+        idx = (idx + 1) & mask;
+      }
+      if (idx != i) {
+        ht[idx] = ht[i];
+        memset(&ht[i], 0, sizeof(KV));
+        moved = true;
+      }
+    }
+  } while (moved);
+
+  return reclaimed;
+}
+
 }  // namespace kmercounter
 
 #endif  // _HT_HELPER_H
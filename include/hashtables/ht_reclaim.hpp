@@ -0,0 +1,176 @@
+/// Reclaiming the tombstones of a shared linear probing table.
+/// Erased keys leave a tombstone behind in casht and folklore: entries cannot
+/// be shifted back while other threads are probing, and an insert cannot
+/// safely take over a tombstone either (two inserts of the same key racing
+/// with an erase could each claim one). Without an online resize to rebuild
+/// the table, the tombstones pile up under churn until inserts fail.
+///
+/// The reclaimer counts the tombstones, and once they take up
+/// TOMBSTONE_LIMIT percent of the slots, the next operation to start on the
+/// table stops the world: it waits for the operations in flight to finish
+/// and compacts the table, while the operations that start meanwhile wait at
+/// their entry. Every handle on the table announces its operations in a slot
+/// of its own, which costs one fenced store per operation: the reclaimer is
+/// only built in with CAS_RECLAIM.
+
+#ifndef HASHTABLES_HT_RECLAIM_HPP
+#define HASHTABLES_HT_RECLAIM_HPP
+
+#include <xmmintrin.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <exception>
+
+#include "plog/Log.h"
+
+namespace kmercounter {
+
+class TombstoneReclaimer {
+ public:
+  constexpr static uint64_t TOMBSTONE_LIMIT = 10;  // percent
+  constexpr static uint32_t MAX_HANDLES = 256;
+
+  /// Per-handle state.
+  struct Handle {
+    uint32_t slot;
+    /// Nesting depth of the public entry points, only the outermost one
+    /// announces the operation.
+    uint32_t depth;
+    /// `epoch` as of the last operation of this handle.
+    uint64_t epoch;
+    /// Erases that left a tombstone behind during the current operation,
+    /// they are counted when it ends.
+    uint64_t tombstones;
+  };
+
+  /// Register a handle on a table of `capacity` slots, with the table's init
+  /// mutex held. Takes the slot of a handle that left, if there is one.
+  Handle join(uint64_t capacity) {
+    const uint32_t num_slots = this->num_slots.load(std::memory_order_relaxed);
+    uint32_t slot = 0;
+    while (slot < num_slots && this->slots[slot].taken) {
+      slot++;
+    }
+    if (slot >= MAX_HANDLES) {
+      PLOG_FATAL.printf("tombstone reclamation supports at most %u threads",
+                        MAX_HANDLES);
+      std::terminate();
+    }
+    this->slots[slot].taken = true;
+    if (slot == num_slots) {
+      this->num_slots.store(slot + 1, std::memory_order_release);
+    }
+    this->capacity = capacity;
+    return Handle{slot, 0, this->epoch.load(), 0};
+  }
+
+  /// Give the slot of `h` back, with the table's init mutex held. It is out
+  /// of its operations, so a compaction does not wait on the slot.
+  void leave(const Handle &h) {
+    assert(h.depth == 0);
+    this->slots[h.slot].taken = false;
+  }
+
+  /// Forget the handles and tombstones once the table is freed, with the
+  /// table's init mutex held.
+  void reset() {
+    this->num_slots = 0;
+    this->tombstones = 0;
+    this->pending = false;
+  }
+
+  /// Start an operation of `h`. If the table has too many tombstones, either
+  /// wait for the others to leave their operations and `compact()` it, or
+  /// wait for the handle that does. Returns true if the table was compacted
+  /// since the last operation of `h`: the entries may have moved, so its
+  /// queued probes must start over from their home slot.
+  template <class CompactFn>
+  bool enter(Handle *h, CompactFn compact) {
+    if (h->depth++) {
+      return false;
+    }
+    std::atomic<bool> &in_op = this->slots[h->slot].in_op;
+
+    for (;;) {
+      // Pairs with the load of `in_op` by the compacting handle: either it
+      // waits for this operation, or this operation sees `pending`.
+      in_op.store(true);
+      if (!this->pending.load()) {
+        break;
+      }
+      in_op.store(false, std::memory_order_release);
+
+      bool expected = false;
+      if (this->compacting.compare_exchange_strong(expected, true)) {
+        if (this->pending.load()) {
+          this->stop_the_world(h->slot, compact);
+        }
+        this->compacting.store(false, std::memory_order_release);
+      }
+      while (this->pending.load(std::memory_order_acquire)) {
+        _mm_pause();
+      }
+    }
+
+    const uint64_t epoch = this->epoch.load(std::memory_order_acquire);
+    const bool moved = epoch != h->epoch;
+    h->epoch = epoch;
+    return moved;
+  }
+
+  void exit(Handle *h) {
+    if (--h->depth) {
+      return;
+    }
+    if (h->tombstones) {
+      const uint64_t total = this->tombstones.fetch_add(
+                                 h->tombstones, std::memory_order_relaxed) +
+                             h->tombstones;
+      h->tombstones = 0;
+      if (total * 100 >= this->capacity * TOMBSTONE_LIMIT &&
+          !this->pending.load(std::memory_order_relaxed)) {
+        this->pending.store(true);
+      }
+    }
+    this->slots[h->slot].in_op.store(false, std::memory_order_release);
+  }
+
+  /// The table was compacted (or cleared) and has no tombstones left.
+  void note_compacted() { this->tombstones = 0; }
+
+ private:
+  struct alignas(64) slot_t {
+    std::atomic<bool> in_op;
+    /// Held by a handle, only touched with the table's init mutex held.
+    bool taken;
+  };
+
+  template <class CompactFn>
+  void stop_the_world(uint32_t self, CompactFn compact) {
+    const uint32_t num_slots = this->num_slots.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < num_slots; i++) {
+      while (i != self && this->slots[i].in_op.load()) {
+        _mm_pause();
+      }
+    }
+
+    compact();
+    this->tombstones = 0;
+    this->epoch.fetch_add(1, std::memory_order_release);
+    this->pending.store(false, std::memory_order_release);
+  }
+
+  uint64_t capacity = 0;
+  std::atomic<uint64_t> tombstones{0};
+  std::atomic<bool> pending{false};
+  std::atomic<bool> compacting{false};
+  /// Number of compactions so far.
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<uint32_t> num_slots{0};
+  slot_t slots[MAX_HANDLES];
+};
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_HT_RECLAIM_HPP
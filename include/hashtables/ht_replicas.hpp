@@ -0,0 +1,86 @@
+/// Per-NUMA-node copies of a shared table, for read-mostly workloads.
+/// The shared tables of casht and folklore live on one node (or are
+/// interleaved over all of them with THREADS_SPLIT_EVEN_NODES), so a share of
+/// the finds always crosses the socket interconnect. Once the inserts are
+/// done, `build()` copies the table to every node and the threads of a node
+/// can look up their own copy.
+///
+/// A replica is a snapshot: inserts keep going to the shared table and only
+/// show up in the replicas after the next `build()`.
+
+#ifndef HASHTABLES_HT_REPLICAS_HPP
+#define HASHTABLES_HT_REPLICAS_HPP
+
+#include <numa.h>
+
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "hashtables/ht_helper.hpp"
+#include "plog/Log.h"
+
+namespace kmercounter {
+
+template <class KV>
+class TableReplicas {
+ public:
+  constexpr static int MAX_NODES = 16;
+
+  ~TableReplicas() { this->drop(); }
+
+  /// Copy the `capacity` slots of `src` to every node, replacing the
+  /// previous copies. Each copy is written by a thread running on its node.
+  /// Nothing may write to `src` meanwhile.
+  void build(const KV *src, uint64_t capacity) {
+    this->drop();
+    int nodes = numa_available() < 0 ? 1 : numa_num_configured_nodes();
+    if (nodes > MAX_NODES) {
+      PLOGW.printf("replicating to the first %d of %d nodes", MAX_NODES,
+                   nodes);
+      nodes = MAX_NODES;
+    }
+
+    std::vector<std::thread> copiers;
+    for (int n = 0; n < nodes; n++) {
+      this->tables[n] = alloc_ht_on_node<KV>(capacity, n);
+      copiers.emplace_back([this, src, capacity, n]() {
+        if (numa_available() >= 0) {
+          numa_run_on_node(n);
+        }
+        memcpy(this->tables[n], src, capacity * sizeof(KV));
+      });
+    }
+    for (auto &t : copiers) {
+      t.join();
+    }
+    this->capacity = capacity;
+    this->num_nodes = nodes;
+    PLOGI.printf("replicated %lu slots to %d nodes", capacity, nodes);
+  }
+
+  void drop() {
+    for (int n = 0; n < this->num_nodes; n++) {
+      free_mem<KV>(this->tables[n], this->capacity, 0, -1);
+      this->tables[n] = nullptr;
+    }
+    this->num_nodes = 0;
+  }
+
+  /// The copy on `node`, or nullptr if there is none.
+  KV *get(int node) const {
+    return (node >= 0 && node < this->num_nodes) ? this->tables[node]
+                                                 : nullptr;
+  }
+
+  int size() const { return this->num_nodes; }
+
+ private:
+  KV *tables[MAX_NODES] = {};
+  uint64_t capacity = 0;
+  int num_nodes = 0;
+};
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_HT_REPLICAS_HPP
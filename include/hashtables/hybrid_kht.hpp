@@ -0,0 +1,408 @@
+/// Shared casht++ with the hot keys combined per thread.
+/// Under a skewed workload a handful of keys take most of the updates, and
+/// on a shared table every thread keeps CASing the same few cache lines. On
+/// the other hand, delegating every key to an owner pays the queues for the
+/// cold keys too, which are the ones that do not contend.
+///
+/// Every thread counts its keys in a small count-min sketch (two rows of
+/// saturating 8-bit counters, halved every `SKETCH_DECAY` updates so that
+/// keys cool down again). A key whose estimate reaches `config.hot_threshold`
+/// gets a slot in the thread's 2-way set-associative hot table, and from then
+/// on its inserts are combined there: the value is replaced (`Item`) or the
+/// count is added up (`Aggr_KV`). A key only takes the slot of another one
+/// that got fewer updates, so that two hot keys of the same set do not evict
+/// each other on every insert. The combined updates are written to the shared
+/// table every `config.hot_flush_interval` inserts, when another hot key
+/// takes the slot, and on `flush_insert_queue()`. All other keys go straight
+/// to `CASHashTable::insert_batch()`.
+///
+/// For `Item`, the updates of a key reach the shared table in the order they
+/// were made, whether they were combined or not. Like the insert queue of
+/// casht++, a find only sees the hot updates that were flushed before it.
+
+#ifndef HASHTABLES_HYBRID_KHT_HPP
+#define HASHTABLES_HYBRID_KHT_HPP
+
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "hashtables/base_kht.hpp"
+#include "hashtables/cas_kht.hpp"
+#include "hashtables/reducers.hpp"
+#include "plog/Log.h"
+#include "types.hpp"
+
+namespace kmercounter {
+
+extern Configuration config;
+
+template <typename KV, typename KVQ>
+class HybridHashTable : public BaseHashTable {
+ public:
+  /// Counters per sketch row
+  constexpr static uint32_t SKETCH_WIDTH = 1 << 12;
+  constexpr static uint32_t SKETCH_MASK = SKETCH_WIDTH - 1;
+  /// Sketch updates between two halvings of all the counters
+  constexpr static uint64_t SKETCH_DECAY = SKETCH_WIDTH * 16;
+  /// The hot table is indexed by the top bits of the sketch hash.
+  constexpr static uint32_t MAX_HOT_SLOTS = 1 << 12;
+  constexpr static uint32_t HOT_WAYS = 2;
+
+  struct Stats {
+    /// Inserts combined in the hot table
+    uint64_t combined;
+    /// Combined updates written to the shared table
+    uint64_t spilled;
+    /// Keys that got a hot slot
+    uint64_t promoted;
+    /// Inserts that went to the shared table directly
+    uint64_t cold;
+  };
+
+  /// `shared` is this thread's casht++, the hybrid table takes it over.
+  HybridHashTable(CASHashTable<KV, KVQ> *shared, uint32_t id)
+      : shared(shared),
+        id(id),
+        threshold(config.hot_threshold),
+        flush_interval(config.hot_flush_interval),
+        set_mask(config.hot_slots / HOT_WAYS - 1),
+        hot(config.hot_slots),
+        since_flush(0),
+        sketch_updates(0),
+        stats{} {
+    if (config.hot_slots < HOT_WAYS || config.hot_slots > MAX_HOT_SLOTS ||
+        (config.hot_slots & (config.hot_slots - 1))) {
+      PLOGE.printf("hot-slots must be a power of two from %u to %u", HOT_WAYS,
+                   MAX_HOT_SLOTS);
+      abort();
+    }
+    if (this->threshold == 0 || this->threshold > UINT8_MAX) {
+      PLOGE.printf("hot-threshold must be between 1 and %u", UINT8_MAX);
+      abort();
+    }
+    memset(this->sketch, 0, sizeof(this->sketch));
+
+    const uint32_t batch = std::max<uint32_t>(config.batch_len, 1);
+    this->writes.reserve(2 * batch);
+    this->spills.reserve(batch);
+  }
+
+  ~HybridHashTable() {
+    PLOGI.printf(
+        "[hybrid:%u] inserts %lu, combined %lu (%.3f) | spilled %lu | "
+        "promoted %lu",
+        this->id, this->stats.combined + this->stats.cold,
+        this->stats.combined, this->combine_ratio(), this->stats.spilled,
+        this->stats.promoted);
+    delete this->shared;
+  }
+
+  bool insert(const void *data) override {
+    this->insert_noprefetch(data);
+    return true;
+  }
+
+  void insert_noprefetch(const void *data,
+                         collector_type *collector = nullptr) override {
+    const InsertFindArgument *arg =
+        reinterpret_cast<const InsertFindArgument *>(data);
+    if (!this->combine(*arg, collector)) {
+      this->stats.cold++;
+      this->writes.push_back(*arg);
+    }
+    this->write_out(collector, true);
+    this->tick(1, collector, true);
+  }
+
+  void insert_batch(const InsertFindArguments &kp,
+                    collector_type *collector = nullptr) override {
+    for (auto &data : kp) {
+      if (!this->combine(data, collector)) {
+        this->stats.cold++;
+        this->writes.push_back(data);
+      }
+    }
+    this->write_out(collector, false);
+    this->tick(kp.size(), collector, false);
+  }
+
+  void flush_insert_queue(collector_type *collector = nullptr) override {
+    this->flush_hot(collector, false);
+    this->shared->flush_insert_queue(collector);
+    if constexpr (combine_adds) {
+      this->shared->flush_upsert_queue(collector);
+    }
+  }
+
+  /// Counts that are already combined, they skip the hot table.
+  void add_batch(const InsertFindArguments &kp,
+                 collector_type *collector = nullptr) override {
+    this->shared->add_batch(kp, collector);
+  }
+
+  void flush_add_queue(collector_type *collector = nullptr) override {
+    this->shared->flush_add_queue(collector);
+  }
+
+  void find_batch(const InsertFindArguments &kp, ValuePairs &vp,
+                  collector_type *collector = nullptr) override {
+    this->shared->find_batch(kp, vp, collector);
+  }
+
+  void *find_noprefetch(const void *data,
+                        collector_type *collector = nullptr) override {
+    return this->shared->find_noprefetch(data, collector);
+  }
+
+  size_t flush_find_queue(ValuePairs &vp,
+                          collector_type *collector = nullptr) override {
+    return this->shared->flush_find_queue(vp, collector);
+  }
+
+  bool replicate() override { return this->shared->replicate(); }
+
+  bool use_replica(int node) override {
+    return this->shared->use_replica(node);
+  }
+
+  bool set_queue_params(QueueType qtype, uint32_t depth,
+                        uint32_t distance) override {
+    return this->shared->set_queue_params(qtype, depth, distance);
+  }
+
+  void display() const override { this->shared->display(); }
+
+  size_t get_fill() const override { return this->shared->get_fill(); }
+
+  size_t get_capacity() const override {
+    return this->shared->get_capacity();
+  }
+
+  size_t get_max_count() const override {
+    return this->shared->get_max_count();
+  }
+
+  void print_to_file(std::string &outfile) const override {
+    this->shared->print_to_file(outfile);
+  }
+
+  uint64_t read_hashtable_element(const void *data) override {
+    // private in casht++, public through the base class
+    return static_cast<BaseHashTable *>(this->shared)
+        ->read_hashtable_element(data);
+  }
+
+  void prefetch_queue(QueueType qtype) override {
+    this->shared->prefetch_queue(qtype);
+  }
+
+  void clear() override {
+    // whatever is still combined belongs to the old contents
+    for (HotSlot &slot : this->hot) {
+      slot = HotSlot{};
+    }
+    this->writes.clear();
+    this->spills.clear();
+    this->shared->clear();
+  }
+
+  const Stats &get_stats() const { return this->stats; }
+
+  /// Share of the inserts that were combined in the hot table.
+  double combine_ratio() const {
+    uint64_t inserts = this->stats.combined + this->stats.cold;
+    return inserts ? (double)this->stats.combined / inserts : 0.0;
+  }
+
+ private:
+  /// Aggregating tables count every insert, so their hot updates are added
+  /// up and merged with upserts. Otherwise the last value wins, which is
+  /// what a plain insert of the combined value does.
+  constexpr static bool combine_adds = std::is_same<KV, Aggr_KV>::value;
+
+  struct HotSlot {
+    /// 0 if the slot is free, see the warning in base_kht.hpp
+    key_type key;
+    /// The last value, or the count of the inserts since the last flush
+    value_type value;
+    /// Holds updates that are not in the shared table yet
+    bool pending;
+    /// Updates since the key got the slot, halved along with the sketch
+    uint32_t hits;
+  };
+
+  CASHashTable<KV, KVQ> *shared;
+  uint32_t id;
+  uint32_t threshold;
+  uint32_t flush_interval;
+  uint32_t set_mask;
+  std::vector<HotSlot> hot;
+  uint8_t sketch[2][SKETCH_WIDTH];
+  uint64_t since_flush;
+  uint64_t sketch_updates;
+  /// Inserts on their way to the shared table, in the order they were made:
+  /// the cold keys, and for `Item` the combined updates as well, so that an
+  /// older value never overwrites a newer one.
+  std::vector<InsertFindArgument> writes;
+  /// Combined counts on their way to the shared table (`Aggr_KV`), the order
+  /// does not matter when they are added up.
+  std::vector<InsertFindArgument> spills;
+  Stats stats;
+
+  static inline uint32_t sketch_hash(key_type key) {
+    return _mm_crc32_u64(0xffffffff, key);
+  }
+
+  /// Count `hash` and return its estimate.
+  inline uint8_t sketch_count(uint32_t hash) {
+    uint8_t &a = this->sketch[0][hash & SKETCH_MASK];
+    uint8_t &b = this->sketch[1][(hash >> 16) & SKETCH_MASK];
+    a += a < UINT8_MAX;
+    b += b < UINT8_MAX;
+    const uint8_t count = std::min(a, b);
+
+    if (++this->sketch_updates == SKETCH_DECAY) {
+      for (auto &row : this->sketch) {
+        for (uint8_t &c : row) {
+          c >>= 1;
+        }
+      }
+      for (HotSlot &slot : this->hot) {
+        slot.hits >>= 1;
+      }
+      this->sketch_updates = 0;
+    }
+    return count;
+  }
+
+  inline void merge(HotSlot &slot, const InsertFindArgument &data) {
+    if constexpr (combine_adds) {
+      slot.value += 1;
+    } else {
+      slot.value = data.value;
+    }
+    slot.pending = true;
+    slot.hits++;
+  }
+
+  /// Take the insert into the hot table if its key is hot. Returns false if
+  /// it has to go to the shared table.
+  inline bool combine(const InsertFindArgument &data,
+                      collector_type *collector) {
+    uint32_t hash = sketch_hash(data.key);
+    HotSlot *set = &this->hot[((hash >> 20) & this->set_mask) * HOT_WAYS];
+    for (uint32_t way = 0; way < HOT_WAYS; way++) {
+      if (set[way].key == data.key && data.key != 0) {
+        this->merge(set[way], data);
+        this->stats.combined++;
+        return true;
+      }
+    }
+    const uint8_t count = this->sketch_count(hash);
+    if (count < this->threshold) {
+      return false;
+    }
+
+    // Take a free slot, or the one of the coolest key if it is cooler than
+    // this one; otherwise this key stays cold for now.
+    HotSlot *slot = nullptr;
+    uint32_t slot_hits = count;
+    for (uint32_t way = 0; way < HOT_WAYS; way++) {
+      if (set[way].key == 0) {
+        slot = &set[way];
+        break;
+      }
+      if (set[way].hits < slot_hits) {
+        slot = &set[way];
+        slot_hits = set[way].hits;
+      }
+    }
+    if (!slot) {
+      return false;
+    }
+    if (slot->pending) {
+      this->spill(*slot, collector);
+    }
+    slot->key = data.key;
+    slot->value = 0;
+    // Its inserts so far, as far as the sketch knows.
+    slot->hits = count - 1;
+    this->merge(*slot, data);
+    this->stats.promoted++;
+    this->stats.combined++;
+    return true;
+  }
+
+  inline void spill(HotSlot &slot, collector_type *collector) {
+    const InsertFindArgument arg{.key = slot.key, .value = slot.value, .id = 0};
+    slot.pending = false;
+    this->stats.spilled++;
+    if constexpr (combine_adds) {
+      slot.value = 0;
+      this->spills.push_back(arg);
+      if (this->spills.size() == this->spills.capacity()) {
+        this->write_spills(collector);
+      }
+    } else {
+      this->writes.push_back(arg);
+    }
+  }
+
+  /// Hand `writes` to the shared table, in order. `sync` inserts them right
+  /// away, like insert_noprefetch(), instead of through the insert queue.
+  void write_out(collector_type *collector, bool sync) {
+    if (this->writes.empty()) {
+      return;
+    }
+    if (sync) {
+      for (const auto &arg : this->writes) {
+        this->shared->insert_noprefetch(&arg, collector);
+      }
+    } else {
+      this->shared->insert_batch(
+          InsertFindArguments(this->writes.data(), this->writes.size()),
+          collector);
+    }
+    this->writes.clear();
+  }
+
+  void write_spills(collector_type *collector) {
+    if (this->spills.empty()) {
+      return;
+    }
+    InsertFindArguments kp(this->spills.data(), this->spills.size());
+    if constexpr (combine_adds) {
+      this->shared->template upsert_batch<AddReducer>(kp, collector);
+    } else {
+      this->shared->insert_batch(kp, collector);
+    }
+    this->spills.clear();
+  }
+
+  /// Write out all the pending hot updates. The keys keep their slots.
+  void flush_hot(collector_type *collector, bool sync) {
+    for (HotSlot &slot : this->hot) {
+      if (slot.pending) {
+        this->spill(slot, collector);
+      }
+    }
+    this->write_out(collector, sync);
+    this->write_spills(collector);
+    this->since_flush = 0;
+  }
+
+  inline void tick(uint64_t ops, collector_type *collector, bool sync) {
+    this->since_flush += ops;
+    if (this->since_flush >= this->flush_interval) {
+      this->flush_hot(collector, sync);
+    }
+  }
+};
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_HYBRID_KHT_HPP
@@ -4,13 +4,38 @@
 #include <immintrin.h>
 #include <plog/Log.h>
 #include <assert.h>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <limits>
 
+#include "hashtables/reducers.hpp"
 #include "types.hpp"
 
 namespace kmercounter {
 
+/// Erased slots in the concurrent tables keep this key, so that probe
+/// sequences running through them stay intact. Like the empty key (0), it
+/// cannot be inserted.
+constexpr key_type TOMBSTONE_KEY = std::numeric_limits<key_type>::max();
+
+/// Number of TOMBSTONE_KEY inserts and upserts that the concurrent tables
+/// dropped.
+inline std::atomic<uint64_t> rejected_tombstone_keys{0};
+
+/// False for TOMBSTONE_KEY, which the concurrent tables do not store: the
+/// slot would read as erased, and be skipped by get_fill() and dropped by
+/// compaction. The first rejection is logged, all of them are counted.
+inline bool insertable_key(key_type key) {
+  if (__builtin_expect(key != TOMBSTONE_KEY, 1)) {
+    return true;
+  }
+  if (rejected_tombstone_keys.fetch_add(1, std::memory_order_relaxed) == 0) {
+    PLOGW << "key " << key << " marks erased slots and is not inserted";
+  }
+  return false;
+}
+
 struct Kmer_base {
   Kmer_s kmer;
   uint16_t count;
@@ -137,14 +162,30 @@ struct Aggr_KV {
   }
 
   inline bool update_cas(queue *elem) {
-    auto ret = false;
-    uint64_t old_val;
+    // lock xadd instead of a CAS loop, which keeps failing on hot keys.
+    __sync_fetch_and_add(&this->count, 1);
+    return true;
+  }
 
-    while (!ret) {
-      old_val = this->count;
-      ret = __sync_bool_compare_and_swap(&this->count, old_val, old_val + 1);
+  /// Single-writer upsert, see reducers.hpp. Returns true if the slot holds
+  /// another key.
+  template <class Reducer>
+  inline bool upsert(queue *elem) {
+    if (this->is_empty()) {
+      this->key = elem->key;
+      this->count = elem->value;
+      return false;
+    } else if (this->key == elem->key) {
+      this->count = Reducer::reduce(this->count, elem->value);
+      return false;
     }
-    return ret;
+    return true;
+  }
+
+  /// Merge into a slot that already holds `elem->key`.
+  template <class Reducer>
+  inline void reduce_cas(queue *elem) {
+    reduce_atomic<Reducer>(&this->count, elem->value);
   }
 
   inline bool compare_key(const void *from) {
@@ -164,6 +205,14 @@ struct Aggr_KV {
         : "rbx");
   }
 
+  /// Turn the slot holding `key` into a tombstone. Fails if the slot was
+  /// concurrently erased.
+  inline bool erase_cas(key_type key) {
+    return __sync_bool_compare_and_swap(&this->key, key, TOMBSTONE_KEY);
+  }
+
+  inline bool is_tombstone() const { return this->key == TOMBSTONE_KEY; }
+
   inline uint64_t get_key() const { return this->key; }
   inline uint16_t get_value() const { return this->count; }
 
@@ -523,6 +572,27 @@ struct Item {
     return ret;
   }
 
+  /// Single-writer upsert, see reducers.hpp. Returns true if the slot holds
+  /// another key.
+  template <class Reducer>
+  inline bool upsert(queue *elem) {
+    if (this->is_empty()) {
+      this->kvpair.key = elem->key;
+      this->kvpair.value = elem->value;
+      return false;
+    } else if (this->kvpair.key == elem->key) {
+      this->kvpair.value = Reducer::reduce(this->kvpair.value, elem->value);
+      return false;
+    }
+    return true;
+  }
+
+  /// Merge into a slot that already holds `elem->key`.
+  template <class Reducer>
+  inline void reduce_cas(queue *elem) {
+    reduce_atomic<Reducer>(&this->kvpair.value, elem->value);
+  }
+
   inline bool compare_key(const void *from) {
     const KVPair *kvpair = reinterpret_cast<const KVPair *>(from);
     return this->kvpair.key == kvpair->key;
@@ -545,6 +615,14 @@ struct Item {
     this->kvpair.value = elem->value;
   }
 
+  /// Turn the slot holding `key` into a tombstone. Fails if the slot was
+  /// concurrently erased.
+  inline bool erase_cas(key_type key) {
+    return __sync_bool_compare_and_swap(&this->kvpair.key, key, TOMBSTONE_KEY);
+  }
+
+  inline bool is_tombstone() const { return this->kvpair.key == TOMBSTONE_KEY; }
+
   inline uint64_t get_key() const { return this->kvpair.key; }
   inline uint64_t get_value() const { return this->kvpair.value; }
 
@@ -0,0 +1,264 @@
+/// Out-of-line values for any of the hashtables.
+/// The wrapped table stores a key and an 8B handle, the payload itself
+/// (of any size) lives in a per-thread `ValueHeap` carved out of a
+/// `HugepageArena`. This serves 64-512B values without bloating the primary
+/// table, whose probe stays at one cacheline.
+///
+/// A handle is `heap id (16 bits) | offset (48 bits)`. Payloads are 64B
+/// aligned, so the low 6 bits of the offset hold the number of cachelines
+/// of the payload minus one, which lets `find_batch` prefetch the whole
+/// payload without touching it first. With `prefetch_payload` set, the
+/// results of a `find_batch` call are prefetched and handed out by the next
+/// call (or flush), so the payload misses overlap with the next batch of
+/// probes.
+///
+/// Payloads are never freed individually: overwriting a key leaks its old
+/// payload until the heap is reset.
+
+#ifndef HASHTABLES_PAYLOAD_KHT_HPP
+#define HASHTABLES_PAYLOAD_KHT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "hashtables/base_kht.hpp"
+#include "plog/Log.h"
+#include "types.hpp"
+#include "utils/hugepage_arena.hpp"
+
+namespace kmercounter {
+
+extern Configuration config;
+
+/// Bump allocator for the payloads of one thread.
+class ValueHeap {
+ public:
+  constexpr static uint64_t OFFSET_BITS = 48;
+  constexpr static uint64_t OFFSET_MASK = (1ULL << OFFSET_BITS) - 1;
+  constexpr static uint64_t LINE_BITS = 6;
+  constexpr static uint64_t LINE_MASK = (1ULL << LINE_BITS) - 1;
+  constexpr static uint64_t CACHELINE_SIZE = 1ULL << LINE_BITS;
+  constexpr static uint32_t MAX_HEAPS = 1 << (64 - OFFSET_BITS);
+
+  /// Header in front of every payload.
+  struct Payload {
+    uint32_t len;
+    uint32_t pad;
+    char data[];
+  };
+
+  ValueHeap(uint64_t bytes)
+      : arena(bytes > ONE_GB ? (bytes + ONE_GB - 1) / ONE_GB : 0,
+              bytes > ONE_GB ? 0 : (bytes + TWO_MB - 1) / TWO_MB),
+        capacity(bytes),
+        used(0) {
+    if (bytes > OFFSET_MASK) {
+      PLOGE.printf("value heap of %lu bytes does not fit a %lu-bit offset",
+                   bytes, OFFSET_BITS);
+      abort();
+    }
+    this->base = (char *)arena.aligned_alloc(bytes, CACHELINE_SIZE);
+    {
+      const std::lock_guard<std::mutex> lock(ids_mutex);
+      if (!free_ids.empty()) {
+        this->id = free_ids.back();
+        free_ids.pop_back();
+      } else if (next_id < MAX_HEAPS) {
+        this->id = next_id++;
+      } else {
+        PLOGE.printf("too many value heaps (%u)", MAX_HEAPS);
+        abort();
+      }
+      bases[this->id] = this->base;
+    }
+  }
+
+  /// The id goes to the next heap, so the handles of this one must be gone
+  /// from the tables by now.
+  ~ValueHeap() {
+    const std::lock_guard<std::mutex> lock(ids_mutex);
+    bases[this->id] = nullptr;
+    free_ids.push_back(this->id);
+  }
+
+  /// Copy `len` bytes from `data` into the heap and return their handle.
+  uint64_t put(const void *data, uint32_t len) {
+    uint64_t sz = sizeof(Payload) + len;
+    uint64_t lines = (sz + CACHELINE_SIZE - 1) / CACHELINE_SIZE;
+    if (this->used + lines * CACHELINE_SIZE > this->capacity) {
+      PLOGE.printf("value heap %u is full (%lu bytes)", this->id,
+                   this->capacity);
+      abort();
+    }
+    Payload *p = (Payload *)(this->base + this->used);
+    p->len = len;
+    memcpy(p->data, data, len);
+
+    uint64_t handle = ((uint64_t)this->id << OFFSET_BITS) | this->used |
+                      (std::min(lines, LINE_MASK + 1) - 1);
+    this->used += lines * CACHELINE_SIZE;
+    return handle;
+  }
+
+  /// Forget all payloads. The handles stored in the hashtable dangle after
+  /// this, so the table has to be cleared as well.
+  void reset() { this->used = 0; }
+
+  uint64_t get_used() const { return this->used; }
+
+  /// Resolve a handle of any thread's heap.
+  static inline const Payload *get(uint64_t handle) {
+    return (const Payload *)(bases[handle >> OFFSET_BITS] +
+                             (handle & OFFSET_MASK & ~LINE_MASK));
+  }
+
+  static inline void prefetch(uint64_t handle) {
+    const char *p = (const char *)get(handle);
+    uint64_t lines = (handle & LINE_MASK) + 1;
+    for (uint64_t i = 0; i < lines; i++) {
+      __builtin_prefetch(p + i * CACHELINE_SIZE, false, 3);
+    }
+  }
+
+ private:
+  constexpr static uint64_t TWO_MB = 1ULL << 21;
+  constexpr static uint64_t ONE_GB = 1ULL << 30;
+
+  HugepageArena arena;
+  char *base;
+  uint64_t capacity;
+  uint64_t used;
+  uint32_t id;
+
+  /// Ids are handed out in order, and those of the destroyed heaps reused.
+  static inline std::mutex ids_mutex;
+  static inline std::vector<uint32_t> free_ids;
+  static inline uint32_t next_id = 0;
+  static inline char *bases[MAX_HEAPS];
+};
+
+struct PayloadInsertArgument {
+  key_type key;
+  const void *data;
+  uint32_t len;
+  /// See `InsertFindArgument::id`.
+  uint32_t id;
+};
+
+struct PayloadFindResult {
+  /// The id of the find operation.
+  uint32_t id;
+  uint32_t len;
+  const char *data;
+};
+
+using PayloadPairs = std::pair<uint32_t, PayloadFindResult *>;
+
+/// Per-thread front-end, like the tables, one instance per thread. `ht` is
+/// not owned.
+class PayloadHashTable {
+ public:
+  PayloadHashTable(BaseHashTable *ht, uint64_t heap_bytes,
+                   bool prefetch_payload)
+      : ht(ht),
+        heap(heap_bytes),
+        prefetch_payload(prefetch_payload),
+        num_pending(0) {}
+
+  void insert_batch(std::span<PayloadInsertArgument> kp,
+                    collector_type *collector = nullptr) {
+    if (this->args.size() < kp.size()) {
+      this->args.resize(kp.size());
+    }
+    for (size_t i = 0; i < kp.size(); i++) {
+      this->args[i].key = kp[i].key;
+      this->args[i].value = this->heap.put(kp[i].data, kp[i].len);
+      this->args[i].id = kp[i].id;
+    }
+    this->ht->insert_batch(InsertFindArguments(this->args.data(), kp.size()),
+                           collector);
+  }
+
+  void flush_insert_queue(collector_type *collector = nullptr) {
+    this->ht->flush_insert_queue(collector);
+  }
+
+  /// Found keys are appended to `out`, at most `config.batch_len` of them
+  /// per call. With `prefetch_payload`, they come out one call late.
+  void find_batch(const InsertFindArguments &kp, PayloadPairs &out,
+                  collector_type *collector = nullptr) {
+    this->emit_pending(out);
+    ValuePairs vp{0, this->results_for(kp.size())};
+    this->ht->find_batch(kp, vp, collector);
+    this->stage(vp, out);
+  }
+
+  /// Returns how many results are still to come, call again until it
+  /// returns 0.
+  size_t flush_find_queue(PayloadPairs &out,
+                          collector_type *collector = nullptr) {
+    this->emit_pending(out);
+    ValuePairs vp{0, this->results_for(config.batch_len)};
+    size_t remaining = this->ht->flush_find_queue(vp, collector);
+    this->stage(vp, out);
+    return remaining + this->num_pending;
+  }
+
+  ValueHeap &get_heap() { return this->heap; }
+
+ private:
+  BaseHashTable *ht;
+  ValueHeap heap;
+  bool prefetch_payload;
+  std::vector<InsertFindArgument> args;
+  /// Results of the wrapped table.
+  std::vector<FindResult> results;
+  /// Results of the previous call, whose payloads are being prefetched.
+  std::vector<FindResult> pending;
+  uint32_t num_pending;
+
+  FindResult *results_for(size_t n) {
+    n = std::max<size_t>(n, config.batch_len);
+    if (this->results.size() < n) {
+      this->results.resize(n);
+      this->pending.resize(n);
+    }
+    return this->results.data();
+  }
+
+  static inline void emit(const FindResult &r, PayloadPairs &out) {
+    const ValueHeap::Payload *p = ValueHeap::get(r.value);
+    out.second[out.first].id = r.id;
+    out.second[out.first].len = p->len;
+    out.second[out.first].data = p->data;
+    out.first++;
+  }
+
+  void emit_pending(PayloadPairs &out) {
+    for (uint32_t i = 0; i < this->num_pending; i++) {
+      emit(this->pending[i], out);
+    }
+    this->num_pending = 0;
+  }
+
+  void stage(const ValuePairs &vp, PayloadPairs &out) {
+    if (!this->prefetch_payload) {
+      for (uint32_t i = 0; i < vp.first; i++) {
+        emit(vp.second[i], out);
+      }
+      return;
+    }
+    for (uint32_t i = 0; i < vp.first; i++) {
+      ValueHeap::prefetch(vp.second[i].value);
+    }
+    std::swap(this->results, this->pending);
+    this->num_pending = vp.first;
+  }
+};
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_PAYLOAD_KHT_HPP
@@ -0,0 +1,83 @@
+/// Value reducers for `upsert_batch()`.
+/// An upsert inserts a key with the incoming value if the key is not present
+/// yet, and otherwise merges the incoming value into the stored one with
+/// `Reducer::reduce(stored, incoming)`. Concurrent upserts of the same key
+/// are applied in any order, so reducers have to be associative and
+/// commutative.
+/// A reducer that sets `fetch_add` promises that `reduce` is a plain
+/// addition: the shared tables then merge with one locked add instead of a
+/// CAS retry loop, which matters for skewed keys.
+
+#ifndef HASHTABLES_REDUCERS_HPP
+#define HASHTABLES_REDUCERS_HPP
+
+#include <algorithm>
+
+#include "types.hpp"
+
+namespace kmercounter {
+
+struct AddReducer {
+  static constexpr bool fetch_add = true;
+  static inline value_type reduce(value_type stored, value_type in) {
+    return stored + in;
+  }
+};
+
+struct MinReducer {
+  static inline value_type reduce(value_type stored, value_type in) {
+    return std::min(stored, in);
+  }
+};
+
+struct MaxReducer {
+  static inline value_type reduce(value_type stored, value_type in) {
+    return std::max(stored, in);
+  }
+};
+
+/// Keep the incoming value, like `insert_batch()` does. Not commutative, the
+/// last writer wins.
+struct AssignReducer {
+  static inline value_type reduce(value_type stored, value_type in) {
+    return in;
+  }
+};
+
+template <class Reducer>
+constexpr bool reducer_fetch_add() {
+  if constexpr (requires { Reducer::fetch_add; }) {
+    return Reducer::fetch_add;
+  } else {
+    return false;
+  }
+}
+
+/// Slot types that can merge values, i.e. tables of them have upsert_batch().
+template <class KV>
+concept reducible_kv = requires(KV kv, typename KV::queue q) {
+  kv.template upsert<AddReducer>(&q);
+};
+
+/// Merge `in` into `*slot`, which other threads may update concurrently.
+template <class Reducer>
+inline void reduce_atomic(value_type *slot, value_type in) {
+  if constexpr (reducer_fetch_add<Reducer>()) {
+    // lock xadd, never retries
+    __atomic_fetch_add(slot, in, __ATOMIC_RELAXED);
+  } else {
+    value_type stored = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    value_type merged;
+    do {
+      merged = Reducer::reduce(stored, in);
+      // min/max mostly do not change anything, skip the store.
+      if (merged == stored) {
+        return;
+      }
+    } while (!__atomic_compare_exchange_n(slot, &stored, merged, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  }
+}
+
+}  // namespace kmercounter
+#endif  // HASHTABLES_REDUCERS_HPP
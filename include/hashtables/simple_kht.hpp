@@ -194,8 +194,20 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
     return 0;
   };
 
-  PartitionedHashStore(uint64_t c, uint8_t id)
-      : id(id), find_head(0), find_tail(0), ins_head(0), ins_tail(0) {
+  /// With `node` >= 0, the partition is bound to that NUMA node instead of
+  /// following `config.numa_split`, and prefaulted by the calling thread.
+  /// Construct it on the thread that owns the partition.
+  PartitionedHashStore(uint64_t c, uint8_t id, int node = -1)
+      : id(id),
+        find_head(0),
+        find_tail(0),
+        ins_head(0),
+        ins_tail(0),
+        ers_head(0),
+        ers_tail(0),
+        ups_head(0),
+        ups_tail(0),
+        upsert_flush(nullptr) {
     this->capacity = c;
 
     {
@@ -223,8 +235,14 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
     this->ht_sz = this->capacity * sizeof(KV);
 
     // Allocate for this id
-    this->hashtable[this->id] =
-        (KV *)calloc_ht<KV>(this->capacity, this->id, &this->fds[this->id]);
+    if (node >= 0) {
+      this->hashtable[this->id] = alloc_ht_on_node<KV>(this->capacity, node);
+      this->fds[this->id] = -1;
+      prefault_on_node(this->hashtable[this->id], this->ht_sz, node);
+    } else {
+      this->hashtable[this->id] =
+          (KV *)calloc_ht<KV>(this->capacity, this->id, &this->fds[this->id]);
+    }
     this->empty_item = this->empty_item.get_empty_key();
     this->key_length = empty_item.key_length();
     this->data_length = empty_item.data_length();
@@ -234,9 +252,17 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
         (KVQ *)(aligned_alloc(64, PREFETCH_QUEUE_SIZE * sizeof(KVQ)));
     this->find_queue =
         (KVQ *)(aligned_alloc(64, PREFETCH_FIND_QUEUE_SIZE * sizeof(KVQ)));
+    this->erase_queue =
+        (KVQ *)(aligned_alloc(64, PREFETCH_QUEUE_SIZE * sizeof(KVQ)));
+    this->upsert_queue =
+        (KVQ *)(aligned_alloc(64, PREFETCH_QUEUE_SIZE * sizeof(KVQ)));
 
     memset(this->insert_queue, 0x0, PREFETCH_QUEUE_SIZE * sizeof(KVQ));
 
+    memset(this->erase_queue, 0x0, PREFETCH_QUEUE_SIZE * sizeof(KVQ));
+
+    memset(this->upsert_queue, 0x0, PREFETCH_QUEUE_SIZE * sizeof(KVQ));
+
     memset(this->find_queue, 0x0, PREFETCH_FIND_QUEUE_SIZE * sizeof(KVQ));
 
     PLOG_DEBUG.printf("id: %d insert_queue %p | find_queue %p", id,
@@ -249,6 +275,8 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
   ~PartitionedHashStore() {
     free(find_queue);
     free(insert_queue);
+    free(erase_queue);
+    free(upsert_queue);
     free_mem<KV>(this->hashtable[this->id], this->capacity, this->id,
                  this->fds[this->id]);
     this->hashtable[this->id] = nullptr;
@@ -616,6 +644,99 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
     // this->find_tail << endl;
   }
 
+  /// Insert the keys of `kp`, or merge their values into the stored ones with
+  /// `Reducer` (see reducers.hpp). A partition has a single writer, so no
+  /// atomics are needed. Switching to another reducer flushes the upserts
+  /// that are still pending.
+  template <class Reducer>
+  void upsert_batch(const InsertFindArguments &kp,
+                    collector_type* collector = nullptr) {
+    this->upsert_use<Reducer>(collector);
+    this->flush_upsert_if_needed<Reducer>(collector);
+
+    for (auto &data : kp) {
+      add_to_upsert_queue(&data, collector);
+    }
+
+    this->flush_upsert_if_needed<Reducer>(collector);
+  }
+
+  template <class Reducer>
+  void flush_upsert_if_needed(collector_type* collector) {
+    size_t curr_queue_sz =
+        (this->ups_head - this->ups_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    while (curr_queue_sz >= INS_FLUSH_THRESHOLD) {
+      __upsert_one<Reducer>(&this->upsert_queue[this->ups_tail], collector);
+      this->ups_tail = (this->ups_tail + 1) & (PREFETCH_QUEUE_SIZE - 1);
+      curr_queue_sz =
+          (this->ups_head - this->ups_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    }
+  }
+
+  void flush_upsert_queue(collector_type* collector = nullptr) {
+    if (this->upsert_flush) {
+      (this->*upsert_flush)(collector);
+    }
+  }
+
+  void add_batch(const InsertFindArguments &kp,
+                 collector_type* collector = nullptr) override {
+    if constexpr (reducible_kv<KV>) {
+      this->template upsert_batch<AddReducer>(kp, collector);
+    } else {
+      BaseHashTable::add_batch(kp, collector);
+    }
+  }
+
+  void flush_add_queue(collector_type* collector = nullptr) override {
+    this->flush_upsert_queue(collector);
+  }
+
+  /// A partition has a single writer, so erased entries are removed with
+  /// backward-shift deletion and no tombstones are left behind. Pending
+  /// inserts are flushed first so that they cannot be overtaken. Finds that
+  /// are still queued for this partition may miss a key that gets shifted
+  /// behind them, flush them before erasing.
+  void erase_batch(const InsertFindArguments &kp, collector_type* collector) override {
+#if defined(BQ_KEY_UPPER_BITS_HAS_HASH)
+    // The home slot of a stored key cannot be recomputed.
+    PLOG_FATAL << "erase_batch is not supported with BQ_KEY_UPPER_BITS_HAS_HASH";
+    std::terminate();
+#endif
+    this->flush_insert_queue(collector);
+    this->flush_upsert_queue(collector);
+    this->flush_erase_if_needed(collector);
+
+    for (auto &data : kp) {
+      add_to_erase_queue(&data, collector);
+    }
+
+    this->flush_erase_if_needed(collector);
+  }
+
+  void flush_erase_if_needed(collector_type* collector) {
+    size_t curr_queue_sz =
+        (this->ers_head - this->ers_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    while (curr_queue_sz >= INS_FLUSH_THRESHOLD) {
+      __erase_one(&this->erase_queue[this->ers_tail], collector);
+      this->ers_tail = (this->ers_tail + 1) & (PREFETCH_QUEUE_SIZE - 1);
+      curr_queue_sz =
+          (this->ers_head - this->ers_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    }
+  }
+
+  void flush_erase_queue(collector_type* collector) override {
+    size_t curr_queue_sz =
+        (this->ers_head - this->ers_tail) & (PREFETCH_QUEUE_SIZE - 1);
+
+    while (curr_queue_sz != 0) {
+      __erase_one(&this->erase_queue[this->ers_tail], collector);
+      this->ers_tail = (this->ers_tail + 1) & (PREFETCH_QUEUE_SIZE - 1);
+      curr_queue_sz =
+          (this->ers_head - this->ers_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    }
+  }
+
   void *find_noprefetch(const void *data, collector_type* collector) override {
 #ifdef CALC_STATS
     uint64_t distance_from_bucket = 0;
@@ -735,10 +856,18 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
   KVQ *queue;    // TODO prefetch this?
   KVQ *find_queue;
   KVQ *insert_queue;
+  KVQ *erase_queue;
   uint32_t find_head;
   uint32_t find_tail;
   uint32_t ins_head;
   uint32_t ins_tail;
+  uint32_t ers_head;
+  uint32_t ers_tail;
+  KVQ *upsert_queue;
+  uint32_t ups_head;
+  uint32_t ups_tail;
+  /// Flushes the upsert queue with the reducer it was filled with.
+  void (PartitionedHashStore::*upsert_flush)(collector_type*);
   Hasher hasher_;
 
   uint64_t hash(const void *k) { return hasher_(k, this->key_length); }
@@ -1281,6 +1410,156 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
     empty_slot_exists_ = true;
   }
 
+  template <class Reducer>
+  void upsert_use(collector_type* collector) {
+    constexpr auto flush =
+        &PartitionedHashStore::template __flush_upsert_queue<Reducer>;
+    if (this->upsert_flush != flush) {
+      if (this->upsert_flush) {
+        (this->*upsert_flush)(collector);
+      }
+      this->upsert_flush = flush;
+    }
+  }
+
+  template <class Reducer>
+  void __flush_upsert_queue(collector_type* collector) {
+    size_t curr_queue_sz =
+        (this->ups_head - this->ups_tail) & (PREFETCH_QUEUE_SIZE - 1);
+
+    while (curr_queue_sz != 0) {
+      __upsert_one<Reducer>(&this->upsert_queue[this->ups_tail], collector);
+      this->ups_tail = (this->ups_tail + 1) & (PREFETCH_QUEUE_SIZE - 1);
+      curr_queue_sz =
+          (this->ups_head - this->ups_tail) & (PREFETCH_QUEUE_SIZE - 1);
+    }
+  }
+
+  template <class Reducer>
+  void __upsert_one(KVQ *q, collector_type* collector) {
+    if (q->key == this->empty_item.get_key()) {
+      empty_slot_ = empty_slot_exists_ ? Reducer::reduce(empty_slot_, q->value)
+                                       : q->value;
+      empty_slot_exists_ = true;
+      return;
+    }
+
+    size_t idx = q->idx;
+    KV *cur_ht = this->hashtable[this->id];
+  try_upsert:
+    KV *curr = &cur_ht[idx];
+
+    if (!curr->template upsert<Reducer>(q)) {
+      return;
+    }
+
+    idx++;
+    idx = idx == this->capacity ? 0 : idx;  // modulo
+
+    // |    4 elements |
+    // | 0 | 1 | 2 | 3 | 4 | 5 ....
+    if ((idx & 0x3) != 0) {
+#ifdef CALC_STATS
+      ++this->num_soft_reprobes;
+#endif
+      goto try_upsert;
+    }
+
+    prefetch(idx);
+
+    this->upsert_queue[this->ups_head].key = q->key;
+    this->upsert_queue[this->ups_head].key_id = q->key_id;
+    this->upsert_queue[this->ups_head].value = q->value;
+    this->upsert_queue[this->ups_head].idx = idx;
+
+    ++this->ups_head;
+    this->ups_head &= (PREFETCH_QUEUE_SIZE - 1);
+
+#ifdef CALC_STATS
+    this->num_reprobes++;
+#endif
+  }
+
+  void __erase_one(KVQ *q, collector_type* collector) {
+    if (q->key == this->empty_item.get_key()) {
+      empty_slot_exists_ = false;
+      empty_slot_ = 0;
+      return;
+    }
+    __erase_branched(q, collector);
+  }
+
+  void __erase_branched(KVQ *q, collector_type* collector) {
+    size_t idx = q->idx;
+    KV *cur_ht = this->hashtable[this->id];
+  try_erase:
+    KV *curr = &cur_ht[idx];
+
+    if (curr->is_empty()) {
+      return;
+    }
+
+    if (curr->compare_key(q)) {
+      __backward_shift(cur_ht, idx);
+      return;
+    }
+
+    idx++;
+    idx = idx == this->capacity ? 0 : idx;  // modulo
+
+    // |    4 elements |
+    // | 0 | 1 | 2 | 3 | 4 | 5 ....
+    if ((idx & 0x3) != 0) {
+      goto try_erase;
+    }
+
+    prefetch(idx);
+
+    this->erase_queue[this->ers_head].key = q->key;
+    this->erase_queue[this->ers_head].key_id = q->key_id;
+    this->erase_queue[this->ers_head].idx = idx;
+
+    ++this->ers_head;
+    this->ers_head &= (PREFETCH_QUEUE_SIZE - 1);
+
+#ifdef CALC_STATS
+    this->num_reprobes++;
+#endif
+  }
+
+  /// Empty slot `hole` and pull the following entries of its cluster back,
+  /// as long as that does not move them in front of their home slot.
+  void __backward_shift(KV *cur_ht, size_t hole) {
+    size_t idx = hole;
+
+    for (;;) {
+      idx++;
+      idx = idx == this->capacity ? 0 : idx;  // modulo
+
+      KV *curr = &cur_ht[idx];
+      if (curr->is_empty()) {
+        break;
+      }
+
+      const uint64_t key = curr->get_key();
+      const size_t home =
+          fastrange32(this->hash((const char *)&key), this->capacity);
+
+      // can `curr` move into the hole, i.e. is hole in [home, idx)?
+      const bool movable = (hole <= idx) ? (home <= hole || home > idx)
+                                         : (home <= hole && home > idx);
+      if (movable) {
+        cur_ht[hole] = *curr;
+        hole = idx;
+#ifdef CALC_STATS
+        this->num_swaps++;
+#endif
+      }
+    }
+
+    cur_ht[hole] = this->empty_item;
+  }
+
   uint64_t read_hashtable_element(const void *data) {
     std::terminate();  // TODO: if you want to use this, we don't use pow2
                        // capacities anymore
@@ -1352,6 +1631,51 @@ class alignas(64) PartitionedHashStore : public BaseHashTable {
     //}
   }
 
+  void add_to_upsert_queue(void *data, collector_type* collector) {
+    InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    uint64_t hash = 0;
+    uint64_t key = 0;
+
+    // Same slot as add_to_insert_queue() would pick.
+    if (bq_load == BQUEUE_LOAD::HtInsert) [[likely]] {
+#if defined(BQ_KEY_UPPER_BITS_HAS_HASH)
+      hash = key_data->key >> 32;
+      key = key_data->key & 0xFFFFFFFF;
+#else
+      hash = this->hash((const char *)&key_data->key);
+      key = key_data->key;
+#endif
+    } else {
+      hash = this->hash((const char *)&key_data->key);
+      key = key_data->key;
+    }
+
+    size_t idx = fastrange32(hash, this->capacity);  // modulo
+
+    this->prefetch(idx);
+
+    this->upsert_queue[this->ups_head].idx = idx;
+    this->upsert_queue[this->ups_head].key = key;
+    this->upsert_queue[this->ups_head].value = key_data->value;
+    this->upsert_queue[this->ups_head].key_id = key_data->id;
+
+    this->ups_head = (this->ups_head + 1) & (PREFETCH_QUEUE_SIZE - 1);
+  }
+
+  void add_to_erase_queue(void *data, collector_type* collector) {
+    InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
+    uint64_t hash = this->hash((const char *)&key_data->key);
+    size_t idx = fastrange32(hash, this->capacity);  // modulo
+
+    this->prefetch(idx);
+
+    this->erase_queue[this->ers_head].idx = idx;
+    this->erase_queue[this->ers_head].key = key_data->key;
+    this->erase_queue[this->ers_head].key_id = key_data->id;
+
+    this->ers_head = (this->ers_head + 1) & (PREFETCH_QUEUE_SIZE - 1);
+  }
+
   void add_to_find_queue(void *data, collector_type* collector) {
     InsertFindArgument *key_data = reinterpret_cast<InsertFindArgument *>(data);
     uint64_t hash = 0;
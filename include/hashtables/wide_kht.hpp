@@ -0,0 +1,462 @@
+/// casht++ for wide keys (16B and 32B).
+/// A wide key does not fit the 16B key-value CAS the other tables rely on,
+/// and comparing it needs a cacheline of its own, so the table keeps a
+/// separate array of 8-bit or 16-bit fingerprints, one per slot. A probe
+/// loads the cacheline of fingerprints around the home slot (64 or 32 slots)
+/// and compares all of them at once with `_mm512_cmpeq_epi8_mask` (or
+/// `_mm512_cmpeq_epi16_mask`). The key-value slot is only touched when its
+/// fingerprint matches, so a miss costs the same single cacheline as in
+/// casht++, and a hit costs one more line, which is prefetched as a second
+/// stage of the queue pipeline.
+///
+/// Fingerprint 0 marks an empty slot and 1 a slot that an inserter has
+/// claimed but not published yet. Inserts claim a slot with a CAS on its
+/// fingerprint, write the key-value pair and then publish the fingerprint.
+/// Like the other shared tables, slots never become empty again, so a probe
+/// can stop at the first empty fingerprint.
+///
+/// The table is not partitioned: all threads share one instance, and each
+/// thread keeps its own insert and find queues.
+
+#ifndef HASHTABLES_WIDE_KHT_HPP
+#define HASHTABLES_WIDE_KHT_HPP
+
+#include <immintrin.h>
+
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <span>
+#include <type_traits>
+
+#include "constants.hpp"
+#include "helper.hpp"
+#include "ht_helper.hpp"
+#include "hashtables/reducers.hpp"
+#include "plog/Log.h"
+
+namespace kmercounter {
+
+template <size_t KEY_BYTES>
+struct WideKey {
+  static_assert(KEY_BYTES == 16 || KEY_BYTES == 32,
+                "wide keys are either 16B or 32B");
+  uint64_t words[KEY_BYTES / sizeof(uint64_t)];
+
+  bool operator==(const WideKey &) const = default;
+};
+
+/// `InsertFindArgument` with a wide key.
+template <size_t KEY_BYTES>
+struct WideInsertFindArgument {
+  WideKey<KEY_BYTES> key;
+  value_type value;
+  /// Returned as `FindResult::id`.
+  uint32_t id;
+  uint32_t part_id;
+};
+
+template <size_t KEY_BYTES>
+using WideInsertFindArguments =
+    std::span<WideInsertFindArgument<KEY_BYTES>>;
+
+/// A key-value slot, padded to a power of two so that it never straddles two
+/// cachelines: 32B for 16B keys and 64B for 32B keys.
+template <size_t KEY_BYTES>
+struct alignas(std::bit_ceil(KEY_BYTES + sizeof(value_type))) WideKV {
+  WideKey<KEY_BYTES> key;
+  value_type value;
+};
+
+template <size_t KEY_BYTES, typename FP>
+struct WideKVQ {
+  WideKey<KEY_BYTES> key;
+  value_type value;
+  uint64_t idx;
+  uint32_t key_id;
+  FP fp;
+  /// False while the fingerprint line at `idx` is being probed, true once
+  /// `idx` points at a slot whose fingerprint matched.
+  bool check_slot;
+};
+
+template <size_t KEY_BYTES, typename FP = uint8_t>
+class WideCASHashTable {
+  static_assert(std::is_same_v<FP, uint8_t> || std::is_same_v<FP, uint16_t>,
+                "fingerprints are 8 or 16 bits");
+
+ public:
+  using key_type = WideKey<KEY_BYTES>;
+  using KV = WideKV<KEY_BYTES>;
+  using KVQ = WideKVQ<KEY_BYTES, FP>;
+  using Arguments = WideInsertFindArguments<KEY_BYTES>;
+
+  /// The global instance is shared by all threads.
+  static FP *fingerprints;
+  static KV *hashtable;
+
+  int fd;
+  int fp_fd;
+  int id;
+  const static uint64_t CACHELINE_SIZE = 64;
+  const static uint64_t FP_IN_CACHELINE = CACHELINE_SIZE / sizeof(FP);
+  const static uint64_t FP_IN_CACHELINE_MASK = FP_IN_CACHELINE - 1;
+  const static uint64_t LINE_LANES = ~0ULL >> (64 - FP_IN_CACHELINE);
+  const static FP FP_EMPTY = 0;
+  const static FP FP_BUSY = 1;
+  const static uint32_t QUEUE_SZ = PREFETCH_QUEUE_SIZE;
+  const static uint32_t QUEUE_SZ_MASK = QUEUE_SZ - 1;
+
+  WideCASHashTable(uint64_t c)
+      : fd(-1),
+        fp_fd(-1),
+        id(1),
+        find_head(0),
+        find_tail(0),
+        ins_head(0),
+        ins_tail(0),
+        upsert_flush(nullptr) {
+    this->capacity = kmercounter::utils::next_pow2(c);
+    if (this->capacity < FP_IN_CACHELINE) {
+      this->capacity = FP_IN_CACHELINE;
+    }
+    {
+      const std::lock_guard<std::mutex> lock(ht_init_mutex);
+      if (!this->hashtable) {
+        assert(this->ref_cnt == 0);
+        this->fingerprints =
+            calloc_ht<FP>(this->capacity, this->id, &this->fp_fd);
+        this->hashtable = calloc_ht<KV>(this->capacity, this->id, &this->fd);
+        PLOGI.printf(
+            "Wide key hashtable base: %p fingerprints: %p Hashtable size: %lu "
+            "key %lu B fingerprint %lu B",
+            this->hashtable, this->fingerprints, this->capacity, KEY_BYTES,
+            sizeof(FP));
+      }
+      this->ref_cnt++;
+    }
+    this->insert_queue = (KVQ *)(aligned_alloc(64, QUEUE_SZ * sizeof(KVQ)));
+    this->find_queue = (KVQ *)(aligned_alloc(64, QUEUE_SZ * sizeof(KVQ)));
+  }
+
+  ~WideCASHashTable() {
+    free(find_queue);
+    free(insert_queue);
+    // Deallocate the global hashtable if ref_cnt goes down to zero.
+    {
+      const std::lock_guard<std::mutex> lock(ht_init_mutex);
+      this->ref_cnt--;
+      if (this->ref_cnt == 0) {
+        free_mem<KV>(this->hashtable, this->capacity, this->id, this->fd);
+        free_mem<FP>(this->fingerprints, this->capacity, this->id,
+                     this->fp_fd);
+        this->hashtable = nullptr;
+        this->fingerprints = nullptr;
+      }
+    }
+  }
+
+  /// Insert the keys of `kp`; an existing key gets the new value.
+  void insert_batch(const Arguments &kp, collector_type *collector = nullptr) {
+    this->upsert_batch<AssignReducer>(kp, collector);
+  }
+
+  void flush_insert_queue(collector_type *collector = nullptr) {
+    this->flush_upsert_queue(collector);
+  }
+
+  /// Insert the keys of `kp`, or merge their values into the stored ones with
+  /// `Reducer` (see reducers.hpp). Like in casht++, the queue has to be
+  /// flushed before switching to another reducer.
+  template <class Reducer>
+  void upsert_batch(const Arguments &kp, collector_type *collector = nullptr) {
+    if (this->upsert_flush != nullptr &&
+        this->upsert_flush != &WideCASHashTable::template __flush<Reducer>) {
+      (this->*upsert_flush)();
+    }
+    this->upsert_flush = &WideCASHashTable::template __flush<Reducer>;
+
+    for (auto &data : kp) {
+      if (get_insert_queue_sz() >= QUEUE_SZ_MASK) {
+        pop_insert_queue<Reducer>();
+      }
+      add_to_queue(&data, this->insert_queue, this->ins_head);
+    }
+  }
+
+  void flush_upsert_queue(collector_type *collector = nullptr) {
+    if (this->upsert_flush != nullptr) {
+      (this->*upsert_flush)();
+    }
+  }
+
+  /// Look up the keys of `kp`. Found keys are appended to `vp`, missing keys
+  /// produce no result, like the other tables.
+  void find_batch(const Arguments &kp, ValuePairs &vp,
+                  collector_type *collector = nullptr) {
+    for (auto &data : kp) {
+      if (get_find_queue_sz() >= QUEUE_SZ_MASK) {
+        pop_find_queue(vp);
+      }
+      add_to_queue(&data, this->find_queue, this->find_head);
+    }
+  }
+
+  size_t flush_find_queue(ValuePairs &vp,
+                          collector_type *collector = nullptr) {
+    size_t curr_queue_sz = get_find_queue_sz();
+    while ((curr_queue_sz > 0) && (vp.first < config.batch_len)) {
+      pop_find_queue(vp);
+      curr_queue_sz = get_find_queue_sz();
+    }
+    return curr_queue_sz;
+  }
+
+  size_t get_fill() const {
+    size_t count = 0;
+    for (size_t i = 0; i < this->capacity; i++) {
+      if (this->fingerprints[i] > FP_BUSY) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  size_t get_capacity() const { return this->capacity; }
+
+ private:
+  /// Assure thread-safety in constructor and destructor.
+  static std::mutex ht_init_mutex;
+  /// Reference counter of the global `hashtable`.
+  static uint32_t ref_cnt;
+  uint64_t capacity;
+  KVQ *find_queue;
+  KVQ *insert_queue;
+  uint32_t find_head;
+  uint32_t find_tail;
+  uint32_t ins_head;
+  uint32_t ins_tail;
+  /// Drains `insert_queue` with the reducer its entries were queued with.
+  void (WideCASHashTable::*upsert_flush)();
+
+  /// Two CRC32 chains with different seeds give 64 bits of hash: the low
+  /// half picks the home slot and the top bits are the fingerprint.
+  static inline uint64_t hash(const key_type &key) {
+    uint64_t lo = 0xffffffff;
+    uint64_t hi = 0x9e3779b9;
+    for (auto w : key.words) {
+      lo = _mm_crc32_u64(lo, w);
+      hi = _mm_crc32_u64(hi, w);
+    }
+    return (hi << 32) | lo;
+  }
+
+  static inline FP fingerprint(uint64_t hash) {
+    FP fp = static_cast<FP>(hash >> (64 - 8 * sizeof(FP)));
+    // 0 and 1 are reserved for empty and claimed slots.
+    if (fp <= FP_BUSY) {
+      fp += 2;
+    }
+    return fp;
+  }
+
+  /// Bitmask of the lanes of `line` that hold `fp`.
+  static inline uint64_t lanes_eq(__m512i line, FP fp) {
+    if constexpr (sizeof(FP) == 1) {
+      return _mm512_cmpeq_epi8_mask(line, _mm512_set1_epi8(fp));
+    } else {
+      return _mm512_cmpeq_epi16_mask(line, _mm512_set1_epi16(fp));
+    }
+  }
+
+  inline uint32_t get_insert_queue_sz() {
+    return (this->ins_head - this->ins_tail) & QUEUE_SZ_MASK;
+  }
+
+  inline uint32_t get_find_queue_sz() {
+    return (this->find_head - this->find_tail) & QUEUE_SZ_MASK;
+  }
+
+  inline void add_to_queue(const WideInsertFindArgument<KEY_BYTES> *data,
+                           KVQ *queue, uint32_t &head) {
+    uint64_t hash = this->hash(data->key);
+    size_t idx = hash & (this->capacity - 1);
+
+    __builtin_prefetch(&this->fingerprints[idx], false, 3);
+
+    KVQ *q = &queue[head];
+    q->key = data->key;
+    q->value = data->value;
+    q->idx = idx;
+    q->key_id = data->id;
+    q->fp = fingerprint(hash);
+    q->check_slot = false;
+
+    head++;
+    head &= QUEUE_SZ_MASK;
+  }
+
+  /// Move `q` to the back of its queue, prefetching what it looks at next.
+  inline void requeue(KVQ *q, KVQ *queue, uint32_t &head) {
+    if (q->check_slot) {
+      __builtin_prefetch(&this->hashtable[q->idx], false, 3);
+    } else {
+      __builtin_prefetch(&this->fingerprints[q->idx], false, 3);
+    }
+    queue[head] = *q;
+    head++;
+    head &= QUEUE_SZ_MASK;
+  }
+
+  enum class Probe { Found, Missing, Requeue };
+
+  /// Probe the fingerprint line at `q->idx`, starting from the lane of
+  /// `q->idx`. On `Found`, `q->idx` is the first candidate slot whose
+  /// fingerprint matches; on `Missing`, it is the first empty slot; on
+  /// `Requeue`, it is the start of the next line (or unchanged if
+  /// `wait_claimed` is set and an unpublished slot might hold the key).
+  inline Probe probe_fingerprints(KVQ *q, bool wait_claimed) {
+    size_t lane = q->idx & FP_IN_CACHELINE_MASK;
+    size_t base = q->idx - lane;
+    __m512i line = _mm512_load_si512(&this->fingerprints[base]);
+
+    uint64_t live = (LINE_LANES << lane) & LINE_LANES;
+    uint64_t empty = lanes_eq(line, FP_EMPTY) & live;
+    // A key lives before the first empty slot of its probe sequence.
+    uint64_t before = empty ? (empty & -empty) - 1 : LINE_LANES;
+    uint64_t match = lanes_eq(line, q->fp) & live & before;
+
+    if (match) {
+      q->idx = base + std::countr_zero(match);
+      return Probe::Found;
+    }
+    if (wait_claimed && (lanes_eq(line, FP_BUSY) & live & before)) {
+      return Probe::Requeue;
+    }
+    if (empty) {
+      q->idx = base + std::countr_zero(empty);
+      return Probe::Missing;
+    }
+    q->idx = (base + FP_IN_CACHELINE) & (this->capacity - 1);
+    return Probe::Requeue;
+  }
+
+  /// Returns true if `q` was put back into the queue.
+  template <class Reducer>
+  bool __upsert_one(KVQ *q) {
+    for (;;) {
+      if (q->check_slot) {
+        KV *curr = &this->hashtable[q->idx];
+        if (curr->key == q->key) {
+          reduce_atomic<Reducer>(&curr->value, q->value);
+          return false;
+        }
+        // fingerprint collision, keep probing after the candidate
+        q->check_slot = false;
+        q->idx = (q->idx + 1) & (this->capacity - 1);
+        continue;
+      }
+
+      switch (probe_fingerprints(q, true)) {
+        case Probe::Found:
+          q->check_slot = true;
+          requeue(q, this->insert_queue, this->ins_head);
+          return true;
+        case Probe::Requeue:
+          requeue(q, this->insert_queue, this->ins_head);
+          return true;
+        case Probe::Missing: {
+          FP *fp = &this->fingerprints[q->idx];
+          if (!__sync_bool_compare_and_swap(fp, FP_EMPTY, FP_BUSY)) {
+            // Somebody else took the slot, maybe with the same key. Probe
+            // the line again from the same lane.
+            continue;
+          }
+          KV *curr = &this->hashtable[q->idx];
+          curr->key = q->key;
+          curr->value = q->value;
+          __atomic_store_n(fp, q->fp, __ATOMIC_RELEASE);
+          return false;
+        }
+      }
+    }
+  }
+
+  /// Returns true if `q` was put back into the queue.
+  bool __find_one(KVQ *q, ValuePairs &vp) {
+    for (;;) {
+      if (q->check_slot) {
+        KV *curr = &this->hashtable[q->idx];
+        if (curr->key == q->key) {
+          vp.second[vp.first].id = q->key_id;
+          vp.second[vp.first].value = curr->value;
+          vp.first++;
+          return false;
+        }
+        q->check_slot = false;
+        q->idx = (q->idx + 1) & (this->capacity - 1);
+        continue;
+      }
+
+      // Claimed but unpublished slots are skipped: that insert has not
+      // happened yet as far as this find is concerned.
+      switch (probe_fingerprints(q, false)) {
+        case Probe::Found:
+          q->check_slot = true;
+          requeue(q, this->find_queue, this->find_head);
+          return true;
+        case Probe::Requeue:
+          requeue(q, this->find_queue, this->find_head);
+          return true;
+        case Probe::Missing:
+          return false;
+      }
+    }
+  }
+
+  template <class Reducer>
+  inline void pop_insert_queue() {
+    bool retry;
+    do {
+      KVQ *q = &this->insert_queue[this->ins_tail];
+      this->ins_tail++;
+      this->ins_tail &= QUEUE_SZ_MASK;
+      retry = __upsert_one<Reducer>(q);
+    } while (retry);
+  }
+
+  inline void pop_find_queue(ValuePairs &vp) {
+    bool retry;
+    do {
+      KVQ *q = &this->find_queue[this->find_tail];
+      this->find_tail++;
+      this->find_tail &= QUEUE_SZ_MASK;
+      retry = __find_one(q, vp);
+    } while (retry);
+  }
+
+  template <class Reducer>
+  void __flush() {
+    while (get_insert_queue_sz() > 0) {
+      pop_insert_queue<Reducer>();
+    }
+  }
+};
+
+/// Static variables
+template <size_t KEY_BYTES, typename FP>
+FP *WideCASHashTable<KEY_BYTES, FP>::fingerprints = nullptr;
+
+template <size_t KEY_BYTES, typename FP>
+typename WideCASHashTable<KEY_BYTES, FP>::KV
+    *WideCASHashTable<KEY_BYTES, FP>::hashtable = nullptr;
+
+template <size_t KEY_BYTES, typename FP>
+std::mutex WideCASHashTable<KEY_BYTES, FP>::ht_init_mutex;
+
+template <size_t KEY_BYTES, typename FP>
+uint32_t WideCASHashTable<KEY_BYTES, FP>::ref_cnt = 0;
+}  // namespace kmercounter
+#endif  // HASHTABLES_WIDE_KHT_HPP
@@ -0,0 +1,669 @@
+#ifndef INPUT_READER_COMPRESSED_FILE_HPP
+#define INPUT_READER_COMPRESSED_FILE_HPP
+
+#include <fcntl.h>
+#include <plog/Log.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "input_reader.hpp"
+#include "input_reader/fastq.hpp"
+#include "input_reader/kmer.hpp"
+#include "input_reader/mmap_file.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+enum class Compression {
+  NONE,
+  /// A gzip stream, possibly of several members. Has to be decompressed
+  /// from the start, so it is not split.
+  GZIP,
+  /// Blocked gzip (bgzip): gzip members of at most 64 KiB that record their
+  /// own size, so any partition can find the next one.
+  BGZF,
+  /// zstd frames. Split at the frames, one frame is read from the start.
+  ZSTD,
+};
+
+/// The compression of data that starts with `head`.
+inline Compression detect_compression(std::string_view head) {
+  const auto byte = [&head](size_t i) -> uint8_t {
+    return i < head.size() ? head[i] : 0;
+  };
+  if (byte(0) == 0x1f && byte(1) == 0x8b) {
+    // FEXTRA with a 'BC' subfield of length 2 first.
+    const bool bgzf = (byte(3) & 0x04) && byte(12) == 'B' && byte(13) == 'C' &&
+                      byte(14) == 2 && byte(15) == 0;
+    return bgzf ? Compression::BGZF : Compression::GZIP;
+  }
+  const uint32_t magic = byte(0) | byte(1) << 8 | byte(2) << 16 |
+                         (uint32_t)byte(3) << 24;
+  // A frame, or a skippable frame.
+  if (magic == 0xFD2FB528 || (magic & 0xFFFFFFF0) == 0x184D2A50) {
+    return Compression::ZSTD;
+  }
+  return Compression::NONE;
+}
+
+/// The compression of `filename`, from its first bytes.
+inline Compression file_compression(std::string_view filename) {
+  const std::string path(filename);
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG_FATAL << "Failed to open file " << filename << ": "
+               << strerror(errno);
+    std::terminate();
+  }
+  char head[16];
+  const ssize_t n = pread(fd, head, sizeof(head), 0);
+  close(fd);
+  return detect_compression(std::string_view(head, std::max<ssize_t>(n, 0)));
+}
+
+/// Decompresses a gzip stream (any number of members) or zstd frames, a
+/// piece at a time.
+class BlockDecoder {
+ public:
+  explicit BlockDecoder(Compression format) : format_(format) {
+    if (format_ == Compression::ZSTD) {
+#ifdef WITH_ZSTD
+      dctx_ = ZSTD_createDCtx();
+#else
+      PLOG_FATAL << "zstd input needs a build with -DZSTD=ON";
+      std::terminate();
+#endif
+    } else {
+      // 15 + 16: the largest window, gzip header and trailer.
+      if (inflateInit2(&strm_, 15 + 16) != Z_OK) {
+        PLOG_FATAL << "inflateInit2 failed";
+        std::terminate();
+      }
+    }
+  }
+
+  BlockDecoder(const BlockDecoder&) = delete;
+  BlockDecoder& operator=(const BlockDecoder&) = delete;
+
+  ~BlockDecoder() {
+#ifdef WITH_ZSTD
+    if (format_ == Compression::ZSTD) {
+      ZSTD_freeDCtx(dctx_);
+      return;
+    }
+#endif
+    inflateEnd(&strm_);
+  }
+
+  /// Start on `input`, which has to start at a member or frame and stay
+  /// valid while it is read.
+  void reset(std::string_view input) {
+    done_ = true;
+#ifdef WITH_ZSTD
+    if (format_ == Compression::ZSTD) {
+      ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
+      in_ = {input.data(), input.size(), 0};
+      return;
+    }
+#endif
+    strm_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    strm_.avail_in = input.size();
+  }
+
+  /// Decompress up to `size` bytes to `out`. Returns how many, less than
+  /// `size` only at the end of the input.
+  size_t read(char* out, size_t size) {
+#ifdef WITH_ZSTD
+    if (format_ == Compression::ZSTD) {
+      return this->read_zstd(out, size);
+    }
+#endif
+    strm_.next_out = reinterpret_cast<Bytef*>(out);
+    strm_.avail_out = size;
+    while (strm_.avail_out > 0) {
+      if (done_) {
+        // Members follow each other until the input ends.
+        if (strm_.avail_in == 0) {
+          break;
+        }
+        inflateReset(&strm_);
+        done_ = false;
+      }
+      const int ret = inflate(&strm_, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        done_ = true;
+      } else if (ret != Z_OK) {
+        PLOG_FATAL << "inflate failed: "
+                   << (ret == Z_BUF_ERROR ? "truncated input"
+                       : strm_.msg != nullptr ? strm_.msg
+                                              : "corrupt input");
+        std::terminate();
+      }
+    }
+    return size - strm_.avail_out;
+  }
+
+ private:
+#ifdef WITH_ZSTD
+  size_t read_zstd(char* out, size_t size) {
+    ZSTD_outBuffer output = {out, size, 0};
+    while (output.pos < output.size) {
+      if (done_ && in_.pos == in_.size) {
+        break;
+      }
+      const size_t ret = ZSTD_decompressStream(dctx_, &output, &in_);
+      if (ZSTD_isError(ret)) {
+        PLOG_FATAL << "ZSTD_decompressStream failed: "
+                   << ZSTD_getErrorName(ret);
+        std::terminate();
+      }
+      // 0 when a frame is done and flushed.
+      done_ = ret == 0;
+      if (!done_ && in_.pos == in_.size && output.pos < output.size) {
+        PLOG_FATAL << "ZSTD_decompressStream failed: truncated input";
+        std::terminate();
+      }
+    }
+    return output.pos;
+  }
+
+  ZSTD_DCtx* dctx_ = nullptr;
+  ZSTD_inBuffer in_ = {nullptr, 0, 0};
+#endif
+  const Compression format_;
+  z_stream strm_ = {};
+  /// At the end of a member or frame.
+  bool done_ = true;
+};
+
+/// Streaming `MmapFastqReader::find_next_sequence` with an `offset` > 0: the
+/// data is fed in pieces, and the bound is right after the line that
+/// follows the first line starting with '+'.
+class FastqBoundFinder {
+ public:
+  /// True if the bound is in `data`, `consumed` is then its offset in
+  /// `data`. Otherwise the bound is after `data`, or at the end of the
+  /// stream if nothing else comes.
+  bool feed(std::string_view data, uint64_t* consumed) {
+    const char* const begin = data.data();
+    const char* const end = begin + data.size();
+    const char* p = begin;
+    while (p < end) {
+      if (line_start_) {
+        quality_header_ = *p == '+';
+        line_start_ = false;
+      }
+      const char* eol = find_char(p, end, '\n');
+      if (eol == end) {
+        return false;
+      }
+      p = eol + 1;
+      line_start_ = true;
+      if (quality_) {
+        *consumed = p - begin;
+        return true;
+      }
+      quality_ = quality_header_;
+    }
+    return false;
+  }
+
+ private:
+  bool line_start_ = true;
+  /// The current line starts with '+'.
+  bool quality_header_ = false;
+  /// The current line is the one after the quality header.
+  bool quality_ = false;
+};
+
+/// Decompresses a partition of a compressed file and hands it out in
+/// chunks, the `Chunks` of a `ChunkedFastqReader`.
+///
+/// The file is sliced up evenly by compressed size, and a partition owns
+/// the BGZF blocks or zstd frames that start in its slice; they are found by
+/// their header and checked by following the chain of sizes to the next
+/// ones. The boundaries are then found in the decompressed stream with
+/// `FastqBoundFinder`, same as `MmapFastqReader` does on plain text, so a
+/// partition decompresses a little of the next one to finish its last
+/// record. A plain gzip stream cannot be split: partition 0 reads it all.
+///
+/// The blocks of a partition are grouped into chunks of about `chunk_size`
+/// decompressed bytes. `threads` workers decompress the groups in parallel
+/// into a ring of `depth` buffers, which the reader takes in order; with
+/// no workers the reader decompresses them itself. Frames that do not
+/// record their size (or are large) are streamed by one worker instead.
+class DecompressedChunkReader {
+ public:
+  DecompressedChunkReader(std::shared_ptr<const MappedFile> file,
+                          Compression format, uint64_t part_id,
+                          uint64_t num_parts, uint32_t chunk_size,
+                          uint32_t depth, uint32_t threads)
+      : file_(std::move(file)),
+        format_(format),
+        chunk_size_(std::max(chunk_size, 1u)),
+        depth_(std::max(depth, 1u)),
+        inline_decoder_(format),
+        tail_decoder_(format) {
+    if (part_id >= num_parts) {
+      PLOG_FATAL << "part_id(" << part_id << " ) >= num_parts(" << num_parts
+                 << ")";
+    }
+    const std::string_view view = file_->view();
+    const uint64_t file_size = view.size();
+    const uint64_t part_start = (double)file_size / num_parts * part_id;
+    const uint64_t part_end = (double)file_size / num_parts * (part_id + 1);
+    const uint64_t range_start = find_block(view, part_start);
+    const uint64_t range_end =
+        std::max(range_start, find_block(view, part_end));
+    PLOG_DEBUG << part_id << "/" << num_parts << ": blocks " << range_start
+               << " - " << range_end;
+    PLOG_WARNING_IF(format_ == Compression::GZIP && part_id == 0 &&
+                    num_parts > 1)
+        << "gzip input is read by one thread, compress it with bgzip to "
+           "read it in parallel";
+    range_ = view.substr(range_start, range_end - range_start);
+    tail_decoder_.reset(view.substr(range_end));
+    // Same as `find_next_sequence`, the start of the file is a bound.
+    started_ = range_start == 0;
+    if (range_end == 0) {
+      end_ = 0;
+    }
+
+    this->make_groups();
+    more_ = !range_.empty();
+    if (streaming_) {
+      inline_decoder_.reset(range_);
+    }
+    if (threads == 0 || !more_) {
+      return;
+    }
+    slots_ = std::make_unique<Slot[]>(depth_);
+    for (uint32_t i = 0; i < depth_; i++) {
+      slots_[i].turn.store(2 * i, std::memory_order_relaxed);
+    }
+    const uint64_t num_workers =
+        streaming_ ? 1 : std::min<uint64_t>(threads, groups_.size());
+    for (uint64_t i = 0; i < num_workers; i++) {
+      workers_.emplace_back(&DecompressedChunkReader::work, this);
+    }
+  }
+
+  DecompressedChunkReader(std::string_view filename, uint64_t part_id,
+                          uint64_t num_parts, uint32_t chunk_size,
+                          uint32_t depth, uint32_t threads)
+      : DecompressedChunkReader(std::make_shared<const MappedFile>(filename),
+                                file_compression(filename), part_id,
+                                num_parts, chunk_size, depth, threads) {}
+
+  DecompressedChunkReader(const DecompressedChunkReader&) = delete;
+  DecompressedChunkReader& operator=(const DecompressedChunkReader&) = delete;
+
+  ~DecompressedChunkReader() {
+    stop_.store(true);
+    // Wake up the workers that wait for a buffer.
+    for (uint32_t i = 0; slots_ && i < depth_; i++) {
+      slots_[i].turn.store(~0ull);
+      slots_[i].turn.notify_all();
+    }
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  /// Point `chunk` to the next chunk, which stays valid until the next call.
+  bool next(std::string_view* chunk) {
+    for (;;) {
+      std::string_view piece;
+      if (more_) {
+        this->next_group(&piece);
+      } else {
+        // The partition ends after the record that crosses the end of its
+        // blocks.
+        if (end_ != ~0ull) {
+          return false;
+        }
+        tail_.resize(TAIL_PIECE_SIZE);
+        tail_.resize(tail_decoder_.read(tail_.data(), tail_.size()));
+        piece = tail_;
+        uint64_t consumed;
+        if (end_finder_.feed(piece, &consumed)) {
+          piece = piece.substr(0, consumed);
+          end_ = pos_ + consumed;
+        } else if (piece.empty()) {
+          end_ = pos_;
+        }
+      }
+
+      const uint64_t piece_offset = pos_;
+      pos_ += piece.size();
+      uint64_t skip = 0;
+      if (!started_) {
+        if (!start_finder_.feed(piece, &skip)) {
+          continue;
+        }
+        started_ = true;
+      }
+      if (skip == piece.size()) {
+        continue;
+      }
+      offset_ = piece_offset + skip;
+      *chunk = piece.substr(skip);
+      return true;
+    }
+  }
+
+  /// Offset of the last chunk in the decompressed partition.
+  uint64_t offset() const { return offset_; }
+
+  /// End of the partition, known once its last chunk has been handed out.
+  uint64_t end() const { return end_; }
+
+ private:
+  /// Blocks that decompress to this much are streamed instead of grouped.
+  constexpr static uint64_t MAX_BLOCK_SIZE = 64 << 20;
+  constexpr static uint64_t TAIL_PIECE_SIZE = 64 << 10;
+
+  /// Blocks that are decompressed together.
+  struct Group {
+    std::string_view input;
+    uint64_t size;
+  };
+
+  /// A buffer of the ring. `turn` is `2 * i` when group `i` may be written
+  /// to it, and `2 * i + 1` once it has been.
+  struct Slot {
+    std::atomic<uint64_t> turn;
+    std::string data;
+    bool last = false;
+  };
+
+  /// Size of the block at `offset`, or 0 if there is none.
+  uint64_t block_size(std::string_view file, uint64_t offset) const {
+    const std::string_view rest = file.substr(offset);
+    if (format_ == Compression::BGZF) {
+      if (rest.size() < 28 || detect_compression(rest) != Compression::BGZF) {
+        return 0;
+      }
+      const uint64_t size =
+          ((uint8_t)rest[16] | (uint8_t)rest[17] << 8) + uint64_t{1};
+      return size <= rest.size() ? size : 0;
+    }
+#ifdef WITH_ZSTD
+    if (format_ == Compression::ZSTD) {
+      if (detect_compression(rest) != Compression::ZSTD) {
+        return 0;
+      }
+      const size_t size = ZSTD_findFrameCompressedSize(rest.data(), rest.size());
+      return ZSTD_isError(size) ? 0 : size;
+    }
+#endif
+    return 0;
+  }
+
+  /// Decompressed size of the block at `offset`, or ~0 if it is not known.
+  uint64_t block_output_size(std::string_view file, uint64_t offset,
+                             uint64_t size) const {
+    if (format_ == Compression::BGZF) {
+      // ISIZE, the last 4 bytes.
+      const char* isize = file.data() + offset + size - 4;
+      uint32_t output_size;
+      memcpy(&output_size, isize, sizeof(output_size));
+      return output_size;
+    }
+#ifdef WITH_ZSTD
+    if (format_ == Compression::ZSTD) {
+      const unsigned long long output_size =
+          ZSTD_getFrameContentSize(file.data() + offset, size);
+      if (output_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+          output_size == ZSTD_CONTENTSIZE_ERROR) {
+        return ~0ull;
+      }
+      return output_size;
+    }
+#endif
+    return ~0ull;
+  }
+
+  /// Offset of the first block at or after `offset`, or the size of the
+  /// file. A header counts if it is followed by another one, or by the end
+  /// of the file.
+  uint64_t find_block(std::string_view file, uint64_t offset) const {
+    if (offset == 0 || offset >= file.size()) {
+      return std::min<uint64_t>(offset, file.size());
+    }
+    std::string_view magic;
+    if (format_ == Compression::BGZF) {
+      magic = std::string_view("\x1f\x8b\x08\x04", 4);
+    } else if (format_ == Compression::ZSTD) {
+      magic = std::string_view("\x28\xb5\x2f\xfd", 4);
+    } else {
+      // Not split.
+      return file.size();
+    }
+    for (uint64_t pos = offset; pos < file.size(); pos++) {
+      const void* found = memmem(file.data() + pos, file.size() - pos,
+                                 magic.data(), magic.size());
+      if (found == nullptr) {
+        break;
+      }
+      pos = static_cast<const char*>(found) - file.data();
+      const uint64_t size = this->block_size(file, pos);
+      if (size == 0) {
+        continue;
+      }
+      const uint64_t next = pos + size;
+      if (next == file.size() || this->block_size(file, next) > 0) {
+        return pos;
+      }
+    }
+    return file.size();
+  }
+
+  /// Group the blocks of `range_`, or stream it if their sizes are not
+  /// known.
+  void make_groups() {
+    if (format_ != Compression::BGZF && format_ != Compression::ZSTD) {
+      streaming_ = true;
+      return;
+    }
+    const char* const base = file_->data();
+    const uint64_t start = range_.data() - base;
+    const uint64_t end = start + range_.size();
+    Group group = {std::string_view(range_.data(), 0), 0};
+    for (uint64_t pos = start; pos < end;) {
+      const uint64_t size = this->block_size(file_->view(), pos);
+      const uint64_t output_size =
+          size == 0 ? ~0ull : this->block_output_size(file_->view(), pos, size);
+      if (output_size > MAX_BLOCK_SIZE) {
+        groups_.clear();
+        streaming_ = true;
+        return;
+      }
+      group.input = std::string_view(group.input.data(),
+                                     group.input.size() + size);
+      group.size += output_size;
+      pos += size;
+      if (group.size >= chunk_size_ || pos >= end) {
+        groups_.push_back(group);
+        group = {std::string_view(base + pos, 0), 0};
+      }
+    }
+  }
+
+  /// Decompress group `i` to `out`. True if it is the last one.
+  bool decompress(uint64_t i, std::string* out, BlockDecoder* decoder) {
+    if (streaming_) {
+      out->resize(chunk_size_);
+      out->resize(decoder->read(out->data(), out->size()));
+      return out->size() < chunk_size_;
+    }
+    const Group& group = groups_[i];
+    out->resize(group.size);
+    decoder->reset(group.input);
+    char extra;
+    if (decoder->read(out->data(), out->size()) != group.size ||
+        decoder->read(&extra, 1) != 0) {
+      PLOG_FATAL << "Block sizes do not match the decompressed data";
+      std::terminate();
+    }
+    return i + 1 == groups_.size();
+  }
+
+  void work() {
+    BlockDecoder decoder(format_);
+    if (streaming_) {
+      decoder.reset(range_);
+    }
+    for (;;) {
+      const uint64_t i = next_task_.fetch_add(1);
+      if (!streaming_ && i >= groups_.size()) {
+        return;
+      }
+      Slot& slot = slots_[i % depth_];
+      for (uint64_t turn; (turn = slot.turn.load()) != 2 * i;) {
+        if (stop_.load()) {
+          return;
+        }
+        slot.turn.wait(turn);
+      }
+      // The slot belongs to the reader once it is stored.
+      const bool last = this->decompress(i, &slot.data, &decoder);
+      slot.last = last;
+      slot.turn.store(2 * i + 1);
+      slot.turn.notify_all();
+      if (last) {
+        return;
+      }
+    }
+  }
+
+  /// Point `piece` to the next group of the partition.
+  void next_group(std::string_view* piece) {
+    const uint64_t i = group_++;
+    bool last;
+    if (workers_.empty()) {
+      last = this->decompress(i, &buffer_, &inline_decoder_);
+      *piece = buffer_;
+    } else {
+      if (i > 0) {
+        // Done with the previous one.
+        Slot& prev = slots_[(i - 1) % depth_];
+        prev.turn.store(2 * (i - 1 + depth_));
+        prev.turn.notify_all();
+      }
+      Slot& slot = slots_[i % depth_];
+      for (uint64_t turn; (turn = slot.turn.load()) != 2 * i + 1;) {
+        slot.turn.wait(turn);
+      }
+      last = slot.last;
+      *piece = slot.data;
+    }
+    more_ = !last;
+  }
+
+  std::shared_ptr<const MappedFile> file_;
+  const Compression format_;
+  const uint32_t chunk_size_;
+  const uint32_t depth_;
+  /// The blocks of the partition.
+  std::string_view range_;
+  std::vector<Group> groups_;
+  /// Stream `range_` in pieces of `chunk_size_` instead of `groups_`.
+  bool streaming_ = false;
+
+  /// Ring of decompressed groups, filled by `workers_`.
+  std::unique_ptr<Slot[]> slots_;
+  std::vector<std::thread> workers_;
+  std::atomic<uint64_t> next_task_ = 0;
+  std::atomic<bool> stop_ = false;
+  /// Decompresses the groups when there are no workers.
+  BlockDecoder inline_decoder_;
+  std::string buffer_;
+
+  /// Decompresses the blocks after the partition, until the end is found.
+  BlockDecoder tail_decoder_;
+  std::string tail_;
+
+  /// Next group to hand out, and whether there is one.
+  uint64_t group_ = 0;
+  bool more_ = false;
+  /// Decompressed bytes so far.
+  uint64_t pos_ = 0;
+  uint64_t offset_ = 0;
+  uint64_t end_ = ~0ull;
+  bool started_ = false;
+  FastqBoundFinder start_finder_;
+  FastqBoundFinder end_finder_;
+};
+
+/// Produce the same sequences as `FastqReader` on the decompressed file.
+/// See `ChunkedFastqReader` for how long the sequences stay valid.
+class CompressedFastqReader
+    : public ChunkedFastqReader<DecompressedChunkReader> {
+ public:
+  CompressedFastqReader(std::string_view filename, uint64_t part_id,
+                        uint64_t num_parts, uint32_t threads = 1,
+                        uint32_t depth = 4, uint32_t chunk_size = 1 << 20)
+      : ChunkedFastqReader(filename, part_id, num_parts, chunk_size, depth,
+                           threads) {}
+};
+
+/// Reads KMers from a gzip, BGZF or zstd compressed Fastq file with a
+/// `CompressedFastqReader`.
+template <size_t K>
+class FastqKMerCompressedReader : public KMerSpanReader {
+ public:
+  template <typename... Args>
+  FastqKMerCompressedReader(Args&&... args)
+      : reader_(std::make_unique<CompressedFastqReader>(
+            std::forward<Args>(args)...)) {}
+
+  bool next(uint64_t* data) override { return reader_.next(data); }
+
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    return reader_.next_span(kmers);
+  }
+
+ private:
+  KMerReader<K, std::string_view> reader_;
+};
+
+/// Helper for instantiating a `FastqKMerCompressedReader` from a runtime `K`.
+template <uint32_t CurrentK=DNAKMer<1>::MAX_K, typename... Args>
+std::unique_ptr<KMerSpanReader> MakeFastqKMerCompressedReader(uint32_t K, Args&&... args) {
+  // Safety check.
+  if (K > DNAKMer<1>::MAX_K || K < 1) {
+    PLOG_FATAL << "K=" << K << " is not a valid value";
+    return nullptr;
+  }
+
+  // Found the right K.
+  if (K == CurrentK) {
+    return std::make_unique<FastqKMerCompressedReader<CurrentK>>(std::forward<Args>(args)...);
+  }
+
+  // Recurse until we found the right K.
+  // Constexpr is necessary here; the compiler will go into an infinite loop otherwise.
+  if constexpr (CurrentK > 1) {
+    return MakeFastqKMerCompressedReader<CurrentK-1, Args...>(K, std::forward<Args>(args)...);
+  }
+  return nullptr;
+}
+}  // namespace input_reader
+}  // namespace kmercounter
+
+#endif  // INPUT_READER_COMPRESSED_FILE_HPP
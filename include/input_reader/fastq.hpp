@@ -5,8 +5,11 @@
 #define INPUT_READER_FASTX_HPP
 
 #include <array>
+#include <cassert>
 #include <istream>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <utility>
 
 #include "file.hpp"
@@ -14,6 +17,7 @@
 #include "input_reader/adaptor.hpp"
 #include "input_reader/reservoir.hpp"
 #include "kmer.hpp"
+#include "mmap_file.hpp"
 #include "plog/Log.h"
 
 namespace kmercounter {
@@ -111,9 +115,248 @@ class FastqReader : public FileReader {
   }
 };
 
-/// Reads KMers from a Fastq file.  
+/// `FastqReader` over a mapped file. The sequences are views into the
+/// mapping, so it has to outlive them; see `MmapFileReader::file()`.
+class MmapFastqReader : public MmapFileReader {
+ public:
+  MmapFastqReader(std::shared_ptr<const MappedFile> file, uint64_t part_id,
+                  uint64_t num_parts)
+      : MmapFileReader(std::move(file), part_id, num_parts,
+                       find_next_sequence) {}
+
+  MmapFastqReader(std::string_view filename, uint64_t part_id,
+                  uint64_t num_parts)
+      : MmapFileReader(filename, part_id, num_parts, find_next_sequence) {}
+
+  MmapFastqReader(std::shared_ptr<const MappedFile> file)
+      : MmapFastqReader(std::move(file), 0, 1) {}
+
+  MmapFastqReader(std::string_view filename)
+      : MmapFastqReader(filename, 0, 1) {}
+
+  // Return the next sequence.
+  bool next(std::string_view* data) override {
+    // Skip over the first line(sequence identifier).
+    if (this->eof() || this->peek() != '@') {
+      return false;
+    }
+    MmapFileReader::next(nullptr);
+
+    // Point `data` to the second line(sequence).
+    if (!MmapFileReader::next(data)) {
+      PLOG_WARNING << "Unexpected EOF. Expecting sequence.";
+      return false;
+    }
+
+    // The parsing for this sequence is finished if the third line
+    // is not a quality header.
+    if (this->peek() != '+') {
+      return true;
+    }
+
+    // Skip over the third line(quality header).
+    if (!MmapFileReader::next(nullptr)) {
+      PLOG_WARNING << "Unexpected EOF. Expecting quality header.";
+      return false;
+    }
+
+    // Skip over the quality.
+    if (!MmapFileReader::next(nullptr)) {
+      PLOG_WARNING << "Unexpected EOF. Expecting quality.";
+      return false;
+    }
+
+    return true;
+  }
+
+  /// Same as `FastqReader::find_next_sequence`: skip to the line after the
+  /// next quality header and its quality line.
+  static uint64_t find_next_sequence(std::string_view file, uint64_t offset) {
+    // Beginning of a file is the beginning of a line.
+    if (offset == 0) {
+      return offset;
+    }
+
+    const char* const begin = file.data();
+    const char* const end = begin + file.size();
+    const char* line = begin + std::min<uint64_t>(offset, file.size());
+    while (line < end) {
+      const bool quality_header = *line == '+';
+      const char* eol = find_char(line, end, '\n');
+      line = eol == end ? end : eol + 1;
+      // Consume quality line after hitting the quality header.
+      // This will lead us to the next sequence.
+      if (quality_header) {
+        eol = find_char(line, end, '\n');
+        line = eol == end ? end : eol + 1;
+        break;
+      }
+    }
+    return line - begin;
+  }
+};
+
+/// Produce the same sequences as `FastqReader` from a partition that comes in
+/// chunks. A sequence is a view into the chunk, or into a copy if its record
+/// crosses two chunks, and stays valid until the next call.
+///
+/// `Chunks` hands out the partition in order:
+///  - `bool next(std::string_view* chunk)`, the chunk stays valid until the
+///    next call;
+///  - `uint64_t offset()`, the stream offset of the last chunk;
+///  - `uint64_t end()`, the partition ends at the first record that starts
+///    at or after it. It only has to be final for the chunks handed out.
+template <class Chunks>
+class ChunkedFastqReader : public InputReader<std::string_view> {
+ public:
+  bool next(std::string_view* data) override {
+    if (chunks_.offset() + pos_ >= chunks_.end()) {
+      return false;
+    }
+
+    uint64_t consumed;
+    switch (parse_record(chunk_.substr(pos_), eof_, data, &consumed)) {
+      case Parse::OK:
+        pos_ += consumed;
+        return true;
+      case Parse::END:
+        return false;
+      case Parse::PARTIAL:
+        return this->next_across_chunks(data);
+    }
+    return false;
+  }
+
+ protected:
+  template <typename... Args>
+  explicit ChunkedFastqReader(Args&&... args)
+      : chunks_(std::forward<Args>(args)...) {
+    this->fetch();
+  }
+
+  Chunks chunks_;
+
+ private:
+  enum class Parse { OK, PARTIAL, END };
+
+  /// Move to the next chunk. Sets `eof_` if there is none.
+  void fetch() {
+    if (!chunks_.next(&chunk_)) {
+      chunk_ = std::string_view();
+      eof_ = true;
+    }
+    pos_ = 0;
+  }
+
+  /// Copy the record that starts at `pos_` and continues in the next chunks,
+  /// one line at a time, until it is complete. Only the first byte of a line
+  /// is copied at first: a record without a quality line ends before the
+  /// next line, and only that byte tells.
+  bool next_across_chunks(std::string_view* data) {
+    carry_.assign(chunk_.substr(pos_));
+    this->fetch();
+    for (;;) {
+      uint64_t consumed;
+      switch (parse_record(carry_, eof_, data, &consumed)) {
+        case Parse::OK:
+          // Give back the first byte of the next record, if it was peeked.
+          assert(carry_.size() - consumed <= std::min<uint64_t>(pos_, 1));
+          pos_ -= carry_.size() - consumed;
+          return true;
+        case Parse::END:
+          return false;
+        case Parse::PARTIAL:
+          break;
+      }
+      if (pos_ == chunk_.size()) {
+        this->fetch();
+        continue;
+      }
+      const char* begin = chunk_.data() + pos_;
+      const char* end = chunk_.data() + chunk_.size();
+      const char* line_end;
+      if (carry_.empty() || carry_.back() == '\n') {
+        line_end = begin + 1;
+      } else {
+        const char* eol = find_char(begin, end, '\n');
+        line_end = eol == end ? end : eol + 1;
+      }
+      carry_.append(begin, line_end);
+      pos_ += line_end - begin;
+    }
+  }
+
+  /// Take one line from `rest`. False if it may continue after `rest`.
+  static bool take_line(std::string_view& rest, bool at_eof,
+                        std::string_view* line) {
+    const char* begin = rest.data();
+    const char* end = begin + rest.size();
+    const char* eol = find_char(begin, end, '\n');
+    if (eol == end && !at_eof) {
+      return false;
+    }
+    if (line != nullptr) {
+      *line = std::string_view(begin, eol - begin);
+    }
+    rest.remove_prefix(eol == end ? rest.size() : eol - begin + 1);
+    return true;
+  }
+
+  /// Parse a record at the start of `buf` like `FastqReader::next()`.
+  /// `at_eof` means that nothing comes after `buf`.
+  static Parse parse_record(std::string_view buf, bool at_eof,
+                            std::string_view* data, uint64_t* consumed) {
+    std::string_view rest = buf;
+    if (rest.empty()) {
+      return at_eof ? Parse::END : Parse::PARTIAL;
+    }
+    if (rest[0] != '@') {
+      return Parse::END;
+    }
+    // Sequence identifier.
+    if (!take_line(rest, at_eof, nullptr)) {
+      return Parse::PARTIAL;
+    }
+    if (rest.empty() && at_eof) {
+      PLOG_WARNING << "Unexpected EOF. Expecting sequence.";
+      return Parse::END;
+    }
+    // Sequence.
+    if (!take_line(rest, at_eof, data)) {
+      return Parse::PARTIAL;
+    }
+    // The record ends here unless the next line is a quality header.
+    if (rest.empty() && !at_eof) {
+      return Parse::PARTIAL;
+    }
+    if (!rest.empty() && rest[0] == '+') {
+      if (!take_line(rest, at_eof, nullptr)) {
+        return Parse::PARTIAL;
+      }
+      if (rest.empty() && at_eof) {
+        PLOG_WARNING << "Unexpected EOF. Expecting quality.";
+        return Parse::END;
+      }
+      if (!take_line(rest, at_eof, nullptr)) {
+        return Parse::PARTIAL;
+      }
+    }
+    *consumed = buf.size() - rest.size();
+    return Parse::OK;
+  }
+
+  std::string_view chunk_;
+  /// Offset in `chunk_`.
+  uint64_t pos_ = 0;
+  /// No chunks left.
+  bool eof_ = false;
+  /// Record that crosses a chunk boundary.
+  std::string carry_;
+};
+
+/// Reads KMers from a Fastq file.
 template <size_t K>
-class FastqKMerReader : public InputReaderU64 {
+class FastqKMerReader : public KMerSpanReader {
  public:
   template <typename... Args>
   FastqKMerReader(Args&&... args)
@@ -121,6 +364,10 @@ class FastqKMerReader : public InputReaderU64 {
 
   bool next(uint64_t* data) override { return reader_.next(data); }
 
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    return reader_.next_span(kmers);
+  }
+
  private:
   KMerReader<K, std::string_view> reader_;
 };
@@ -128,7 +375,7 @@ class FastqKMerReader : public InputReaderU64 {
 /// Produce the same output as `FastqKMerReader` but the sequencies are parsed
 /// and stored in the memory before producing.
 template <size_t K>
-class FastqKMerPreloadReader : public InputReaderU64 {
+class FastqKMerPreloadReader : public KMerSpanReader {
  public:
   template <typename... Args>
   FastqKMerPreloadReader(Args&&... args)
@@ -138,13 +385,55 @@ class FastqKMerPreloadReader : public InputReaderU64 {
 
   bool next(uint64_t* data) override { return reader_.next(data); }
 
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    return reader_.next_span(kmers);
+  }
+
  private:
   KMerReader<K> reader_;
 };
 
+/// Produce the same output as `FastqKMerPreloadReader`, but the file is mapped
+/// and only the views of the sequencies are kept, instead of copies of them.
+/// Every shard maps the file, but only faults in its own partition.
+template <size_t K>
+class FastqKMerMmapReader : public KMerSpanReader {
+ public:
+  FastqKMerMmapReader(std::string_view filename, uint64_t part_id,
+                      uint64_t num_parts)
+      : FastqKMerMmapReader(std::make_shared<const MappedFile>(filename),
+                            part_id, num_parts) {}
+
+  FastqKMerMmapReader(std::shared_ptr<const MappedFile> file,
+                      uint64_t part_id = 0, uint64_t num_parts = 1)
+      : file_(file),
+        reader_(std::make_unique<Reservoir<std::string_view>>(
+            prefaulted(std::move(file), part_id, num_parts))) {}
+
+  bool next(uint64_t* data) override { return reader_.next(data); }
+
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    return reader_.next_span(kmers);
+  }
+
+ private:
+  static std::unique_ptr<MmapFastqReader> prefaulted(
+      std::shared_ptr<const MappedFile> file, uint64_t part_id,
+      uint64_t num_parts) {
+    auto reader =
+        std::make_unique<MmapFastqReader>(std::move(file), part_id, num_parts);
+    reader->prefault();
+    return reader;
+  }
+
+  /// Keeps the mapping alive for the views in `reader_`.
+  std::shared_ptr<const MappedFile> file_;
+  KMerReader<K, std::string_view> reader_;
+};
+
 /// Helper for instantiating a `FastqKMerReader` from a runtime `K`.
 template <uint32_t CurrentK=DNAKMer<1>::MAX_K, typename... Args>
-std::unique_ptr<InputReaderU64> MakeFastqKMerReader(uint32_t K, Args&&... args) {
+std::unique_ptr<KMerSpanReader> MakeFastqKMerReader(uint32_t K, Args&&... args) {
   // Safety check.
   if (K > DNAKMer<1>::MAX_K || K < 1) {
     PLOG_FATAL << "K=" << K << " is not a valid value";
@@ -166,7 +455,7 @@ std::unique_ptr<InputReaderU64> MakeFastqKMerReader(uint32_t K, Args&&... args)
 
 /// Helper for instantiating a `FastqKMerPreloadReader` from a runtime `K`.
 template <uint32_t CurrentK=DNAKMer<1>::MAX_K, typename... Args>
-std::unique_ptr<InputReaderU64> MakeFastqKMerPreloadReader(uint32_t K, Args&&... args) {
+std::unique_ptr<KMerSpanReader> MakeFastqKMerPreloadReader(uint32_t K, Args&&... args) {
   // Safety check.
   if (K > DNAKMer<1>::MAX_K || K < 1) {
     PLOG_FATAL << "K=" << K << " is not a valid value";
@@ -185,6 +474,28 @@ std::unique_ptr<InputReaderU64> MakeFastqKMerPreloadReader(uint32_t K, Args&&...
   }
   return nullptr;
 }
+
+/// Helper for instantiating a `FastqKMerMmapReader` from a runtime `K`.
+template <uint32_t CurrentK=DNAKMer<1>::MAX_K, typename... Args>
+std::unique_ptr<KMerSpanReader> MakeFastqKMerMmapReader(uint32_t K, Args&&... args) {
+  // Safety check.
+  if (K > DNAKMer<1>::MAX_K || K < 1) {
+    PLOG_FATAL << "K=" << K << " is not a valid value";
+    return nullptr;
+  }
+
+  // Found the right K.
+  if (K == CurrentK) {
+    return std::make_unique<FastqKMerMmapReader<CurrentK>>(std::forward<Args>(args)...);
+  }
+
+  // Recurse until we found the right K.
+  // Constexpr is necessary here; the compiler will go into an infinite loop otherwise.
+  if constexpr (CurrentK > 1) {
+    return MakeFastqKMerMmapReader<CurrentK-1, Args...>(K, std::forward<Args>(args)...);
+  }
+  return nullptr;
+}
 }  // namespace input_reader
 }  // namespace kmercounter
 #endif  // INPUT_READER_FASTX_HPP
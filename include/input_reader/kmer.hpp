@@ -1,103 +1,268 @@
 #ifndef INPUT_READER_KMER_HPP
 #define INPUT_READER_KMER_HPP
 
+#include <x86intrin.h>
+
+#include <algorithm>
 #include <array>
+#include <cstring>
 #include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
 #include "input_reader.hpp"
 #include "utils/circular_buffer.hpp"
 
 namespace kmercounter {
 namespace input_reader {
+/// Encodes sequences 64 bases at a time and emits all of their k-mers, the
+/// same ones that pushing the bases through a `DNAKMer<K>` gives: one for
+/// every K consecutive bases that are A, C, G or T (either case).
+///
+/// A block of 64 bases is classified with a few compares into three bit
+/// planes: which bases are valid and the two bits of their codes. The codes
+/// are packed into a 2-bit stream with the first base in the high bits,
+/// the same order as `DNAKMer`, so the k-mer that ends at base `e` is a
+/// funnel shift of the two stream words around it. A k-mer is emitted if
+/// its K bases are valid, which is also worked out on the bit planes, so
+/// 'N' runs cost no branches.
+template <size_t K>
+class KMerExtractor {
+ public:
+  constexpr static uint64_t KMER_MASK = DNAKMer<K>::KMER_MASK;
+
+  /// Write the k-mers of `seq` to `out`, which has room for `seq.size()`
+  /// of them. Returns how many were written.
+  size_t extract(std::string_view seq, uint64_t* out) {
+    const size_t len = seq.size();
+    if (len < K) {
+      return 0;
+    }
+    // One zero word in front, so that the first k-mers can look back.
+    const size_t num_blocks = (len + 63) / 64;
+    packed_.assign(2 * num_blocks + 1, 0);
+    valid_.assign(num_blocks + 1, 0);
+    for (size_t b = 0; b < num_blocks; b++) {
+      uint64_t hi, lo;
+      const size_t block_len = std::min<size_t>(64, len - b * 64);
+      classify(seq.data() + b * 64, block_len, &valid_[b + 1], &hi, &lo);
+      packed_[2 * b + 1] = pack(hi, lo);
+      packed_[2 * b + 2] = pack(hi >> 32, lo >> 32);
+    }
+
+    size_t n = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+      const uint64_t emit = emit_mask(valid_[b], valid_[b + 1]);
+      n += emit_block(b, emit, out + n);
+    }
+    return n;
+  }
+
+ private:
+  /// Bit `i` of `valid` is set if base `i` is A, C, G or T. `hi` and `lo`
+  /// are the two bits of the codes (A=0, C=1, G=2, T=3).
+  static inline void classify(const char* p, size_t len, uint64_t* valid,
+                              uint64_t* hi, uint64_t* lo) {
+#if defined(__AVX512BW__)
+    const __mmask64 in = len == 64 ? ~0ull : (1ull << len) - 1;
+    // Upper case; only 'a'..'t' become one of 'A'..'T'.
+    const __m512i x = _mm512_and_si512(_mm512_maskz_loadu_epi8(in, p),
+                                       _mm512_set1_epi8((char)0xDF));
+    const uint64_t a = _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('A'));
+    const uint64_t c = _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('C'));
+    const uint64_t g = _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('G'));
+    const uint64_t t = _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('T'));
+#else
+    // Zero-pad the tail, zeros are not bases.
+    alignas(64) char tail[64];
+    if (len < 64) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, len);
+      p = tail;
+    }
+#if defined(__AVX2__)
+    uint64_t a = 0, c = 0, g = 0, t = 0;
+    for (int half = 0; half < 2; half++) {
+      const __m256i x = _mm256_and_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * half)),
+          _mm256_set1_epi8((char)0xDF));
+      const auto bits = [&x](char base) -> uint64_t {
+        return (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(base)));
+      };
+      a |= bits('A') << (32 * half);
+      c |= bits('C') << (32 * half);
+      g |= bits('G') << (32 * half);
+      t |= bits('T') << (32 * half);
+    }
+#else
+    uint64_t a = 0, c = 0, g = 0, t = 0;
+    for (int i = 0; i < 64; i++) {
+      const char x = p[i] & 0xDF;
+      a |= (uint64_t)(x == 'A') << i;
+      c |= (uint64_t)(x == 'C') << i;
+      g |= (uint64_t)(x == 'G') << i;
+      t |= (uint64_t)(x == 'T') << i;
+    }
+#endif
+#endif
+    *valid = a | c | g | t;
+    *hi = g | t;
+    *lo = c | t;
+  }
+
+  /// Interleave the low 32 bits of the planes into 32 codes, the first base
+  /// in the high bits.
+  static inline uint64_t pack(uint64_t hi, uint64_t lo) {
+#if defined(__BMI2__)
+    uint64_t x = _pdep_u64(hi, 0xAAAAAAAAAAAAAAAAull) |
+                 _pdep_u64(lo, 0x5555555555555555ull);
+#else
+    uint64_t x = spread(hi) << 1 | spread(lo);
+#endif
+    // Reverse the order of the codes: bytes, then the codes in the bytes.
+    x = __builtin_bswap64(x);
+    x = (x >> 4 & 0x0F0F0F0F0F0F0F0Full) | (x & 0x0F0F0F0F0F0F0F0Full) << 4;
+    x = (x >> 2 & 0x3333333333333333ull) | (x & 0x3333333333333333ull) << 2;
+    return x;
+  }
+
+  /// Move bit `i` of the low 32 bits to bit `2 * i`.
+  static inline uint64_t spread(uint64_t x) {
+    x &= 0xFFFFFFFFull;
+    x = (x | x << 16) & 0x0000FFFF0000FFFFull;
+    x = (x | x << 8) & 0x00FF00FF00FF00FFull;
+    x = (x | x << 4) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | x << 2) & 0x3333333333333333ull;
+    x = (x | x << 1) & 0x5555555555555555ull;
+    return x;
+  }
+
+  /// Bit `i` is set if bases `i - K + 1` .. `i` of the block are all valid,
+  /// looking back into the previous block.
+  static inline uint64_t emit_mask(uint64_t prev, uint64_t curr) {
+    uint64_t emit = curr;
+    for (size_t s = 1; s < K; s++) {
+      emit &= curr << s | prev >> (64 - s);
+    }
+    return emit;
+  }
+
+  /// The k-mers that end in block `b` and are set in `emit`.
+  inline size_t emit_block(size_t b, uint64_t emit, uint64_t* out) const {
+    // Stream word of base `e` is packed_[e / 32 + 1].
+    const uint64_t* words = packed_.data() + 2 * b + 1;
+#if defined(__AVX512F__)
+    size_t n = 0;
+    // Lanes 0-7 are 8 consecutive bases `r` in the same stream word.
+    const __m512i lane = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i kmer_mask = _mm512_set1_epi64(KMER_MASK);
+    for (int g = 0; g < 8; g++) {
+      const __mmask8 m = emit >> (8 * g);
+      if (m == 0) {
+        continue;
+      }
+      const int w = g / 4;
+      const __m512i r = _mm512_add_epi64(lane, _mm512_set1_epi64(8 * (g % 4)));
+      // (word >> (62 - 2r)) | (prev << (2r + 2)), a shift by 64 gives 0.
+      const __m512i two_r = _mm512_slli_epi64(r, 1);
+      const __m512i v = _mm512_and_si512(
+          _mm512_or_si512(
+              _mm512_srlv_epi64(_mm512_set1_epi64(words[w]),
+                                _mm512_sub_epi64(_mm512_set1_epi64(62), two_r)),
+              _mm512_sllv_epi64(_mm512_set1_epi64(words[w - 1]),
+                                _mm512_add_epi64(two_r, _mm512_set1_epi64(2)))),
+          kmer_mask);
+      if (m == 0xFF) {
+        _mm512_storeu_si512(out + n, v);
+      } else {
+        _mm512_mask_compressstoreu_epi64(out + n, m, v);
+      }
+      n += __builtin_popcount(m);
+    }
+    return n;
+#else
+    size_t n = 0;
+    for (; emit != 0; emit &= emit - 1) {
+      const unsigned i = __builtin_ctzll(emit);
+      const unsigned r = i % 32;
+      const uint64_t* word = words + i / 32;
+      const uint64_t prev = word[-1];
+      // Split the shift, `prev` moves out completely for r = 31.
+      out[n++] = (*word >> (62 - 2 * r) | (prev << (2 * r + 1)) << 1) &
+                 KMER_MASK;
+    }
+    return n;
+#endif
+  }
+
+  /// The 2-bit stream, two words per block after a zero word.
+  std::vector<uint64_t> packed_;
+  /// The valid bases, one word per block after a zero word.
+  std::vector<uint64_t> valid_;
+};
+
+/// A k-mer reader that can also hand out all k-mers of a sequence at once.
+class KMerSpanReader : public InputReaderU64 {
+ public:
+  /// Point `kmers` to the (remaining) k-mers of the current sequence, or of
+  /// the next one that has any. They stay valid until the next call.
+  virtual bool next_span(std::span<const uint64_t>* kmers) = 0;
+};
+
 /// Generate KMer from a sequence.
 template <size_t K, class Input = std::string>
-class KMerReader : public InputReaderU64 {
+class KMerReader : public KMerSpanReader {
  public:
   KMerReader(std::unique_ptr<InputReader<Input>> lines)
-      : lines_(std::move(lines)), eof_(false) {
-    PLOG_WARNING_IF(!this->fetch_and_prep_new_line()) << "Empty input.";
+      : lines_(std::move(lines)), pos_(0), size_(0) {
+    PLOG_WARNING_IF(!this->fetch_new_line()) << "Empty input.";
   }
 
   // Return the next kmer.
   bool next(uint64_t* data) override {
-    if (eof_) {
+    if (pos_ == size_ && !this->fetch_new_line()) {
       return false;
     }
-    *data = kmer_.data();
-
-    if (current_line_iter_ == current_line_end_) {
-      // This sequence is exhausted. Fetch the next sequence.
-      if (!(this->fetch_and_prep_new_line())) {
-        // All sequences are exhausted.
-        eof_ = true;
-        return true;
-      } else {
-        // Successfully fetched a new sequence and refill the buffer.
-        return true;
-      }
-    }
+    *data = kmers_[pos_++];
+    return true;
+  }
 
-    // Update the buffer for next kmer.
-    const uint8_t mer = *current_line_iter_;
-    current_line_iter_++;
-    if (!kmer_.push(mer)) {
-      if (refill_buffer()) {
-        // Successfully refilled a buffer
-        return true;
-      } else {
-        // Failed to refill a buffer.
-        // Try to fetch a new sequence and try again.
-        fetch_and_prep_new_line();
-        // Either fetched a new line and the buffer is refilled successfully
-        // or it failed. `eof_` is set according in `fetch_and_prep_new_line()`
-        return true;
-      }
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    if (pos_ == size_ && !this->fetch_new_line()) {
+      return false;
     }
+    *kmers = std::span<const uint64_t>(kmers_.data() + pos_, size_ - pos_);
+    pos_ = size_;
     return true;
   }
 
  private:
-  // Fetch a newline and refill buffer.
-  // Repeat until the buffer is fully refilled.
-  bool fetch_and_prep_new_line() {
+  // Extract the kmers of the next line that has any.
+  bool fetch_new_line() {
     while (lines_->next(&current_line_)) {
-      current_line_iter_ = current_line_.begin();
-      current_line_end_ = current_line_.end();
-
-      // Refill the kmer buffer.
-      if (!refill_buffer()) {
-        continue;
+      if (kmers_.size() < current_line_.size()) {
+        kmers_.resize(current_line_.size());
+      }
+      size_ = extractor_.extract(current_line_, kmers_.data());
+      pos_ = 0;
+      if (size_ > 0) {
+        return true;
       }
-      return true;
     }
     // All seqs are exhausted.
-    eof_ = true;
+    pos_ = size_ = 0;
     return false;
   }
 
-  // Refill the buffer because of a new sequence or a 'N'.
-  bool refill_buffer() {
-    for (size_t i = 0; i < K; i++) {
-      if (current_line_iter_ == current_line_end_) {
-        return false;
-      }
-      const uint8_t mer = *current_line_iter_;
-      current_line_iter_++;
-      // TODO(tian): shifting is not necessary.
-      if (!kmer_.push(mer)) {
-        return refill_buffer();
-      }
-    }
-    return true;
-  }
-
   std::unique_ptr<InputReader<Input>> lines_;
   Input current_line_;
-  typename Input::iterator current_line_iter_;
-  typename Input::iterator current_line_end_;
-  DNAKMer<K> kmer_;
-  bool eof_;
+  KMerExtractor<K> extractor_;
+  // The kmers of `current_line_`.
+  std::vector<uint64_t> kmers_;
+  size_t pos_;
+  size_t size_;
 };
 }  // namespace input_reader
 }  // namespace kmercounter
@@ -0,0 +1,273 @@
+#ifndef INPUT_READER_MMAP_FILE_HPP
+#define INPUT_READER_MMAP_FILE_HPP
+
+#include <fcntl.h>
+#include <plog/Log.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "input_reader.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+/// Return the first `c` in [begin, end), or `end` if there is none.
+/// Looks at a whole vector of bytes per step; the loads never cross into the
+/// page after `end`, so this is safe at the end of a mapping.
+inline const char* find_char(const char* begin, const char* end, char c) {
+  const char* p = begin;
+#if defined(__AVX512BW__)
+  const __m512i needle = _mm512_set1_epi8(c);
+  for (; p + 64 <= end; p += 64) {
+    const __mmask64 mask = _mm512_cmpeq_epi8_mask(
+        _mm512_loadu_si512(reinterpret_cast<const void*>(p)), needle);
+    if (mask != 0) {
+      return p + __builtin_ctzll(mask);
+    }
+  }
+  if (p < end) {
+    // Masked load of the tail; the masked-off bytes are not touched.
+    const __mmask64 tail = (1ull << (end - p)) - 1;
+    const __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(
+        tail, _mm512_maskz_loadu_epi8(tail, p), needle);
+    return mask != 0 ? p + __builtin_ctzll(mask) : end;
+  }
+  return end;
+#elif defined(__AVX2__)
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; p + 32 <= end; p += 32) {
+    const uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  const void* found = memchr(p, c, end - p);
+  return found != nullptr ? static_cast<const char*>(found) : end;
+}
+
+/// A read-only mapping of a whole file.
+/// The readers share it, and the views they return stay valid as long as
+/// somebody holds on to it.
+class MappedFile {
+ public:
+  /// Map `filename`. `populate` faults the whole file in up front; the
+  /// partitioned readers use prefault() on their part instead.
+  MappedFile(std::string_view filename, bool populate = false) {
+    const std::string path(filename);
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      PLOG_FATAL << "Failed to open file " << filename << ": "
+                 << strerror(errno);
+      return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      PLOG_FATAL << "Failed to stat file " << filename << ": "
+                 << strerror(errno);
+      close(fd);
+      return;
+    }
+    size_ = st.st_size;
+
+    // mmap does not take empty mappings.
+    if (size_ > 0) {
+      void* addr = mmap(nullptr, size_, PROT_READ,
+                        MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+      if (addr == MAP_FAILED) {
+        PLOG_FATAL << "Failed to map file " << filename << ": "
+                   << strerror(errno);
+        size_ = 0;
+      } else {
+        data_ = static_cast<const char*>(addr);
+        mapped_ = true;
+        // Hints only; a kernel without THP for the page cache ignores the
+        // second one.
+        madvise(addr, size_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(addr, size_, MADV_HUGEPAGE);
+#endif
+      }
+    }
+    // The mapping keeps the file alive.
+    close(fd);
+  }
+
+  /// Wrap memory that the caller owns, e.g. a dataset that is already
+  /// loaded. Nothing is copied or unmapped.
+  static std::shared_ptr<const MappedFile> from_memory(std::string_view data) {
+    return std::shared_ptr<const MappedFile>(new MappedFile(data.data(),
+                                                            data.size()));
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (mapped_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+  /// Fault in [begin, end) of the mapping, e.g. the partition of one reader,
+  /// instead of the whole file. Memory from from_memory() is left alone.
+  void prefault(const char* begin, const char* end) const {
+    if (!mapped_ || begin >= end) {
+      return;
+    }
+    const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    char* first = reinterpret_cast<char*>(
+        reinterpret_cast<uintptr_t>(begin) & ~page_mask);
+    const size_t len = end - first;
+#ifdef MADV_POPULATE_READ
+    if (madvise(first, len, MADV_POPULATE_READ) == 0) {
+      return;
+    }
+#endif
+    // Before 5.14, only start the reads.
+    madvise(first, len, MADV_WILLNEED);
+  }
+
+  const char* data() const { return data_; }
+
+  uint64_t size() const { return size_; }
+
+ private:
+  MappedFile(const char* data, uint64_t size) : data_(data), size_(size) {}
+
+  const char* data_ = nullptr;
+  uint64_t size_ = 0;
+  bool mapped_ = false;
+};
+
+/// `FileReader` over a mapped file. A line is returned as a view into the
+/// mapping, so nothing is copied and there is no line length limit.
+/// The file is sliced up evenly among the partitions, and `find_bound` is used
+/// to find the boundary of each partition, same as `FileReader`.
+class MmapFileReader : public InputReader<std::string_view> {
+ public:
+  /// Takes the whole file and returns the offset of the boundary at or after
+  /// `offset`, or the size of the file if there is none.
+  using find_bound_t =
+      std::function<uint64_t(std::string_view file, uint64_t offset)>;
+
+  MmapFileReader(std::shared_ptr<const MappedFile> file, uint64_t part_id,
+                 uint64_t num_parts, find_bound_t find_bound = find_next_line)
+      : file_(std::move(file)), part_id_(part_id), num_parts_(num_parts) {
+    if (part_id >= num_parts) {
+      PLOG_FATAL << "part_id(" << part_id << " ) >= num_parts(" << num_parts
+                 << ")";
+    }
+
+    // Same slicing as `FileReader`, so that both read the same records.
+    const std::string_view view = file_->view();
+    const uint64_t file_size = view.size();
+    const uint64_t part_start = (double)file_size / num_parts * part_id;
+    const uint64_t part_end = (double)file_size / num_parts * (part_id + 1);
+    const uint64_t adjusted_part_start =
+        std::min(find_bound(view, part_start), file_size);
+    const uint64_t adjusted_part_end =
+        std::min(find_bound(view, part_end), file_size);
+    PLOG_DEBUG << part_id << "/" << num_parts << ": adj_start "
+               << adjusted_part_start << ", adj_end " << adjusted_part_end;
+
+    curr_ = view.data() + adjusted_part_start;
+    // A partition ends after the line that crosses its end.
+    part_end_ = view.data() + std::max(adjusted_part_start, adjusted_part_end);
+    file_end_ = view.data() + file_size;
+  }
+
+  MmapFileReader(std::string_view filename, uint64_t part_id,
+                 uint64_t num_parts, find_bound_t find_bound = find_next_line)
+      : MmapFileReader(std::make_shared<const MappedFile>(filename), part_id,
+                       num_parts, find_bound) {}
+
+  /// Single partition variant.
+  MmapFileReader(std::shared_ptr<const MappedFile> file)
+      : MmapFileReader(std::move(file), 0, 1) {}
+
+  /// Single partition variant.
+  MmapFileReader(std::string_view filename) : MmapFileReader(filename, 0, 1) {}
+
+  /// Point `output` to the next line and advance the offset.
+  bool next(std::string_view* output) override {
+    if (this->eof()) {
+      return false;
+    }
+
+    const char* eol = find_char(curr_, file_end_, '\n');
+    // Skip the line if `output` is nullptr.
+    if (output != nullptr) {
+      *output = std::string_view(curr_, eol - curr_);
+    }
+    curr_ = eol == file_end_ ? eol : eol + 1;
+    return true;
+  }
+
+  /// Skip to next line.
+  bool skip_to_next_line() { return this->next(nullptr); }
+
+  /// The next character, or EOF at the end of the file.
+  int peek() {
+    return curr_ < file_end_ ? static_cast<unsigned char>(*curr_) : EOF;
+  }
+
+  int get() {
+    return curr_ < file_end_ ? static_cast<unsigned char>(*curr_++) : EOF;
+  }
+
+  bool good() { return curr_ < file_end_; }
+
+  bool eof() { return curr_ >= part_end_; }
+
+  uint64_t num_parts() { return num_parts_; }
+
+  uint64_t part_id() { return part_id_; }
+
+  /// The mapping the returned views point into.
+  const std::shared_ptr<const MappedFile>& file() const { return file_; }
+
+  /// Fault in what is left of this partition, see MappedFile::prefault().
+  void prefault() const { file_->prefault(curr_, part_end_); }
+
+ protected:
+  /// Find offset of next line.
+  static uint64_t find_next_line(std::string_view file, uint64_t offset) {
+    // Beginning of a file is the beginning of a line.
+    if (offset == 0 || offset >= file.size()) {
+      return offset;
+    }
+    // Like `FileReader`, a partition that starts at the beginning of a line
+    // still skips it; the previous partition reads it.
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    const char* eol = find_char(begin + offset, end, '\n');
+    return eol == end ? file.size() : eol - begin + 1;
+  }
+
+ private:
+  std::shared_ptr<const MappedFile> file_;
+  const char* curr_;
+  const char* part_end_;
+  const char* file_end_;
+  uint64_t part_id_;
+  uint64_t num_parts_;
+};
+
+}  // namespace input_reader
+}  // namespace kmercounter
+
+#endif  // INPUT_READER_MMAP_FILE_HPP
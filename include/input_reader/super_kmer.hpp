@@ -0,0 +1,214 @@
+#ifndef INPUT_READER_SUPER_KMER_HPP
+#define INPUT_READER_SUPER_KMER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "input_reader/kmer.hpp"
+#include "plog/Log.h"
+
+namespace kmercounter {
+namespace input_reader {
+/// The reverse complement of a k-mer of length `k`.
+inline uint64_t reverse_complement(uint64_t kmer, uint32_t k) {
+  // Reverse the order of the codes, then complement them (A<->T, C<->G is
+  // `3 - code`) and drop the codes that were not part of the k-mer.
+  uint64_t x = __builtin_bswap64(kmer);
+  x = (x >> 4 & 0x0F0F0F0F0F0F0F0Full) | (x & 0x0F0F0F0F0F0F0F0Full) << 4;
+  x = (x >> 2 & 0x3333333333333333ull) | (x & 0x3333333333333333ull) << 2;
+  return ~x >> (64 - 2 * k);
+}
+
+/// The order of the m-mers when picking minimizers. Lexicographic order
+/// would make poly-A runs the minimizer of everything around them; this is
+/// the murmur3 finalizer, a bijection, so different m-mers never tie.
+inline uint64_t minimizer_hash(uint64_t mmer) {
+  mmer ^= mmer >> 33;
+  mmer *= 0xff51afd7ed558ccdull;
+  mmer ^= mmer >> 33;
+  mmer *= 0xc4ceb9fe1a85ec53ull;
+  mmer ^= mmer >> 33;
+  return mmer;
+}
+
+/// Turns the k-mers of another reader into canonical k-mers and/or
+/// super-k-mers.
+///
+/// A canonical k-mer is the smaller of the k-mer and its reverse
+/// complement, so that both strands of a read count the same key.
+///
+/// The minimizer of a k-mer is the smallest (by `minimizer_hash`) of the
+/// canonical m-mers in it. Consecutive k-mers of a read mostly share it,
+/// and a run of them with the same minimizer is a super-k-mer. Since the
+/// minimizer only depends on the k-mer (and is the same for both strands),
+/// routing super-k-mers by their minimizer sends every occurrence of a
+/// k-mer to the same partition, in runs instead of one k-mer at a time.
+///
+/// Both are updated incrementally: when a k-mer is the previous one
+/// shifted by a base, its reverse complement is shifted the other way, and
+/// the m-mers are kept in a sliding-window minimum. Only the first k-mer
+/// after a gap is computed from scratch.
+class SuperKMerReader : public KMerSpanReader {
+ public:
+  /// `kmers` gives forward k-mers of length `K`. A `minimizer_len` of 0
+  /// leaves out the minimizers, each sequence is then one super-k-mer.
+  SuperKMerReader(std::unique_ptr<KMerSpanReader> kmers, uint32_t K,
+                  bool canonical, uint32_t minimizer_len)
+      : kmers_(std::move(kmers)),
+        k_(K),
+        m_(minimizer_len),
+        canonical_(canonical),
+        kmer_mask_(K == 32 ? ~0ull : (1ull << (2 * K)) - 1),
+        mmer_mask_(minimizer_len == 32 ? ~0ull
+                                       : (1ull << (2 * minimizer_len)) - 1),
+        window_(K - minimizer_len + 1) {
+    if (K == 0 || K > DNAKMer<1>::MAX_K || minimizer_len > K) {
+      PLOG_FATAL.printf("invalid minimizer length %u for K=%u", minimizer_len,
+                        K);
+      std::terminate();
+    }
+  }
+
+  bool next(uint64_t* data) override {
+    if (pos_ == size_ && !this->fetch()) {
+      return false;
+    }
+    *data = out_[pos_++];
+    return true;
+  }
+
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    if (pos_ == size_ && !this->fetch()) {
+      return false;
+    }
+    *kmers = std::span<const uint64_t>(out_.data() + pos_, size_ - pos_);
+    pos_ = size_;
+    return true;
+  }
+
+  /// Point `kmers` to the next super-k-mer, and set `minimizer` to the
+  /// `minimizer_hash` of its minimizer.
+  bool next_super_kmer(std::span<const uint64_t>* kmers, uint64_t* minimizer) {
+    if (pos_ == size_ && !this->fetch()) {
+      return false;
+    }
+    size_t end = pos_ + 1;
+    if (m_ == 0) {
+      end = size_;
+    } else {
+      while (end < size_ && minimizers_[end] == minimizers_[pos_]) {
+        end++;
+      }
+    }
+    *kmers = std::span<const uint64_t>(out_.data() + pos_, end - pos_);
+    *minimizer = m_ == 0 ? 0 : minimizers_[pos_];
+    pos_ = end;
+    return true;
+  }
+
+ private:
+  /// A canonical m-mer in the sliding window.
+  struct MMer {
+    uint64_t hash;
+    uint64_t idx;
+  };
+  /// Larger than the largest window, K - m + 1 <= 32.
+  constexpr static uint64_t RING_SIZE = 64;
+
+  bool fetch() {
+    std::span<const uint64_t> in;
+    while (kmers_->next_span(&in)) {
+      if (out_.size() < in.size()) {
+        out_.resize(in.size());
+        minimizers_.resize(in.size());
+      }
+      for (size_t i = 0; i < in.size(); i++) {
+        this->push(in[i], i);
+      }
+      pos_ = 0;
+      size_ = in.size();
+      if (size_ > 0) {
+        return true;
+      }
+    }
+    pos_ = size_ = 0;
+    return false;
+  }
+
+  inline void push(uint64_t fwd, size_t i) {
+    // The previous k-mer shifted by one base. Across sequences or an 'N'
+    // this is only true if the bases happen to match, and then the update
+    // is as good as recomputing, it only depends on the bases.
+    const bool shifted = has_prev_ && (prev_ << 2 & kmer_mask_) == (fwd & ~3ull);
+    if (shifted) {
+      rc_ = rc_ >> 2 | (3 - (fwd & 3)) << (2 * (k_ - 1));
+    } else {
+      rc_ = reverse_complement(fwd, k_);
+    }
+    prev_ = fwd;
+    has_prev_ = true;
+    out_[i] = canonical_ ? std::min(fwd, rc_) : fwd;
+    if (m_ == 0) {
+      return;
+    }
+
+    if (shifted) {
+      // The new m-mer ends the k-mer, its reverse complement starts `rc_`.
+      this->push_mmer(fwd & mmer_mask_, rc_ >> (2 * (k_ - m_)));
+    } else {
+      head_ = tail_;
+      for (uint32_t j = 0; j < window_; j++) {
+        this->push_mmer(fwd >> (2 * (k_ - m_ - j)) & mmer_mask_,
+                        rc_ >> (2 * j) & mmer_mask_);
+      }
+    }
+    minimizers_[i] = ring_[head_ % RING_SIZE].hash;
+  }
+
+  /// Add the next m-mer to the window and drop the ones that fell out.
+  inline void push_mmer(uint64_t fwd, uint64_t rc) {
+    const uint64_t hash = minimizer_hash(std::min(fwd, rc));
+    const uint64_t idx = next_idx_++;
+    // Nothing behind a smaller m-mer can become the minimum again.
+    while (tail_ != head_ && ring_[(tail_ - 1) % RING_SIZE].hash >= hash) {
+      tail_--;
+    }
+    ring_[tail_++ % RING_SIZE] = {hash, idx};
+    while (ring_[head_ % RING_SIZE].idx + window_ <= idx) {
+      head_++;
+    }
+  }
+
+  std::unique_ptr<KMerSpanReader> kmers_;
+  const uint32_t k_;
+  const uint32_t m_;
+  const bool canonical_;
+  const uint64_t kmer_mask_;
+  const uint64_t mmer_mask_;
+  /// Number of m-mers in a k-mer.
+  const uint32_t window_;
+
+  /// The k-mers of the current sequence, and their minimizers.
+  std::vector<uint64_t> out_;
+  std::vector<uint64_t> minimizers_;
+  size_t pos_ = 0;
+  size_t size_ = 0;
+
+  /// The last forward k-mer and its reverse complement.
+  uint64_t prev_ = 0;
+  uint64_t rc_ = 0;
+  bool has_prev_ = false;
+  /// Sliding-window minimum: increasing hashes from `head_` to `tail_`.
+  MMer ring_[RING_SIZE];
+  uint64_t head_ = 0;
+  uint64_t tail_ = 0;
+  uint64_t next_idx_ = 0;
+};
+}  // namespace input_reader
+}  // namespace kmercounter
+
+#endif  // INPUT_READER_SUPER_KMER_HPP
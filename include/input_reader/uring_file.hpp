@@ -0,0 +1,359 @@
+#ifndef INPUT_READER_URING_FILE_HPP
+#define INPUT_READER_URING_FILE_HPP
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <plog/Log.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "input_reader.hpp"
+#include "input_reader/fastq.hpp"
+#include "input_reader/kmer.hpp"
+#include "input_reader/mmap_file.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+/// Reads a byte range of a file in fixed-size chunks with io_uring.
+/// `depth` chunk buffers rotate: while the caller works on one chunk, the
+/// reads of the next `depth - 1` are in flight. With `direct` the file is
+/// opened with O_DIRECT, and the reads start at the page below `start`.
+///
+/// The range only bounds the read-ahead. Chunks after `end` can still be
+/// read one at a time, e.g. to finish a record that crosses the end.
+class UringChunkReader {
+ public:
+  /// O_DIRECT offsets, lengths and buffers are aligned to this.
+  constexpr static uint64_t ALIGNMENT = 4096;
+
+  UringChunkReader(std::string_view filename, uint64_t start, uint64_t end,
+                   uint32_t chunk_size, uint32_t depth, bool direct)
+      : chunk_size_(chunk_size), buffers_(std::max(depth, 1u)) {
+    if (chunk_size == 0 || chunk_size % ALIGNMENT != 0) {
+      PLOG_FATAL << "chunk size (" << chunk_size << ") must be a multiple of "
+                 << ALIGNMENT;
+      std::terminate();
+    }
+
+    const std::string path(filename);
+    fd_ = open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd_ < 0) {
+      PLOG_FATAL << "Failed to open file " << filename << ": "
+                 << strerror(errno);
+      std::terminate();
+    }
+    struct stat st;
+    if (fstat(fd_, &st) < 0) {
+      PLOG_FATAL << "Failed to stat file " << filename << ": "
+                 << strerror(errno);
+      std::terminate();
+    }
+    file_size_ = st.st_size;
+
+    const int ret = io_uring_queue_init(buffers_.size(), &ring_, 0);
+    if (ret < 0) {
+      PLOG_FATAL << "io_uring_queue_init failed: " << strerror(-ret);
+      std::terminate();
+    }
+    for (Buffer& buffer : buffers_) {
+      buffer.data =
+          static_cast<char*>(std::aligned_alloc(ALIGNMENT, chunk_size_));
+    }
+
+    start_ = std::min(start, file_size_);
+    end_ = std::min(end, file_size_);
+    base_ = direct ? start_ / ALIGNMENT * ALIGNMENT : start_;
+    this->read_ahead();
+  }
+
+  UringChunkReader(const UringChunkReader&) = delete;
+  UringChunkReader& operator=(const UringChunkReader&) = delete;
+
+  ~UringChunkReader() {
+    // The kernel may still be writing into the buffers.
+    while (inflight_ > 0) {
+      this->reap();
+    }
+    io_uring_queue_exit(&ring_);
+    for (Buffer& buffer : buffers_) {
+      std::free(buffer.data);
+    }
+    close(fd_);
+  }
+
+  /// Point `chunk` to the next chunk. It stays valid until the next call.
+  bool next(std::string_view* chunk) {
+    // The caller is done with the previous chunk; reuse its buffer.
+    if (held_) {
+      held_ = false;
+      consumed_++;
+      this->read_ahead();
+    }
+
+    const uint64_t offset = this->chunk_offset(consumed_);
+    if (offset >= file_size_) {
+      return false;
+    }
+    // Past the read-ahead range.
+    if (submitted_ == consumed_) {
+      this->submit(submitted_++);
+      io_uring_submit(&ring_);
+    }
+
+    Buffer& buffer = this->buffer(consumed_);
+    while (!buffer.done) {
+      this->reap();
+    }
+
+    // Skip the bytes before `start` that O_DIRECT made us read.
+    const uint64_t skip = offset < start_ ? start_ - offset : 0;
+    *chunk = std::string_view(buffer.data + skip, buffer.filled - skip);
+    held_ = true;
+    return true;
+  }
+
+  /// File offset of the first byte of the last chunk returned by `next()`.
+  uint64_t offset() const {
+    return std::max(this->chunk_offset(consumed_), start_);
+  }
+
+  /// End of the range, a `ChunkedFastqReader` stops at the first record
+  /// that starts at or after it.
+  uint64_t end() const { return end_; }
+
+  uint64_t file_size() const { return file_size_; }
+
+ private:
+  struct Buffer {
+    char* data = nullptr;
+    /// Chunk that is being read into the buffer.
+    uint64_t chunk = 0;
+    uint32_t length = 0;
+    uint32_t filled = 0;
+    bool done = false;
+  };
+
+  uint64_t chunk_offset(uint64_t chunk) const {
+    return base_ + chunk * chunk_size_;
+  }
+
+  Buffer& buffer(uint64_t chunk) {
+    return buffers_[chunk % buffers_.size()];
+  }
+
+  /// Keep every free buffer busy with the chunks up to `end_`.
+  void read_ahead() {
+    bool queued = false;
+    while (submitted_ - consumed_ < buffers_.size() &&
+           this->chunk_offset(submitted_) < end_) {
+      this->submit(submitted_++);
+      queued = true;
+    }
+    if (queued) {
+      io_uring_submit(&ring_);
+    }
+  }
+
+  void submit(uint64_t chunk) {
+    Buffer& buffer = this->buffer(chunk);
+    buffer.chunk = chunk;
+    // O_DIRECT wants whole pages, the kernel stops at the end of the file.
+    buffer.length = chunk_size_;
+    buffer.filled = 0;
+    buffer.done = false;
+    this->queue_read(buffer);
+  }
+
+  void queue_read(Buffer& buffer) {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+      // Never more reads than entries.
+      PLOG_FATAL << "io_uring submission queue is full";
+      std::terminate();
+    }
+    io_uring_prep_read(sqe, fd_, buffer.data + buffer.filled,
+                       buffer.length - buffer.filled,
+                       this->chunk_offset(buffer.chunk) + buffer.filled);
+    io_uring_sqe_set_data(sqe, &buffer);
+    inflight_++;
+  }
+
+  /// Wait for one completion.
+  void reap() {
+    io_uring_cqe* cqe;
+    const int ret = io_uring_wait_cqe(&ring_, &cqe);
+    if (ret < 0) {
+      PLOG_FATAL << "io_uring_wait_cqe failed: " << strerror(-ret);
+      std::terminate();
+    }
+    Buffer& buffer = *static_cast<Buffer*>(io_uring_cqe_get_data(cqe));
+    const int res = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+    inflight_--;
+
+    if (res < 0) {
+      PLOG_FATAL << "read at " << this->chunk_offset(buffer.chunk)
+                 << " failed: " << strerror(-res);
+      std::terminate();
+    }
+    buffer.filled += res;
+    const uint64_t read_end = this->chunk_offset(buffer.chunk) + buffer.filled;
+    if (res > 0 && buffer.filled < buffer.length && read_end < file_size_) {
+      // Short read in the middle of the file, read the rest.
+      this->queue_read(buffer);
+      io_uring_submit(&ring_);
+      return;
+    }
+    // Do not hand out what O_DIRECT read past the end of the file.
+    buffer.filled = std::min<uint64_t>(
+        buffer.filled, file_size_ - this->chunk_offset(buffer.chunk));
+    buffer.done = true;
+  }
+
+  int fd_;
+  io_uring ring_;
+  uint64_t file_size_;
+  uint64_t start_;
+  uint64_t end_;
+  /// File offset of the first chunk.
+  uint64_t base_;
+  uint32_t chunk_size_;
+  std::vector<Buffer> buffers_;
+  /// Chunks handed out / read so far, a chunk lives in buffer `chunk % depth`.
+  uint64_t consumed_ = 0;
+  uint64_t submitted_ = 0;
+  uint32_t inflight_ = 0;
+  /// The caller has chunk `consumed_`.
+  bool held_ = false;
+};
+
+/// Produce the same sequences as `FastqReader`, but the partition is read
+/// with a `UringChunkReader`, so the reads of the next chunks overlap with
+/// the work on the current one. See `ChunkedFastqReader` for how long the
+/// sequences stay valid.
+class UringFastqReader : public ChunkedFastqReader<UringChunkReader> {
+ public:
+  UringFastqReader(std::string_view filename, uint64_t part_id,
+                   uint64_t num_parts, uint32_t chunk_size, uint32_t depth,
+                   bool direct)
+      : UringFastqReader(filename, find_partition(filename, part_id, num_parts),
+                         chunk_size, depth, direct) {}
+
+ private:
+  struct Partition {
+    uint64_t start;
+    uint64_t end;
+  };
+
+  UringFastqReader(std::string_view filename, Partition part,
+                   uint32_t chunk_size, uint32_t depth, bool direct)
+      : ChunkedFastqReader(filename, part.start, part.end, chunk_size, depth,
+                           direct) {}
+
+  /// Same boundaries as `FastqReader`, found with a few small preads.
+  static Partition find_partition(std::string_view filename, uint64_t part_id,
+                                  uint64_t num_parts) {
+    if (part_id >= num_parts) {
+      PLOG_FATAL << "part_id(" << part_id << " ) >= num_parts(" << num_parts
+                 << ")";
+    }
+    const std::string path(filename);
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      PLOG_FATAL << "Failed to open file " << filename << ": "
+                 << strerror(errno);
+      std::terminate();
+    }
+    struct stat st;
+    fstat(fd, &st);
+    const uint64_t file_size = st.st_size;
+    const uint64_t part_start = (double)file_size / num_parts * part_id;
+    const uint64_t part_end = (double)file_size / num_parts * (part_id + 1);
+    const Partition part{find_bound(fd, file_size, part_start),
+                         find_bound(fd, file_size, part_end)};
+    close(fd);
+    PLOG_DEBUG << part_id << "/" << num_parts << ": adj_start " << part.start
+               << ", adj_end " << part.end;
+    return {part.start, std::max(part.start, part.end)};
+  }
+
+  static uint64_t find_bound(int fd, uint64_t file_size, uint64_t offset) {
+    if (offset == 0 || offset >= file_size) {
+      return std::min(offset, file_size);
+    }
+    // Read from one byte before `offset`, which keeps the search from
+    // treating the window as the beginning of the file.
+    std::string window;
+    for (uint64_t size = 64 * 1024;; size *= 2) {
+      const uint64_t from = offset - 1;
+      const uint64_t length = std::min(size, file_size - from);
+      window.resize(length);
+      const ssize_t n = pread(fd, window.data(), length, from);
+      if (n < 0 || (uint64_t)n != length) {
+        PLOG_FATAL << "pread at " << from << " failed: " << strerror(errno);
+        std::terminate();
+      }
+      const uint64_t bound = MmapFastqReader::find_next_sequence(window, 1);
+      // Found, or there is nothing else to look at.
+      if (bound < length || from + length == file_size) {
+        return from + bound;
+      }
+    }
+  }
+
+};
+
+/// Reads KMers from a Fastq file with a `UringFastqReader`. Unlike the
+/// preloading readers, the file is read while the k-mers are produced.
+template <size_t K>
+class FastqKMerUringReader : public KMerSpanReader {
+ public:
+  template <typename... Args>
+  FastqKMerUringReader(Args&&... args)
+      : reader_(
+            std::make_unique<UringFastqReader>(std::forward<Args>(args)...)) {}
+
+  bool next(uint64_t* data) override { return reader_.next(data); }
+
+  bool next_span(std::span<const uint64_t>* kmers) override {
+    return reader_.next_span(kmers);
+  }
+
+ private:
+  KMerReader<K, std::string_view> reader_;
+};
+
+/// Helper for instantiating a `FastqKMerUringReader` from a runtime `K`.
+template <uint32_t CurrentK=DNAKMer<1>::MAX_K, typename... Args>
+std::unique_ptr<KMerSpanReader> MakeFastqKMerUringReader(uint32_t K, Args&&... args) {
+  // Safety check.
+  if (K > DNAKMer<1>::MAX_K || K < 1) {
+    PLOG_FATAL << "K=" << K << " is not a valid value";
+    return nullptr;
+  }
+
+  // Found the right K.
+  if (K == CurrentK) {
+    return std::make_unique<FastqKMerUringReader<CurrentK>>(std::forward<Args>(args)...);
+  }
+
+  // Recurse until we found the right K.
+  // Constexpr is necessary here; the compiler will go into an infinite loop otherwise.
+  if constexpr (CurrentK > 1) {
+    return MakeFastqKMerUringReader<CurrentK-1, Args...>(K, std::forward<Args>(args)...);
+  }
+  return nullptr;
+}
+}  // namespace input_reader
+}  // namespace kmercounter
+
+#endif  // INPUT_READER_URING_FILE_HPP
@@ -23,8 +23,22 @@ bool distribute_memory_to_nodes(void *addr, uint64_t alloc_sz);
 int find_remote_node(int current_node);
 bool move_memory_to_node(void* addr, uint64_t size, int to_node);
 
+#include <barrier>
+#include <functional>
+#include <vector>
+
 #include "hashtables/base_kht.hpp"
 namespace kmercounter{
-BaseHashTable* init_ht(const uint64_t sz, uint8_t id);
+// `node` is the numa node of the calling shard, partitioned tables are
+// placed there with --local-partitions.
+BaseHashTable* init_ht(const uint64_t sz, uint8_t id, int node = -1);
+// With --replicate-ht, copy the table to every numa node and route the finds
+// of `shard` to its node's copy. Called by all shards between the insert
+// and the find phase.
+void use_local_replica(Shard *shard, BaseHashTable *ht,
+                       std::barrier<std::function<void()>> *sync_barrier);
+// Set up the queues of the delegated table, before the shards start.
+// Shard `i` runs on `cpus[i]`.
+void init_delegation(const std::vector<uint32_t> &cpus);
 }
 #endif  //_MISC_LIB_H
@@ -143,6 +143,14 @@ enum numa_policy_queues {
   PROD_CONS_EQUAL_PARTITION = 3,
 };
 
+/* Numa node that holds the data of a producer -> consumer queue */
+enum queue_placement {
+  // enqueues stay local, the consumer reads across nodes
+  QUEUE_ON_PRODUCER = 0,
+  // dequeues stay local, the producer writes across nodes
+  QUEUE_ON_CONSUMER = 1,
+};
+
 class NumaPolicyQueues : public Numa {
  public:
   NumaPolicyQueues(int num_prod, int num_cons, numa_policy_queues npq) {
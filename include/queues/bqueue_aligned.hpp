@@ -5,7 +5,11 @@
 #include <map>
 #include <assert.h>
 #include <x86intrin.h>
+#include <algorithm>
 #include <cstring>
+#include <span>
+
+#include "bulk_copy.hpp"
 
 #define OPTIMIZE_BACKTRACKING2
 
@@ -136,18 +140,29 @@ class BQueueAligned {
       this->start_time = clock();
     }
 
+    /// A slot is free when it holds the zero entry. `data_t`'s operator
+    /// bool is true for the zero entry, so it cannot be used for this.
+    static inline bool is_empty(const data_t &slot) {
+      return slot == data_t{};
+    }
+
+    /// Move `batch_head` one batch ahead if the consumer freed that batch.
+    inline int reserve_batch(prod_queue_t *pq) {
+      uint32_t tmp_head = pq->head + this->batch_size;
+      if (tmp_head >= this->queue_size) tmp_head = 0;
+
+      if (!is_empty(pq->data[tmp_head])) {
+        fipc_test_time_wait_ticks(CONGESTION_PENALTY);
+        return RETRY;
+      }
+      pq->batch_head = tmp_head;
+      return SUCCESS;
+    }
+
     int enqueue(uint32_t p, uint32_t c, data_t value) {
       auto pq = &this->all_pqueues[p][c];
-      uint32_t tmp_head;
       if (pq->head == pq->batch_head) {
-        tmp_head = pq->head + this->batch_size;
-        if (tmp_head >= this->queue_size) tmp_head = 0;
-
-        if (pq->data[tmp_head]) {
-          fipc_test_time_wait_ticks(CONGESTION_PENALTY);
-          return RETRY;
-        }
-        pq->batch_head = tmp_head;
+        if (reserve_batch(pq) != SUCCESS) return RETRY;
       }
 
       //printf("enqueuing at pq->head %u | val %" PRIu64 "\n", pq->head, value);
@@ -188,13 +203,13 @@ class BQueueAligned {
 
       unsigned long batch_size = this->batch_size;
 #if defined(OPTIMIZE_BACKTRACKING2)
-      if ((!q->data[tmp_tail]) && !q->backtrack_flag) {
+      if (is_empty(q->data[tmp_tail]) && !q->backtrack_flag) {
         fipc_test_time_wait_ticks(CONGESTION_PENALTY);
         return -1;
       }
 #endif
 
-      while (!(q->data[tmp_tail])) {
+      while (is_empty(q->data[tmp_tail])) {
         if (batch_size > 1) {
           batch_size = batch_size >> 1;
           tmp_tail = q->tail + batch_size - 1;
@@ -236,6 +251,58 @@ class BQueueAligned {
       return SUCCESS;
     }
 
+    /// Enqueue as much of `values` as the consumer has room for, reserving
+    /// a batch at a time and copying whole cachelines into it. Returns how
+    /// many entries were enqueued. The slots double as the full/empty flags,
+    /// so the stores have to stay ordered: no non-temporal stores here.
+    size_t enqueue_bulk(uint32_t p, uint32_t c,
+                        std::span<const data_t> values) {
+      auto pq = &this->all_pqueues[p][c];
+      const data_t *src = values.data();
+      size_t left = values.size();
+
+      while (left > 0) {
+        if (pq->head == pq->batch_head) {
+          if (reserve_batch(pq) != SUCCESS) break;
+        }
+        uint32_t end = pq->batch_head > pq->head ? pq->batch_head
+                                                 : this->queue_size;
+        size_t n = std::min<size_t>(left, end - pq->head);
+        copy_entries<false>(&pq->data[pq->head], src, n);
+        src += n;
+        left -= n;
+        pq->head = pq->head + n;
+        if (pq->head >= this->queue_size) {
+          pq->head = 0;
+        }
+      }
+      return values.size() - left;
+    }
+
+    /// Dequeue up to `values.size()` entries. Returns how many were
+    /// dequeued, 0 if none were ready (where dequeue() returns RETRY).
+    size_t dequeue_bulk(uint32_t p, uint32_t c, std::span<data_t> values) {
+      auto cq = &this->all_cqueues[c][p];
+      data_t *dst = values.data();
+      size_t left = values.size();
+
+      while (left > 0) {
+        if (cq->tail == cq->batch_tail) {
+          if (backtracking(cq) != 0) break;
+        }
+        uint32_t end = cq->batch_tail > cq->tail ? cq->batch_tail
+                                                 : this->queue_size;
+        size_t n = std::min<size_t>(left, end - cq->tail);
+        copy_entries<false>(dst, (const data_t *)&cq->data[cq->tail], n);
+        memset((void *)&cq->data[cq->tail], 0, n * sizeof(data_t));
+        dst += n;
+        left -= n;
+        cq->tail = cq->tail + n;
+        if (cq->tail >= this->queue_size) cq->tail = 0;
+      }
+      return values.size() - left;
+    }
+
     void push_done(uint32_t p, uint32_t c) {
       auto pq = &this->all_pqueues[p][c];
       auto cq = &this->all_cqueues[c][p];
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <x86intrin.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace kmercounter {
+
+/// Copy `n` queue entries from `src` to `dst`. Entries up to the first
+/// cacheline boundary of `dst` are copied one by one, after that every full
+/// line is moved with a single 64B load/store (AVX-512 when available).
+/// With `stream`, the stores to `dst` are non-temporal: they bypass the
+/// cache of the writer and are weakly ordered, so the writer has to
+/// `_mm_sfence()` before publishing them.
+template <bool stream, typename T>
+inline void copy_entries(T *dst, const T *src, size_t n) {
+  constexpr size_t LINE = 64;
+  constexpr size_t PER_LINE = LINE / sizeof(T);
+  static_assert(LINE % sizeof(T) == 0, "entries must not straddle lines");
+
+  for (; n > 0 && ((uintptr_t)dst & (LINE - 1)); n--) {
+    *dst++ = *src++;
+  }
+
+  for (; n >= PER_LINE; n -= PER_LINE, dst += PER_LINE, src += PER_LINE) {
+#if defined(__AVX512F__)
+    __m512i line = _mm512_loadu_si512((const void *)src);
+    if constexpr (stream) {
+      _mm512_stream_si512((__m512i *)dst, line);
+    } else {
+      _mm512_store_si512((void *)dst, line);
+    }
+#else
+    if constexpr (stream) {
+      const __m128i *s = (const __m128i *)src;
+      __m128i *d = (__m128i *)dst;
+      _mm_stream_si128(d + 0, _mm_loadu_si128(s + 0));
+      _mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+      _mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+      _mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+    } else {
+      memcpy((void *)dst, (const void *)src, LINE);
+    }
+#endif
+  }
+
+  for (; n > 0; n--) {
+    *dst++ = *src++;
+  }
+}
+
+}  // namespace kmercounter
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <assert.h>
+#include <numaif.h>
+
+#include <atomic>
+#include <numa.hpp>
+#include <vector>
+
+#include "helper.hpp"
+#include "queue.hpp"
+
+#include "../types.hpp"
+
+namespace kmercounter {
+
+extern const uint64_t CACHELINE_MASK;
+extern const uint64_t PAGESIZE;
+
+/// Lynx (Mitropoulou et al., CGO'16) without the red zones. The original in
+/// lynxq.hpp mprotects the page past each section and finds section
+/// boundaries in a SIGSEGV handler that decodes the faulting instruction
+/// with capstone, which does not mix with sanitizers or with hosts that
+/// have their own signal handling.
+///
+/// The queue layout and protocol are the same: every SPSC queue is split
+/// into NUM_SECTIONS sections, the producer fills a whole section before
+/// handing it over, and the consumer drains a whole section before handing
+/// it back, so the shared section state is touched once per section and
+/// never on the way. Instead of taking a fault, enqueue() and dequeue()
+/// compare their index against the end of the current section, a branch
+/// that is taken once per section and otherwise predicted away.
+///
+/// The interface follows SectionQueue: `all_pqueues[p][c]` is the state of
+/// producer p towards consumer c and `all_cqueues[c][p]` the other end.
+class LynxQueue {
+ public:
+  /// As in Lynx, one section is written while the other one is read.
+  constexpr static uint32_t NUM_SECTIONS = 2;
+
+  enum section_state : uint32_t {
+    /// Free for the producer, the consumer has read all of it.
+    POP_READY = 0,
+    /// Filled by the producer, the consumer may read it.
+    PUSH_READY = 1,
+  };
+
+  struct CACHE_ALIGNED section_t {
+    std::atomic<uint32_t> state;
+  };
+
+  struct shared_t {
+    section_t sections[NUM_SECTIONS];
+#ifdef CALC_STATS
+    CACHE_ALIGNED size_t numEnqueueSpins;
+    CACHE_ALIGNED size_t numDequeueSpins;
+#endif
+  };
+
+  struct prod_queue_t {
+    data_t *push_index;
+    data_t *push_end;
+    data_t *data;
+    shared_t *shared;
+    uint32_t section;
+  };
+
+  struct cons_queue_t {
+    data_t *pop_index;
+    data_t *pop_end;
+    data_t *data;
+    shared_t *shared;
+    uint32_t section;
+    /// The consumer is in `section` and has to release it when done.
+    bool holds;
+  };
+
+  static const uint64_t BQ_MAGIC_64BIT = 0xD221A6BE96E04673UL;
+  static inline const data_t BQ_MAGIC_KV =
+      data_t(BQ_MAGIC_64BIT, BQ_MAGIC_64BIT);
+
+  prod_queue_t **all_pqueues;
+  cons_queue_t **all_cqueues;
+
+  /// Bytes per queue.
+  size_t queue_size;
+
+ private:
+  uint32_t nprod;
+  uint32_t ncons;
+  size_t section_entries;
+  shared_t **all_shared;
+  /// Queue data of each producer
+  std::vector<data_t *> prod_data;
+
+  void init_queues(const std::vector<uint32_t> &prod_cpus) {
+    size_t bytes = (ncons * this->queue_size + PAGESIZE - 1) & ~(PAGESIZE - 1);
+
+    for (auto p = 0u; p < nprod; p++) {
+      auto data = (data_t *)utils::zero_aligned_alloc(PAGESIZE, bytes);
+      this->prod_data.push_back(data);
+
+      // written and mostly read back by the producer, see SectionQueue
+      if (p < prod_cpus.size()) {
+        unsigned long nodemask = 1UL << numa_node_of_cpu(prod_cpus[p]);
+        if (mbind(data, bytes, MPOL_BIND, &nodemask, sizeof(nodemask) * 8,
+                  MPOL_MF_MOVE) < 0) {
+          PLOGW.printf("mbind of lynx queues of producer %u failed (errno %d)",
+                       p, errno);
+        }
+      }
+
+      all_pqueues[p] = (prod_queue_t *)utils::zero_aligned_alloc(
+          FIPC_CACHE_LINE_SIZE, ncons * sizeof(prod_queue_t));
+      all_shared[p] = (shared_t *)utils::zero_aligned_alloc(
+          FIPC_CACHE_LINE_SIZE, ncons * sizeof(shared_t));
+
+      for (auto c = 0u; c < ncons; c++) {
+        prod_queue_t *pq = &all_pqueues[p][c];
+        pq->data = data + c * (this->queue_size / sizeof(data_t));
+        pq->shared = &all_shared[p][c];
+        pq->section = 0;
+        pq->push_index = pq->data;
+        pq->push_end = pq->data + this->section_entries;
+      }
+    }
+
+    for (auto c = 0u; c < ncons; c++) {
+      all_cqueues[c] = (cons_queue_t *)utils::zero_aligned_alloc(
+          FIPC_CACHE_LINE_SIZE, nprod * sizeof(cons_queue_t));
+      for (auto p = 0u; p < nprod; p++) {
+        cons_queue_t *cq = &all_cqueues[c][p];
+        cq->data = all_pqueues[p][c].data;
+        cq->shared = &all_shared[p][c];
+        cq->section = 0;
+        cq->holds = false;
+        // an empty window, the first dequeue waits for section 0
+        cq->pop_index = cq->pop_end = cq->data;
+      }
+    }
+  }
+
+  /// Hand the full section over to the consumer and wait for the next one
+  /// to be drained.
+  void next_push_section(prod_queue_t *pq) {
+    pq->shared->sections[pq->section].state.store(PUSH_READY,
+                                                  std::memory_order_release);
+    pq->section = (pq->section + 1) % NUM_SECTIONS;
+
+    auto &next = pq->shared->sections[pq->section].state;
+    while (next.load(std::memory_order_acquire) != POP_READY) {
+#ifdef CALC_STATS
+      pq->shared->numEnqueueSpins++;
+#endif
+      asm volatile("pause");
+    }
+    pq->push_index = pq->data + pq->section * this->section_entries;
+    pq->push_end = pq->push_index + this->section_entries;
+  }
+
+  /// Hand the drained section back to the producer and enter the next one
+  /// if it has been filled.
+  bool next_pop_section(cons_queue_t *cq) {
+    if (cq->holds) {
+      cq->shared->sections[cq->section].state.store(POP_READY,
+                                                    std::memory_order_release);
+      cq->section = (cq->section + 1) % NUM_SECTIONS;
+      cq->pop_index = cq->pop_end =
+          cq->data + cq->section * this->section_entries;
+      cq->holds = false;
+    }
+
+    if (cq->shared->sections[cq->section].state.load(
+            std::memory_order_acquire) != PUSH_READY) {
+#ifdef CALC_STATS
+      cq->shared->numDequeueSpins++;
+#endif
+      return false;
+    }
+    cq->holds = true;
+    cq->pop_end = cq->pop_index + this->section_entries;
+    return true;
+  }
+
+ public:
+  explicit LynxQueue(uint32_t nprod, uint32_t ncons, size_t queue_size,
+                     NumaPolicyQueues *npq)
+      : LynxQueue(nprod, ncons, queue_size,
+                  npq->get_assigned_cpu_list_producers()) {}
+
+  /// `queue_size` is in bytes. The queues of producer `p` are placed on the
+  /// node of `prod_cpus[p]`.
+  explicit LynxQueue(uint32_t nprod, uint32_t ncons, size_t queue_size,
+                     const std::vector<uint32_t> &prod_cpus) {
+    assert(queue_size % (NUM_SECTIONS * FIPC_CACHE_LINE_SIZE) == 0);
+    this->nprod = nprod;
+    this->ncons = ncons;
+    this->queue_size = queue_size;
+    this->section_entries = queue_size / NUM_SECTIONS / sizeof(data_t);
+
+    this->all_pqueues = (prod_queue_t **)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, nprod * sizeof(prod_queue_t *));
+    this->all_cqueues = (cons_queue_t **)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, ncons * sizeof(cons_queue_t *));
+    this->all_shared = (shared_t **)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, nprod * sizeof(shared_t *));
+
+    this->init_queues(prod_cpus);
+    PLOGV.printf("%u x %u lynx queues of %zu bytes (%zu entries a section)",
+                 nprod, ncons, queue_size, this->section_entries);
+  }
+
+  inline int enqueue(prod_queue_t *pq, uint32_t p, uint32_t c, data_t value) {
+    *pq->push_index = value;
+    pq->push_index += 1;
+
+    if (__builtin_expect(pq->push_index == pq->push_end, 0)) {
+      this->next_push_section(pq);
+    }
+    return SUCCESS;
+  }
+
+  inline int dequeue(cons_queue_t *cq, uint32_t p, uint32_t c, data_t *value) {
+    if (__builtin_expect(cq->pop_index == cq->pop_end, 0)) {
+      if (!this->next_pop_section(cq)) {
+        return RETRY;
+      }
+    }
+    *value = *cq->pop_index;
+    cq->pop_index += 1;
+    return SUCCESS;
+  }
+
+  inline void prefetch(uint32_t p, uint32_t c, bool is_prod) {
+    if (is_prod) {
+      auto nc = ((c + 1) >= ncons) ? 0 : (c + 1);
+      auto pq = &all_pqueues[p][nc];
+      if (((uint64_t)pq->push_index & CACHELINE_MASK) == 0) {
+        __builtin_prefetch(pq->push_index + 8, 1, 3);
+      }
+    } else {
+      auto np = ((p + 1) >= nprod) ? 0 : (p + 1);
+      auto cq = &all_cqueues[c][np];
+      __builtin_prefetch(cq->pop_index + 0, 0, 3);
+      __builtin_prefetch(cq->pop_index + 4, 0, 3);
+    }
+  }
+
+  /// The end of the messages of producer `p` to consumer `c`: publishes the
+  /// partially filled section, up to and including the magic entry. Nothing
+  /// may be enqueued to `c` afterwards.
+  inline void push_done(uint32_t p, uint32_t c) {
+    prod_queue_t *pq = &this->all_pqueues[p][c];
+    this->enqueue(pq, p, c, BQ_MAGIC_KV);
+    pq->shared->sections[pq->section].state.store(PUSH_READY,
+                                                  std::memory_order_release);
+  }
+
+  void pop_done(uint32_t p, uint32_t c) {}
+
+  void dump_stats(uint32_t p, uint32_t c) {
+#ifdef CALC_STATS
+    shared_t *s = &this->all_shared[p][c];
+    printf("[%u][%u] enq spins %zu | deq spins %zu\n", p, c,
+           s->numEnqueueSpins, s->numDequeueSpins);
+#endif
+  }
+
+  ~LynxQueue() {
+    for (auto p = 0u; p < nprod; p++) {
+      free(this->all_pqueues[p]);
+      free(this->all_shared[p]);
+      free(this->prod_data[p]);
+    }
+    for (auto c = 0u; c < ncons; c++) {
+      free(this->all_cqueues[c]);
+    }
+    free(this->all_pqueues);
+    free(this->all_cqueues);
+    free(this->all_shared);
+  }
+};
+
+}  // namespace kmercounter
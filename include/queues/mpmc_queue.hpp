@@ -0,0 +1,328 @@
+#pragma once
+
+#include <assert.h>
+#include <numaif.h>
+
+#include <algorithm>
+#include <atomic>
+#include <numa.hpp>
+#include <vector>
+
+#include "bulk_copy.hpp"
+#include "helper.hpp"
+#include "queue.hpp"
+
+#include "../types.hpp"
+#include "../utils/poll_backoff.hpp"
+
+namespace kmercounter {
+
+extern const uint64_t PAGESIZE;
+
+/// One inbound queue per consumer, shared by all producers, instead of an
+/// nprod x ncons mesh of SPSC queues. A consumer then polls a single queue
+/// no matter how many producers there are, and the queue memory grows
+/// linearly with the thread count.
+///
+/// Every queue is a bounded MPMC ring of chunks (Vyukov-style: the sequence
+/// number of a chunk says whether it is free or full for a given lap).
+/// Producers stage entries in their `prod_queue_t` and claim a ring slot
+/// once per chunk, so the shared tail is touched every CHUNK_ENTRIES
+/// messages rather than on every message. Dequeues claim whole chunks with a
+/// CAS on the head, so any number of cursors (`cons_queue_t`) may consume
+/// from a ring concurrently, e.g. an idle consumer helping a busy one.
+///
+/// The interface follows SectionQueue: `all_pqueues[p][c]` is the
+/// producer-side state of producer p towards consumer c, and
+/// `all_cqueues[c][p]` are cursors onto the ring of consumer c.
+class MPMCQueue {
+ public:
+  /// Entries per chunk, so that a chunk with its header spans 4 cachelines.
+  constexpr static uint32_t CHUNK_ENTRIES =
+      (4 * FIPC_CACHE_LINE_SIZE - 16) / sizeof(data_t);
+
+  struct CACHE_ALIGNED chunk_t {
+    std::atomic<uint64_t> seq;
+    uint32_t count;
+    uint32_t pad;
+    data_t data[CHUNK_ENTRIES];
+  };
+
+  struct ring_t {
+    CACHE_ALIGNED std::atomic<uint64_t> enq_pos;
+    CACHE_ALIGNED std::atomic<uint64_t> deq_pos;
+    CACHE_ALIGNED chunk_t *chunks;
+    uint64_t mask;
+#ifdef CALC_STATS
+    CACHE_ALIGNED size_t numEnqueueSpins;
+    CACHE_ALIGNED size_t numDequeueSpins;
+#endif
+  };
+
+  struct CACHE_ALIGNED prod_queue_t {
+    ring_t *ring;
+    uint32_t count;
+    data_t buf[CHUNK_ENTRIES];
+  };
+
+  struct CACHE_ALIGNED cons_queue_t {
+    ring_t *ring;
+    chunk_t *chunk;
+    uint64_t pos;
+    uint32_t idx;
+    uint32_t count;
+  };
+
+  static const uint64_t BQ_MAGIC_64BIT = 0xD221A6BE96E04673UL;
+  static inline const data_t BQ_MAGIC_KV =
+      data_t(BQ_MAGIC_64BIT, BQ_MAGIC_64BIT);
+
+  prod_queue_t **all_pqueues;
+  cons_queue_t **all_cqueues;
+
+  /// Chunks in the ring of each consumer.
+  size_t queue_size;
+
+ private:
+  uint32_t nprod;
+  uint32_t ncons;
+  ring_t *rings;
+  /// One per consumer, see enable_doorbells()
+  Doorbell *doorbells = nullptr;
+
+  void init_rings(const std::vector<uint32_t> &cons_cpus) {
+    size_t bytes = (this->queue_size * sizeof(chunk_t) + PAGESIZE - 1) &
+                   ~(PAGESIZE - 1);
+    this->rings = (ring_t *)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, ncons * sizeof(ring_t));
+
+    for (auto c = 0u; c < ncons; c++) {
+      ring_t *ring = &this->rings[c];
+      ring->chunks =
+          (chunk_t *)utils::zero_aligned_alloc(PAGESIZE, bytes);
+      ring->mask = this->queue_size - 1;
+      for (auto i = 0u; i < this->queue_size; i++) {
+        ring->chunks[i].seq.store(i, std::memory_order_relaxed);
+      }
+
+      // the ring is written by everyone but read by its consumer
+      if (c < cons_cpus.size()) {
+        unsigned long nodemask = 1UL << numa_node_of_cpu(cons_cpus[c]);
+        if (mbind(ring->chunks, bytes, MPOL_BIND, &nodemask,
+                  sizeof(nodemask) * 8, MPOL_MF_MOVE) < 0) {
+          PLOGW.printf("mbind of inbound queue %u failed (errno %d)", c,
+                       errno);
+        }
+      }
+    }
+  }
+
+  void init_prod_queues() {
+    for (auto p = 0u; p < nprod; p++) {
+      all_pqueues[p] = (prod_queue_t *)utils::zero_aligned_alloc(
+          FIPC_CACHE_LINE_SIZE, ncons * sizeof(prod_queue_t));
+      for (auto c = 0u; c < ncons; c++) {
+        all_pqueues[p][c].ring = &this->rings[c];
+      }
+    }
+  }
+
+  void init_cons_queues() {
+    for (auto c = 0u; c < ncons; c++) {
+      all_cqueues[c] = (cons_queue_t *)utils::zero_aligned_alloc(
+          FIPC_CACHE_LINE_SIZE, nprod * sizeof(cons_queue_t));
+      for (auto p = 0u; p < nprod; p++) {
+        all_cqueues[c][p].ring = &this->rings[c];
+      }
+    }
+  }
+
+  /// Move the staged entries of `pq` into the next chunk of its ring,
+  /// spinning while the consumer has not freed that chunk yet.
+  inline void publish(prod_queue_t *pq) {
+    ring_t *ring = pq->ring;
+    uint64_t pos = ring->enq_pos.fetch_add(1, std::memory_order_relaxed);
+    chunk_t *chunk = &ring->chunks[pos & ring->mask];
+
+    while (chunk->seq.load(std::memory_order_acquire) != pos) {
+#ifdef CALC_STATS
+      ring->numEnqueueSpins++;
+#endif
+      asm volatile("pause");
+    }
+    copy_entries<false>(chunk->data, (const data_t *)pq->buf, pq->count);
+    chunk->count = pq->count;
+    chunk->seq.store(pos + 1, std::memory_order_release);
+    pq->count = 0;
+    if (this->doorbells) {
+      this->doorbells[ring - this->rings].ring();
+    }
+  }
+
+  /// Claim the next full chunk of the ring for `cq`.
+  inline bool claim(cons_queue_t *cq) {
+    ring_t *ring = cq->ring;
+    uint64_t pos = ring->deq_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      chunk_t *chunk = &ring->chunks[pos & ring->mask];
+      uint64_t seq = chunk->seq.load(std::memory_order_acquire);
+      if (seq != pos + 1) {
+        if (seq < pos + 1) {
+          // not filled yet
+#ifdef CALC_STATS
+          ring->numDequeueSpins++;
+#endif
+          return false;
+        }
+        // another cursor took it, catch up
+        pos = ring->deq_pos.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (ring->deq_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+        cq->chunk = chunk;
+        cq->pos = pos;
+        cq->idx = 0;
+        cq->count = chunk->count;
+        return true;
+      }
+    }
+  }
+
+  /// Hand the chunk of `cq` back to the producers for the next lap.
+  inline void release(cons_queue_t *cq) {
+    cq->chunk->seq.store(cq->pos + this->queue_size,
+                         std::memory_order_release);
+    cq->chunk = nullptr;
+  }
+
+ public:
+  /// `queue_size` is the number of chunks per producer, the ring of a
+  /// consumer gets room for all producers.
+  explicit MPMCQueue(uint32_t nprod, uint32_t ncons, size_t queue_size,
+                     NumaPolicyQueues *npq)
+      : MPMCQueue(nprod, ncons, queue_size,
+                  npq->get_assigned_cpu_list_consumers()) {}
+
+  /// The ring of consumer `c` is placed on the node of `cons_cpus[c]`.
+  explicit MPMCQueue(uint32_t nprod, uint32_t ncons, size_t queue_size,
+                     const std::vector<uint32_t> &cons_cpus) {
+    assert(queue_size > 0);
+    this->nprod = nprod;
+    this->ncons = ncons;
+    this->queue_size =
+        utils::next_pow2(std::max<size_t>(2, nprod * queue_size));
+
+    this->all_pqueues = (prod_queue_t **)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, nprod * sizeof(prod_queue_t *));
+    this->all_cqueues = (cons_queue_t **)utils::zero_aligned_alloc(
+        FIPC_CACHE_LINE_SIZE, ncons * sizeof(cons_queue_t *));
+
+    this->init_rings(cons_cpus);
+    this->init_prod_queues();
+    this->init_cons_queues();
+    PLOGV.printf("%u inbound queues of %zu chunks (%u entries each)", ncons,
+                 this->queue_size, CHUNK_ENTRIES);
+  }
+
+  inline int enqueue(prod_queue_t *pq, uint32_t p, uint32_t c, data_t value) {
+    pq->buf[pq->count++] = value;
+    if (pq->count == CHUNK_ENTRIES) {
+      this->publish(pq);
+    }
+    return SUCCESS;
+  }
+
+  /// Publish a partially filled chunk right away.
+  inline void flush(prod_queue_t *pq) {
+    if (pq->count > 0) {
+      this->publish(pq);
+    }
+  }
+
+  inline int dequeue(cons_queue_t *cq, uint32_t p, uint32_t c, data_t *value) {
+    if (!cq->chunk && !this->claim(cq)) {
+      return RETRY;
+    }
+    *value = cq->chunk->data[cq->idx++];
+    if (cq->idx == cq->count) {
+      this->release(cq);
+    }
+    return SUCCESS;
+  }
+
+  /// Whether `cq` has something to dequeue, without dequeuing it.
+  inline bool has_data(const cons_queue_t *cq, uint32_t p, uint32_t c) const {
+    if (cq->chunk) {
+      return true;
+    }
+    ring_t *ring = cq->ring;
+    uint64_t pos = ring->deq_pos.load(std::memory_order_relaxed);
+    return ring->chunks[pos & ring->mask].seq.load(
+               std::memory_order_acquire) == pos + 1;
+  }
+
+  /// See SectionQueue::enable_doorbells().
+  void enable_doorbells() {
+    if (!this->doorbells) {
+      this->doorbells = new Doorbell[this->ncons];
+    }
+  }
+
+  Doorbell *get_doorbell(uint32_t c) {
+    return this->doorbells ? &this->doorbells[c] : nullptr;
+  }
+
+  inline void prefetch(uint32_t p, uint32_t c, bool is_prod) {
+    if (is_prod) {
+      ring_t *ring = this->all_pqueues[p][c].ring;
+      __builtin_prefetch(
+          &ring->chunks[ring->enq_pos.load(std::memory_order_relaxed) &
+                        ring->mask],
+          1, 3);
+    } else {
+      cons_queue_t *cq = &this->all_cqueues[c][p];
+      if (!cq->chunk) {
+        ring_t *ring = cq->ring;
+        __builtin_prefetch(
+            &ring->chunks[ring->deq_pos.load(std::memory_order_relaxed) &
+                          ring->mask],
+            0, 3);
+      }
+    }
+  }
+
+  /// The end of the messages of producer `p` to consumer `c`. With a
+  /// shared ring, the consumer sees one of these per producer.
+  void push_done(uint32_t p, uint32_t c) {
+    prod_queue_t *pq = &this->all_pqueues[p][c];
+    this->enqueue(pq, p, c, BQ_MAGIC_KV);
+    this->flush(pq);
+  }
+
+  void pop_done(uint32_t p, uint32_t c) {}
+
+  void dump_stats(uint32_t p, uint32_t c) {
+#ifdef CALC_STATS
+    ring_t *ring = &this->rings[c];
+    printf("[%u][%u] enq spins %zu | deq spins %zu\n", p, c,
+           ring->numEnqueueSpins, ring->numDequeueSpins);
+#endif
+  }
+
+  ~MPMCQueue() {
+    for (auto p = 0u; p < nprod; p++) {
+      free(this->all_pqueues[p]);
+    }
+    for (auto c = 0u; c < ncons; c++) {
+      free(this->all_cqueues[c]);
+      free(this->rings[c].chunks);
+    }
+    free(this->rings);
+    delete[] this->doorbells;
+    free(this->all_pqueues);
+    free(this->all_cqueues);
+  }
+};
+
+}  // namespace kmercounter
@@ -3,14 +3,20 @@
 #include <assert.h>
 #include <numaif.h>
 
+#include <algorithm>
 #include <map>
 #include <numa.hpp>
+#include <span>
 #include <tuple>
+#include <vector>
 
+#include "bulk_copy.hpp"
 #include "helper.hpp"
 #include "queue.hpp"
 
 #include "../types.hpp"
+#include "../utils/hugepage_allocator.hpp"
+#include "../utils/poll_backoff.hpp"
 
 namespace kmercounter {
 
@@ -102,8 +108,15 @@ class SectionQueue {
   cons_queue_t **all_cqueues;
   pc_queue_t **all_pc_queues;
   static const uint64_t BQ_MAGIC_64BIT = 0xD221A6BE96E04673UL;
-  static const data_t BQ_MAGIC_KV;
+  static inline const data_t BQ_MAGIC_KV =
+      data_t(BQ_MAGIC_64BIT, BQ_MAGIC_64BIT);
   static const uint64_t SECTION_MASK = SECTION_SIZE - 1;
+#ifdef QUEUE_NT_STORES
+  /// enqueue_bulk() writes the queue with non-temporal stores
+  static constexpr bool NT_STORES = true;
+#else
+  static constexpr bool NT_STORES = false;
+#endif
 
   size_t queue_size;
 
@@ -118,6 +131,20 @@ class SectionQueue {
   std::map<std::tuple<int, int>, pc_queue_t *> pc_queue_map;
 
   queue_t ***queues;
+  /// Queue data of each node and its size, see init_data()
+  std::vector<std::pair<char *, size_t>> node_data;
+  queue_placement placement = QUEUE_ON_PRODUCER;
+  /// The queue data is backed by hugepages
+  bool hugepages = false;
+  /// One per consumer, see enable_doorbells()
+  Doorbell *doorbells = nullptr;
+  bool own_doorbells = false;
+
+  inline void ring(uint32_t c) {
+    if (this->doorbells) {
+      this->doorbells[c].ring();
+    }
+  }
 
   void init_prod_queues() {
     // map queues and producer_metadata
@@ -159,28 +186,30 @@ class SectionQueue {
     }
   }
 
-  void init_data(NumaPolicyQueues *npq) {
-    // auto qdata_sz = nprod * ncons * this->queue_size;
-    std::map<uint32_t, std::vector<uint32_t>> node_map;
-
-    auto get_current_node = [](uint32_t cpu) { return numa_node_of_cpu(cpu); };
+  /// Place every queue on the node picked by `placement`, one allocation
+  /// per node. `cons_cpus` is only needed with QUEUE_ON_CONSUMER.
+  void init_data(const std::vector<uint32_t> &prod_cpus,
+                 const std::vector<uint32_t> &cons_cpus) {
+    auto node_of_queue = [&](uint32_t p, uint32_t c) -> uint32_t {
+      if (this->placement == QUEUE_ON_CONSUMER) {
+        return numa_node_of_cpu(cons_cpus[c]);
+      }
+      return numa_node_of_cpu(prod_cpus[p]);
+    };
 
-    for (auto cpu : npq->get_assigned_cpu_list_producers()) {
-      auto cpu_node = get_current_node(cpu);
-      if (node_map.find(cpu_node) != node_map.end()) {
-        node_map[cpu_node].push_back(cpu);
-      } else {
-        node_map[cpu_node] = std::vector<uint32_t>();
-        node_map[cpu_node].push_back(cpu);
+    std::map<uint32_t, size_t> node_queues;
+    for (auto p = 0u; p < nprod; p++) {
+      for (auto c = 0u; c < ncons; c++) {
+        node_queues[node_of_queue(p, c)]++;
       }
     }
     std::ostringstream os;
-    for (auto nodes : node_map) {
-      os << "node " << nodes.first << "\n\t{ ";
-      for (auto cpu : nodes.second) {
-        os << cpu << ", ";
-      }
-      os << " }\n";
+    os << "queues on the " << (this->placement == QUEUE_ON_CONSUMER
+                                   ? "consumer"
+                                   : "producer")
+       << " nodes" << (this->hugepages ? " (hugepages)" : "") << "\n";
+    for (auto nodes : node_queues) {
+      os << "\tnode " << nodes.first << ": " << nodes.second << " queues\n";
     }
     PLOGI << os.str();
     std::map<uint32_t, char *> node_memmap;
@@ -198,23 +227,29 @@ class SectionQueue {
       return ret;
     };
 
-    for (auto nodes : node_map) {
-      auto num_queues_in_node = nodes.second.size() * ncons;
-      char *data = (char *)utils::zero_aligned_alloc(
-          1 << 21, this->queue_size * num_queues_in_node);
+    for (auto nodes : node_queues) {
+      size_t bytes = this->queue_size * nodes.second;
+      char *data;
+      if (this->hugepages) {
+        // mbind() wants whole hugepages, so cover the mapping the allocator
+        // rounds up to
+        huge_page_allocator<char> alloc;
+        bytes = alloc.get_rounded_alloc_size(bytes).second;
+        // not faulted in yet, so the mbind below decides where it lands
+        data = alloc.allocate(bytes);
+      } else {
+        data = (char *)utils::zero_aligned_alloc(1 << 21, bytes);
+      }
       node_memmap[nodes.first] = data;
-      mbind_buffer_local(data, this->queue_size * num_queues_in_node,
-                         nodes.first);
+      this->node_data.push_back(std::make_pair(data, bytes));
+      mbind_buffer_local(data, bytes, nodes.first);
     }
 
     for (auto p = 0u; p < nprod; p++) {
-      uint32_t node_for_prod =
-          get_current_node(npq->get_assigned_cpu_list_producers()[p]);
-      char *qdata = node_memmap[node_for_prod];
-      node_memmap[node_for_prod] = qdata + ncons * this->queue_size;
-
       for (auto c = 0u; c < ncons; c++) {
-        data_t *data = (data_t *)(qdata + c * this->queue_size);
+        uint32_t node = node_of_queue(p, c);
+        data_t *data = (data_t *)node_memmap[node];
+        node_memmap[node] += this->queue_size;
         auto it = pqueue_map.find(std::make_tuple(p, c));
         if (it != pqueue_map.end()) {
           prod_queue_t *pq = pqueue_map.at(std::make_tuple(p, c));
@@ -250,9 +285,31 @@ class SectionQueue {
   }
   void teardown_cons_queues() {
     for (auto c = 0u; c < ncons; c++) {
-      auto cq = this->all_cqueues[c];
-      free(cq->data);
+      free(this->all_cqueues[c]);
+    }
+  }
+
+  void teardown_pc_shared_queues() {
+    for (auto p = 0u; p < nprod; p++) {
+      free(this->all_pc_queues[p]);
+    }
+  }
+
+  void teardown_data() {
+    for (auto [data, bytes] : this->node_data) {
+      if (this->hugepages) {
+        huge_page_allocator<char>().deallocate(data, bytes);
+      } else {
+        free(data);
+      }
     }
+    for (auto p = 0u; p < nprod; p++) {
+      for (auto c = 0u; c < ncons; c++) {
+        delete this->queues[p][c];
+      }
+      free(this->queues[p]);
+    }
+    free(this->queues);
   }
 
  public:
@@ -271,10 +328,33 @@ class SectionQueue {
   }
 
   explicit SectionQueue(uint32_t nprod, uint32_t ncons, size_t num_sections,
-                        NumaPolicyQueues *npq) {
+                        NumaPolicyQueues *npq,
+                        queue_placement placement = QUEUE_ON_PRODUCER,
+                        bool hugepages = false)
+      : SectionQueue(nprod, ncons, num_sections,
+                     npq->get_assigned_cpu_list_producers(),
+                     npq->get_assigned_cpu_list_consumers(), placement,
+                     hugepages) {}
+
+  /// The queues of producer `p` are placed on the node of `prod_cpus[p]`.
+  explicit SectionQueue(uint32_t nprod, uint32_t ncons, size_t num_sections,
+                        const std::vector<uint32_t> &prod_cpus)
+      : SectionQueue(nprod, ncons, num_sections, prod_cpus, {},
+                     QUEUE_ON_PRODUCER, false) {}
+
+  /// The queue from producer `p` to consumer `c` is placed on the node of
+  /// `prod_cpus[p]` or `cons_cpus[c]`, as `placement` says. With
+  /// `hugepages`, the queue data is backed by 2MB pages.
+  explicit SectionQueue(uint32_t nprod, uint32_t ncons, size_t num_sections,
+                        const std::vector<uint32_t> &prod_cpus,
+                        const std::vector<uint32_t> &cons_cpus,
+                        queue_placement placement, bool hugepages) {
     printf("%s, numsections %zu\n", __func__, num_sections);
     assert((num_sections & (num_sections - 1)) == 0);
+    assert(placement != QUEUE_ON_CONSUMER || cons_cpus.size() >= ncons);
     this->num_sections = num_sections;
+    this->placement = placement;
+    this->hugepages = hugepages;
 
     this->queue_size = SECTION_SIZE * this->num_sections;
     this->section_size = this->queue_size / this->num_sections;
@@ -293,7 +373,7 @@ class SectionQueue {
     this->init_prod_queues();
     this->init_cons_queues();
     this->init_pc_shared_queues();
-    this->init_data(npq);
+    this->init_data(prod_cpus, cons_cpus);
 
     this->queues = (queue_t ***)calloc(1, nprod * sizeof(queue_t *));
     for (auto p = 0u; p < nprod; p++) {
@@ -340,11 +420,160 @@ class SectionQueue {
           asm volatile("pause");
         }
         pcq->enqSharedPtr = pq->enqPtr;
+        this->ring(c);
+      }
+    }
+    return SUCCESS;
+  }
+
+  /// Like enqueue(), but returns RETRY instead of spinning when the
+  /// consumer has not released the next section yet. Nothing is enqueued
+  /// then, so the caller can do something else and try again.
+  inline int try_enqueue(prod_queue_t *pq, uint32_t p, uint32_t c,
+                         data_t value) {
+    data_t *next = pq->enqPtr + 1;
+
+    if (((uint64_t)next & SECTION_MASK) == 0) {
+      if (next == pq->queue_end) {
+        next = pq->data;
       }
+
+      pc_queue_t *pcq = &all_pc_queues[p][c];
+      if (next == pq->deqLocalPtr) {
+        pq->deqLocalPtr = pcq->deqSharedPtr;
+        if (next == pq->deqLocalPtr) {
+#ifdef CALC_STATS
+          pcq->numEnqueueSpins++;
+#endif
+          return RETRY;
+        }
+      }
+      *pq->enqPtr = value;
+      pq->enqPtr = next;
+      pcq->enqSharedPtr = next;
+      this->ring(c);
+      return SUCCESS;
     }
+
+    *pq->enqPtr = value;
+    pq->enqPtr = next;
     return SUCCESS;
   }
 
+  /// Enqueue all of `values`. Unlike enqueue(), the section boundary is
+  /// checked once per copy instead of once per entry: the entries are copied
+  /// a cacheline at a time up to the end of the current section, which is
+  /// then published with a single store to `enqSharedPtr`. Spins like
+  /// enqueue() while the consumer has not released the next section.
+  inline size_t enqueue_bulk(prod_queue_t *pq, uint32_t p, uint32_t c,
+                             std::span<const data_t> values) {
+    const data_t *src = values.data();
+    size_t left = values.size();
+
+    while (left > 0) {
+      size_t room =
+          (SECTION_SIZE - ((uint64_t)pq->enqPtr & SECTION_MASK)) /
+          sizeof(data_t);
+      size_t n = std::min(left, room);
+      copy_entries<NT_STORES>(pq->enqPtr, src, n);
+      pq->enqPtr += n;
+      src += n;
+      left -= n;
+
+      if (n == room) {
+        if (pq->enqPtr == pq->queue_end) {
+          pq->enqPtr = pq->data;
+        }
+
+        pc_queue_t *pcq = &all_pc_queues[p][c];
+        while (pq->enqPtr == pq->deqLocalPtr) {
+          pq->deqLocalPtr = pcq->deqSharedPtr;
+#ifdef CALC_STATS
+          pcq->numEnqueueSpins++;
+#endif
+          asm volatile("pause");
+        }
+        if constexpr (NT_STORES) {
+          _mm_sfence();
+        }
+        pcq->enqSharedPtr = pq->enqPtr;
+        this->ring(c);
+      }
+    }
+    return values.size();
+  }
+
+  /// Dequeue up to `values.size()` entries, a section at a time. Returns
+  /// how many were dequeued, 0 if nothing has been published (where
+  /// dequeue() returns RETRY).
+  inline size_t dequeue_bulk(cons_queue_t *cq, uint32_t p, uint32_t c,
+                             std::span<data_t> values) {
+    data_t *dst = values.data();
+    size_t left = values.size();
+
+    while (left > 0) {
+      if (((uint64_t)cq->deqPtr & SECTION_MASK) == 0) {
+        if (cq->deqPtr == cq->queue_end) {
+          cq->deqPtr = cq->data;
+        }
+
+        pc_queue_t *pcq = &all_pc_queues[p][c];
+        pcq->deqSharedPtr = cq->deqPtr;
+        if (cq->deqPtr == cq->enqLocalPtr) {
+          cq->enqLocalPtr = pcq->enqSharedPtr;
+          if (cq->deqPtr == cq->enqLocalPtr) {
+#ifdef CALC_STATS
+            pcq->numDequeueSpins++;
+#endif
+            break;
+          }
+        }
+      }
+
+      size_t room =
+          (SECTION_SIZE - ((uint64_t)cq->deqPtr & SECTION_MASK)) /
+          sizeof(data_t);
+      size_t n = std::min(left, room);
+      copy_entries<false>(dst, (const data_t *)cq->deqPtr, n);
+      cq->deqPtr += n;
+      dst += n;
+      left -= n;
+    }
+    return values.size() - left;
+  }
+
+  /// Whether `cq` has something to dequeue, without dequeuing it.
+  inline bool has_data(const cons_queue_t *cq, uint32_t p, uint32_t c) const {
+    if (((uint64_t)cq->deqPtr & SECTION_MASK) != 0) {
+      return true;
+    }
+    data_t *next = cq->deqPtr == cq->queue_end ? cq->data : cq->deqPtr;
+    return all_pc_queues[p][c].enqSharedPtr != next;
+  }
+
+  /// From now on, producers ring the doorbell of consumer `c` whenever they
+  /// publish a section to it, so that an idle consumer can wait on the
+  /// doorbell instead of polling (see PollBackoff). Call before the
+  /// producers start. Several queues can share the `bells` of the caller
+  /// (ncons of them), so that a consumer waits on a single doorbell.
+  void enable_doorbells(Doorbell *bells = nullptr) {
+    if (this->doorbells) {
+      return;
+    }
+    this->own_doorbells = !bells;
+    this->doorbells = bells ? bells : new Doorbell[this->ncons];
+  }
+
+  Doorbell *get_doorbell(uint32_t c) {
+    return this->doorbells ? &this->doorbells[c] : nullptr;
+  }
+
+  /// Whether everything enqueued on `pq` has been published, i.e. the
+  /// producer is at the start of a section.
+  inline bool at_section_start(const prod_queue_t *pq) const {
+    return ((uint64_t)pq->enqPtr & SECTION_MASK) == 0;
+  }
+
   inline int dequeue(cons_queue_t *cq, uint32_t p, uint32_t c, data_t *value) {
     if (((uint64_t)cq->deqPtr & SECTION_MASK) == 0) {
       if (cq->deqPtr == cq->queue_end) {
@@ -354,13 +583,16 @@ class SectionQueue {
       {
         pc_queue_t *pcq = &all_pc_queues[p][c];
         pcq->deqSharedPtr = cq->deqPtr;
-        while (cq->deqPtr == cq->enqLocalPtr) {
+        // only empty if it still is after a fresh look at the producer, so
+        // that a RETRY means there was nothing to dequeue
+        if (cq->deqPtr == cq->enqLocalPtr) {
           cq->enqLocalPtr = pcq->enqSharedPtr;
+          if (cq->deqPtr == cq->enqLocalPtr) {
 #ifdef CALC_STATS
-          pcq->numDequeueSpins++;
+            pcq->numDequeueSpins++;
 #endif
-          // asm volatile("pause");
-          return RETRY;
+            return RETRY;
+          }
         }
       }
     }
@@ -415,6 +647,7 @@ class SectionQueue {
     auto pq = &this->all_pqueues[p][c];
     enqueue(pq, p, c, BQ_MAGIC_KV);
     pcq->enqSharedPtr = (data_t *)0xdeadbeef;
+    this->ring(c);
   }
 
   void pop_done(uint32_t p, uint32_t c) {
@@ -423,8 +656,16 @@ class SectionQueue {
   }
 
   ~SectionQueue() {
+    teardown_data();
     teardown_prod_queues();
     teardown_cons_queues();
+    teardown_pc_shared_queues();
+    free(this->all_pqueues);
+    free(this->all_cqueues);
+    free(this->all_pc_queues);
+    if (this->own_doorbells) {
+      delete[] this->doorbells;
+    }
   }
 };
 }  // namespace kmercounter
@@ -3,6 +3,7 @@
 
 #include <barrier>
 #include <functional>
+#include <vector>
 
 #include "hashtables/base_kht.hpp"
 #include "types.hpp"
@@ -20,6 +21,9 @@ class HashjoinTest {
   void join_relations_from_files(Shard *sh, const Configuration &config,
                                  BaseHashTable *ht,
                                  std::barrier<VoidFn> *barrier);
+  /// Set up the queues of the delegated join (DELEGATEDJOIN) before the
+  /// shards start. Shard `i` runs on `cpus[i]`.
+  void init_delegated_join(const std::vector<uint32_t> &cpus);
 };
 
 }  // namespace kmercounter
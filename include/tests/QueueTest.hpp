@@ -28,14 +28,25 @@ class QueueTest {
  public:
   const unsigned LYNX_QUEUE_SIZE = (1 << 12) * 8;
   const unsigned BQ_QUEUE_SIZE = 4096;
+  // chunks per producer in the inbound queue of a consumer
+  const unsigned MPMC_QUEUE_SIZE = 16;
   static const uint64_t BQ_MAGIC_64BIT = 0xD221A6BE96E04673UL;
 
   void run_find_test(Configuration *cfg, Numa *n, bool is_join, NumaPolicyQueues *npq);
 
+  /// Finds over the queues (--queued-finds): producers send their finds to
+  /// the consumer that owns the key and harvest the values from response
+  /// queues later, so the round trip is measured and not just the lookup.
+  void run_queued_find_test(Configuration *cfg, NumaPolicyQueues *npq);
+
   void run_test(Configuration *cfg, Numa *n, bool, NumaPolicyQueues *npq);
 
   void insert_with_queues(Configuration *cfg, Numa *n, bool is_join, NumaPolicyQueues *npq);
 
+  /// Messages/sec between one producer and one consumer for increasing
+  /// enqueue_bulk/dequeue_bulk sizes, against plain enqueue/dequeue.
+  void run_bulk_test(Configuration *cfg, NumaPolicyQueues *npq);
+
   void producer_thread(const uint32_t tid, const uint32_t n_prod,
                        const uint32_t n_cons, const bool main_thread,
                        const double skew,
@@ -52,6 +63,10 @@ class QueueTest {
                        std::barrier<std::function<void()>>* barrier);
 
   void init_queues(uint32_t nprod, uint32_t ncons);
+
+  /// The producer CPUs in shard order. The producer on CPU 0 runs on the
+  /// main thread and takes the last producer shard, see insert_with_queues().
+  std::vector<uint32_t> get_producer_cpus();
 };
 
 }  // namespace kmercounter
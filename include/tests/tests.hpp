@@ -18,14 +18,16 @@ namespace kmercounter {
 class LynxQueue;
 class BQueueAligned;
 class SectionQueue;
+class MPMCQueue;
 
 class Tests {
  public:
   SynthTest st;
   PrefetchTest pt;
   //QueueTest<kmercounter::BQueueAligned> qt;
-  // QueueTest<kmercounter::LynxQueue> qt;
   QueueTest<kmercounter::SectionQueue> qt;
+  QueueTest<kmercounter::MPMCQueue> inbound_qt;
+  QueueTest<kmercounter::LynxQueue> lynx_qt;
   CacheMissTest cmt;
   ZipfianTest zipf;
   KmerTest kmer;
@@ -56,7 +56,7 @@ extern BQUEUE_LOAD bq_load;
 #endif
 
 // XXX: If you add/modify a mode, update the `run_mode_strings` in
-// src/Application.cpp
+// src/types.cpp
 typedef enum {
   DRY_RUN = 1,
   READ_FROM_DISK = 2,
@@ -75,6 +75,7 @@ typedef enum {
   BW = 15,
   PARTITIONJOINV1 = 16,
   PARTITIONJOINV2 = 17,
+  DELEGATEDJOIN = 18,
 } run_mode_t;
 
 // XXX: If you add/modify a mode, update the `ht_type_strings` in
@@ -91,8 +92,20 @@ typedef enum {
   TBB_HT = 9,
   DLHT_HT = 10,
   FOLKLORE_HT = 11,
+  DELEGATED_HT = 12,
+  HYBRID_HT = 13,
 } ht_type_t;
 
+// How FASTQ_WITH_INSERT reads its input
+typedef enum {
+  // copy the sequences out of an ifstream before counting
+  PRELOAD_READER = 0,
+  // map the file and keep views of the sequences
+  MMAP_READER = 1,
+  // stream chunks through io_uring while counting (IO_URING builds)
+  URING_READER = 2,
+} in_file_reader_t;
+
 extern const char* run_mode_strings[];
 extern const char* ht_type_strings[];
 
@@ -112,7 +125,21 @@ struct Configuration {
   std::string ht_file;
   std::string in_file;
   uint64_t in_file_sz;
+  // k-mer counting: how the input file is read, see in_file_reader_t
+  uint32_t in_file_reader;
+  // io_uring reader: bytes per read, buffers per thread, O_DIRECT
+  uint32_t uring_chunk_size;
+  uint32_t uring_depth;
+  bool uring_direct;
+  // gzip/BGZF/zstd input: decompression threads and buffers per thread
+  uint32_t decompress_threads;
+  uint32_t decompress_depth;
   uint32_t K;
+  // k-mer counting: count the smaller of a k-mer and its reverse complement
+  bool canonical;
+  // k-mer counting with the delegated table: send runs of k-mers to the
+  // partition of their minimizer of this length, 0 = every k-mer by its hash
+  uint32_t minimizer_len;
 
   // number of threads
   uint32_t num_threads;
@@ -177,8 +204,42 @@ struct Configuration {
   std::string delimitor;
 
   bool rw_queues;
+  // measure enqueue_bulk/dequeue_bulk instead of the queue tests (mode 8)
+  bool queue_bulk_test;
+  // one MPMC inbound queue per consumer instead of the SPSC mesh (mode 8)
+  bool inbound_queues;
+  // Lynx queues (section handoff, no per-entry checks) instead (mode 8)
+  bool lynx_queues;
+  // idle queue consumers back off to umwait/futex sleep instead of polling
+  bool consumer_backoff;
+  // finds in flight per producer over request/response queues, 0 = finds
+  // go to the partitions directly (mode 8, power of two)
+  uint32_t queued_finds;
+  // node of the queue data: 0 = producer's, 1 = consumer's (section queues)
+  uint32_t queue_placement;
+  // back the queue data with hugepages (section queues)
+  bool queue_hugepages;
   unsigned pollute_ratio;
   uint32_t find_queue_sz;
+  // tune queue depth and prefetch distance at runtime (zipfian/uniform)
+  bool adaptive_prefetch;
+  // probes in flight of the coroutine engine, 0 = queue engine (zipfian)
+  uint32_t coro_group;
+  // copy the table to every numa node before the finds (zipfian/uniform)
+  bool replicate_ht;
+  // bind each partition of the partitioned table to its owner's numa node
+  bool local_partitions;
+  // sections per queue of the delegated table (power of two)
+  uint32_t delegation_sections;
+  // hybrid table: sketch count at which a key is hot (1-255)
+  uint32_t hot_threshold;
+  // hybrid table: slots of the per-thread hot key table (power of two, >= 2)
+  uint32_t hot_slots;
+  // hybrid table: inserts between two flushes of the combined hot keys
+  uint32_t hot_flush_interval;
+  // k-mer counting: slots of the per-thread combining table (power of two),
+  // 0 = every k-mer goes to the hashtable
+  uint32_t combine_slots;
   std::string perf_cnt_path;
   std::string perf_def_path;
   bool test;
@@ -198,16 +259,42 @@ struct Configuration {
     printf("  ht_type %u - %s\n", ht_type, ht_type_strings[ht_type]);
     printf("  ht_size %" PRIu64 " (%" PRIu64 " GiB)\n", ht_size,
            (ht_size * (KEY_SIZE+VALUE_SIZE)  ) / (1024*1024*1024)); // elements*KVsize/ GiB (in bytes)
-    printf("  K %" PRIu32 "\n", K);
+    printf("  K %" PRIu32 "%s\n", K, canonical ? " (canonical)" : "");
+    printf("  minimizer length %u\n", minimizer_len);
     printf("  P(read) %f\n", pread);
     printf("  Pollution Ratio %u\n", pollute_ratio);
     printf("BQUEUES:\n  n_prod %u | n_cons %u\n", n_prod, n_cons);
+    printf("  inbound queues %s\n", inbound_queues ? "enabled" : "disabled");
+    printf("  lynx queues %s\n", lynx_queues ? "enabled" : "disabled");
+    printf("  consumer backoff %s\n",
+           consumer_backoff ? "enabled" : "disabled");
+    printf("  queued finds %u\n", queued_finds);
+    printf("  queue placement %s%s\n",
+           queue_placement ? "consumer node" : "producer node",
+           queue_hugepages ? ", hugepages" : "");
     printf("  ht_fill %u\n", ht_fill);
     printf("ZIPFIAN:\n  skew: %f\n  seed: %ld\n", skew, seed);
     printf("  HW prefetchers %s\n", hwprefetchers ? "enabled" : "disabled");
     printf("  SW prefetch engine %s\n", no_prefetch ? "disabled" : "enabled");
     printf("  Run both %s\n", run_both ? "enabled" : "disabled");
     printf("  batch length %u\n", batch_len);
+    printf("  adaptive prefetch %s\n",
+           adaptive_prefetch ? "enabled" : "disabled");
+    printf("  coroutine group %u\n", coro_group);
+    printf("  replicated table %s\n", replicate_ht ? "enabled" : "disabled");
+    printf("  local partitions %s\n", local_partitions ? "enabled" : "disabled");
+    printf("  delegation sections %u\n", delegation_sections);
+    printf("  hot keys: threshold %u | slots %u | flush interval %u\n",
+           hot_threshold, hot_slots, hot_flush_interval);
+    printf("  combine slots %u\n", combine_slots);
+    printf("  input reader %u", in_file_reader);
+    if (in_file_reader == URING_READER) {
+      printf(" (chunk %u, depth %u%s)", uring_chunk_size, uring_depth,
+             uring_direct ? ", O_DIRECT" : "");
+    }
+    printf("\n");
+    printf("  decompression: threads %u | depth %u\n", decompress_threads,
+           decompress_depth);
     printf("  relation_r %s\n", relation_r.c_str());
     printf("  relation_s %s\n", relation_r.c_str());
     printf("  relation_r_size %" PRIu64 "\n", relation_r_size);
@@ -372,6 +459,8 @@ enum class ExecPhase {
   recording,
   none,
   free_global_zipfian_values,
+  // the barrier of use_local_replica(), not a phase to time or count
+  replication,
 };
 // Can be use for, let's say, cleanup functions.
 using VoidFn = std::function<void()>;
@@ -0,0 +1,227 @@
+#ifndef UTILS_CORO_EXECUTOR_HPP
+#define UTILS_CORO_EXECUTOR_HPP
+
+#include <array>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <utility>
+
+namespace kmercounter {
+
+/// Interleaved execution of hashtable probes (AMAC / CoroBase style).
+/// Instead of a hand-written state machine, every operation is a coroutine
+/// with straight-line probe code that `co_await`s `prefetch_line()` before
+/// touching a bucket. The `CoroExecutor` keeps a group of such coroutines in
+/// flight and resumes them round-robin, so that by the time an operation
+/// runs again its cacheline has (hopefully) arrived:
+///
+///   ProbeTask find(uint64_t key, ...) {
+///     size_t idx = home_slot(key);
+///     for (;;) {
+///       co_await prefetch_line(&table[idx], false);
+///       ... compare the bucket, co_return when done ...
+///     }
+///   }
+
+/// Recycles the coroutine frames of a thread. A probe allocates one frame
+/// per operation and they all have the same size, so a free list per 64B
+/// size class avoids going to malloc on the fast path.
+class CoroFramePool {
+ public:
+  constexpr static size_t CLASS_SIZE = 64;
+  constexpr static size_t NUM_CLASSES = 16;
+
+  static void *alloc(size_t sz) {
+    size_t c = size_class(sz);
+    if (c < NUM_CLASSES) {
+      FreeLists &lists = free_lists();
+      FreeFrame *f = lists.heads[c];
+      if (f) {
+        lists.heads[c] = f->next;
+        return f;
+      }
+    }
+    void *p = aligned_alloc(CLASS_SIZE, (c + 1) * CLASS_SIZE);
+    if (!p) {
+      std::terminate();
+    }
+    return p;
+  }
+
+  static void free(void *p, size_t sz) {
+    size_t c = size_class(sz);
+    if (c >= NUM_CLASSES) {
+      std::free(p);
+      return;
+    }
+    FreeLists &lists = free_lists();
+    FreeFrame *f = static_cast<FreeFrame *>(p);
+    f->next = lists.heads[c];
+    lists.heads[c] = f;
+  }
+
+ private:
+  struct FreeFrame {
+    FreeFrame *next;
+  };
+
+  struct FreeLists {
+    FreeFrame *heads[NUM_CLASSES] = {};
+
+    ~FreeLists() {
+      for (FreeFrame *&head : heads) {
+        while (head) {
+          FreeFrame *next = head->next;
+          std::free(head);
+          head = next;
+        }
+      }
+    }
+  };
+
+  static FreeLists &free_lists() {
+    static thread_local FreeLists lists;
+    return lists;
+  }
+
+  static size_t size_class(size_t sz) {
+    return (sz + CLASS_SIZE - 1) / CLASS_SIZE - 1;
+  }
+};
+
+/// A single probe. It starts running as soon as it is created, up to its
+/// first suspension point, and keeps its frame after finishing until the
+/// owner destroys it.
+class ProbeTask {
+ public:
+  struct promise_type {
+    ProbeTask get_return_object() {
+      return ProbeTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void *operator new(size_t sz) { return CoroFramePool::alloc(sz); }
+    static void operator delete(void *p, size_t sz) {
+      CoroFramePool::free(p, sz);
+    }
+  };
+
+  ProbeTask() = default;
+  ProbeTask(const ProbeTask &) = delete;
+  ProbeTask(ProbeTask &&other) noexcept
+      : handle(std::exchange(other.handle, {})) {}
+
+  ProbeTask &operator=(ProbeTask &&other) noexcept {
+    if (this != &other) {
+      this->reset();
+      this->handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+
+  ~ProbeTask() { this->reset(); }
+
+  inline bool done() const { return this->handle.done(); }
+  inline void resume() { this->handle.resume(); }
+
+  void reset() {
+    if (this->handle) {
+      this->handle.destroy();
+      this->handle = {};
+    }
+  }
+
+ private:
+  explicit ProbeTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+/// Issue a prefetch and yield to the next probe of the group.
+struct PrefetchAwaiter {
+  const void *addr;
+  bool write;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<>) const noexcept {
+    if (this->write) {
+      __builtin_prefetch(this->addr, true, 3);
+    } else {
+      __builtin_prefetch(this->addr, false, 3);
+    }
+  }
+  void await_resume() const noexcept {}
+};
+
+inline PrefetchAwaiter prefetch_line(const void *addr, bool write) {
+  return PrefetchAwaiter{addr, write};
+}
+
+/// Runs the probes of a batch, `group` of them at a time. One executor per
+/// thread, like the hashtables.
+class CoroExecutor {
+ public:
+  constexpr static uint32_t MAX_GROUP = 64;
+
+  explicit CoroExecutor(uint32_t group) : group(1) { this->set_group(group); }
+
+  /// Number of probes in flight, 1 to MAX_GROUP.
+  bool set_group(uint32_t n) {
+    if (n == 0 || n > MAX_GROUP) {
+      return false;
+    }
+    this->group = n;
+    return true;
+  }
+
+  uint32_t get_group() const { return this->group; }
+
+  /// Run `spawn(i)` for every i in [0, n), which has to return the
+  /// `ProbeTask` of the i-th operation. Returns once all of them finished.
+  template <typename Spawn>
+  void run(size_t n, Spawn &&spawn) {
+    size_t next = 0;
+    uint32_t live = 0;
+    for (; live < this->group && next < n; live++) {
+      this->slots[live] = spawn(next++);
+    }
+
+    while (live > 0) {
+      for (uint32_t i = 0; i < live;) {
+        ProbeTask &task = this->slots[i];
+        if (!task.done()) {
+          task.resume();
+        }
+        if (!task.done()) {
+          i++;
+        } else if (next < n) {
+          // a new probe takes over the slot, it already issued its
+          // prefetch and runs again in the next round
+          task = spawn(next++);
+          i++;
+        } else {
+          // shrink the group, the last probe moves into this slot
+          live--;
+          if (i != live) {
+            task = std::move(this->slots[live]);
+          } else {
+            task.reset();
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  uint32_t group;
+  std::array<ProbeTask, MAX_GROUP> slots;
+};
+
+}  // namespace kmercounter
+#endif  // UTILS_CORO_EXECUTOR_HPP
@@ -0,0 +1,168 @@
+#ifndef UTILS_POLL_BACKOFF_HPP
+#define UTILS_POLL_BACKOFF_HPP
+
+#include <cpuid.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+namespace kmercounter {
+
+/// Wakes up a consumer that went idle. Producers call `ring()` after they
+/// published something to the consumer (a section, a chunk); it costs a
+/// fence and a read of a mostly shared line as long as nobody waits.
+struct alignas(64) Doorbell {
+  /// Bumped on every ring with a waiter, doubles as the futex word.
+  std::atomic<uint32_t> seq{0};
+  /// Consumers in umwait or futex wait.
+  std::atomic<uint32_t> waiters{0};
+  /// Consumers in futex wait.
+  std::atomic<uint32_t> sleepers{0};
+
+  inline void ring() {
+    // order the publish before reading `waiters`, see PollBackoff::wait()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->waiters.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    this->seq.fetch_add(1, std::memory_order_seq_cst);
+    if (this->sleepers.load(std::memory_order_seq_cst) > 0) {
+      syscall(SYS_futex, (uint32_t *)&this->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+              nullptr, nullptr, 0);
+    }
+  }
+};
+
+/// Adaptive backoff of a consumer whose queues are all empty. Consecutive
+/// empty poll rounds escalate from `pause` loops (doubling up to
+/// MAX_PAUSES), to umonitor/umwait on the doorbell where the CPU has
+/// WAITPKG, to a futex sleep on the doorbell. A ring of the doorbell ends
+/// the umwait or the sleep within microseconds; the sleep also times out
+/// after SLEEP_NS, so producers that never ring are still picked up. The
+/// first round that finds work resets the backoff.
+class PollBackoff {
+ public:
+  constexpr static uint32_t SPIN_ROUNDS = 16;
+  constexpr static uint32_t WAIT_ROUNDS = 64;
+  constexpr static uint32_t MAX_PAUSES = 64;
+  /// Upper bound of a single umwait, ~20us.
+  constexpr static uint64_t WAIT_TICKS = CPUFREQ_MHZ * 20ULL;
+  constexpr static long SLEEP_NS = 1000000;
+
+  struct Stats {
+    uint64_t polls;
+    uint64_t misses;
+    uint64_t pauses;
+    uint64_t umwaits;
+    uint64_t sleeps;
+  };
+
+  explicit PollBackoff(Doorbell *bell)
+      : bell(bell), level(0), stats{}, umwait(waitpkg_usable()) {}
+
+  /// The last poll round found work.
+  inline void hit() {
+    this->stats.polls++;
+    this->level = 0;
+  }
+
+  /// The last poll round found all queues empty. `has_work()` has to check
+  /// the queues again without dequeuing anything.
+  template <typename HasWork>
+  inline void miss(HasWork &&has_work) {
+    this->stats.polls++;
+    this->stats.misses++;
+    if (this->level < SPIN_ROUNDS) {
+      uint32_t pauses = std::min(1u << this->level, MAX_PAUSES);
+      for (uint32_t i = 0; i < pauses; i++) {
+        _mm_pause();
+      }
+      this->stats.pauses += pauses;
+    } else if (!this->bell) {
+      for (uint32_t i = 0; i < MAX_PAUSES; i++) {
+        _mm_pause();
+      }
+      this->stats.pauses += MAX_PAUSES;
+    } else if (this->level < SPIN_ROUNDS + WAIT_ROUNDS && this->umwait) {
+      this->wait(has_work, false);
+    } else {
+      this->wait(has_work, true);
+    }
+    if (this->level < SPIN_ROUNDS + WAIT_ROUNDS) {
+      this->level++;
+    }
+  }
+
+  const Stats &get_stats() const { return this->stats; }
+
+  /// Fraction of the poll rounds that found nothing.
+  double miss_ratio() const {
+    return this->stats.polls ? (double)this->stats.misses / this->stats.polls
+                             : 0.0;
+  }
+
+ private:
+  Doorbell *bell;
+  uint32_t level;
+  Stats stats;
+  bool umwait;
+
+  /// Built with WAITPKG (-march=native on a CPU that has it) and running
+  /// on such a CPU.
+  static bool waitpkg_usable() {
+#ifdef __WAITPKG__
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return ecx & (1u << 5);
+#else
+    return false;
+#endif
+  }
+
+  /// Register as a waiter before checking the queues one last time, so
+  /// that a producer either sees us and rings, or we see its data.
+  template <typename HasWork>
+  void wait(HasWork &&has_work, bool sleep) {
+    Doorbell *b = this->bell;
+    b->waiters.fetch_add(1, std::memory_order_seq_cst);
+    if (sleep) {
+      b->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    }
+    uint32_t seq = b->seq.load(std::memory_order_seq_cst);
+
+    if (!has_work()) {
+      if (sleep) {
+        struct timespec timeout = {0, SLEEP_NS};
+        syscall(SYS_futex, (uint32_t *)&b->seq, FUTEX_WAIT_PRIVATE, seq,
+                &timeout, nullptr, 0);
+        this->stats.sleeps++;
+      } else {
+#ifdef __WAITPKG__
+        _umonitor((void *)&b->seq);
+        if (b->seq.load(std::memory_order_relaxed) == seq) {
+          // C0.2, the deeper of the two states
+          _umwait(0, __rdtsc() + WAIT_TICKS);
+        }
+#endif
+        this->stats.umwaits++;
+      }
+    }
+
+    if (sleep) {
+      b->sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+    b->waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+};
+
+}  // namespace kmercounter
+#endif  // UTILS_POLL_BACKOFF_HPP
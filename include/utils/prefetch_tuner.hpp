@@ -0,0 +1,178 @@
+#ifndef UTILS_PREFETCH_TUNER_HPP
+#define UTILS_PREFETCH_TUNER_HPP
+
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "hashtables/base_kht.hpp"
+#include "plog/Log.h"
+#include "types.hpp"
+
+namespace kmercounter {
+
+/// Per-thread controller for the queue depth and prefetch distance of a
+/// batched hashtable pipeline (see `BaseHashTable::set_queue_params`).
+/// The best values depend on the memory the table lives in (local, remote
+/// socket, HBM), so instead of fixing them at compile time, the tuner
+/// measures the cycles per operation over epochs of `EPOCH_BATCHES` batches
+/// and hill-climbs over powers of two: it tries one neighbour of the current
+/// setting per epoch (depth or distance doubled or halved) and moves there
+/// if it is at least `MIN_GAIN` faster. Once no neighbour is faster it
+/// settles, and starts searching again if the cost drifts by more than
+/// `DRIFT`.
+class PrefetchTuner {
+ public:
+  constexpr static uint32_t EPOCH_BATCHES = 64;
+  /// Batches ignored after a change, while the queue adapts to it.
+  constexpr static uint32_t WARMUP_BATCHES = 4;
+  constexpr static double MIN_GAIN = 0.03;
+  constexpr static double DRIFT = 0.15;
+  constexpr static uint32_t MIN_DEPTH_LOG = 2;
+
+  PrefetchTuner(BaseHashTable *ht, QueueType qtype, uint32_t max_depth)
+      : ht(ht),
+        qtype(qtype),
+        max_depth_log(log2(max_depth)),
+        state(State::Measure),
+        next_neighbour(0),
+        best_cost(0),
+        moves(0),
+        warmup(0),
+        last_tsc(0),
+        cycles(0),
+        ops(0),
+        batches(0) {
+    this->current.depth_log = this->max_depth_log;
+    this->current.dist_log =
+        std::min<uint32_t>(3, this->max_depth_log - 1);  // 8, as in casht++
+    this->enabled = this->max_depth_log >= MIN_DEPTH_LOG &&
+                    this->apply(this->current);
+    if (!this->enabled) {
+      PLOGW.printf("hashtable has no tunable %s queue",
+                   qtype == QueueType::insert_queue ? "insert" : "find");
+    }
+  }
+
+  /// Account a batch of `num_ops` operations, call after every batch.
+  inline void tick(uint64_t num_ops) {
+    uint64_t now = __rdtsc();
+    uint64_t prev = this->last_tsc;
+    this->last_tsc = now;
+    if (!this->enabled || prev == 0) {
+      return;
+    }
+    if (this->warmup > 0) {
+      this->warmup--;
+      return;
+    }
+    this->cycles += now - prev;
+    this->ops += num_ops;
+    if (++this->batches == EPOCH_BATCHES) {
+      double cost = this->ops ? (double)this->cycles / this->ops : 0;
+      this->cycles = this->ops = this->batches = 0;
+      this->end_epoch(cost);
+    }
+  }
+
+  /// Call when the thread did something else since the last batch, so that
+  /// the gap is not accounted to the next one.
+  inline void pause() { this->last_tsc = 0; }
+
+  uint32_t get_depth() const { return 1u << this->current.depth_log; }
+  uint32_t get_distance() const { return 1u << this->current.dist_log; }
+  /// Cycles per operation of the current setting.
+  double get_cost() const { return this->best_cost; }
+  uint32_t get_moves() const { return this->moves; }
+  bool is_settled() const { return this->state == State::Settled; }
+
+ private:
+  struct Params {
+    uint32_t depth_log;
+    uint32_t dist_log;
+  };
+
+  enum class State { Measure, Try, Settled };
+
+  BaseHashTable *ht;
+  QueueType qtype;
+  uint32_t max_depth_log;
+  bool enabled;
+  State state;
+  Params current;
+  Params trial;
+  uint32_t next_neighbour;
+  double best_cost;
+  uint32_t moves;
+  uint32_t warmup;
+  uint64_t last_tsc;
+  uint64_t cycles;
+  uint64_t ops;
+  uint32_t batches;
+
+  static uint32_t log2(uint32_t x) { return x ? 31 - __builtin_clz(x) : 0; }
+
+  bool apply(Params p) {
+    this->warmup = WARMUP_BATCHES;
+    return this->ht->set_queue_params(this->qtype, 1u << p.depth_log,
+                                      1u << p.dist_log);
+  }
+
+  bool valid(Params p) const {
+    return p.depth_log >= MIN_DEPTH_LOG && p.depth_log <= this->max_depth_log &&
+           p.dist_log < p.depth_log;
+  }
+
+  /// Apply the next untried neighbour of `current`, or settle.
+  void try_next() {
+    const int steps[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    for (; this->next_neighbour < 4; this->next_neighbour++) {
+      Params p{
+          (uint32_t)(this->current.depth_log + steps[this->next_neighbour][0]),
+          (uint32_t)(this->current.dist_log + steps[this->next_neighbour][1])};
+      if (this->valid(p) && this->apply(p)) {
+        this->trial = p;
+        this->state = State::Try;
+        return;
+      }
+    }
+    this->apply(this->current);
+    this->state = State::Settled;
+    PLOGV.printf("%s queue settled at depth %u distance %u, %.1f cycles/op",
+                 this->qtype == QueueType::insert_queue ? "insert" : "find",
+                 this->get_depth(), this->get_distance(), this->best_cost);
+  }
+
+  void end_epoch(double cost) {
+    switch (this->state) {
+      case State::Measure:
+        this->best_cost = cost;
+        this->next_neighbour = 0;
+        this->try_next();
+        break;
+      case State::Try:
+        if (cost < this->best_cost * (1 - MIN_GAIN)) {
+          this->current = this->trial;
+          this->best_cost = cost;
+          this->moves++;
+          this->next_neighbour = 0;
+        } else {
+          this->next_neighbour++;
+        }
+        this->try_next();
+        break;
+      case State::Settled:
+        if (cost > this->best_cost * (1 + DRIFT) ||
+            cost < this->best_cost * (1 - DRIFT)) {
+          // the workload or the memory changed, measure again
+          this->state = State::Measure;
+          this->end_epoch(cost);
+        }
+        break;
+    }
+  }
+};
+
+}  // namespace kmercounter
+#endif  // UTILS_PREFETCH_TUNER_HPP
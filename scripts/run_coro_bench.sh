@@ -0,0 +1,17 @@
+#!/usr/bin/env bash
+# Compare the casht++ queue engine with the coroutine engine (--coro-group)
+# on the zipfian insert/find test.
+# usage: ./scripts/run_coro_bench.sh [dramhit binary] [threads] [skew]
+
+DRAMHIT_BIN=${1:-"./build/dramhit"}
+THREADS=${2:-64}
+SKEW=${3:-0.01}
+LOG_DIR="coro_logs"
+
+mkdir -p ${LOG_DIR}
+
+${DRAMHIT_BIN} --ht-type=3 --mode=14 --ht-fill=75 --num-threads=${THREADS} --skew=${SKEW} |& tee "${LOG_DIR}/queue_t${THREADS}_s${SKEW}.log"
+
+for group in 4 8 16 32 64; do
+  ${DRAMHIT_BIN} --ht-type=3 --mode=14 --ht-fill=75 --num-threads=${THREADS} --skew=${SKEW} --coro-group=${group} |& tee "${LOG_DIR}/coro${group}_t${THREADS}_s${SKEW}.log"
+done
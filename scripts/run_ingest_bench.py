@@ -0,0 +1,93 @@
+#!/bin/python3
+
+# Runs k-mer counting (--mode=4) with every input reader, once with a warm
+# page cache and once after dropping it, and reports the ingest rate: the
+# size of the input over the time of the slowest thread, from opening the
+# file to its last insert.
+#
+#   ./run_ingest_bench.py --build_dir ../build --in_file reads.fq --threads 32
+#
+# The io_uring reader needs a build with -DIO_URING=ON. Dropping the page
+# cache needs sudo.
+
+import argparse
+import os
+import pathlib
+import re
+import subprocess
+import sys
+
+READERS = {
+    0: 'preload',
+    1: 'mmap',
+    2: 'io_uring',
+}
+
+def get_ingest_seconds(text: str):
+    times = [float(m) for m in re.findall(r'\[ingest:\d+\] k-mers \d+ in ([0-9.]+) s', text)]
+    return max(times) if times else 0.0
+
+def run_one(args: argparse.Namespace, reader: int, direct: bool, cold: bool):
+    dramhit_args = ['--mode=4', f'--in-file={args.in_file}', f'--num-threads={args.threads}',
+                    f'--ht-type={args.ht_type}', f'--in-file-reader={reader}',
+                    f'--drop-caches={int(cold)}']
+    if args.ht_size:
+        dramhit_args += [f'--ht-size={args.ht_size}']
+    if args.K:
+        dramhit_args += [f'--k={args.K}']
+    if reader == 2:
+        dramhit_args += [f'--uring-chunk-size={args.chunk_size}', f'--uring-depth={args.depth}',
+                         f'--uring-direct={int(direct)}']
+
+    command = ['./dramhit'] + dramhit_args
+    print(f'Running {" ".join(command)}', flush=True)
+    run = subprocess.run(command, cwd=args.build_dir, capture_output=True, text=True)
+
+    name = f'{READERS[reader]}{"-direct" if direct else ""}-{"cold" if cold else "warm"}'
+    logfile = args.log_dir.joinpath(f'{name}.log')
+    with open(logfile, 'w') as log:
+        log.write(run.stdout)
+        log.write(run.stderr)
+    if run.returncode != 0:
+        print(f'exit status: {run.returncode}, see {logfile}')
+        sys.exit(1)
+    return get_ingest_seconds(run.stdout + run.stderr)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compare the ingest rate of the input readers')
+    parser.add_argument('--build_dir', type=pathlib.Path, required=True, help='Directory with the dramhit binary')
+    parser.add_argument('--log_dir', type=pathlib.Path, default=pathlib.Path('ingest'), help='Where logs and summary.csv go')
+    parser.add_argument('--in_file', type=pathlib.Path, required=True, help='FASTQ input')
+    parser.add_argument('--threads', type=int, required=True)
+    parser.add_argument('--ht_type', type=int, default=3, help='Hashtable type')
+    parser.add_argument('--ht_size', type=int, help='Size of the hashtable')
+    parser.add_argument('--K', type=int, help='k-mer length')
+    parser.add_argument('--chunk_size', type=int, default=4 << 20, help='io_uring bytes per read')
+    parser.add_argument('--depth', type=int, default=3, help='io_uring buffers per thread')
+    parser.add_argument('--readers', type=int, nargs='*', default=list(READERS), help='Readers to run')
+
+    args = parser.parse_args()
+    args.build_dir = args.build_dir.resolve()
+    args.in_file = args.in_file.resolve()
+    args.log_dir = args.log_dir.resolve()
+    args.log_dir.mkdir(parents=True, exist_ok=True)
+    size = os.path.getsize(args.in_file)
+
+    runs = []
+    for reader in args.readers:
+        runs.append((reader, False))
+        if reader == 2:
+            runs.append((reader, True))
+
+    with open(args.log_dir.joinpath('summary.csv'), 'w') as csv:
+        header = 'reader, o_direct, page cache, seconds, GB/s'
+        print(header)
+        csv.write(header + '\n')
+        for reader, direct in runs:
+            for cold in [False, True]:
+                seconds = run_one(args, reader, direct, cold)
+                gbps = size / seconds / 1e9 if seconds else 0.0
+                line = f'{READERS[reader]}, {int(direct)}, {"cold" if cold else "warm"}, ' \
+                       f'{seconds:.3f}, {gbps:.3f}'
+                print(line, flush=True)
+                csv.write(line + '\n')
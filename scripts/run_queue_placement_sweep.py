@@ -0,0 +1,126 @@
+#!/bin/python3
+
+# Runs the queue test (--mode=8) under every producer/consumer NUMA policy
+# and queue placement, and reports the throughput next to the cross-socket
+# traffic that perf counted for the run.
+#
+#   ./run_queue_placement_sweep.py --build_dir ../build --nprod 16 --ncons 16
+
+import argparse
+import os
+import pathlib
+import re
+import subprocess
+import sys
+
+NUMA_SPLITS = {
+    1: 'sequential',
+    2: 'separate-nodes',
+    3: 'equal-partition',
+}
+
+PLACEMENTS = {
+    0: 'producer',
+    1: 'consumer',
+}
+
+# local vs. remote DRAM/cache accesses as seen by the cores
+DEFAULT_EVENTS = [
+    'node-loads',
+    'node-load-misses',
+    'node-stores',
+    'node-store-misses',
+]
+
+# print_stats() in src/misc_lib.cpp: "set_mops : %lu, get_mops : %lu"
+MOPS_RE = re.compile(r'set_mops\s*:\s*(?P<set>\d+),\s*get_mops\s*:\s*(?P<get>\d+)')
+
+def parse_mops(text: str, logfile: pathlib.Path):
+    m = MOPS_RE.search(text)
+    if not m:
+        print(f'no set_mops/get_mops in the output, see {logfile}')
+        sys.exit(1)
+    return int(m['set']), int(m['get'])
+
+def get_counters(perf_out: str, events: list):
+    # perf stat -x, lines: value,unit,event,...
+    counters = {e: 0 for e in events}
+    for line in perf_out.splitlines():
+        tokens = line.split(',')
+        if len(tokens) < 3 or tokens[2] not in counters:
+            continue
+        try:
+            counters[tokens[2]] += int(tokens[0])
+        except ValueError:
+            # <not counted> / <not supported>
+            pass
+    return counters
+
+def run_one(args: argparse.Namespace, numa_split: int, placement: int, events: list):
+    dramhit_args = ['--mode=8', f'--nprod={args.nprod}', f'--ncons={args.ncons}',
+                    '--ht-type=1', f'--numa-split={numa_split}',
+                    f'--queue-placement={placement}']
+    if args.hugepages:
+        dramhit_args += ['--queue-hugepages=1']
+    if args.local_partitions:
+        dramhit_args += ['--local-partitions=1']
+    if args.ht_size:
+        dramhit_args += [f'--ht-size={args.ht_size}']
+    if args.skew:
+        dramhit_args += [f'--skew={args.skew}']
+
+    perf_file = args.log_dir.joinpath(f'perf-s{numa_split}-q{placement}.csv')
+    command = ['perf', 'stat', '-a', '-x,', '-o', str(perf_file),
+               '-e', ','.join(events), './dramhit'] + dramhit_args
+    print(f'Running {" ".join(command)}', flush=True)
+    run = subprocess.run(command, cwd=args.build_dir, capture_output=True, text=True)
+
+    logfile = args.log_dir.joinpath(f's{numa_split}-q{placement}.log')
+    with open(logfile, 'w') as log:
+        log.write(run.stdout)
+        log.write(run.stderr)
+    if run.returncode != 0:
+        print(f'exit status: {run.returncode}, see {logfile}')
+        sys.exit(1)
+
+    with open(perf_file) as f:
+        counters = get_counters(f.read(), events)
+    set_mops, get_mops = parse_mops(run.stdout + run.stderr, logfile)
+    return set_mops, get_mops, counters
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Sweep NUMA policies and queue placements')
+    parser.add_argument('--build_dir', type=pathlib.Path, required=True, help='Directory with the dramhit binary')
+    parser.add_argument('--log_dir', type=pathlib.Path, default=pathlib.Path('queue_placement'), help='Where logs and summary.csv go')
+    parser.add_argument('--nprod', type=int, required=True)
+    parser.add_argument('--ncons', type=int, required=True)
+    parser.add_argument('--ht_size', type=int, help='Size of the hashtable')
+    parser.add_argument('--skew', type=float, help='Skew for zipfian')
+    parser.add_argument('--hugepages', action='store_true', help='Back the queues with hugepages')
+    parser.add_argument('--local_partitions', action='store_true', help='Allocate each partition on the node of its consumer')
+    parser.add_argument('--events', nargs='*', default=[], help='More perf events, e.g. uncore UPI counters')
+
+    args = parser.parse_args()
+    args.build_dir = args.build_dir.resolve()
+    args.log_dir = args.log_dir.resolve()
+    args.log_dir.mkdir(parents=True, exist_ok=True)
+    events = DEFAULT_EVENTS + args.events
+
+    remote = lambda c: c['node-load-misses'] + c['node-store-misses']
+    local = lambda c: c['node-loads'] + c['node-stores']
+
+    with open(args.log_dir.joinpath('summary.csv'), 'w') as csv:
+        header = 'numa split, queue placement, set mops/s, get mops/s, ' \
+                 + ', '.join(events) + ', remote %'
+        print(header)
+        csv.write(header + '\n')
+        for numa_split, split_name in NUMA_SPLITS.items():
+            for placement, placement_name in PLACEMENTS.items():
+                set, get, counters = run_one(args, numa_split, placement, events)
+                total = local(counters)
+                remote_pct = 100.0 * remote(counters) / total if total else 0.0
+                line = f'{split_name}, {placement_name}, {set}, {get}, ' \
+                       + ', '.join(str(counters[e]) for e in events) \
+                       + f', {remote_pct:.2f}'
+                print(line, flush=True)
+                csv.write(line + '\n')
@@ -132,16 +132,31 @@ def run_casht(build_dir: str, args: argparse.Namespace):
         run_synchronous(build_dir, './dramhit', casht_args, os.open(logfile, os.O_RDWR | os.O_CREAT))
     dumplog(casht_home)
 
+def run_hybrid(build_dir: str, args: argparse.Namespace):
+    print(f'Running hybrid', flush=True)
+    for n in range(1, NPROC + 1):
+        hybrid_args = [f'--num-threads={n}', '--ht-type=13', '--numa-split=1']
+        if not args.skew:
+            hybrid_args += ['--mode=6']
+        if args.hot_threshold:
+            hybrid_args += [f'--hot-threshold={args.hot_threshold}']
+        hybrid_args += get_additional_args(n, args)
+        logfile = hybrid_home.parent.joinpath(f'{n}.log')
+        print(f'Running hybrid{n} with {hybrid_args}', flush=True)
+        run_synchronous(build_dir, './dramhit', hybrid_args, os.open(logfile, os.O_RDWR | os.O_CREAT))
+    dumplog(hybrid_home)
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Run sweep test')
     parser.add_argument('--small_ht', action='store_true', help='Run tests on small-sized hashtable (32 MiB)')
     parser.add_argument('--clean', action='store_true', help='Perform a clean build if dir is present')
-    parser.add_argument('--ht_type', nargs='?', type=int, choices=range(1, 4), help='1 - Partitioned, 2 - Casht, 3 - Casht++', required=True)
+    parser.add_argument('--ht_type', nargs='?', type=int, choices=range(1, 5), help='1 - Partitioned, 2 - Casht, 3 - Casht++, 4 - Hybrid (casht++ with hot keys combined)', required=True)
     parser.add_argument('--xorwow', action='store_true', help='Insert random keys (generated using xorwow)')
     parser.add_argument('--dumplog', action='store_true', help='Dump the log without running')
     parser.add_argument('--skew', nargs='?', type=float, help='Skew for zipfian')
     parser.add_argument('--bq', action='store_true', help='Enable prodcuer/consumer with partitioned HT')
     parser.add_argument('--no_prefetch', action='store_true', default=False, help='Disable prefetch engine')
+    parser.add_argument('--hot_threshold', nargs='?', type=int, help='Sketch count at which the hybrid table combines a key')
 
     args = parser.parse_args()
 
@@ -161,6 +176,7 @@ if __name__ == '__main__':
     casht_home = tests_home.joinpath('casht', 'build')
     cashtpp_home = tests_home.joinpath('casht++', 'build')
     part_home = tests_home.joinpath('partitioned', 'build')
+    hybrid_home = tests_home.joinpath('hybrid', 'build')
 
     setup_system(source)
 
@@ -180,6 +196,8 @@ if __name__ == '__main__':
                 logdir = casht_home
             case 3:
                 logdir = cashtpp_home
+            case 4:
+                logdir = hybrid_home
         dumplog(logdir)
         sys.exit(1)
 
@@ -216,3 +234,12 @@ if __name__ == '__main__':
             run_synchronous(cashtpp_home, 'cmake', ['--build', '.'])
 
             run_cashtpp(cashtpp_home, args)
+
+        case 4:
+            print('Building hybrid', flush=True)
+            hybrid_home.mkdir(parents=True, exist_ok=True)
+            run_synchronous(hybrid_home, 'cmake', [
+                            source, '-GNinja'] + additional_build_args)
+            run_synchronous(hybrid_home, 'cmake', ['--build', '.'])
+
+            run_hybrid(hybrid_home, args)
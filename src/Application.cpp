@@ -71,7 +71,15 @@ const Configuration def = {
     .ht_file = std::string(""),
     .in_file = std::string("/local/devel/devel/datasets/turkey/myseq0.fa"),
     .in_file_sz = 0,
+    .in_file_reader = PRELOAD_READER,
+    .uring_chunk_size = 4 << 20,
+    .uring_depth = 3,
+    .uring_direct = false,
+    .decompress_threads = 1,
+    .decompress_depth = 4,
     .K = 20,
+    .canonical = false,
+    .minimizer_len = 0,
     .num_threads = 1,
     .mode = BQ_TESTS_YES_BQ,  // TODO enum
     .numa_split = 4,
@@ -100,8 +108,24 @@ const Configuration def = {
     .relation_s_size = 128000000,
     .delimitor = "|",
     .rw_queues = false,
+    .queue_bulk_test = false,
+    .inbound_queues = false,
+    .lynx_queues = false,
+    .consumer_backoff = false,
+    .queued_finds = 0,
+    .queue_placement = QUEUE_ON_PRODUCER,
+    .queue_hugepages = false,
     .pollute_ratio = 0,
     .find_queue_sz = 16,
+    .adaptive_prefetch = false,
+    .coro_group = 0,
+    .replicate_ht = false,
+    .local_partitions = true,
+    .delegation_sections = 4,
+    .hot_threshold = 8,
+    .hot_slots = 256,
+    .hot_flush_interval = 4096,
+    .combine_slots = 0,
     .perf_cnt_path = "",
     .perf_def_path = "",
     .test = false,
@@ -284,6 +308,10 @@ void sync_complete(void) {
     delete g_zipf_values;
     return;
   }
+  // an extra barrier, it must not flip the counters from start to stop
+  if (cur_phase == ExecPhase::replication) {
+    return;
+  }
 #if defined(WITH_PAPI_LIB)
   if (stop_sync) {
     PLOGI.printf("Stopping counters");
@@ -367,7 +395,7 @@ void sync_complete(void) {
 
     switch (config.mode) {
       case FASTQ_WITH_INSERT:
-        kmer_ht = init_ht(config.ht_size, sh->shard_idx);
+        kmer_ht = init_ht(config.ht_size, sh->shard_idx, sh->numa_node);
         break;
       case PREFETCH:
         // kmer_ht = new PartitionedHashStore<Prefetch_KV, PrefetchKV_Queue>(
@@ -377,21 +405,22 @@ void sync_complete(void) {
       case RW_RATIO:
       case ZIPFIAN:
       case UNIFORM:
-        kmer_ht = init_ht(config.ht_size, sh->shard_idx);
+        kmer_ht = init_ht(config.ht_size, sh->shard_idx, sh->numa_node);
         break;
       case BW:
       case HASHJOIN:
       case PARTITIONJOINV1:
       case PARTITIONJOINV2:
+      case DELEGATEDJOIN:
         kmer_ht = NULL;
         break;
       case BQ_TESTS_NO_BQ:
-        kmer_ht = init_ht(config.ht_size, sh->shard_idx);
+        kmer_ht = init_ht(config.ht_size, sh->shard_idx, sh->numa_node);
         break;
       case FASTQ_NO_INSERT:
         break;
       case CACHE_MISS:
-        kmer_ht = init_ht(HT_TESTS_HT_SIZE, sh->shard_idx);
+        kmer_ht = init_ht(HT_TESTS_HT_SIZE, sh->shard_idx, sh->numa_node);
         break;
       default:
         PLOGF.printf("No config mode specified! cannot run");
@@ -428,6 +457,7 @@ void sync_complete(void) {
       case HASHJOIN:
       case PARTITIONJOINV1:
       case PARTITIONJOINV2:
+      case DELEGATEDJOIN:
         this->test.hj.join_relations_generated(sh, config, kmer_ht,
                                                config.materialize, barrier);
         break;
@@ -450,7 +480,8 @@ void sync_complete(void) {
     // Write to file
     if (!config.ht_file.empty()) {
       // for CAS hashtable, not every thread has to write to file
-      if ((config.ht_type == CASHTPP || config.ht_type == MULTI_HT) &&
+      if ((config.ht_type == CASHTPP || config.ht_type == MULTI_HT ||
+           config.ht_type == HYBRID_HT) &&
           (sh->shard_idx > 0)) {
         goto done;
       }
@@ -498,6 +529,13 @@ void sync_complete(void) {
       sh_idx++;
     }
 
+    if (config.ht_type == DELEGATED_HT) {
+      init_delegation(this->np->get_assigned_cpu_list());
+    }
+    if (config.mode == DELEGATEDJOIN) {
+      this->test.hj.init_delegated_join(this->np->get_assigned_cpu_list());
+    }
+
     if (config.mode == FASTQ_WITH_INSERT) {
       config.in_file_sz = get_file_size(config.in_file.c_str());
       PLOG_INFO.printf("File size: %" PRIu64 " bytes", config.in_file_sz);
@@ -515,7 +553,8 @@ void sync_complete(void) {
       uint64_t orig_num_inserts = HT_TESTS_NUM_INSERTS;
       if (config.ht_type == CASHTPP || config.ht_type == MULTI_HT ||
           config.ht_type == GROWHT || config.ht_type == CAS23HTPP ||
-          config.ht_type == TBB_HT || config.ht_type == DLHT_HT || config.ht_type == FOLKLORE_HT) {
+          config.ht_type == TBB_HT || config.ht_type == DLHT_HT || config.ht_type == FOLKLORE_HT ||
+          config.ht_type == DELEGATED_HT || config.ht_type == HYBRID_HT) {
         HT_TESTS_NUM_INSERTS = HT_TESTS_NUM_INSERTS / config.num_threads;
         PLOGI.printf(
             "total kv %lu, num_threads %u, op per thread (per run) %lu",
@@ -612,7 +651,10 @@ void sync_complete(void) {
           "10: Cache Miss test\n"
           "11: Zipfian non-bqueue test\n"
           "12: RW-ratio test\n"
-          "13: Hashjoin")("base",
+          "13: Hashjoin\n"
+          "16/17: Partitioned (radix) join v1/v2\n"
+          "18: Delegated join, tuples are sent to the owner of their key "
+          "over section queues")("base",
                           po::value<uint64_t>(&config.kmer_create_data_base)
                               ->default_value(def.kmer_create_data_base),
                           "Number of base K-mers")(
@@ -651,13 +693,44 @@ void sync_complete(void) {
           po::value<uint32_t>(&config.ht_type)->default_value(def.ht_type),
           "1: Partitioned HT\n"
           "3: Casht++\n"
-          "4: Arrayht\n")(
+          "4: Arrayht\n"
+          "12: Delegated (partitions behind queues)\n"
+          "13: Hybrid (hot keys combined per thread, casht++ for the rest)\n")(
           "out-file",
           po::value<std::string>(&config.ht_file)->default_value(def.ht_file),
           "Hashtable output file name.")(
           "in-file",
           po::value<std::string>(&config.in_file)->default_value(def.in_file),
           "Input fasta file")(
+          "in-file-reader",
+          po::value(&config.in_file_reader)
+              ->default_value(def.in_file_reader),
+          "How the input file is read:\n"
+          "0: Preload (copy the sequences before counting)\n"
+          "1: mmap (keep views into the mapped file)\n"
+          "2: io_uring (read chunks while counting, IO_URING builds)\n"
+          "gzip, BGZF and zstd files are detected and decompressed while "
+          "counting instead\n")(
+          "uring-chunk-size",
+          po::value(&config.uring_chunk_size)
+              ->default_value(def.uring_chunk_size),
+          "io_uring reader: bytes per read, a multiple of 4096")(
+          "uring-depth",
+          po::value(&config.uring_depth)->default_value(def.uring_depth),
+          "io_uring reader: chunk buffers per thread (2 = double buffering)")(
+          "uring-direct",
+          po::value<bool>(&config.uring_direct)
+              ->default_value(def.uring_direct),
+          "io_uring reader: bypass the page cache with O_DIRECT")(
+          "decompress-threads",
+          po::value(&config.decompress_threads)
+              ->default_value(def.decompress_threads),
+          "gzip/BGZF/zstd input: decompression threads per counting "
+          "thread, 0 = decompress on the counting thread")(
+          "decompress-depth",
+          po::value(&config.decompress_depth)
+              ->default_value(def.decompress_depth),
+          "gzip/BGZF/zstd input: decompressed chunks buffered per thread")(
           "drop-caches",
           po::value<bool>(&config.drop_caches)->default_value(def.drop_caches),
           "drop page cache before run")(
@@ -670,6 +743,14 @@ void sync_complete(void) {
           "for bqueues only")(
           "k", po::value<uint32_t>(&config.K)->default_value(def.K),
           "the value of 'k' in k-mer")(
+          "canonical",
+          po::value<bool>(&config.canonical)->default_value(def.canonical),
+          "K-mer counting: count a k-mer and its reverse complement as one")(
+          "minimizer-len",
+          po::value(&config.minimizer_len)->default_value(def.minimizer_len),
+          "K-mer counting with the delegated table (--ht-type 12): send "
+          "runs of k-mers with the same minimizer of this length to one "
+          "partition, 0 = each k-mer by its hash")(
           "num_nops",
           po::value<uint32_t>(&config.num_nops)->default_value(def.num_nops),
           "number of nops in bqueue cons thread")(
@@ -717,12 +798,86 @@ void sync_complete(void) {
           "rw-queues",
           po::value<bool>(&config.rw_queues)->default_value(def.rw_queues),
           "Enable R/W tests for queues tests")(
+          "queue-bulk-test",
+          po::value<bool>(&config.queue_bulk_test)
+              ->default_value(def.queue_bulk_test),
+          "Measure messages/sec of the queues for increasing bulk sizes "
+          "(mode 8)")(
+          "inbound-queues",
+          po::value<bool>(&config.inbound_queues)
+              ->default_value(def.inbound_queues),
+          "One shared inbound queue per consumer instead of a queue per "
+          "producer/consumer pair (mode 8)")(
+          "lynx-queues",
+          po::value<bool>(&config.lynx_queues)
+              ->default_value(def.lynx_queues),
+          "Lynx queues instead of section queues (mode 8). With "
+          "--queue-bulk-test, compares both")(
+          "consumer-backoff",
+          po::value<bool>(&config.consumer_backoff)
+              ->default_value(def.consumer_backoff),
+          "Idle queue consumers (mode 8, delegated table) back off from "
+          "polling to umwait and futex sleep, woken up by the producers")(
+          "queued-finds",
+          po::value(&config.queued_finds)->default_value(def.queued_finds),
+          "Producers send their finds to the owning consumer and get the "
+          "values back over response queues, with up to this many in flight "
+          "(mode 8, power of two). 0: finds go to the partitions directly")(
+          "queue-placement",
+          po::value(&config.queue_placement)
+              ->default_value(def.queue_placement),
+          "NUMA node of the section queue data (mode 8)\n"
+          "0: the producer's, enqueues stay local\n"
+          "1: the consumer's, dequeues stay local")(
+          "queue-hugepages",
+          po::value<bool>(&config.queue_hugepages)
+              ->default_value(def.queue_hugepages),
+          "Back the section queue data with 2MB hugepages (mode 8)")(
           "pollute-ratio",
           po::value(&config.pollute_ratio)->default_value(def.pollute_ratio),
           "Ratio of pollution events to ops (>1)")(
           "find_queue_sz",
           po::value(&config.find_queue_sz)->default_value(def.find_queue_sz),
           "Find queue size")(
+          "adaptive-prefetch",
+          po::value<bool>(&config.adaptive_prefetch)
+              ->default_value(def.adaptive_prefetch),
+          "Tune queue depth and prefetch distance per thread at runtime, up "
+          "to find_queue_sz (zipfian/uniform)")(
+          "coro-group",
+          po::value(&config.coro_group)->default_value(def.coro_group),
+          "Run casht++ inserts/finds on the coroutine engine with this many "
+          "probes in flight instead of the queues, 0 disables (zipfian)")(
+          "replicate-ht",
+          po::value<bool>(&config.replicate_ht)
+              ->default_value(def.replicate_ht),
+          "Copy casht/folklore to every NUMA node after the inserts and look "
+          "up the local copy (zipfian/uniform)")(
+          "local-partitions",
+          po::value<bool>(&config.local_partitions)
+              ->default_value(def.local_partitions),
+          "Bind every partition of the partitioned table to the numa node of "
+          "its owner instead of following numa_split")(
+          "delegation-sections",
+          po::value(&config.delegation_sections)
+              ->default_value(def.delegation_sections),
+          "Sections (of 4KiB) per queue of the delegated table, power of two")(
+          "hot-threshold",
+          po::value(&config.hot_threshold)->default_value(def.hot_threshold),
+          "Hybrid table: sketch count (1-255) at which a key is combined "
+          "per thread")(
+          "hot-slots",
+          po::value(&config.hot_slots)->default_value(def.hot_slots),
+          "Hybrid table: hot keys per thread, power of two from 2 to 4096")(
+          "hot-flush-interval",
+          po::value(&config.hot_flush_interval)
+              ->default_value(def.hot_flush_interval),
+          "Hybrid table: inserts between two flushes of the hot keys")(
+          "combine-slots",
+          po::value(&config.combine_slots)->default_value(def.combine_slots),
+          "K-mer counting: merge repeated k-mers in a per-thread table of "
+          "this many slots (power of two, e.g. 4096-16384) and add their "
+          "counts to the hashtable in batches, 0 = off")(
           "perf_cnt_path",
           po::value(&config.perf_cnt_path)->default_value(def.perf_cnt_path),
           "Perf counter (to be recorded) events")(
@@ -832,6 +987,26 @@ void sync_complete(void) {
           PLOG_ERROR.printf("Please provide input fasta file.");
           exit(-1);
         }
+        if (config.minimizer_len > 0) {
+          // only the delegated table can send a k-mer to another partition
+          if (config.ht_type != DELEGATED_HT) {
+            PLOG_ERROR.printf("minimizer-len needs the delegated table");
+            exit(-1);
+          }
+          if (config.minimizer_len > config.K) {
+            PLOG_ERROR.printf("minimizer-len must not be larger than k");
+            exit(-1);
+          }
+        }
+        // the combiner adds its counts with add_batch, which the delegated
+        // table does not have, and it ignores the minimizer partitions
+        if (config.combine_slots > 0 &&
+            (config.minimizer_len > 0 || config.ht_type == DELEGATED_HT)) {
+          PLOG_ERROR.printf(
+              "combine-slots does not work with minimizer-len or the "
+              "delegated table");
+          exit(-1);
+        }
       } else if (config.mode == FASTQ_NO_INSERT) {
         PLOG_INFO.printf("Mode : FASTQ_NO_INSERT");
         if (config.in_file.empty()) {
@@ -849,10 +1024,21 @@ void sync_complete(void) {
         case MULTI_HT:
           PLOG_INFO.printf("Hashtable type : Multi HT");
           break;
+        case DELEGATED_HT:
+          PLOG_INFO.printf("Hashtable type : Delegated HT");
+          if (config.delegation_sections == 0 ||
+              (config.delegation_sections & (config.delegation_sections - 1))) {
+            PLOGE.printf("delegation-sections must be a power of two");
+            exit(-1);
+          }
+          break;
 #endif
         case CASHTPP:
           PLOG_INFO.printf("Hashtable type : Cas HT");
           break;
+        case HYBRID_HT:
+          PLOG_INFO.printf("Hashtable type : Hybrid HT (hot keys combined)");
+          break;
         case CAS23HTPP:
           PLOG_INFO.printf("Hashtable type : CAS2023 HT");
           break;
@@ -936,7 +1122,8 @@ void sync_complete(void) {
       init_zipfian_dist(config.skew, config.seed, sample_size, key_range);
 
     } else if (config.mode == HASHJOIN || config.mode == PARTITIONJOINV1 ||
-               config.mode == PARTITIONJOINV2) {
+               config.mode == PARTITIONJOINV2 ||
+               config.mode == DELEGATEDJOIN) {
       init_hashjoin_dist(config.skew, config.hit_rate, config.seed,
                          config.relation_r_size, config.relation_s_size);
     } else if (config.mode == UNIFORM) {
@@ -972,6 +1159,22 @@ void sync_complete(void) {
         default:
           break;
       }
+
+      if (config.mode == BQ_TESTS_YES_BQ && config.queue_bulk_test) {
+        this->test.qt.run_bulk_test(&config, this->npq);
+        if (config.lynx_queues) {
+          this->test.lynx_qt.run_bulk_test(&config, this->npq);
+        }
+        return 0;
+      }
+      if (config.mode == BQ_TESTS_YES_BQ && config.lynx_queues) {
+        this->test.lynx_qt.run_test(&config, this->n, false, this->npq);
+        return 0;
+      }
+      if (config.mode == BQ_TESTS_YES_BQ && config.inbound_queues) {
+        this->test.inbound_qt.run_test(&config, this->n, false, this->npq);
+        return 0;
+      }
     } else {
       switch (config.numa_split) {
         case THREADS_SPLIT_SEPARATE_NODES:
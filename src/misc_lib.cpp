@@ -114,6 +114,7 @@ extern uint64_t g_zipf_num_unique_values;
 extern double g_zipf_skewness;
 extern uint64_t expected_join_size;
 extern uint64_t g_zipf_values_size;
+extern ExecPhase cur_phase;
 
 // g_zipf_values is global ....
 void print_stats(Shard *all_sh, Configuration &config) {
@@ -213,7 +214,7 @@ void print_stats(Shard *all_sh, Configuration &config) {
   }
 
   if (config.mode == HASHJOIN || config.mode == PARTITIONJOINV1 ||
-      config.mode == PARTITIONJOINV2) {
+      config.mode == PARTITIONJOINV2 || config.mode == DELEGATEDJOIN) {
     if (config.test) {
       uint64_t join_answer = expected_join_size;
 
@@ -238,7 +239,7 @@ void print_stats(Shard *all_sh, Configuration &config) {
     if (sum_op > 0)
       throughput_cpo = (total_find_cycles + total_insert_cycles) / sum_op;
 
-    if (config.mode != HASHJOIN) {
+    if (config.mode == PARTITIONJOINV1 || config.mode == PARTITIONJOINV2) {
       uint64_t part_cpo = 0;
       if (avg_insert_duration > 0) part_cpo = total_insert_cycles / sum_op;
 
@@ -315,6 +316,16 @@ void print_stats(Shard *all_sh, Configuration &config) {
         avg_insert_duration, total_inserts,
         cycles_per_insert, cycles_per_find,
         insert_mops, find_mops);
+
+    // not measured: assumes one cacheline per find, to compare the shared
+    // table with per-node replicas (--replicate-ht). See the PAPI/PCM
+    // counters for the actual memory bandwidth.
+    double find_sec = avg_find_duration / (CPUFREQ_MHZ * 1000000.0);
+    if (find_sec > 0.0) {
+      PLOGI.printf("find_probe_bw_est : %.1f GB/s (%s table, 64B per find)",
+                   ((double)total_finds * 64 / (1000 * 1000 * 1000)) / find_sec,
+                   config.replicate_ht ? "replicated" : "shared");
+    }
   }
 #ifdef COMMENT_OUT
   printf("===============================================================\n");
@@ -403,7 +414,42 @@ inline uint64_t get_gigbytes(size_t num_kv) {
          (1024 * 1024 * 1024);
 }
 
-BaseHashTable *init_ht(const uint64_t sz, uint8_t id) {
+void use_local_replica(Shard *shard, BaseHashTable *ht,
+                       std::barrier<std::function<void()>> *sync_barrier) {
+  if (!config.replicate_ht) {
+    return;
+  }
+  if (shard->shard_idx == 0) {
+    // keep the barrier below out of the phase timings and the counters
+    cur_phase = ExecPhase::replication;
+    if (!ht->replicate()) {
+      PLOGE.printf("hashtable type %u cannot be replicated", config.ht_type);
+      abort();
+    }
+  }
+  sync_barrier->arrive_and_wait();
+  if (!ht->use_replica(shard->numa_node)) {
+    PLOGW.printf("shard %u: no replica on node %d, using the shared table",
+                 shard->shard_idx, shard->numa_node);
+  }
+}
+
+#if defined(PART_ID) && !defined(BQUEUE_KMER_TEST)
+static DelegationService *delegation;
+#endif
+
+void init_delegation(const std::vector<uint32_t> &cpus) {
+#if defined(PART_ID) && !defined(BQUEUE_KMER_TEST)
+  // lives until the end of the run, the threads' tables point into it
+  delegation = new DelegationService(config.num_threads, cpus,
+                                     config.delegation_sections);
+#else
+  PLOGE.printf("the delegated table needs PART_ID");
+  abort();
+#endif
+}
+
+BaseHashTable *init_ht(const uint64_t sz, uint8_t id, int node) {
   BaseHashTable *kmer_ht = NULL;
 
   // Create hash table
@@ -413,8 +459,19 @@ BaseHashTable *init_ht(const uint64_t sz, uint8_t id) {
       kmer_ht = new MultiHashTable<KVType, ItemQueue>(sz);
       break;
     case PARTITIONED_HT:
-      kmer_ht = new PartitionedHashStore<KVType, ItemQueue>(sz, id);
+      kmer_ht = new PartitionedHashStore<KVType, ItemQueue>(
+          sz, id, config.local_partitions ? node : -1);
+      break;
+#ifndef BQUEUE_KMER_TEST
+    case DELEGATED_HT:
+      // `sz` is the size of the whole table
+      kmer_ht = new DelegatedHashTable(
+          delegation, id,
+          new PartitionedHashStore<KVType, ItemQueue>(
+              sz / config.num_threads, id,
+              config.local_partitions ? node : -1));
       break;
+#endif
 #endif
     case CAS23HTPP:
 #ifdef CAS_NO_ABSTRACT
@@ -441,6 +498,16 @@ BaseHashTable *init_ht(const uint64_t sz, uint8_t id) {
       kmer_ht =
           new CASHashTable<KVType, ItemQueue>(sz, config.find_queue_sz, id);
       break;
+    case HYBRID_HT:
+#ifdef CAS_NO_ABSTRACT
+      PLOGE.printf("the hybrid table doesn't support no abstract methods "
+                   "feature");
+      abort();
+#endif
+      kmer_ht = new HybridHashTable<KVType, ItemQueue>(
+          new CASHashTable<KVType, ItemQueue>(sz, config.find_queue_sz, id),
+          id);
+      break;
     case ARRAY_HT:
       kmer_ht = new ArrayHashTable<Value, ItemQueue>(sz);
       break;
@@ -35,11 +35,12 @@
 #include "misc_lib.h"
 #include "plog/Log.h"
 // #include "print_stats.h"
-// #include "queues/section_queues.hpp"
 #include "hasher.hpp"
 #include "hashtables/cas_kht_st.hpp"
+#include "hashtables/delegated_kht.hpp"
 #include "helper.hpp"
 #include "print_stats.h"
+#include "queues/section_queues.hpp"
 #include "sync.h"
 #include "tests/HashjoinTest.hpp"
 #include "types.hpp"
@@ -469,7 +470,7 @@ void hashjoin(Shard* sh, Element* build, Element* probe, JoinElement* mvec,
               std::barrier<std::function<void()>>* barrier,
               uint64_t partition_sz_r, uint64_t partition_sz_s) {
   uint64_t ht_size = config.relation_r_size * 100 / config.ht_fill;
-  BaseHashTable* ht = init_ht(ht_size, sh->shard_idx);
+  BaseHashTable* ht = init_ht(ht_size, sh->shard_idx, sh->numa_node);
 
   // Measure Build
   if (sh->shard_idx == 0) {
@@ -883,6 +884,232 @@ void radixjoin2016(Shard* sh, Element* build, Element* probe, JoinElement* mvec,
   }
 }
 
+SectionQueue* join_queues;
+std::atomic<uint64_t> join_arrivals;
+
+void HashjoinTest::init_delegated_join(const std::vector<uint32_t>& cpus) {
+  // with a single section, a sender could never publish it
+  if (config.delegation_sections < 2 ||
+      (config.delegation_sections & (config.delegation_sections - 1))) {
+    PLOGE.printf("delegation-sections must be a power of two, at least 2");
+    exit(-1);
+  }
+  join_queues = new SectionQueue(config.num_threads, config.num_threads,
+                                 config.delegation_sections, cpus);
+  join_arrivals = 0;
+}
+
+/// One thread of the delegated join (DELEGATEDJOIN). A tuple is not joined
+/// by the thread that reads it, but sent to the owner of its key
+/// (`DelegationService::owner_of`) over `join_queues`: first all of R,
+/// which every owner inserts into its private table, then all of S, which
+/// every owner probes against its table and materializes locally. No table
+/// is shared, and unlike HASHJOIN on the delegated table, no result travels
+/// back to the sender.
+///
+/// Every thread is a sender and an owner at once: it serves its inbound
+/// queues after every batch it sends, whenever an outbound queue is full,
+/// and until all the threads have sent everything. The last section of
+/// every queue is published by padding it with PAD_KEY. The phases must be
+/// separated by a barrier, or early S tuples would be taken for R.
+class DelegatedJoin {
+ public:
+  constexpr static key_type PAD_KEY = 0;
+
+  DelegatedJoin(uint32_t id, uint64_t ht_sz, JoinVec* out)
+      : q(join_queues),
+        id(id),
+        n(config.num_threads),
+        ht(hugepage_alloc_inst_element.allocate(ht_sz)),
+        fill(0),
+        found(0),
+        out(out),
+        epoch(0) {
+    this->ht.size = ht_sz;
+    memset((void*)this->ht.vec, 0, ht_sz * sizeof(Element));
+    for (uint32_t i = 0; i < this->n; i++) {
+      this->pq.push_back(&this->q->all_pqueues[id][i]);
+      this->cq.push_back(&this->q->all_cqueues[id][i]);
+    }
+    this->batch.resize(std::max<uint32_t>(config.batch_len, 1));
+  }
+
+  ~DelegatedJoin() {
+    hugepage_alloc_inst_element.deallocate(this->ht.vec, this->ht.size);
+  }
+
+  /// Returns the number of R tuples this thread inserted as an owner.
+  uint64_t build(Element* tuples, uint64_t len) {
+    this->run<true>(tuples, len);
+    return this->fill;
+  }
+
+  /// Returns the number of S tuples this thread matched as an owner.
+  uint64_t probe(Element* tuples, uint64_t len) {
+    this->run<false>(tuples, len);
+    return this->found;
+  }
+
+  uint64_t capacity() const { return this->ht.size; }
+
+ private:
+  SectionQueue* q;
+  uint32_t id;
+  uint32_t n;
+  std::vector<SectionQueue::prod_queue_t*> pq;
+  std::vector<SectionQueue::cons_queue_t*> cq;
+  RadixArrayHashTable ht;
+  uint64_t fill;
+  uint64_t found;
+  JoinVec* out;
+  std::vector<Element> batch;
+  uint64_t epoch;
+
+  template <bool build>
+  void run(Element* tuples, uint64_t len) {
+    const uint64_t batch_len = this->batch.size();
+
+    for (uint64_t i = 0; i < len; i++) {
+      if (!(i & (ELE_NUM_PER_CACHE_LINE - 1)) &&
+          (i + PREFETCHES_AHEAD < len)) {
+        __builtin_prefetch(&tuples[i + PREFETCHES_AHEAD], false, 3);
+      }
+      Element& e = tuples[i];
+      if (e.key != PAD_KEY) {
+        this->push<build>(DelegationService::owner_of(e.key, this->n), e);
+      }
+      if ((i + 1) % batch_len == 0) {
+        this->serve<build>();
+      }
+    }
+
+    for (uint32_t c = 0; c < this->n; c++) {
+      while (!this->q->at_section_start(this->pq[c])) {
+        this->push<build>(c, Element(PAD_KEY, 0));
+      }
+    }
+
+    // everything we sent is published, wait for the others to get there
+    this->epoch++;
+    const uint64_t all = this->epoch * this->n;
+    join_arrivals.fetch_add(1);
+    while (join_arrivals.load(std::memory_order_acquire) < all) {
+      if (this->serve<build>() == 0) {
+        _mm_pause();
+      }
+    }
+    while (this->serve<build>() > 0) {
+    }
+  }
+
+  /// Enqueue to owner `c`, serving our own inbound queues while it is full.
+  template <bool build>
+  inline void push(uint32_t c, const Element& e) {
+    while (this->q->try_enqueue(this->pq[c], this->id, c, e) == RETRY) {
+      this->serve<build>();
+      _mm_pause();
+    }
+  }
+
+  /// Owner side: take up to a batch from every inbound queue, prefetch the
+  /// slots of the batch and then insert or probe it. Returns the number of
+  /// tuples taken.
+  template <bool build>
+  size_t serve() {
+    size_t total = 0;
+    data_t m;
+
+    for (uint32_t p = 0; p < this->n; p++) {
+      uint32_t cnt = 0;
+      while (cnt < this->batch.size() &&
+             this->q->dequeue(this->cq[p], p, this->id, &m) == SUCCESS) {
+        if (m.key == PAD_KEY) {
+          continue;
+        }
+        __builtin_prefetch(&this->ht.vec[this->ht.hash(m.key)], build, 3);
+        this->batch[cnt++] = m;
+      }
+
+      for (uint32_t i = 0; i < cnt; i++) {
+        Element& e = this->batch[i];
+        if constexpr (build) {
+          if (++this->fill >= this->ht.size) {
+            PLOGE.printf("delegated join: table of owner %u is full (%lu)",
+                         this->id, this->ht.size);
+            abort();
+          }
+          this->ht.insert(e);
+        } else {
+          value_type v;
+          if (this->ht.find(e, v)) {
+            this->found++;
+            if (this->out) {
+              this->out->push_back({e.key, e.value, v});
+            }
+          }
+        }
+      }
+      total += cnt;
+    }
+    return total;
+  }
+};
+
+void delegatedjoin(Shard* sh, Element* build, Element* probe, bool materialize,
+                   std::barrier<std::function<void()>>* barrier,
+                   uint64_t partition_sz_r, uint64_t partition_sz_s) {
+  // an owner gets about 1/n of R, leave some room for the imbalance
+  uint64_t owner_sz_r = config.relation_r_size / config.num_threads;
+  owner_sz_r += owner_sz_r / 8 + 1;
+  uint64_t ht_sz = utils::next_pow2(owner_sz_r * 100 / config.ht_fill);
+
+  JoinVec out(hugepage_alloc_inst_join_element);
+  if (materialize) {
+    out.reserve(partition_sz_s);
+  }
+  DelegatedJoin join(sh->shard_idx, ht_sz, materialize ? &out : nullptr);
+
+  // Measure Build
+  if (sh->shard_idx == 0) {
+    cur_phase = ExecPhase::insertions;
+    g_app_record_start = true;
+  }
+  barrier->arrive_and_wait();
+
+  uint64_t inserted = join.build(build, partition_sz_r);
+
+  if (sh->shard_idx == 0) {
+    cur_phase = ExecPhase::insertions;
+    g_app_record_start = false;
+  }
+  barrier->arrive_and_wait();
+
+  sh->stats->insertions.op_count = partition_sz_r;
+  sh->stats->insertions.duration = g_insert_end - g_insert_start;
+
+  // Measure Probe
+  if (sh->shard_idx == 0) {
+    cur_phase = ExecPhase::finds;
+    g_app_record_start = true;
+  }
+  barrier->arrive_and_wait();
+
+  uint64_t found = join.probe(probe, partition_sz_s);
+
+  if (sh->shard_idx == 0) {
+    cur_phase = ExecPhase::finds;
+    g_app_record_start = false;
+  }
+  barrier->arrive_and_wait();
+
+  sh->stats->finds.op_count = partition_sz_s;
+  sh->stats->finds.duration = g_find_end - g_find_start;
+  sh->stats->found = found;
+
+  PLOGV.printf("owner %u: built %lu out of %lu slots, matched %lu",
+               sh->shard_idx, inserted, join.capacity(), found);
+}
+
 
 HugepageArena* arenas;
 
@@ -938,7 +1165,8 @@ void HashjoinTest::join_relations_generated(Shard* sh,
   // hugepage_alloc_inst_element.allocate(partition_sz_s);
   JoinElement* join_relation = nullptr;
 
-  if (materialize)
+  // the delegated join materializes on the owners
+  if (materialize && config.mode != DELEGATEDJOIN)
     join_relation = hugepage_alloc_inst_join_element.allocate(partition_sz_s);
 
   // Copy data from global vec into hugepage back vec.
@@ -984,6 +1212,9 @@ void HashjoinTest::join_relations_generated(Shard* sh,
     radixjoin2016(sh, build_relation, probe_relation, join_relation, barrier,
                   partition_sz_r, partition_sz_s);
   } else if (config.mode == PARTITIONJOINV2) {
+  } else if (config.mode == DELEGATEDJOIN) {
+    delegatedjoin(sh, build_relation, probe_relation, materialize, barrier,
+                  partition_sz_r, partition_sz_s);
   } else {
     PLOGE.printf("Unsupported mode for join");
     abort();
@@ -992,7 +1223,7 @@ void HashjoinTest::join_relations_generated(Shard* sh,
   // hugepage_alloc_inst_element.deallocate(build_relation, partition_sz_r);
   // hugepage_alloc_inst_element.deallocate(probe_relation, partition_sz_s);
 
-  if (materialize)
+  if (join_relation)
     hugepage_alloc_inst_join_element.deallocate(join_relation, partition_sz_s);
 }
 
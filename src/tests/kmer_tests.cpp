@@ -3,16 +3,26 @@
 #include <algorithm>
 #include <atomic>
 #include <barrier>
+#include <chrono>
 #include <cstdint>
+#include <memory>
+#include <span>
 #include <plog/Log.h>
 
 #include "constants.hpp"
+#include "fastrange.h"
 #include "hashtables/base_kht.hpp"
+#include "hashtables/batch_runner/batch_combiner.hpp"
 #include "hashtables/batch_runner/batch_runner.hpp"
 #include "hashtables/kvtypes.hpp"
 #include "sync.h"
+#include "input_reader/compressed_file.hpp"
 #include "input_reader/fastq.hpp"
 #include "input_reader/counter.hpp"
+#include "input_reader/super_kmer.hpp"
+#ifdef WITH_IO_URING
+#include "input_reader/uring_file.hpp"
+#endif
 #include "types.hpp"
 #include "print_stats.h"
 
@@ -24,9 +34,52 @@ void KmerTest::count_kmer(Shard* sh,
                               BaseHashTable* ht,
                               std::barrier<VoidFn>* barrier){
   uint64_t num_kmers = 0;
+  // From opening the file to the last insert, so that the preloading readers
+  // pay for their reads too.
+  const auto ingest_start = std::chrono::steady_clock::now();
   // Be care of the `K` here; it's a compile time constant.
-  auto reader = input_reader::MakeFastqKMerPreloadReader(config.K, config.in_file, sh->shard_idx, config.num_threads);
+  std::unique_ptr<input_reader::KMerSpanReader> reader;
+  if (input_reader::file_compression(config.in_file) !=
+      input_reader::Compression::NONE) {
+    // Whatever the reader, compressed input is decompressed while counting.
+    reader = input_reader::MakeFastqKMerCompressedReader(
+        config.K, config.in_file, sh->shard_idx, config.num_threads,
+        config.decompress_threads, config.decompress_depth);
+  } else {
+    switch (config.in_file_reader) {
+      case MMAP_READER:
+        reader = input_reader::MakeFastqKMerMmapReader(config.K, config.in_file, sh->shard_idx, config.num_threads);
+        break;
+      case URING_READER:
+#ifdef WITH_IO_URING
+        reader = input_reader::MakeFastqKMerUringReader(
+            config.K, config.in_file, sh->shard_idx, config.num_threads,
+            config.uring_chunk_size, config.uring_depth, config.uring_direct);
+#else
+        PLOGE.printf("io_uring reader needs a build with -DIO_URING=ON");
+        abort();
+#endif
+        break;
+      default:
+        reader = input_reader::MakeFastqKMerPreloadReader(config.K, config.in_file, sh->shard_idx, config.num_threads);
+        break;
+    }
+  }
+  input_reader::SuperKMerReader* super_kmers = nullptr;
+  if (config.canonical || config.minimizer_len > 0) {
+    auto wrapped = std::make_unique<input_reader::SuperKMerReader>(
+        std::move(reader), config.K, config.canonical, config.minimizer_len);
+    super_kmers = wrapped.get();
+    reader = std::move(wrapped);
+  }
+  uint64_t num_super_kmers = 0;
   HTBatchRunner batch_runner(ht);
+  // The combined counts are added to the values, so with Item tables the
+  // value of a k-mer becomes its count as well.
+  std::unique_ptr<HTBatchCombiner<>> combiner;
+  if (config.combine_slots > 0) {
+    combiner = std::make_unique<HTBatchCombiner<>>(ht, config.combine_slots);
+  }
 
   if(sh->shard_idx == 0)
   {
@@ -35,11 +88,41 @@ void KmerTest::count_kmer(Shard* sh,
   }
 
   barrier->arrive_and_wait();
-  for (uint64_t kmer; reader->next(&kmer);) {
-    batch_runner.insert(kmer, 0 /* we use the aggr tables so no value */);
-    num_kmers++;
+  // All k-mers of a sequence at once, see `KMerExtractor`.
+  std::span<const uint64_t> kmers;
+  if (combiner) {
+    while (reader->next_span(&kmers)) {
+      for (const uint64_t kmer : kmers) {
+        combiner->insert(kmer);
+      }
+      num_kmers += kmers.size();
+    }
+    combiner->flush();
+  } else if (config.minimizer_len > 0) {
+    // Every k-mer of a super-k-mer goes to the partition of the minimizer,
+    // see `DelegatedHashTable`.
+    uint64_t minimizer;
+    while (super_kmers->next_super_kmer(&kmers, &minimizer)) {
+      const uint32_t part = fastrange32(minimizer >> 32, config.num_threads);
+      for (const uint64_t kmer : kmers) {
+        batch_runner.insert(kmer, 0, part);
+      }
+      num_kmers += kmers.size();
+      num_super_kmers++;
+    }
+    batch_runner.flush_insert();
+  } else {
+    while (reader->next_span(&kmers)) {
+      for (const uint64_t kmer : kmers) {
+        batch_runner.insert(kmer, 0 /* we use the aggr tables so no value */);
+      }
+      num_kmers += kmers.size();
+    }
+    batch_runner.flush_insert();
   }
-  batch_runner.flush_insert();
+  const double ingest_s = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - ingest_start)
+                              .count();
   if(sh->shard_idx == 0)
   {
     cur_phase = ExecPhase::recording;
@@ -48,6 +131,19 @@ void KmerTest::count_kmer(Shard* sh,
   barrier->arrive_and_wait();
   sh->stats->insertions.op_count = num_kmers;
   get_ht_stats(sh, ht);
+  PLOGI.printf("[ingest:%u] k-mers %lu in %.3f s", sh->shard_idx, num_kmers,
+               ingest_s);
+  if (num_super_kmers > 0) {
+    PLOGI.printf("[super-k-mers:%u] %lu, %.1f k-mers each", sh->shard_idx,
+                 num_super_kmers, (double)num_kmers / num_super_kmers);
+  }
+  if (combiner) {
+    const auto &stats = combiner->stats();
+    PLOGI.printf(
+        "[combiner:%u] k-mers %lu, combined %lu (%.3f) | hashtable updates %lu",
+        sh->shard_idx, stats.inserts, stats.combined,
+        combiner->combine_ratio(), stats.spilled);
+  }
 
   if (sh->shard_idx == 0) {
     PLOGI.printf("get fill %.3f",
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <cstdint>
+#include <span>
 #include <tuple>
 
 #include "hasher.hpp"
@@ -14,10 +15,12 @@
 
 #include "queues/section_queues.hpp"
 #include "queues/bqueue_aligned.hpp"
-#include "queues/lynxq.hpp"
+#include "queues/lynxq_portable.hpp"
+#include "queues/mpmc_queue.hpp"
 
 #include "sync.h"
 #include "tests/QueueTest.hpp"
+#include "utils/poll_backoff.hpp"
 #include "utils/vtune.hpp"
 #include "xorwow.hpp"
 #include "zipf_distribution.hpp"
@@ -28,11 +31,9 @@ namespace kmercounter {
 
 using namespace std;
 
-const uint64_t CACHELINE_SIZE = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
-const uint64_t CACHELINE_MASK = CACHELINE_SIZE - 1;
-const uint64_t PAGESIZE = sysconf(_SC_PAGESIZE);
-
-void setup_signal_handler(void);
+extern const uint64_t CACHELINE_SIZE;
+extern const uint64_t CACHELINE_MASK;
+extern const uint64_t PAGESIZE;
 
 extern uint64_t HT_TESTS_HT_SIZE;
 extern uint64_t HT_TESTS_NUM_INSERTS;
@@ -44,7 +45,7 @@ extern uint64_t HT_TESTS_NUM_INSERTS;
 static uint64_t ready = 0;
 static uint64_t ready_threads = 0;
 
-extern BaseHashTable *init_ht(uint64_t, uint8_t);
+extern BaseHashTable *init_ht(uint64_t, uint8_t, int);
 extern void get_ht_stats(Shard *, BaseHashTable *);
 
 struct bq_kmer {
@@ -110,6 +111,24 @@ std::barrier<std::function<void()>> *prod_barrier;
 uint64_t g_rw_start, g_rw_end;
 std::vector<cacheline> toxic_waste_dump(1024 * 1024 * 1024 / sizeof(cacheline));
 
+/// Queues whose producers can wake up an idle consumer.
+template <typename T>
+constexpr bool has_doorbells = std::is_same<T, SectionQueue>::value ||
+                               std::is_same<T, MPMCQueue>::value;
+
+// A queued find is sent as {key, id} and answered with
+// {id | FIND_RESP_TAG [| FIND_RESP_FOUND], value}. Key 0 is padding that
+// publishes a partially filled section.
+constexpr uint64_t FIND_RESP_TAG = 1ULL << 32;
+constexpr uint64_t FIND_RESP_FOUND = 1ULL << 33;
+
+/// A slot of the completion ring of a queued-find producer. The find with
+/// id `i` waits in slot `i & (window - 1)` until its response comes back.
+struct find_completion {
+  uint64_t start;
+  bool pending;
+};
+
 template <typename T>
 void QueueTest<T>::producer_thread(
     const uint32_t tid, const uint32_t n_prod, const uint32_t n_cons,
@@ -139,7 +158,7 @@ void QueueTest<T>::producer_thread(
 #ifdef CONFIG_NUMA_AFFINITY
     mbind_buffer_local((void *)PGROUNDDOWN((uint64_t)pqueues[i]),
                        sizeof(typename T::prod_queue_t));
-    // mbind_buffer_local(pqueues[i]->data, this->queues->queue_size);
+    // the data is bound when the queues are built, see --queue-placement
 #endif
   }
 
@@ -227,7 +246,7 @@ void QueueTest<T>::producer_thread(
   }
 
   auto ht_size = config.ht_size / n_cons;
-  const auto ktable = init_ht(ht_size, sh->shard_idx);
+  const auto ktable = init_ht(ht_size, sh->shard_idx, sh->numa_node);
   this->ht_vec->at(tid) = ktable;
 
   std::bernoulli_distribution coin{config.pread};
@@ -419,14 +438,18 @@ void QueueTest<T>::consumer_thread(
   uint8_t this_cons_id = sh->shard_idx - n_prod;
   uint64_t inserted = 0u;
   typename T::cons_queue_t *cqueues[n_prod];
+  // With one inbound queue per consumer, all producers send to the queue
+  // behind cqueues[0] and there is only that one to poll.
+  constexpr bool inbound = std::is_same<T, MPMCQueue>::value;
+  const uint32_t num_queues = inbound ? 1 : n_prod;
 
   // initialize the local queues array from queue_map
-  for (auto i = 0u; i < n_prod; i++) {
+  for (auto i = 0u; i < num_queues; i++) {
     cqueues[i] = &this->queues->all_cqueues[this_cons_id][i];
 #ifdef CONFIG_NUMA_AFFINITY
     mbind_buffer_local((void *)PGROUNDDOWN((uint64_t)cqueues[i]),
                        sizeof(typename T::cons_queue_t));
-    // mbind_buffer_local(cqueues[i]->data, this->queues->queue_size);
+    // the data is bound when the queues are built, see --queue-placement
 #endif
   }
   vtune::set_threadname("consumer_thread" + std::to_string(tid));
@@ -436,7 +459,7 @@ void QueueTest<T>::consumer_thread(
   if (bq_load == BQUEUE_LOAD::HtInsert) {
     PLOGV.printf("[cons:%u] init_ht id:%d size:%u", this_cons_id, sh->shard_idx,
                  ht_size);
-    kmer_ht = init_ht(ht_size, sh->shard_idx);
+    kmer_ht = init_ht(ht_size, sh->shard_idx, sh->numa_node);
     (*this->ht_vec)[tid] = kmer_ht;
   }
 
@@ -453,6 +476,14 @@ void QueueTest<T>::consumer_thread(
   static auto event = -1;
   if (tid == n_prod) event = vtune::event_start("message_deq");
 
+  // Backs off once a whole round over the queues came back empty
+  Doorbell *bell = nullptr;
+  if constexpr (has_doorbells<T>) {
+    bell = this->queues->get_doorbell(this_cons_id);
+  }
+  PollBackoff backoff(bell);
+  uint64_t round_start = 0;
+
   auto t_start = RDTSC_START();
 
   // Round-robin between 0..n_prod
@@ -476,7 +507,7 @@ void QueueTest<T>::consumer_thread(
 
     auto get_next_prod = [&](auto inc) {
       auto next_prod_id = prod_id + inc;
-      if (next_prod_id >= n_prod) next_prod_id = 0;
+      if (next_prod_id >= num_queues) next_prod_id = 0;
       return next_prod_id;
     };
 
@@ -523,7 +554,9 @@ void QueueTest<T>::consumer_thread(
         fipc_test_FAI(finished_producers);
         // printf("Got MAGIC bit. stopping consumer\n");
         this->queues->pop_done(prod_id, this_cons_id);
-        active_qmask &= ~(1ull << prod_id);
+        if (!inbound) {
+          active_qmask &= ~(1ull << prod_id);
+        }
         /* PLOGV.printf(
             "Consumer %u, received HALT from prod_id %u. "
             "finished_producers :%u",
@@ -579,8 +612,24 @@ void QueueTest<T>::consumer_thread(
     // reset the value of k
     // incase if the next dequeue fails, we will have a stale value of k
     k = 0;
-    if (++prod_id >= n_prod) {
+    if (++prod_id >= num_queues) {
       prod_id = 0;
+      if constexpr (has_doorbells<T>) {
+        if (bell && count == round_start) {
+          backoff.miss([&]() {
+            for (auto i = 0u; i < num_queues; i++) {
+              if ((inbound || (active_qmask & (1ull << i))) &&
+                  this->queues->has_data(cqueues[i], i, this_cons_id)) {
+                return true;
+              }
+            }
+            return false;
+          });
+        } else if (bell) {
+          backoff.hit();
+        }
+      }
+      round_start = count;
     }
   }
 
@@ -598,6 +647,14 @@ void QueueTest<T>::consumer_thread(
   for (auto i = 0u; i < n_prod; ++i) {
     this->queues->dump_stats(i, this_cons_id);
   }
+  if (bell) {
+    const PollBackoff::Stats &s = backoff.get_stats();
+    PLOGI.printf(
+        "[cons:%u] poll rounds %lu, miss ratio %.3f | pauses %lu umwaits %lu "
+        "sleeps %lu",
+        this_cons_id, s.polls, backoff.miss_ratio(), s.pauses, s.umwaits,
+        s.sleeps);
+  }
 #ifdef CONFIG_ALIGN_BQUEUE_METADATA
   for (auto i = 0u; i < n_prod; ++i) {
     auto *q = cqueues[i];
@@ -663,7 +720,7 @@ void QueueTest<T>::find_thread(int tid, int n_prod, int n_cons, bool is_join,
     auto ht_size = get_ht_size(n_cons);
     PLOGV.printf("[find%u] init_ht ht_size: %u | id: %d", tid, ht_size,
                  sh->shard_idx);
-    ktable = init_ht(ht_size, sh->shard_idx);
+    ktable = init_ht(ht_size, sh->shard_idx, sh->numa_node);
     this->ht_vec->at(tid) = ktable;
   } else {
     PLOGD.printf("Dist to nodes tid %u", tid);
@@ -832,6 +889,156 @@ void QueueTest<T>::find_thread(int tid, int n_prod, int n_cons, bool is_join,
 #endif
 }
 
+template <typename T>
+void QueueTest<T>::run_bulk_test(Configuration *cfg, NumaPolicyQueues *npq) {
+  constexpr uint64_t NUM_MSGS = 1ULL << 24;
+  // 0 stands for the single-entry enqueue/dequeue. All sizes divide a
+  // section, so the producer always ends on a published section.
+  const uint32_t bulk_sizes[] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256};
+  const uint32_t prod_cpu = npq->get_assigned_cpu_list_producers()[0];
+  const uint32_t cons_cpu = npq->get_assigned_cpu_list_consumers()[0];
+
+  for (uint32_t bulk : bulk_sizes) {
+    T *q;
+    if constexpr (std::is_same<T, SectionQueue>::value) {
+      q = new T(1, 1, 4, std::vector<uint32_t>{prod_cpu});
+    } else if constexpr (std::is_same<T, BQueueAligned>::value) {
+      q = new T(1, 1, QueueTest::BQ_QUEUE_SIZE);
+    } else if constexpr (std::is_same<T, LynxQueue>::value) {
+      // no bulk interface, only the single-entry row to compare against
+      if (bulk > 0) {
+        break;
+      }
+      q = new T(1, 1, QueueTest::LYNX_QUEUE_SIZE,
+                std::vector<uint32_t>{prod_cpu});
+    } else {
+      PLOGE.printf("bulk test is not supported on this queue");
+      return;
+    }
+
+    auto enqueue = [q, bulk](std::span<const data_t> v) -> size_t {
+      if constexpr (std::is_same<T, SectionQueue>::value) {
+        auto pq = &q->all_pqueues[0][0];
+        if (bulk == 0) {
+          return q->enqueue(pq, 0, 0, v[0]) == SUCCESS;
+        }
+        return q->enqueue_bulk(pq, 0, 0, v);
+      } else if constexpr (std::is_same<T, BQueueAligned>::value) {
+        if (bulk == 0) {
+          return q->enqueue(0, 0, v[0]) == SUCCESS;
+        }
+        return q->enqueue_bulk(0, 0, v);
+      } else if constexpr (std::is_same<T, LynxQueue>::value) {
+        return q->enqueue(&q->all_pqueues[0][0], 0, 0, v[0]) == SUCCESS;
+      }
+      return 0;
+    };
+
+    auto dequeue = [q, bulk](std::span<data_t> v) -> size_t {
+      if constexpr (std::is_same<T, SectionQueue>::value) {
+        auto cq = &q->all_cqueues[0][0];
+        if (bulk == 0) {
+          return q->dequeue(cq, 0, 0, &v[0]) == SUCCESS;
+        }
+        return q->dequeue_bulk(cq, 0, 0, v);
+      } else if constexpr (std::is_same<T, BQueueAligned>::value) {
+        if (bulk == 0) {
+          return q->dequeue(0, 0, &v[0]) == SUCCESS;
+        }
+        return q->dequeue_bulk(0, 0, v);
+      } else if constexpr (std::is_same<T, LynxQueue>::value) {
+        return q->dequeue(&q->all_cqueues[0][0], 0, 0, &v[0]) == SUCCESS;
+      }
+      return 0;
+    };
+
+    const uint32_t n = bulk ? bulk : 1;
+    std::barrier<> barrier(2);
+    uint64_t t_start = 0, t_end = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start_ts, end_ts;
+
+    auto producer = [&]() {
+      std::vector<data_t> msgs(n);
+      barrier.arrive_and_wait();
+      start_ts = std::chrono::steady_clock::now();
+      t_start = RDTSC_START();
+      for (uint64_t sent = 0; sent < NUM_MSGS;) {
+        for (uint32_t i = 0; i < n; i++) {
+          msgs[i] = data_t(sent + i + 1, sent + i + 1);
+        }
+        std::span<const data_t> v(msgs);
+        while (!v.empty()) {
+          v = v.subspan(enqueue(v));
+        }
+        sent += n;
+      }
+      if constexpr (std::is_same<T, BQueueAligned>::value ||
+                    std::is_same<T, LynxQueue>::value) {
+        // let the consumer drain the last partial batch
+        q->push_done(0, 0);
+      }
+    };
+
+    auto consumer = [&]() {
+      std::vector<data_t> msgs(n);
+      uint64_t received = 0, last = 0;
+      barrier.arrive_and_wait();
+      while (received < NUM_MSGS) {
+        size_t got = dequeue(std::span<data_t>(msgs.data(), n));
+        if (got > 0) {
+          last = msgs[got - 1].key;
+          received += got;
+        }
+      }
+      t_end = RDTSCP();
+      end_ts = std::chrono::steady_clock::now();
+      if (last != NUM_MSGS) {
+        PLOGE.printf("bulk %u: last message %lu, expected %lu", bulk, last,
+                     NUM_MSGS);
+      }
+    };
+
+    cpu_set_t cpuset;
+    std::thread prod_thread(producer);
+    CPU_ZERO(&cpuset);
+    CPU_SET(prod_cpu, &cpuset);
+    pthread_setaffinity_np(prod_thread.native_handle(), sizeof(cpu_set_t),
+                           &cpuset);
+    std::thread cons_thread(consumer);
+    CPU_ZERO(&cpuset);
+    CPU_SET(cons_cpu, &cpuset);
+    pthread_setaffinity_np(cons_thread.native_handle(), sizeof(cpu_set_t),
+                           &cpuset);
+    prod_thread.join();
+    cons_thread.join();
+
+    auto us =
+        chrono::duration_cast<chrono::microseconds>(end_ts - start_ts).count();
+    PLOGI.printf("bulk %3u: %.2f Mmsgs/s | %.2f cycles per msg%s", n,
+                 us ? (double)NUM_MSGS / us : 0.0,
+                 (double)(t_end - t_start) / NUM_MSGS,
+                 bulk ? "" : " (enqueue/dequeue)");
+    delete q;
+  }
+}
+
+template <typename T>
+std::vector<uint32_t> QueueTest<T>::get_producer_cpus() {
+  std::vector<uint32_t> cpus;
+  bool on_main = false;
+  for (auto cpu : this->npq->get_assigned_cpu_list_producers()) {
+    if (cpu == 0) {
+      on_main = true;
+      continue;
+    }
+    cpus.push_back(cpu);
+  }
+  if (on_main) {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
 template <typename T>
 void QueueTest<T>::init_queues(uint32_t nprod, uint32_t ncons) {
   PLOG_DEBUG.printf("Initializing queues");
@@ -841,8 +1048,26 @@ void QueueTest<T>::init_queues(uint32_t nprod, uint32_t ncons) {
     this->QUEUE_SIZE = QueueTest::BQ_QUEUE_SIZE;
   } else if (std::is_same<T, kmercounter::SectionQueue>::value) {
     this->QUEUE_SIZE = 4;
+  } else if (std::is_same<T, kmercounter::MPMCQueue>::value) {
+    this->QUEUE_SIZE = QueueTest::MPMC_QUEUE_SIZE;
+  }
+  if constexpr (std::is_same<T, SectionQueue>::value) {
+    this->queues = new T(nprod, ncons, this->QUEUE_SIZE,
+                         this->get_producer_cpus(),
+                         this->npq->get_assigned_cpu_list_consumers(),
+                         (queue_placement)this->cfg->queue_placement,
+                         this->cfg->queue_hugepages);
+  } else if constexpr (std::is_same<T, LynxQueue>::value) {
+    this->queues =
+        new T(nprod, ncons, this->QUEUE_SIZE, this->get_producer_cpus());
+  } else {
+    this->queues = new T(nprod, ncons, this->QUEUE_SIZE, this->npq);
+  }
+  if constexpr (has_doorbells<T>) {
+    if (this->cfg->consumer_backoff) {
+      this->queues->enable_doorbells();
+    }
   }
-  this->queues = new T(nprod, ncons, this->QUEUE_SIZE, this->npq);
 }
 
 template <typename T>
@@ -881,7 +1106,13 @@ void QueueTest<T>::run_test(Configuration *cfg, Numa *n, bool is_join,
   }
 
   // 2) spawn n_prod + n_cons threads for find
-  if (!is_join || cfg->rw_queues) this->run_find_test(cfg, n, is_join, npq);
+  if (!is_join || cfg->rw_queues) {
+    if (cfg->queued_finds) {
+      this->run_queued_find_test(cfg, npq);
+    } else {
+      this->run_find_test(cfg, n, is_join, npq);
+    }
+  }
 
   end_ts = std::chrono::steady_clock::now();
 
@@ -980,6 +1211,308 @@ void QueueTest<T>::run_find_test(Configuration *cfg, Numa *n, bool is_join,
   print_stats(this->shards, *cfg);
 }
 
+template <typename T>
+void QueueTest<T>::run_queued_find_test(Configuration *cfg,
+                                        NumaPolicyQueues *npq) {
+  if constexpr (!std::is_same<T, SectionQueue>::value) {
+    // the producers must not block on a full queue while their responses
+    // pile up, which needs try_enqueue()
+    PLOGE.printf("queued finds are only supported on section queues");
+    return;
+  } else {
+    const uint32_t n_prod = cfg->n_prod;
+    const uint32_t n_cons = cfg->n_cons;
+    const uint32_t window = cfg->queued_finds;
+
+    if (window & (window - 1)) {
+      PLOGE.printf("queued-finds must be a power of two");
+      exit(-1);
+    }
+
+    // requests go from producer p to consumer c on req[p][c], the responses
+    // come back on resp[c][p], both placed as --queue-placement says
+    const auto placement = (queue_placement)cfg->queue_placement;
+    T req(n_prod, n_cons, this->QUEUE_SIZE,
+          npq->get_assigned_cpu_list_producers(),
+          npq->get_assigned_cpu_list_consumers(), placement,
+          cfg->queue_hugepages);
+    T resp(n_cons, n_prod, this->QUEUE_SIZE,
+           npq->get_assigned_cpu_list_consumers(),
+           npq->get_assigned_cpu_list_producers(), placement,
+           cfg->queue_hugepages);
+
+    std::vector<uint64_t> round_trips(n_prod);
+    std::barrier<> barrier(n_prod + n_cons);
+
+    auto client = [&](uint32_t tid) {
+      Shard *sh = &this->shards[tid];
+      Hasher hasher;
+      auto [ratio, num_messages, key_start] = get_params(n_prod, n_cons, tid);
+      std::vector<typename T::prod_queue_t *> pqueues(n_cons);
+      std::vector<typename T::cons_queue_t *> cqueues(n_cons);
+      std::vector<find_completion> ring(window);
+      uint32_t next_id = 0;
+      uint64_t issued = 0, completed = 0, found = 0, round_trip = 0;
+
+#ifdef LATENCY_COLLECTION
+      const auto collector = &collectors.at(tid);
+      collector->claim();
+#endif
+
+      for (auto c = 0u; c < n_cons; c++) {
+        pqueues[c] = &req.all_pqueues[tid][c];
+        cqueues[c] = &resp.all_cqueues[tid][c];
+      }
+
+      auto harvest = [&]() {
+        uint64_t got = 0;
+        data_t m;
+        for (auto c = 0u; c < n_cons; c++) {
+          while (resp.dequeue(cqueues[c], c, tid, &m) == SUCCESS) {
+            if (m.key == 0) {
+              continue;
+            }
+            find_completion &slot = ring[(uint32_t)m.key & (window - 1)];
+            round_trip += _rdtsc() - slot.start;
+#ifdef LATENCY_COLLECTION
+            collector->sync_end(slot.start);
+#endif
+            slot.pending = false;
+            found += (m.key & FIND_RESP_FOUND) != 0;
+            got++;
+          }
+        }
+        completed += got;
+        return got;
+      };
+
+      // publish the requests of unfinished sections
+      auto flush = [&]() {
+        for (auto c = 0u; c < n_cons; c++) {
+          while (!req.at_section_start(pqueues[c])) {
+            while (req.try_enqueue(pqueues[c], tid, c, data_t{}) == RETRY) {
+              harvest();
+            }
+          }
+        }
+      };
+
+      auto wait = [&]() {
+        if (harvest() == 0) {
+          flush();
+          _mm_pause();
+        }
+      };
+
+      barrier.arrive_and_wait();
+      auto t_start = RDTSC_START();
+
+      struct xorwow_state _xw_state, init_state;
+      xorwow_init(&_xw_state);
+      init_state = _xw_state;
+
+      for (auto m = 0u; m < config.insert_factor; m++) {
+        uint64_t k = key_start;
+        [[maybe_unused]] auto zipf_idx = key_start == 1 ? 0 : key_start;
+        _xw_state = init_state;
+
+        for (auto i = 0u; i < num_messages; i++) {
+#if defined(XORWOW)
+          k = xorwow(&_xw_state);
+#elif defined(BQ_TESTS_INSERT_ZIPFIAN)
+          k = g_zipf_values->at(zipf_idx++);
+#endif
+          uint32_t c = hash_to_cpu(hasher(&k, sizeof(k)), n_cons);
+
+          find_completion &slot = ring[next_id & (window - 1)];
+          while (slot.pending) {
+            wait();
+          }
+#ifdef LATENCY_COLLECTION
+          slot.start = collector->sync_start();
+#else
+          slot.start = _rdtsc();
+#endif
+          slot.pending = true;
+
+          while (req.try_enqueue(pqueues[c], tid, c, data_t(k, next_id)) ==
+                 RETRY) {
+            harvest();
+          }
+          next_id++;
+          issued++;
+#if !defined(XORWOW) && !defined(BQ_TESTS_INSERT_ZIPFIAN)
+          k++;
+#endif
+        }
+      }
+
+      while (completed < issued) {
+        wait();
+      }
+      auto t_end = RDTSCP();
+
+      for (auto c = 0u; c < n_cons; c++) {
+        req.push_done(tid, c);
+      }
+
+      sh->stats->finds.duration = t_end - t_start;
+      sh->stats->finds.op_count = completed;
+      sh->stats->found = found;
+      round_trips[tid] = round_trip;
+
+      PLOGV.printf(
+          "[client:%u] %lu finds (%lu found) | avg round trip %lu cycles", tid,
+          completed, found, completed ? round_trip / completed : 0);
+#ifdef LATENCY_COLLECTION
+      collector->dump("queued_find", tid);
+#endif
+    };
+
+    auto server = [&](uint32_t tid) {
+      Shard *sh = &this->shards[tid];
+      const uint32_t this_cons_id = tid - n_prod;
+      BaseHashTable *ktable = this->ht_vec->at(tid);
+      std::vector<typename T::prod_queue_t *> pqueues(n_prod);
+      std::vector<typename T::cons_queue_t *> cqueues(n_prod);
+      std::vector<bool> finished(n_prod, false);
+      uint32_t num_finished = 0;
+      uint64_t served = 0;
+
+      // a batch of requests of one producer, looked up together
+      std::vector<InsertFindArgument> items(config.batch_len);
+      std::vector<uint32_t> ids(config.batch_len);
+      std::vector<FindResult> results(config.batch_len);
+      std::vector<value_type> values(config.batch_len);
+      std::vector<bool> hits(config.batch_len);
+
+#ifdef LATENCY_COLLECTION
+      const auto collector = &collectors.at(tid);
+      collector->claim();
+#else
+      collector_type *const collector{};
+#endif
+
+      for (auto p = 0u; p < n_prod; p++) {
+        pqueues[p] = &resp.all_pqueues[this_cons_id][p];
+        cqueues[p] = &req.all_cqueues[this_cons_id][p];
+      }
+
+      auto respond = [&](uint32_t p, data_t m) {
+        while (resp.try_enqueue(pqueues[p], this_cons_id, p, m) == RETRY) {
+          _mm_pause();
+        }
+      };
+
+      auto answer = [&](uint32_t p, uint32_t cnt) {
+        ValuePairs vp{0, results.data()};
+        ktable->prefetch_queue(QueueType::find_queue);
+        ktable->find_batch(InsertFindArguments(items.data(), cnt), vp,
+                           collector);
+        ktable->flush_find_queue(vp, collector);
+
+        std::fill_n(hits.begin(), cnt, false);
+        for (auto r = 0u; r < vp.first; r++) {
+          hits[results[r].id] = true;
+          values[results[r].id] = results[r].value;
+        }
+        for (auto i = 0u; i < cnt; i++) {
+          uint64_t tag = FIND_RESP_TAG | (hits[i] ? FIND_RESP_FOUND : 0);
+          respond(p, data_t(ids[i] | tag, hits[i] ? values[i] : 0));
+        }
+        served += cnt;
+      };
+
+      barrier.arrive_and_wait();
+      auto t_start = RDTSC_START();
+
+      while (num_finished < n_prod) {
+        bool drained = true;
+
+        for (auto p = 0u; p < n_prod; p++) {
+          if (finished[p]) {
+            continue;
+          }
+          uint32_t cnt = 0;
+          data_t m;
+          while (cnt < config.batch_len &&
+                 req.dequeue(cqueues[p], p, this_cons_id, &m) == SUCCESS) {
+            if (m == T::BQ_MAGIC_KV) [[unlikely]] {
+              req.pop_done(p, this_cons_id);
+              finished[p] = true;
+              num_finished++;
+              break;
+            }
+            if (m.key == 0) {
+              continue;
+            }
+            items[cnt].key = m.key;
+            items[cnt].id = cnt;
+            items[cnt].part_id = tid;
+            ids[cnt] = (uint32_t)m.value;
+            cnt++;
+          }
+          if (cnt == config.batch_len) {
+            drained = false;
+          }
+          if (cnt > 0) {
+            answer(p, cnt);
+          }
+        }
+
+        // nothing else to do right now, hand out what we have
+        if (drained) {
+          for (auto p = 0u; p < n_prod; p++) {
+            while (!resp.at_section_start(pqueues[p])) {
+              respond(p, data_t{});
+            }
+          }
+        }
+      }
+      auto t_end = RDTSCP();
+
+      // the lookups are counted at the producers
+      sh->stats->finds.duration = t_end - t_start;
+      sh->stats->finds.op_count = 0;
+      sh->stats->found = 0;
+      PLOGV.printf("[server:%u] served %lu finds", this_cons_id, served);
+#ifdef LATENCY_COLLECTION
+      collector->dump("queued_find", tid);
+#endif
+    };
+
+    std::vector<std::thread> threads;
+    cpu_set_t cpuset;
+    auto spawn = [&](std::thread &&t, uint32_t cpu) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t), &cpuset);
+      threads.push_back(std::move(t));
+    };
+
+    uint32_t i = 0;
+    for (auto cpu : npq->get_assigned_cpu_list_producers()) {
+      spawn(std::thread(client, i++), cpu);
+    }
+    for (auto cpu : npq->get_assigned_cpu_list_consumers()) {
+      spawn(std::thread(server, i++), cpu);
+    }
+    for (auto &th : threads) {
+      th.join();
+    }
+
+    uint64_t finds = 0, round_trip = 0;
+    for (auto p = 0u; p < n_prod; p++) {
+      finds += this->shards[p].stats->finds.op_count;
+      round_trip += round_trips[p];
+    }
+    PLOGI.printf("Queued finds done: %lu finds, %u in flight per producer, "
+                 "avg round trip %lu cycles",
+                 finds, window, finds ? round_trip / finds : 0);
+    print_stats(this->shards, *cfg);
+  }
+}
+
 template <class T>
 void QueueTest<T>::insert_with_queues(Configuration *cfg, Numa *n, bool is_join,
                                       NumaPolicyQueues *npq) {
@@ -1029,6 +1562,8 @@ void QueueTest<T>::insert_with_queues(Configuration *cfg, Numa *n, bool is_join,
     if (assigned_cpu == 0) continue;
     Shard *sh = &this->shards[i];
     sh->shard_idx = i;
+    sh->assigned_cpu = assigned_cpu;
+    sh->numa_node = numa_node_of_cpu(assigned_cpu);
     auto _thread =
         std::thread(&QueueTest<T>::producer_thread, this, i, cfg->n_prod,
                     cfg->n_cons, false, cfg->skew, is_join, &barrier);
@@ -1047,13 +1582,19 @@ void QueueTest<T>::insert_with_queues(Configuration *cfg, Numa *n, bool is_join,
   uint32_t last_cpu = 0;
   CPU_SET(last_cpu, &cpuset);
   sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
+  main_sh->assigned_cpu = last_cpu;
+  main_sh->numa_node = numa_node_of_cpu(last_cpu);
   PLOG_DEBUG.printf("Thread 'controller': affinity: %u", last_cpu);
 
-  // Spawn consumer threads
+  // Spawn consumer threads. A consumer's partition is allocated on its node
+  // (--local-partitions), next to the queues it drains with
+  // --queue-placement=1.
   i = cfg->n_prod;
   for (auto assigned_cpu : this->npq->get_assigned_cpu_list_consumers()) {
     Shard *sh = &this->shards[i];
     sh->shard_idx = i;
+    sh->assigned_cpu = assigned_cpu;
+    sh->numa_node = numa_node_of_cpu(assigned_cpu);
 
     PLOG_DEBUG.printf("tid %d assigned cpu %d", i, assigned_cpu);
 
@@ -1096,9 +1637,8 @@ void QueueTest<T>::insert_with_queues(Configuration *cfg, Numa *n, bool is_join,
 }
 
 template class QueueTest<SectionQueue>;
+template class QueueTest<MPMCQueue>;
+template class QueueTest<LynxQueue>;
 
-const data_t SectionQueue::BQ_MAGIC_KV =
-    data_t(SectionQueue::BQ_MAGIC_64BIT, SectionQueue::BQ_MAGIC_64BIT);
-// template class QueueTest<LynxQueue>;
 // template class QueueTest<BQueueAligned>;
 }  // namespace kmercounter
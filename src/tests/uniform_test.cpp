@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <cstdlib>
+#include "misc_lib.h"
 #include "tests/UniformTest.hpp"
 
 namespace kmercounter {
@@ -211,6 +212,9 @@ void UniformTest::run(Shard *shard, BaseHashTable *hashtable,
 
   if (shard->shard_idx == 0) {
     PLOGI.printf("test insert end");
+  }
+  use_local_replica(shard, hashtable, sync_barrier);
+  if (shard->shard_idx == 0) {
     PLOGI.printf("test find start");
   }
   find_timings = do_uniform_gets(hashtable, shard->shard_idx, requests_num, sync_barrier);
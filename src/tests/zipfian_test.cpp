@@ -14,9 +14,11 @@
 #include "./hashtables/folklore_kht.hpp"
 
 
+#include "misc_lib.h"
 #include "print_stats.h"
 #include "sync.h"
 #include "utils/hugepage_allocator.hpp"
+#include "utils/prefetch_tuner.hpp"
 #include "utils/vtune.hpp"
 
 #ifdef ENABLE_HIGH_LEVEL_PAPI
@@ -30,6 +32,7 @@
 #ifdef WITH_PCM
 #include "PCMCounter.hpp"
 #endif
+#include <memory>
 #include <random>
 namespace kmercounter {
 
@@ -60,7 +63,28 @@ extern std::vector<key_type> *g_zipf_values;
 using HashTableTestHugepageAlloc = huge_page_allocator<key_type>;
 using HashTableTestVec = std::vector<key_type, HashTableTestHugepageAlloc>;
 
-uint64_t do_batch_insertion(BaseHashTable *ht, HashTableTestVec &workload) {
+/// The table to run the coroutine engine on (--coro-group), or nullptr to
+/// use the queues.
+CASHashTable<KVType, ItemQueue> *get_coro_table(BaseHashTable *ht) {
+  if (config.coro_group == 0) {
+    return nullptr;
+  }
+  auto *cas_ht = dynamic_cast<CASHashTable<KVType, ItemQueue> *>(ht);
+  if (!cas_ht) {
+    PLOGE.printf("the coroutine engine is only implemented by casht++");
+    abort();
+  }
+  if (!cas_ht->set_coro_group(config.coro_group)) {
+    PLOGE.printf("invalid coroutine group %u (1 to %u)", config.coro_group,
+                 CoroExecutor::MAX_GROUP);
+    abort();
+  }
+  return cas_ht;
+}
+
+uint64_t do_batch_insertion(BaseHashTable *ht, HashTableTestVec &workload,
+                            PrefetchTuner *tuner = nullptr) {
+  CASHashTable<KVType, ItemQueue> *coro_ht = get_coro_table(ht);
 #if defined(CAS_NO_ABSTRACT)
   CASHashTable<KVType, ItemQueue> *cas_ht =
       static_cast<CASHashTable<KVType, ItemQueue> *>(ht);
@@ -79,6 +103,7 @@ uint64_t do_batch_insertion(BaseHashTable *ht, HashTableTestVec &workload) {
       64, sizeof(InsertFindArgument) * config.batch_len);
   key_type value;
   uint64_t idx = 0;
+  if (tuner) tuner->pause();
   for (uint64_t n = 0; n < batch_num; ++n) {
     for (uint32_t i = 0; i < batch_len; i++) {
       if (!(idx & 7) && idx + 16 < request_num) {
@@ -94,11 +119,16 @@ uint64_t do_batch_insertion(BaseHashTable *ht, HashTableTestVec &workload) {
 
     InsertFindArguments keypairs(items, batch_len);
 
+    if (coro_ht) {
+      coro_ht->insert_batch_coro(keypairs, collector);
+    } else {
 #if defined(CAS_NO_ABSTRACT)
-    cas_ht->insert_batch_inline(keypairs, collector);
+      cas_ht->insert_batch_inline(keypairs, collector);
 #else
-    ht->insert_batch(keypairs, collector);
+      ht->insert_batch(keypairs, collector);
 #endif
+    }
+    if (tuner) tuner->tick(batch_len);
   }
 
   uint64_t residue_num = request_num - batch_len * batch_num;
@@ -113,11 +143,15 @@ uint64_t do_batch_insertion(BaseHashTable *ht, HashTableTestVec &workload) {
       idx++;
     }
     InsertFindArguments keypairs(items, residue_num);
+    if (coro_ht) {
+      coro_ht->insert_batch_coro(keypairs, collector);
+    } else {
 #if defined(CAS_NO_ABSTRACT)
-    cas_ht->insert_batch_inline(keypairs, collector);
+      cas_ht->insert_batch_inline(keypairs, collector);
 #else
-    ht->insert_batch(keypairs, collector);
+      ht->insert_batch(keypairs, collector);
 #endif
+    }
   }
   ht->flush_insert_queue(collector);
   free(items);
@@ -131,7 +165,8 @@ struct ht_do_batch_find_ret {
 };
 
 uint64_t do_batch_find(BaseHashTable *ht, HashTableTestVec &workload,
-                       uint64_t *found_res) {
+                       uint64_t *found_res, PrefetchTuner *tuner = nullptr) {
+  CASHashTable<KVType, ItemQueue> *coro_ht = get_coro_table(ht);
 #if defined(CAS_NO_ABSTRACT)
   CASHashTable<KVType, ItemQueue> *cas_ht =
       static_cast<CASHashTable<KVType, ItemQueue> *>(ht);
@@ -158,6 +193,7 @@ uint64_t do_batch_find(BaseHashTable *ht, HashTableTestVec &workload,
 
   ValuePairs vp = std::make_pair(0, results);
   key_type value;
+  if (tuner) tuner->pause();
   for (uint64_t n = 0; n < batch_num; ++n) {
     for (uint32_t i = 0; i < batch_len; i++) {
       if (!(idx & 7) && idx + 16 < request_num) {
@@ -173,14 +209,20 @@ uint64_t do_batch_find(BaseHashTable *ht, HashTableTestVec &workload,
 
     vp.first = 0;
 
+    if (coro_ht) {
+      coro_ht->find_batch_coro(InsertFindArguments(items, batch_len), vp,
+                               collector);
+    } else {
 #if defined(CAS_NO_ABSTRACT)
-    cas_ht->find_batch_inline(InsertFindArguments(items, batch_len), vp,
-                              collector);
+      cas_ht->find_batch_inline(InsertFindArguments(items, batch_len), vp,
+                                collector);
 #else
-    ht->find_batch(InsertFindArguments(items, batch_len), vp, collector);
+      ht->find_batch(InsertFindArguments(items, batch_len), vp, collector);
 #endif
+    }
 
     found += vp.first;
+    if (tuner) tuner->tick(batch_len);
   }
 
   uint64_t residue_num = request_num - batch_len * batch_num;
@@ -196,12 +238,17 @@ uint64_t do_batch_find(BaseHashTable *ht, HashTableTestVec &workload,
     }
 
     vp.first = 0;
+    if (coro_ht) {
+      coro_ht->find_batch_coro(InsertFindArguments(items, residue_num), vp,
+                               collector);
+    } else {
 #if defined(CAS_NO_ABSTRACT)
-    cas_ht->find_batch_inline(InsertFindArguments(items, residue_num), vp,
-                              collector);
+      cas_ht->find_batch_inline(InsertFindArguments(items, residue_num), vp,
+                                collector);
 #else
-    ht->find_batch(InsertFindArguments(items, residue_num), vp, collector);
+      ht->find_batch(InsertFindArguments(items, residue_num), vp, collector);
 #endif
+    }
 
     found += vp.first;
   }
@@ -224,7 +271,8 @@ uint64_t do_batch_find(BaseHashTable *ht, HashTableTestVec &workload,
 OpTimings do_zipfian_inserts(
     BaseHashTable *hashtable,
     unsigned int id, std::barrier<std::function<void()>> *sync_barrier,
-    std::vector<key_type, huge_page_allocator<key_type>> &zipf_set) {
+    std::vector<key_type, huge_page_allocator<key_type>> &zipf_set,
+    PrefetchTuner *tuner) {
   if (config.insert_factor == 0) return {1, 1};
 
   uint64_t ops = 0;
@@ -235,7 +283,7 @@ OpTimings do_zipfian_inserts(
   sync_barrier->arrive_and_wait();
 
   for (auto j = 0u; j < config.insert_factor; j++) {
-    ops += do_batch_insertion(hashtable, zipf_set);
+    ops += do_batch_insertion(hashtable, zipf_set, tuner);
   }
 
   if (id == 0) {
@@ -254,7 +302,8 @@ OpTimings do_zipfian_inserts(
 
 OpTimings do_zipfian_gets(BaseHashTable *hashtable,
                           unsigned int id, auto sync_barrier,
-                          HashTableTestVec &zipf_set, uint64_t *found) {
+                          HashTableTestVec &zipf_set, uint64_t *found,
+                          PrefetchTuner *tuner) {
   if (config.read_factor == 0) {
     return {1, 1};
   }
@@ -269,7 +318,7 @@ OpTimings do_zipfian_gets(BaseHashTable *hashtable,
   sync_barrier->arrive_and_wait();
 
   for (auto j = 0u; j < config.read_factor; j++) {
-    ops += do_batch_find(hashtable, zipf_set, &found_per_turn);
+    ops += do_batch_find(hashtable, zipf_set, &found_per_turn, tuner);
     *found = *found + found_per_turn;
   }
 
@@ -338,9 +387,17 @@ void ZipfianTest::run(Shard *shard, BaseHashTable *hashtable,
   if (shard->shard_idx == 0) {
     PLOGI.printf("zipfian test insert start");
   }
+  std::unique_ptr<PrefetchTuner> insert_tuner, find_tuner;
+  if (config.adaptive_prefetch) {
+    insert_tuner = std::make_unique<PrefetchTuner>(
+        hashtable, QueueType::insert_queue, config.find_queue_sz);
+    find_tuner = std::make_unique<PrefetchTuner>(
+        hashtable, QueueType::find_queue, config.find_queue_sz);
+  }
+
   insert_timings =
       do_zipfian_inserts(hashtable, shard->shard_idx,
-                         sync_barrier, zipf_set_local);
+                         sync_barrier, zipf_set_local, insert_tuner.get());
   if (shard->shard_idx == 0) {
     PLOGI.printf("zipfian test insert end");
   }
@@ -389,13 +446,16 @@ void ZipfianTest::run(Shard *shard, BaseHashTable *hashtable,
   __itt_resume();
 #endif
 
+  use_local_replica(shard, hashtable, sync_barrier);
+
   if (shard->shard_idx == 0) {
     PLOGI.printf("zipfian test find start");
   }
 
   uint64_t found = 0;
   find_timings = do_zipfian_gets(hashtable, shard->shard_idx,
-                                 sync_barrier, zipf_set_local, &found);
+                                 sync_barrier, zipf_set_local, &found,
+                                 find_tuner.get());
 
   if (shard->shard_idx == 0) {
     PLOGI.printf("zipfian test find end");
@@ -413,6 +473,19 @@ void ZipfianTest::run(Shard *shard, BaseHashTable *hashtable,
 
   shard->stats->finds = find_timings;
   shard->stats->found = found;
+  if (config.adaptive_prefetch) {
+    PLOGI.printf(
+        "shard %u converged insert queue depth %u distance %u (%.1f "
+        "cycles/op, %u moves%s), find queue depth %u distance %u (%.1f "
+        "cycles/op, %u moves%s)",
+        shard->shard_idx, insert_tuner->get_depth(),
+        insert_tuner->get_distance(), insert_tuner->get_cost(),
+        insert_tuner->get_moves(),
+        insert_tuner->is_settled() ? "" : ", still searching",
+        find_tuner->get_depth(), find_tuner->get_distance(),
+        find_tuner->get_cost(), find_tuner->get_moves(),
+        find_tuner->is_settled() ? "" : ", still searching");
+  }
   get_ht_stats(shard, hashtable);
 
   if (shard->shard_idx == 0) {
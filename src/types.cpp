@@ -1,5 +1,7 @@
 #include "types.hpp"
 
+#include <unistd.h>
+
 #include <iostream>
 
 #include "eth_hashjoin/src/types64.hpp"
@@ -28,6 +30,10 @@ Key::Key() : key(0) {}
 
 // Global config. This is a temporary dirty hack.
 Configuration config;
+// Used by the queues, which are built into the tests as well as dramhit.
+extern const uint64_t CACHELINE_SIZE = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+extern const uint64_t CACHELINE_MASK = CACHELINE_SIZE - 1;
+extern const uint64_t PAGESIZE = sysconf(_SC_PAGESIZE);
 // Extern stuff
 const char* ht_type_strings[] = {
     "",
@@ -39,7 +45,11 @@ const char* ht_type_strings[] = {
     "GROW_HT",
     "CLHT_HT",
     "CAS23_HT",
-    "TBB_HT"
+    "TBB_HT",
+    "DLHT_HT",
+    "FOLKLORE_HT",
+    "DELEGATED_HT",
+    "HYBRID_HT"
 };
 const char* run_mode_strings[] = {
     "",
@@ -53,9 +63,13 @@ const char* run_mode_strings[] = {
     "BQ_TESTS_YES_BQ", // 8
     "BQ_TESTS_NO_BQ", // 9 
     "CACHE_MISS", // 10
-    "ZIPFIAN", // 11 
+    "UNIFORM", // 11
     "RW_RATIO", // 12 
     "HASHJOIN", // 13
-    "UNIFORM", // 14
+    "ZIPFIAN", // 14
+    "BW", // 15
+    "PARTITIONJOINV1", // 16
+    "PARTITIONJOINV2", // 17
+    "DELEGATEDJOIN", // 18
 };
 }  // namespace kmercounter
\ No newline at end of file
@@ -6,17 +6,27 @@
 #include <plog/Log.h>
 
 #include <cassert>
+#include <chrono>
+#include <functional>
 #include <initializer_list>
 #include <iostream>
 #include <memory>
 #include <span>
 #include <string_view>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "hashtable.h"
+#include "hashtables/batch_runner/batch_combiner.hpp"
 #include "hashtables/batch_runner/batch_runner.hpp"
 #include "hashtables/cas_kht.hpp"
+#include "hashtables/delegated_kht.hpp"
+#include "hashtables/folklore_kht.hpp"
+#include "hashtables/hybrid_kht.hpp"
+#include "hashtables/payload_kht.hpp"
 #include "hashtables/simple_kht.hpp"
+#include "hashtables/wide_kht.hpp"
 #include "test_lib.hpp"
 
 namespace kmercounter {
@@ -30,10 +40,17 @@ using testing::UnorderedElementsAre;
 // Hashtable names.
 const char PARTITIONED_HT[] = "Partitioned HT";
 const char CAS_HT[] = "CAS HT";
+const char FOLKLORE_HT[] = "Folklore HT";
 constexpr const char* HTS[]{
     PARTITIONED_HT,
     CAS_HT,
 };
+// Hashtables that support erase_batch.
+constexpr const char* ERASE_HTS[]{
+    PARTITIONED_HT,
+    CAS_HT,
+    FOLKLORE_HT,
+};
 
 // Helper for checking the find results.
 class FindResultChecker {
@@ -89,6 +106,10 @@ class HashtableTest : public ::testing::TestWithParam<const char*> {
             return new kmercounter::CASHashTable<kmercounter::Item,
                                                  kmercounter::ItemQueue>{
                 hashtable_size};
+          else if (ht_name == FOLKLORE_HT)
+            return new kmercounter::FolkloreHashTable<kmercounter::Item,
+                                                      kmercounter::ItemQueue>{
+                hashtable_size};
           else
             return nullptr;
         }());
@@ -217,5 +238,1307 @@ TEST_P(HashtableTest, BATCH_QUERY_TEST) {
 INSTANTIATE_TEST_CASE_P(TestAllHashtables, HashtableTest,
                         ::testing::ValuesIn(HTS));
 
+class EraseTest : public HashtableTest {
+ protected:
+  /// Look up keys [1, test_size], of which the odd ones were erased, and
+  /// return the number of hits.
+  uint64_t find_all(uint64_t test_size) {
+    return find_range(1, test_size, [](uint64_t key) { return key % 2; });
+  }
+
+  /// Look up keys [first, last] and return the number of hits. The find
+  /// results are checked by hand, as `HTBatchFinder` drops them.
+  uint64_t find_range(uint64_t first, uint64_t last,
+                      const std::function<bool(uint64_t)>& erased) {
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    uint64_t found = 0;
+    auto check_results = [&](const ValuePairs& vp) {
+      for (uint32_t i = 0; i < vp.first; i++) {
+        EXPECT_FALSE(erased(results[i].id)) << "Erased key found " << results[i];
+        EXPECT_EQ(results[i].value, (uint64_t)results[i].id * results[i].id);
+      }
+      found += vp.first;
+    };
+
+    for (uint64_t i = first; i <= last; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+      }
+      ValuePairs vp{0, results};
+      ht_->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+      check_results(vp);
+    }
+    size_t remaining;
+    do {
+      ValuePairs vp{0, results};
+      remaining = ht_->flush_find_queue(vp);
+      check_results(vp);
+    } while (remaining > 0);
+    return found;
+  }
+};
+
+/// Erase every odd key and make sure that the even keys behind them in the
+/// probe sequences can still be found, before and after compaction.
+TEST_P(EraseTest, BATCH_ERASE_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+
+  for (uint64_t i = 1; i <= test_size; i++) {
+    batch_runner_.insert(i, i * i);
+  }
+  batch_runner_.flush_insert();
+  ASSERT_EQ(ht_->get_fill(), test_size);
+
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 1; i <= test_size; i += 2 * HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + 2 * j, .value = 0, .id = (uint32_t)(i + 2 * j)};
+    }
+    ht_->erase_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  ht_->flush_erase_queue();
+
+  EXPECT_EQ(ht_->get_fill(), test_size / 2);
+  EXPECT_EQ(find_all(test_size), test_size / 2);
+
+  ht_->compact();
+  EXPECT_EQ(ht_->get_fill(), test_size / 2);
+  EXPECT_EQ(find_all(test_size), test_size / 2);
+
+  // Erase the rest and insert it back.
+  for (uint64_t i = 2; i <= test_size; i += 2) {
+    args[0] = {.key = i, .value = 0, .id = (uint32_t)i};
+    ht_->erase_batch(InsertFindArguments(args, 1));
+  }
+  ht_->flush_erase_queue();
+  EXPECT_EQ(ht_->get_fill(), 0u);
+  EXPECT_EQ(find_all(test_size), 0u);
+
+  for (uint64_t i = 2; i <= test_size; i += 2) {
+    batch_runner_.insert(i, i * i);
+  }
+  batch_runner_.flush_insert();
+  EXPECT_EQ(ht_->get_fill(), test_size / 2);
+  EXPECT_EQ(find_all(test_size), test_size / 2);
+}
+
+/// TOMBSTONE_KEY is a valid key to the partitioned table, which shifts erased
+/// entries out, but the shared tables mark erased slots with it. There it is
+/// rejected, instead of being stored as an erased slot that compaction drops.
+TEST_P(EraseTest, TOMBSTONE_KEY_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  const bool stored = std::string_view(GetParam()) == PARTITIONED_HT;
+  const uint64_t rejected = rejected_tombstone_keys;
+
+  batch_runner_.insert(TOMBSTONE_KEY, 42);
+  for (uint64_t i = 1; i <= test_size; i++) {
+    batch_runner_.insert(i, i * i);
+  }
+  batch_runner_.flush_insert();
+  EXPECT_EQ(rejected_tombstone_keys, rejected + !stored);
+  EXPECT_EQ(ht_->get_fill(), test_size + stored);
+
+  auto find_tombstone_key = [this]() {
+    InsertFindArgument arg{.key = TOMBSTONE_KEY, .value = 0, .id = 7};
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    ValuePairs vp{0, results};
+    ht_->find_batch(InsertFindArguments(&arg, 1), vp);
+    while (ht_->flush_find_queue(vp) > 0) {
+    }
+    for (uint32_t i = 0; i < vp.first; i++) {
+      EXPECT_EQ(results[i], FindResult(7, 42));
+    }
+    return vp.first;
+  };
+  EXPECT_EQ(find_tombstone_key(), stored);
+
+  // Erasing it must not touch the tombstones left by the other keys.
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 1; i <= test_size; i += 2 * HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + 2 * j, .value = 0, .id = (uint32_t)(i + 2 * j)};
+    }
+    ht_->erase_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  if (!stored) {
+    args[0] = {.key = TOMBSTONE_KEY, .value = 0, .id = 7};
+    ht_->erase_batch(InsertFindArguments(args, 1));
+  }
+  ht_->flush_erase_queue();
+
+  ht_->compact();
+  EXPECT_EQ(ht_->get_fill(), test_size / 2 + stored);
+  EXPECT_EQ(find_all(test_size), test_size / 2);
+  EXPECT_EQ(find_tombstone_key(), stored);
+}
+
+/// Keep inserting new keys and erasing the oldest ones, so that many more
+/// keys go through the table than it has slots. The inserts only keep
+/// succeeding if the tombstones are reclaimed along the way.
+TEST_P(EraseTest, CHURN_TEST) {
+#ifndef CAS_RECLAIM
+  // Otherwise the shared tables only reclaim them on compact(), and casht++
+  // when it migrates with CAS_RESIZE.
+  const std::string_view name = GetParam();
+  if (name == FOLKLORE_HT
+#ifndef CAS_RESIZE
+      || name == CAS_HT
+#endif
+  ) {
+    GTEST_SKIP() << name << " needs CAS_RECLAIM";
+  }
+#endif
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t live = ht_->get_capacity() / 4;
+  const uint64_t total = ht_->get_capacity() * 8;
+
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 1; i <= total; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      batch_runner_.insert(i + j, (i + j) * (i + j));
+    }
+    batch_runner_.flush_insert();
+    if (i <= live) {
+      continue;
+    }
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      const uint64_t key = i + j - live;
+      args[j] = {.key = key, .value = 0, .id = (uint32_t)key};
+    }
+    ht_->erase_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+    ht_->flush_erase_queue();
+  }
+
+  const uint64_t first_live = total - live + 1;
+  EXPECT_EQ(ht_->get_fill(), live);
+  EXPECT_EQ(find_range(first_live - HT_TESTS_BATCH_LENGTH, total,
+                       [=](uint64_t key) { return key < first_live; }),
+            live);
+}
+
+INSTANTIATE_TEST_CASE_P(TestErasableHashtables, EraseTest,
+                        ::testing::ValuesIn(ERASE_HTS));
+
+#ifdef CAS_RECLAIM
+/// CHURN_TEST with a few threads on the shared casht++, so that compactions
+/// start while the others are in the middle of their batches.
+TEST(CASReclaimTest, CONCURRENT_CHURN_TEST) {
+  using Table = kmercounter::CASHashTable<kmercounter::Item,
+                                          kmercounter::ItemQueue>;
+  config.no_prefetch = 0;
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  constexpr uint64_t capacity = 1ull << 14;
+  constexpr uint64_t num_threads = 4;
+  constexpr uint64_t live = capacity / 4 / num_threads;
+  constexpr uint64_t total = capacity * 4 / num_threads;
+
+  // One handle per thread on the shared table.
+  std::vector<std::unique_ptr<Table>> hts;
+  for (uint64_t i = 0; i < num_threads; i++) {
+    hts.emplace_back(new Table{capacity});
+  }
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t] {
+      BaseHashTable* ht = hts[t].get();
+      HTBatchRunner<> batch_runner(ht);
+      InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+      const uint64_t base = t * total;
+      for (uint64_t i = 1; i <= total; i += HT_TESTS_BATCH_LENGTH) {
+        for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+          const uint64_t key = base + i + j;
+          batch_runner.insert(key, key * key);
+        }
+        batch_runner.flush_insert();
+        if (i <= live) {
+          continue;
+        }
+        for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+          const uint64_t key = base + i + j - live;
+          args[j] = {.key = key, .value = 0, .id = (uint32_t)key};
+        }
+        ht->erase_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+        ht->flush_erase_queue();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(hts[0]->get_fill(), num_threads * live);
+  BaseHashTable* ht = hts[0].get();
+  for (uint64_t t = 0; t < num_threads; t++) {
+    const uint64_t first_live = (t + 1) * total - live + 1;
+    for (uint64_t key = first_live; key <= (t + 1) * total; key++) {
+      InsertFindArgument arg{.key = key, .value = 0, .id = (uint32_t)key};
+      FindResult result;
+      ValuePairs vp{0, &result};
+      ht->find_batch(InsertFindArguments(&arg, 1), vp);
+      while (vp.first == 0 && ht->flush_find_queue(vp) > 0) {
+      }
+      ASSERT_EQ(vp.first, 1u) << "Key " << key << " not found";
+      EXPECT_EQ(result.value, key * key);
+    }
+  }
+}
+
+/// Threads that come and go on a table that stays alive, e.g. one phase after
+/// the other, give their reclaimer slots back.
+TEST(CASReclaimTest, HANDLE_REUSE_TEST) {
+  using Table = kmercounter::CASHashTable<kmercounter::Item,
+                                          kmercounter::ItemQueue>;
+  config.no_prefetch = 0;
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  constexpr uint64_t capacity = 1ull << 12;
+  constexpr uint64_t rounds = 2 * TombstoneReclaimer::MAX_HANDLES;
+  // Enough tombstones for a compaction, which must not wait on the slots of
+  // the tables that are gone.
+  static_assert(rounds * 100 > capacity * TombstoneReclaimer::TOMBSTONE_LIMIT);
+  Table keep{capacity};
+
+  for (uint64_t i = 1; i <= rounds; i++) {
+    Table table{capacity};
+    BaseHashTable* ht = &table;
+    HTBatchRunner<> batch_runner(ht);
+    batch_runner.insert(i, i * i);
+    batch_runner.flush_insert();
+    InsertFindArgument arg{.key = i, .value = 0, .id = (uint32_t)i};
+    ht->erase_batch(InsertFindArguments(&arg, 1));
+    ht->flush_erase_queue();
+  }
+  EXPECT_EQ(keep.get_fill(), 0u);
+}
+#endif
+
+class MultiGetTest : public HashtableTest {};
+
+/// Look up present and missing keys, in an order that is not the insertion
+/// order, and with lengths that are not a multiple of the batch length.
+TEST_P(MultiGetTest, MULTI_GET_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+
+  for (uint64_t i = 1; i <= test_size; i++) {
+    batch_runner_.insert(i, i * 3);
+  }
+  batch_runner_.flush_insert();
+
+  for (size_t len : {size_t{1}, size_t{HT_TESTS_BATCH_LENGTH + 3},
+                     size_t{test_size}}) {
+    std::vector<key_type> keys(len);
+    for (size_t i = 0; i < len; i++) {
+      // every other key is missing
+      keys[i] = (i % 2) ? test_size + i : len - i;
+    }
+    std::vector<value_type> out(len, 0xdead);
+    std::vector<uint8_t> bitmap((len + 7) / 8, 0xff);
+
+    size_t found = ht_->multi_get(keys, out, bitmap);
+    EXPECT_EQ(found, (len + 1) / 2);
+    for (size_t i = 0; i < len; i++) {
+      bool hit = (bitmap[i / 8] >> (i % 8)) & 1;
+      EXPECT_EQ(hit, i % 2 == 0) << "key " << keys[i];
+      EXPECT_EQ(out[i], hit ? keys[i] * 3 : 0xdead) << "key " << keys[i];
+    }
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(TestAllHashtables, MultiGetTest,
+                        ::testing::ValuesIn(ERASE_HTS));
+
+// Hashtables that support per-node replicas.
+constexpr const char* REPLICATED_HTS[]{
+    CAS_HT,
+    FOLKLORE_HT,
+};
+
+class ReplicaTest : public HashtableTest {
+ protected:
+  /// Look up keys [1, n] through both the native and the find_batch based
+  /// multi_get and return the number of hits.
+  size_t count_found(uint64_t n) {
+    std::vector<key_type> keys(n);
+    for (uint64_t i = 0; i < n; i++) {
+      keys[i] = i + 1;
+    }
+    std::vector<value_type> out(n);
+    std::vector<uint8_t> bitmap((n + 7) / 8);
+    size_t found = ht_->multi_get(keys, out, bitmap);
+    for (uint64_t i = 0; i < n; i++) {
+      if ((bitmap[i / 8] >> (i % 8)) & 1) {
+        EXPECT_EQ(out[i], keys[i] * keys[i]);
+      }
+    }
+    EXPECT_EQ(ht_->BaseHashTable::multi_get(keys, out, bitmap), found);
+    return found;
+  }
+};
+
+/// Finds on a replica see the table as it was when it was replicated.
+TEST_P(ReplicaTest, SNAPSHOT_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  EXPECT_FALSE(ht_->use_replica(0));
+
+  for (uint64_t i = 1; i <= test_size / 2; i++) {
+    batch_runner_.insert(i, i * i);
+  }
+  batch_runner_.flush_insert();
+  if (!ht_->replicate()) {
+    GTEST_SKIP() << "replication is not supported by this build";
+  }
+  ASSERT_TRUE(ht_->use_replica(0));
+  EXPECT_FALSE(ht_->use_replica(CHAR_MAX));
+  EXPECT_EQ(count_found(test_size), test_size / 2);
+
+  for (uint64_t i = test_size / 2 + 1; i <= test_size; i++) {
+    batch_runner_.insert(i, i * i);
+  }
+  batch_runner_.flush_insert();
+  EXPECT_EQ(count_found(test_size), test_size / 2);
+
+  ASSERT_TRUE(ht_->use_replica(-1));
+  EXPECT_EQ(count_found(test_size), test_size);
+}
+
+INSTANTIATE_TEST_CASE_P(TestReplicatedHashtables, ReplicaTest,
+                        ::testing::ValuesIn(REPLICATED_HTS));
+
+template <typename HT>
+class UpsertTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    config.batch_len = HT_TESTS_BATCH_LENGTH;
+    const auto hashtable_size = absl::GetFlag(FLAGS_hashtable_size);
+    if constexpr (std::is_same_v<HT, PartitionedHashStore<Item, ItemQueue>>) {
+      ht_ = std::make_unique<HT>(hashtable_size, 0);
+    } else {
+      ht_ = std::make_unique<HT>(hashtable_size);
+    }
+  }
+
+  /// Upsert `rounds` values for each of the keys [1, test_size]; round `r`
+  /// upserts `value(key, r)`.
+  template <class Reducer, class ValueFn>
+  void upsert_all(uint64_t test_size, uint64_t rounds, ValueFn value) {
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+        for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+          args[j] = {.key = i + j, .value = value(i + j, r), .id = 1};
+        }
+        ht_->template upsert_batch<Reducer>(
+            InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+      }
+    }
+    ht_->flush_upsert_queue();
+  }
+
+  /// Check that every key in [1, test_size] maps to `expected(key)`.
+  template <class ExpectedFn>
+  void check_all(uint64_t test_size, ExpectedFn expected) {
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    uint64_t found = 0;
+    auto check_results = [&](const ValuePairs& vp) {
+      for (uint32_t i = 0; i < vp.first; i++) {
+        EXPECT_EQ(results[i].value, expected(results[i].id))
+            << "Invalid value for key " << results[i].id;
+      }
+      found += vp.first;
+    };
+
+    BaseHashTable* ht = ht_.get();
+    for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+      }
+      ValuePairs vp{0, results};
+      ht->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+      check_results(vp);
+    }
+    size_t remaining;
+    do {
+      ValuePairs vp{0, results};
+      remaining = ht->flush_find_queue(vp);
+      check_results(vp);
+    } while (remaining > 0);
+    EXPECT_EQ(found, test_size);
+  }
+
+  std::unique_ptr<HT> ht_;
+};
+
+using UpsertHashtables =
+    ::testing::Types<CASHashTable<Item, ItemQueue>,
+                     FolkloreHashTable<Item, ItemQueue>,
+                     PartitionedHashStore<Item, ItemQueue>>;
+TYPED_TEST_SUITE(UpsertTest, UpsertHashtables);
+
+TYPED_TEST(UpsertTest, ADD_TEST) {
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  this->template upsert_all<AddReducer>(
+      test_size, 4, [](uint64_t key, uint64_t r) { return key + r; });
+  EXPECT_EQ(this->ht_->get_fill(), test_size);
+  this->check_all(test_size, [](uint64_t key) { return 4 * key + 6; });
+}
+
+TYPED_TEST(UpsertTest, MIN_MAX_TEST) {
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  auto value = [](uint64_t key, uint64_t r) { return key + (r * 7) % 5; };
+  this->template upsert_all<MaxReducer>(test_size, 5, value);
+  this->check_all(test_size, [](uint64_t key) { return key + 4; });
+
+  // Switching the reducer flushes the pending upserts.
+  this->template upsert_all<MinReducer>(test_size, 5, value);
+  this->check_all(test_size, [](uint64_t key) { return key; });
+}
+
+template <typename HT>
+class WideKeyTest : public ::testing::Test {
+ protected:
+  using Argument = typename HT::Arguments::value_type;
+
+  void SetUp() override {
+    config.batch_len = HT_TESTS_BATCH_LENGTH;
+    ht_ = std::make_unique<HT>(absl::GetFlag(FLAGS_hashtable_size));
+  }
+
+  /// The keys only differ in their last word, so that every word takes part
+  /// in the comparison.
+  static Argument make_arg(uint64_t i, uint64_t value) {
+    Argument arg{};
+    for (auto& w : arg.key.words) {
+      w = 0x5555555555555555ull;
+    }
+    arg.key.words[std::size(arg.key.words) - 1] = i;
+    arg.value = value;
+    arg.id = (uint32_t)i;
+    return arg;
+  }
+
+  /// Look up the keys [first, first + count) and return how many were found.
+  template <class ExpectedFn>
+  uint64_t find_all(uint64_t first, uint64_t count, ExpectedFn expected) {
+    Argument args[HT_TESTS_BATCH_LENGTH];
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    uint64_t found = 0;
+    auto check_results = [&](const ValuePairs& vp) {
+      for (uint32_t i = 0; i < vp.first; i++) {
+        EXPECT_EQ(results[i].value, expected(results[i].id))
+            << "Invalid value for key " << results[i].id;
+      }
+      found += vp.first;
+    };
+
+    for (uint64_t i = first; i < first + count; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        args[j] = make_arg(i + j, 0);
+      }
+      ValuePairs vp{0, results};
+      ht_->find_batch(typename HT::Arguments(args, HT_TESTS_BATCH_LENGTH), vp);
+      check_results(vp);
+    }
+    size_t remaining;
+    do {
+      ValuePairs vp{0, results};
+      remaining = ht_->flush_find_queue(vp);
+      check_results(vp);
+    } while (remaining > 0);
+    return found;
+  }
+
+  std::unique_ptr<HT> ht_;
+};
+
+using WideKeyHashtables =
+    ::testing::Types<WideCASHashTable<16, uint8_t>,
+                     WideCASHashTable<16, uint16_t>,
+                     WideCASHashTable<32, uint8_t>>;
+TYPED_TEST_SUITE(WideKeyTest, WideKeyHashtables);
+
+TYPED_TEST(WideKeyTest, INSERT_FIND_UPSERT_TEST) {
+  using Argument = typename TypeParam::Arguments::value_type;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  Argument args[HT_TESTS_BATCH_LENGTH];
+
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = this->make_arg(i + j, (i + j) * 3);
+    }
+    this->ht_->insert_batch(
+        typename TypeParam::Arguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  this->ht_->flush_insert_queue();
+  EXPECT_EQ(this->ht_->get_fill(), test_size);
+
+  auto inserted = [](uint64_t key) { return key * 3; };
+  EXPECT_EQ(this->find_all(1, test_size, inserted), test_size);
+  // Keys that were never inserted.
+  EXPECT_EQ(this->find_all(test_size + 1, test_size, inserted), 0);
+
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = this->make_arg(i + j, 1);
+    }
+    this->ht_->template upsert_batch<AddReducer>(
+        typename TypeParam::Arguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  this->ht_->flush_upsert_queue();
+  EXPECT_EQ(this->ht_->get_fill(), test_size);
+  EXPECT_EQ(this->find_all(1, test_size,
+                           [](uint64_t key) { return key * 3 + 1; }),
+            test_size);
+}
+
+/// Out-of-line payloads of 1 to 512 bytes, with and without prefetching
+/// them as a second find stage.
+class PayloadTest : public ::testing::TestWithParam<bool> {
+ protected:
+  static std::string payload(uint64_t key) {
+    std::string s((key * 37) % 512 + 1, 'a' + key % 26);
+    memcpy(s.data(), &key, std::min(s.size(), sizeof(key)));
+    return s;
+  }
+};
+
+TEST_P(PayloadTest, INSERT_FIND_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  CASHashTable<Item, ItemQueue> casht(absl::GetFlag(FLAGS_hashtable_size));
+  PayloadHashTable ht(&casht, 1ull << 21, GetParam());
+
+  std::vector<std::string> payloads(test_size + 1);
+  PayloadInsertArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      payloads[i + j] = payload(i + j);
+      args[j] = {.key = i + j,
+                 .data = payloads[i + j].data(),
+                 .len = (uint32_t)payloads[i + j].size(),
+                 .id = 1};
+    }
+    ht.insert_batch(std::span(args, HT_TESTS_BATCH_LENGTH));
+  }
+  ht.flush_insert_queue();
+  payloads.clear();
+
+  InsertFindArgument find_args[HT_TESTS_BATCH_LENGTH];
+  PayloadFindResult results[HT_TESTS_BATCH_LENGTH];
+  uint64_t found = 0;
+  auto check_results = [&](const PayloadPairs& vp) {
+    for (uint32_t i = 0; i < vp.first; i++) {
+      EXPECT_EQ(std::string(results[i].data, results[i].len),
+                payload(results[i].id))
+          << "Invalid payload for key " << results[i].id;
+    }
+    found += vp.first;
+  };
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      find_args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+    }
+    PayloadPairs vp{0, results};
+    ht.find_batch(InsertFindArguments(find_args, HT_TESTS_BATCH_LENGTH), vp);
+    check_results(vp);
+  }
+  size_t remaining;
+  do {
+    PayloadPairs vp{0, results};
+    remaining = ht.flush_find_queue(vp);
+    check_results(vp);
+  } while (remaining > 0);
+  EXPECT_EQ(found, test_size);
+}
+
+INSTANTIATE_TEST_SUITE_P(PayloadPrefetch, PayloadTest, ::testing::Bool());
+
+/// A heap's id goes back to the pool with it, so heaps can come and go for
+/// good without running out of the 16 bits of the handles.
+TEST(ValueHeapTest, ID_REUSE_TEST) {
+  constexpr uint64_t bytes = 1 << 20;
+  const uint64_t value = 42;
+  auto heap_id = [&](ValueHeap& heap) {
+    return heap.put(&value, sizeof(value)) >> ValueHeap::OFFSET_BITS;
+  };
+
+  ValueHeap keep(bytes);
+  uint64_t freed;
+  {
+    ValueHeap heap(bytes);
+    freed = heap_id(heap);
+    EXPECT_NE(freed, heap_id(keep));
+  }
+  ValueHeap a(bytes), b(bytes);
+  EXPECT_TRUE(heap_id(a) == freed || heap_id(b) == freed);
+  EXPECT_NE(heap_id(a), heap_id(b));
+  EXPECT_NE(heap_id(a), heap_id(keep));
+  EXPECT_NE(heap_id(b), heap_id(keep));
+
+  const uint64_t handle = b.put(&value, sizeof(value));
+  EXPECT_EQ(*(const uint64_t*)ValueHeap::get(handle)->data, value);
+}
+
+/// Change the pipeline depth and prefetch distance of casht++ between every
+/// batch, in both directions, and make sure no operation gets lost.
+TEST(CASQueueParamsTest, CHANGE_DEPTH_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  constexpr uint32_t queue_sz = 32;
+  CASHashTable<Item, ItemQueue> casht(absl::GetFlag(FLAGS_hashtable_size),
+                                      queue_sz, 0);
+  BaseHashTable& ht = casht;
+  EXPECT_FALSE(ht.set_queue_params(QueueType::find_queue, queue_sz * 2, 8));
+  EXPECT_FALSE(ht.set_queue_params(QueueType::insert_queue, 1, 1));
+
+  constexpr uint32_t depths[] = {queue_sz, 4, 16, 2, 8, queue_sz};
+  uint32_t step = 0;
+  auto next_params = [&](QueueType qtype) {
+    uint32_t depth = depths[step++ % std::size(depths)];
+    ASSERT_TRUE(ht.set_queue_params(qtype, depth, depth / 2));
+  };
+
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    next_params(QueueType::insert_queue);
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + j, .value = (i + j) * 2, .id = 1};
+    }
+    ht.insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  ht.flush_insert_queue();
+  EXPECT_EQ(ht.get_fill(), test_size);
+
+  FindResult results[HT_TESTS_BATCH_LENGTH];
+  uint64_t found = 0;
+  auto check_results = [&](const ValuePairs& vp) {
+    for (uint32_t i = 0; i < vp.first; i++) {
+      EXPECT_EQ(results[i].value, (uint64_t)results[i].id * 2);
+    }
+    found += vp.first;
+  };
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    next_params(QueueType::find_queue);
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+    }
+    ValuePairs vp{0, results};
+    ht.find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+    EXPECT_LE(vp.first, HT_TESTS_BATCH_LENGTH);
+    check_results(vp);
+  }
+  size_t remaining;
+  do {
+    ValuePairs vp{0, results};
+    remaining = ht.flush_find_queue(vp);
+    check_results(vp);
+  } while (remaining > 0);
+  EXPECT_EQ(found, test_size);
+}
+
+/// A partition bound to a node lives there and works like any other.
+TEST(PartitionPlacementTest, LOCAL_NODE_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  PartitionedHashStore<Item, ItemQueue> part(
+      absl::GetFlag(FLAGS_hashtable_size), 0, 0);
+
+  int node = -1;
+  ASSERT_EQ(get_mempolicy(&node, NULL, 0, part.hashtable[0],
+                          MPOL_F_NODE | MPOL_F_ADDR),
+            0);
+  EXPECT_EQ(node, 0);
+
+  HTBatchRunner<> batch_runner(&part);
+  for (uint64_t i = 1; i <= test_size; i++) {
+    batch_runner.insert(i, i + 7);
+  }
+  batch_runner.flush_insert();
+  EXPECT_EQ(part.get_fill(), test_size);
+
+  std::vector<key_type> keys(test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    keys[i] = i + 1;
+  }
+  std::vector<value_type> out(test_size);
+  std::vector<uint8_t> bitmap((test_size + 7) / 8);
+  EXPECT_EQ(part.multi_get(keys, out, bitmap), test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    EXPECT_EQ(out[i], keys[i] + 7);
+  }
+}
+
+/// Run casht++ on the coroutine engine with different group sizes,
+/// including the empty key and keys that are not in the table.
+class CASCoroTest : public ::testing::TestWithParam<uint32_t> {};
+
+TEST_P(CASCoroTest, INSERT_FIND_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  CASHashTable<Item, ItemQueue> casht(absl::GetFlag(FLAGS_hashtable_size), 8,
+                                      0);
+  ASSERT_TRUE(casht.set_coro_group(GetParam()));
+  EXPECT_FALSE(casht.set_coro_group(0));
+  casht.clear();
+
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 0; i < test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + j, .value = (i + j) * 2 + 1, .id = 1};
+    }
+    casht.insert_batch_coro(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  // the empty key lives outside of the table
+  EXPECT_EQ(casht.get_fill(), test_size - 1);
+
+  FindResult results[HT_TESTS_BATCH_LENGTH];
+  uint64_t found = 0;
+  for (uint64_t i = 0; i < test_size * 2; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+    }
+    ValuePairs vp{0, results};
+    casht.find_batch_coro(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH),
+                          vp);
+    for (uint32_t k = 0; k < vp.first; k++) {
+      EXPECT_LT(results[k].id, test_size);
+      EXPECT_EQ(results[k].value, (uint64_t)results[k].id * 2 + 1);
+    }
+    found += vp.first;
+  }
+  EXPECT_EQ(found, test_size);
+}
+
+INSTANTIATE_TEST_SUITE_P(CoroGroups, CASCoroTest,
+                         ::testing::Values(1u, 3u, 16u,
+                                           CoroExecutor::MAX_GROUP));
+
+/// Every thread inserts its own keys into the delegated table, then looks up
+/// the keys of its neighbour and keys that were never inserted, twice.
+class DelegatedTest : public ::testing::TestWithParam<uint32_t> {};
+
+/// With `straggle`, the last thread sleeps before it flushes its inserts, so
+/// that the others run out of work and back off meanwhile.
+static void delegated_insert_find(uint32_t n, bool straggle = false) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  const uint64_t hashtable_size = absl::GetFlag(FLAGS_hashtable_size);
+  DelegationService svc(n, std::vector<uint32_t>(n, sched_getcpu()), 4);
+  std::vector<uint64_t> found(n), bad(n);
+  std::vector<DelegatedHashTable*> tables(n);
+
+  auto worker = [&](uint32_t t) {
+    tables[t] = new DelegatedHashTable(
+        &svc, t, new PartitionedHashStore<Item, ItemQueue>(hashtable_size, t));
+    DelegatedHashTable* ht = tables[t];
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    const uint64_t base = t * test_size + 1;
+    for (uint64_t i = 0; i < test_size; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        args[j] = {.key = base + i + j, .value = (base + i + j) * 3, .id = 0};
+      }
+      ht->insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+    }
+    if (straggle && t == n - 1) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    ht->flush_insert_queue();
+
+    // the second half of the ids are keys past all the inserted ones
+    const uint64_t other = ((t + 1) % n) * test_size + 1;
+    auto check = [&](const ValuePairs& vp) {
+      for (uint32_t k = 0; k < vp.first; k++) {
+        uint64_t key = other + results[k].id;
+        if (results[k].id >= test_size || results[k].value != key * 3) {
+          bad[t]++;
+        }
+      }
+      found[t] += vp.first;
+    };
+    for (int round = 0; round < 2; round++) {
+      for (uint64_t i = 0; i < 2 * test_size; i += HT_TESTS_BATCH_LENGTH) {
+        for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+          uint64_t id = i + j;
+          uint64_t key = id < test_size ? other + id : n * test_size + id;
+          args[j] = {.key = key, .value = 0, .id = (uint32_t)id};
+        }
+        ValuePairs vp{0, results};
+        ht->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+        check(vp);
+      }
+      for (;;) {
+        ValuePairs vp{0, results};
+        size_t remaining = ht->flush_find_queue(vp);
+        check(vp);
+        if (vp.first == 0 && remaining == 0) {
+          break;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < n; t++) {
+    threads.emplace_back(worker, t);
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  for (uint32_t t = 0; t < n; t++) {
+    EXPECT_EQ(found[t], 2 * test_size) << "thread " << t;
+    EXPECT_EQ(bad[t], 0) << "thread " << t;
+  }
+  EXPECT_EQ(tables[0]->get_fill(), n * test_size);
+  EXPECT_EQ(tables[0]->get_capacity(), n * hashtable_size);
+  if (straggle && n > 1) {
+    // The others waited on their doorbells, in umwait or in a futex sleep.
+    uint64_t waits = 0;
+    for (uint32_t t = 0; t + 1 < n; t++) {
+      const PollBackoff::Stats& s = tables[t]->get_backoff_stats();
+      waits += s.umwaits + s.sleeps;
+    }
+    EXPECT_GT(waits, 0u);
+  }
+  for (DelegatedHashTable* ht : tables) {
+    delete ht;
+  }
+}
+
+TEST_P(DelegatedTest, INSERT_FIND_TEST) { delegated_insert_find(GetParam()); }
+
+/// Threads that wait for the others in a flush sleep on their doorbell.
+TEST_P(DelegatedTest, INSERT_FIND_BACKOFF_TEST) {
+  config.consumer_backoff = true;
+  delegated_insert_find(GetParam(), true);
+  config.consumer_backoff = false;
+}
+
+/// With `config.minimizer_len`, a key goes to the partition in its
+/// `part_id` instead of the one of its hash, and is found there.
+TEST_P(DelegatedTest, PART_ID_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  config.minimizer_len = 1;
+  const uint32_t n = GetParam();
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  const uint64_t hashtable_size = absl::GetFlag(FLAGS_hashtable_size);
+  DelegationService svc(n, std::vector<uint32_t>(n, sched_getcpu()), 4);
+  std::vector<uint64_t> found(n), bad(n);
+  std::vector<DelegatedHashTable*> tables(n);
+
+  auto worker = [&](uint32_t t) {
+    tables[t] = new DelegatedHashTable(
+        &svc, t, new PartitionedHashStore<Item, ItemQueue>(hashtable_size, t));
+    DelegatedHashTable* ht = tables[t];
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    FindResult results[HT_TESTS_BATCH_LENGTH];
+    const uint64_t base = t * test_size + 1;
+    for (uint64_t i = 0; i < test_size; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        const uint64_t key = base + i + j;
+        args[j] = {.key = key,
+                   .value = key * 3,
+                   .id = 0,
+                   .part_id = (uint32_t)(key % n)};
+      }
+      ht->insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+    }
+    ht->flush_insert_queue();
+
+    auto check = [&](const ValuePairs& vp) {
+      for (uint32_t k = 0; k < vp.first; k++) {
+        if (results[k].value != (base + results[k].id) * 3) {
+          bad[t]++;
+        }
+      }
+      found[t] += vp.first;
+    };
+    for (uint64_t i = 0; i < test_size; i += HT_TESTS_BATCH_LENGTH) {
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+        const uint64_t key = base + i + j;
+        args[j] = {.key = key,
+                   .value = 0,
+                   .id = (uint32_t)(i + j),
+                   .part_id = (uint32_t)(key % n)};
+      }
+      ValuePairs vp{0, results};
+      ht->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+      check(vp);
+    }
+    for (;;) {
+      ValuePairs vp{0, results};
+      size_t remaining = ht->flush_find_queue(vp);
+      check(vp);
+      if (vp.first == 0 && remaining == 0) {
+        break;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < n; t++) {
+    threads.emplace_back(worker, t);
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  config.minimizer_len = 0;
+
+  for (uint32_t t = 0; t < n; t++) {
+    EXPECT_EQ(found[t], test_size) << "thread " << t;
+    EXPECT_EQ(bad[t], 0) << "thread " << t;
+    // keys 1 .. n * test_size, evenly over the remainders
+    EXPECT_EQ(tables[t]->get_partition()->get_fill(), test_size)
+        << "partition " << t;
+  }
+  for (DelegatedHashTable* ht : tables) {
+    delete ht;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(DelegatedThreads, DelegatedTest,
+                         ::testing::Values(1u, 2u, 4u));
+
+/// Threads that keep hitting a few hot keys in between the cold ones: the
+/// hot keys are combined, and after the flush the shared table holds the
+/// last value of every key.
+TEST(HybridTest, HOT_KEYS_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  config.hot_threshold = 4;
+  config.hot_slots = 64;
+  config.hot_flush_interval = 1000;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  const uint64_t hashtable_size = absl::GetFlag(FLAGS_hashtable_size);
+  constexpr uint32_t n = 2;
+  constexpr uint64_t num_hot = 8;
+  std::vector<HybridHashTable<Item, ItemQueue>*> tables(n);
+  for (uint32_t t = 0; t < n; t++) {
+    tables[t] = new HybridHashTable<Item, ItemQueue>(
+        new CASHashTable<Item, ItemQueue>(hashtable_size, 16, t), t);
+  }
+
+  auto worker = [&](uint32_t t) {
+    InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+    uint64_t hot_step = 0;
+    for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH / 2) {
+      // every other insert goes to a hot key, with an older value until the
+      // last round
+      for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j += 2) {
+        uint64_t key = std::min(i + j / 2, test_size);
+        args[j] = {.key = key, .value = key * 3, .id = 0};
+        uint64_t hot = hot_step++ % num_hot + 1;
+        args[j + 1] = {.key = hot, .value = hot, .id = 0};
+      }
+      tables[t]->insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+    }
+    for (uint64_t hot = 1; hot <= num_hot; hot++) {
+      args[hot - 1] = {.key = hot, .value = hot * 3, .id = 0};
+    }
+    tables[t]->insert_batch(InsertFindArguments(args, num_hot));
+    tables[t]->flush_insert_queue();
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < n; t++) {
+    threads.emplace_back(worker, t);
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  for (uint32_t t = 0; t < n; t++) {
+    const auto& stats = tables[t]->get_stats();
+    EXPECT_GT(stats.combined, test_size / 2) << "thread " << t;
+    EXPECT_GT(stats.promoted, 0) << "thread " << t;
+    EXPECT_LT(stats.spilled, stats.combined) << "thread " << t;
+  }
+  EXPECT_EQ(tables[0]->get_fill(), test_size);
+
+  std::vector<key_type> keys(test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    keys[i] = i + 1;
+  }
+  std::vector<value_type> out(test_size);
+  std::vector<uint8_t> bitmap((test_size + 7) / 8);
+  EXPECT_EQ(tables[0]->multi_get(keys, out, bitmap), test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    EXPECT_EQ(out[i], keys[i] * 3) << "key " << keys[i];
+  }
+  for (auto* ht : tables) {
+    delete ht;
+  }
+}
+
+/// Keys whose sketch counts drop below the threshold whenever the sketch
+/// decays, and that keep taking each other's hot slots: their updates go to
+/// the shared table combined, evicted and cold, in every order. After every
+/// flush, the last value of every key has to win all the same.
+TEST(HybridTest, LAST_VALUE_WINS_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  config.hot_threshold = 200;
+  config.hot_slots = 2;
+  config.hot_flush_interval = 1 << 20;
+  constexpr uint64_t num_keys = 8;
+  constexpr uint64_t num_inserts = 1 << 18;
+  constexpr uint64_t flush_every = 512;
+  HybridHashTable<Item, ItemQueue> ht(
+      new CASHashTable<Item, ItemQueue>(absl::GetFlag(FLAGS_hashtable_size),
+                                        16, 0),
+      0);
+
+  std::vector<key_type> keys(num_keys);
+  for (uint64_t i = 0; i < num_keys; i++) {
+    keys[i] = i + 1;
+  }
+  std::vector<value_type> last(num_keys + 1);
+  std::vector<value_type> out(num_keys);
+  std::vector<uint8_t> bitmap(num_keys / 8);
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  uint64_t state = 88172645463325252ull;
+  for (uint64_t i = 0; i < num_inserts; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    const key_type key = state % num_keys + 1;
+    last[key] = i + 1;
+    args[i % HT_TESTS_BATCH_LENGTH] = {.key = key, .value = i + 1, .id = 0};
+    // every other round one at a time
+    if ((i / flush_every) % 2) {
+      ht.insert_noprefetch(&args[i % HT_TESTS_BATCH_LENGTH]);
+    } else if (i % HT_TESTS_BATCH_LENGTH == HT_TESTS_BATCH_LENGTH - 1) {
+      ht.insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+    }
+
+    if ((i + 1) % flush_every == 0) {
+      ht.flush_insert_queue();
+      ASSERT_EQ(ht.multi_get(keys, out, bitmap), num_keys);
+      for (uint64_t k = 0; k < num_keys; k++) {
+        ASSERT_EQ(out[k], last[keys[k]])
+            << "key " << keys[k] << " after " << i + 1 << " inserts";
+      }
+    }
+  }
+  EXPECT_GT(ht.get_stats().spilled, 0u);
+}
+
+/// Three keys that are about as hot on a single set of the hot table: two of
+/// them keep their slots instead of evicting each other on every insert.
+TEST(HybridTest, NO_THRASHING_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  config.hot_threshold = 2;
+  config.hot_slots = 2;
+  config.hot_flush_interval = 1 << 20;
+  HybridHashTable<Item, ItemQueue> ht(
+      new CASHashTable<Item, ItemQueue>(absl::GetFlag(FLAGS_hashtable_size),
+                                        16, 0),
+      0);
+
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  for (uint64_t i = 0; i < 3000; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      const key_type key = (i + j) % 3 + 1;
+      args[j] = {.key = key, .value = key, .id = 0};
+    }
+    ht.insert_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH));
+  }
+  ht.flush_insert_queue();
+
+  const auto& stats = ht.get_stats();
+  EXPECT_LE(stats.promoted, 3u);
+  EXPECT_GT(stats.combined, 3000u / 2);
+  EXPECT_EQ(ht.get_fill(), 3u);
+}
+
+/// Count keys through a combining table that is much smaller than the key
+/// set, so that entries get evicted as well as merged: every count has to
+/// arrive in the aggregating table exactly once.
+TEST(CombinerTest, COUNT_TEST) {
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  const uint64_t test_size = absl::GetFlag(FLAGS_test_size);
+  PartitionedHashStore<Aggr_KV, ItemQueue> ht(
+      absl::GetFlag(FLAGS_hashtable_size), 0);
+  // key k occurs k % 7 + 1 times, and key 1 takes every other insert
+  auto count_of = [&](uint64_t key) {
+    return key % 7 + 1 + (key == 1 ? 7 * test_size : 0);
+  };
+
+  HTBatchCombiner<> combiner(&ht, 64);
+  for (uint64_t round = 0; round < 7; round++) {
+    for (uint64_t key = 1; key <= test_size; key++) {
+      if (key % 7 + 1 > round) {
+        combiner.insert(key);
+      }
+      combiner.insert(1);
+    }
+  }
+  combiner.flush();
+
+  const auto& stats = combiner.stats();
+  uint64_t total = 0;
+  for (uint64_t key = 1; key <= test_size; key++) {
+    total += count_of(key);
+  }
+  EXPECT_EQ(stats.inserts, total);
+  EXPECT_EQ(stats.combined + stats.spilled, total);
+  EXPECT_GT(combiner.combine_ratio(), 0.5);
+  EXPECT_EQ(ht.get_fill(), test_size);
+
+  std::vector<key_type> keys(test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    keys[i] = i + 1;
+  }
+  std::vector<value_type> out(test_size);
+  std::vector<uint8_t> bitmap((test_size + 7) / 8);
+  EXPECT_EQ(ht.multi_get(keys, out, bitmap), test_size);
+  for (uint64_t i = 0; i < test_size; i++) {
+    // the stored count is 16 bits wide
+    EXPECT_EQ(out[i], count_of(keys[i]) & 0xffff) << "key " << keys[i];
+  }
+}
+
+#ifdef CAS_RESIZE
+/// Fill a small casht++ well past its load factor so that it has to grow
+/// several times, and make sure nothing is lost during the migrations.
+TEST(CASResizeTest, GROW_TEST) {
+  config.no_prefetch = 0;
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  constexpr uint64_t initial_size = 1ull << 14;
+  constexpr uint64_t test_size = initial_size * 4;
+  std::unique_ptr<kmercounter::BaseHashTable> ht(
+      new kmercounter::CASHashTable<kmercounter::Item, kmercounter::ItemQueue>{
+          initial_size});
+
+  {
+    HTBatchRunner<> batch_runner(ht.get());
+    for (uint64_t i = 1; i <= test_size; i++) {
+      batch_runner.insert(i, i * i);
+    }
+    batch_runner.flush_insert();
+  }
+  EXPECT_GT(ht->get_capacity(), initial_size);
+  EXPECT_EQ(ht->get_fill(), test_size);
+
+  // The find results are checked by hand, as `HTBatchFinder` drops them.
+  InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+  FindResult results[HT_TESTS_BATCH_LENGTH];
+  uint64_t found = 0;
+  auto check_results = [&](const ValuePairs& vp) {
+    for (uint32_t i = 0; i < vp.first; i++) {
+      EXPECT_EQ(results[i].value, (uint64_t)results[i].id * results[i].id);
+    }
+    found += vp.first;
+  };
+
+  for (uint64_t i = 1; i <= test_size; i += HT_TESTS_BATCH_LENGTH) {
+    for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+      args[j] = {.key = i + j, .value = 0, .id = (uint32_t)(i + j)};
+    }
+    ValuePairs vp{0, results};
+    ht->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+    check_results(vp);
+  }
+  size_t remaining;
+  do {
+    ValuePairs vp{0, results};
+    remaining = ht->flush_find_queue(vp);
+    check_results(vp);
+  } while (remaining > 0);
+  EXPECT_EQ(found, test_size);
+}
+
+/// Keep finding keys that are already in the table while other threads grow
+/// it underneath. A find must never miss a key that was inserted before it
+/// started, whatever stage of the migration it runs into.
+TEST(CASResizeTest, GROW_WHILE_FINDING_TEST) {
+  using Table = kmercounter::CASHashTable<kmercounter::Item,
+                                          kmercounter::ItemQueue>;
+  config.no_prefetch = 0;
+  config.batch_len = HT_TESTS_BATCH_LENGTH;
+  constexpr uint64_t initial_size = 1ull << 14;
+  constexpr uint64_t num_present = initial_size / 2;
+  constexpr uint64_t num_inserters = 2;
+  constexpr uint64_t num_finders = 2;
+  constexpr uint64_t inserts_per_thread = initial_size * 4;
+
+  // One handle per thread on the shared table.
+  std::vector<std::unique_ptr<Table>> hts;
+  for (uint64_t i = 0; i < num_inserters + num_finders; i++) {
+    hts.emplace_back(new Table{initial_size});
+  }
+  {
+    HTBatchRunner<> batch_runner(hts[0].get());
+    for (uint64_t key = 1; key <= num_present; key++) {
+      batch_runner.insert(key, key * key);
+    }
+    batch_runner.flush_insert();
+  }
+
+  std::atomic<uint64_t> inserters_done = 0;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < num_inserters; t++) {
+    threads.emplace_back([&, t] {
+      HTBatchRunner<> batch_runner(hts[t].get());
+      const uint64_t first = num_present + 1 + t * inserts_per_thread;
+      for (uint64_t key = first; key < first + inserts_per_thread; key++) {
+        batch_runner.insert(key, key * key);
+      }
+      batch_runner.flush_insert();
+      inserters_done++;
+    });
+  }
+
+  std::atomic<uint64_t> num_rounds = 0;
+  std::atomic<uint64_t> num_missed = 0;
+  for (uint64_t t = 0; t < num_finders; t++) {
+    threads.emplace_back([&, t] {
+      BaseHashTable* ht = hts[num_inserters + t].get();
+      InsertFindArgument args[HT_TESTS_BATCH_LENGTH];
+      FindResult results[HT_TESTS_BATCH_LENGTH];
+      // One more round after the inserters are done.
+      for (bool last = false; !last;) {
+        last = inserters_done.load() == num_inserters;
+        uint64_t found = 0;
+        auto check_results = [&](const ValuePairs& vp) {
+          for (uint32_t i = 0; i < vp.first; i++) {
+            EXPECT_EQ(results[i].value,
+                      (uint64_t)results[i].id * results[i].id);
+          }
+          found += vp.first;
+        };
+        for (uint64_t key = 1; key <= num_present;
+             key += HT_TESTS_BATCH_LENGTH) {
+          for (uint64_t j = 0; j < HT_TESTS_BATCH_LENGTH; j++) {
+            args[j] = {.key = key + j, .value = 0, .id = (uint32_t)(key + j)};
+          }
+          ValuePairs vp{0, results};
+          ht->find_batch(InsertFindArguments(args, HT_TESTS_BATCH_LENGTH), vp);
+          check_results(vp);
+        }
+        size_t remaining;
+        do {
+          ValuePairs vp{0, results};
+          remaining = ht->flush_find_queue(vp);
+          check_results(vp);
+        } while (remaining > 0);
+        num_missed += num_present - found;
+        num_rounds++;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_GT(hts[0]->get_capacity(), initial_size * 4);
+  EXPECT_GE(num_rounds.load(), num_finders);
+  EXPECT_EQ(num_missed.load(), 0u);
+}
+#endif
+
 }  // namespace
 }  // namespace kmercounter
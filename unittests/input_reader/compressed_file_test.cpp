@@ -0,0 +1,208 @@
+#include "input_reader/compressed_file.hpp"
+
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "input_reader/fastq.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+namespace {
+/// `num_seqs` records of different lengths.
+std::string make_fastq(uint64_t num_seqs) {
+  std::string text;
+  for (uint64_t i = 0; i < num_seqs; i++) {
+    const std::string seq(50 + (i * 37) % 400, "ACGTN"[i % 5]);
+    text += "@seq" + std::to_string(i) + "\n" + seq + "\n+\n" +
+            std::string(seq.size(), 'E') + "\n";
+  }
+  return text;
+}
+
+std::string write_file(const std::string& name, const std::string& data) {
+  const std::string path = testing::TempDir() + name;
+  std::ofstream file(path, std::ios::trunc | std::ios::binary);
+  file << data;
+  return path;
+}
+
+std::string write_gzip(const std::string& text) {
+  const std::string path = testing::TempDir() + "compressed_file_test.fq.gz";
+  gzFile file = gzopen(path.c_str(), "wb");
+  gzwrite(file, text.data(), text.size());
+  gzclose(file);
+  return path;
+}
+
+/// Raw deflate of `data`.
+std::string deflate_raw(std::string_view data) {
+  z_stream strm = {};
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+               Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&strm, data.size()), '\0');
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<Bytef*>(out.data());
+  strm.avail_out = out.size();
+  deflate(&strm, Z_FINISH);
+  out.resize(strm.total_out);
+  deflateEnd(&strm);
+  return out;
+}
+
+void put_le(std::string* out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+/// BGZF blocks of `block_size` bytes of `text`, and the empty end block.
+std::string write_bgzf(const std::string& text, size_t block_size) {
+  std::string out;
+  for (size_t pos = 0;; pos += block_size) {
+    const std::string_view data =
+        std::string_view(text).substr(std::min(pos, text.size()), block_size);
+    const std::string compressed = deflate_raw(data);
+    out += std::string("\x1f\x8b\x08\x04\0\0\0\0\0\xff\x06\0BC\x02\0", 16);
+    put_le(&out, compressed.size() + 25, 2);
+    out += compressed;
+    put_le(&out, crc32(0, reinterpret_cast<const Bytef*>(data.data()),
+                       data.size()),
+           4);
+    put_le(&out, data.size(), 4);
+    if (data.empty()) {
+      break;
+    }
+  }
+  return write_file("compressed_file_test.fq.bgz", out);
+}
+
+template <typename Reader, typename... Args>
+std::vector<std::string> read_all(uint64_t num_parts, Args... args) {
+  std::vector<std::string> out;
+  for (uint64_t part_id = 0; part_id < num_parts; part_id++) {
+    Reader reader(args..., part_id, num_parts);
+    for (std::string_view seq; reader.next(&seq);) {
+      out.emplace_back(seq);
+    }
+  }
+  return out;
+}
+
+/// Add the decompression parameters after the partition.
+struct Compressed : CompressedFastqReader {
+  static inline uint32_t threads;
+  static inline uint32_t depth;
+  static inline uint32_t chunk_size;
+  Compressed(const std::string& path, uint64_t part_id, uint64_t num_parts)
+      : CompressedFastqReader(path, part_id, num_parts, threads, depth,
+                              chunk_size) {}
+};
+
+/// Every record once and in order, whatever the partitions and the ring.
+void check_same_as_fastq_reader(const std::string& path,
+                                const std::vector<std::string>& expected) {
+  constexpr auto num_partss = std::to_array({1, 2, 5, 13, 200});
+  constexpr auto threadss = std::to_array({0u, 1u, 3u});
+  constexpr auto depths = std::to_array({1u, 2u, 4u});
+  constexpr auto chunk_sizes = std::to_array({100u, 64u * 1024});
+  for (const auto num_parts : num_partss) {
+    for (const auto threads : threadss) {
+      for (const auto depth : depths) {
+        for (const auto chunk_size : chunk_sizes) {
+          Compressed::threads = threads;
+          Compressed::depth = depth;
+          Compressed::chunk_size = chunk_size;
+          ASSERT_EQ(expected, read_all<Compressed>(num_parts, path))
+              << path << ": " << num_parts << " partitions, " << threads
+              << " threads, depth " << depth << ", chunk " << chunk_size;
+        }
+      }
+    }
+  }
+}
+
+std::vector<std::string> read_text(const std::string& text) {
+  std::unique_ptr<std::istream> input =
+      std::make_unique<std::istringstream>(text);
+  FastqReader reader(std::move(input));
+  std::vector<std::string> out;
+  for (std::string_view seq; reader.next(&seq);) {
+    out.emplace_back(seq);
+  }
+  return out;
+}
+
+TEST(CompressedFileTest, DetectCompression) {
+  const std::string text = make_fastq(10);
+  EXPECT_EQ(Compression::NONE,
+            file_compression(write_file("compressed_file_test.fq", text)));
+  EXPECT_EQ(Compression::GZIP, file_compression(write_gzip(text)));
+  EXPECT_EQ(Compression::BGZF, file_compression(write_bgzf(text, 1000)));
+  EXPECT_EQ(Compression::NONE, detect_compression(""));
+}
+
+TEST(CompressedFileTest, Gzip) {
+  for (const uint64_t num_seqs : {0, 1, 3, 2000}) {
+    const std::string text = make_fastq(num_seqs);
+    const auto expected = read_text(text);
+    ASSERT_EQ(num_seqs, expected.size());
+    check_same_as_fastq_reader(write_gzip(text), expected);
+  }
+}
+
+TEST(CompressedFileTest, Bgzf) {
+  for (const uint64_t num_seqs : {0, 1, 3, 2000}) {
+    const std::string text = make_fastq(num_seqs);
+    const auto expected = read_text(text);
+    for (const size_t block_size : {100, 4000, 60000}) {
+      check_same_as_fastq_reader(write_bgzf(text, block_size), expected);
+    }
+  }
+}
+
+#ifdef WITH_ZSTD
+/// zstd frames of `frame_size` bytes of `text`. Without `content_size` the
+/// frames are streamed and do not record their size.
+std::string write_zstd(const std::string& text, size_t frame_size,
+                       bool content_size) {
+  std::string out;
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, content_size);
+  for (size_t pos = 0; pos < text.size(); pos += frame_size) {
+    const std::string_view data = std::string_view(text).substr(pos, frame_size);
+    std::string frame(ZSTD_compressBound(data.size()), '\0');
+    ZSTD_outBuffer output = {frame.data(), frame.size(), 0};
+    ZSTD_inBuffer input = {data.data(), data.size(), 0};
+    ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+    frame.resize(output.pos);
+    out += frame;
+  }
+  ZSTD_freeCCtx(cctx);
+  return write_file("compressed_file_test.fq.zst", out);
+}
+
+TEST(CompressedFileTest, Zstd) {
+  for (const uint64_t num_seqs : {1, 3, 2000}) {
+    const std::string text = make_fastq(num_seqs);
+    const auto expected = read_text(text);
+    for (const size_t frame_size : {100, 4000, 1000000}) {
+      for (const bool content_size : {true, false}) {
+        const std::string path = write_zstd(text, frame_size, content_size);
+        EXPECT_EQ(Compression::ZSTD, file_compression(path));
+        check_same_as_fastq_reader(path, expected);
+      }
+    }
+  }
+}
+#endif
+
+}  // namespace
+}  // namespace input_reader
+}  // namespace kmercounter
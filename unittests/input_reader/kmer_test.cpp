@@ -4,6 +4,7 @@
 
 #include <array>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <string_view>
 #include <vector>
@@ -40,6 +41,50 @@ TAGNAC
   EXPECT_FALSE(kmer_reader.next(&kmer));
 }
 
+/// The k-mers that pushing one base at a time through a `DNAKMer` gives.
+template <size_t K>
+std::vector<uint64_t> push_kmers(std::string_view seq) {
+  std::vector<uint64_t> kmers;
+  DNAKMer<K> kmer;
+  size_t run = 0;
+  for (const char c : seq) {
+    run = kmer.push(c) ? run + 1 : 0;
+    if (run >= K) {
+      kmers.push_back(kmer.data());
+    }
+  }
+  return kmers;
+}
+
+template <size_t K>
+void check_extractor(const std::vector<std::string>& seqs) {
+  KMerExtractor<K> extractor;
+  for (const auto& seq : seqs) {
+    std::vector<uint64_t> kmers(seq.size());
+    kmers.resize(extractor.extract(seq, kmers.data()));
+    ASSERT_EQ(push_kmers<K>(seq), kmers) << "K=" << K << " seq " << seq;
+  }
+  if constexpr (K > 1) {
+    check_extractor<K - 1>(seqs);
+  }
+}
+
+TEST(KmerTest, ExtractorTest) {
+  std::mt19937_64 rng(42);
+  std::vector<std::string> seqs = {"", "A", "ACGT", "acgtNNACGTn"};
+  for (size_t len = 1; len < 300; len += 7) {
+    for (const char* alphabet : {"ACGT", "ACGTacgtN", "ACGTNNNNNNNN\r"}) {
+      std::string seq;
+      const size_t n = strlen(alphabet);
+      for (size_t i = 0; i < len; i++) {
+        seq.push_back(alphabet[rng() % n]);
+      }
+      seqs.push_back(seq);
+    }
+  }
+  check_extractor<DNAKMer<1>::MAX_K>(seqs);
+}
+
 }  // namespace
 }  // namespace input_reader
 }  // namespace kmercounter
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "input_reader/mmap_file.hpp"
+
+#include <absl/strings/str_join.h>
+#include <gtest/gtest.h>
+
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "input_reader/fastq.hpp"
+#include "input_reader/file.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+namespace {
+const char ONE_SEQ[] =
+    R"(@SRR077487.2.1 HWUSI-EAS635_105240777:5:1:943:17901 length=200
+NAGGAGAAAAAAGAGGCAATCAGAAAAGGGCATGGTTTGACTNNNTTTGAATGTGGTTTCGTTGGCAGCAAATGTGTCTTCACTTTTTAATGAAAAAGTCAGATACTTTGTCACCAGGCAGAGGGCAATATCCTGTCTGTTATGACAAATGCTAATTGACAGCTCCCCCACAGGAAGTCGTCTGTCCTGGTGTGGGGGGG
++SRR077487.2.1 HWUSI-EAS635_105240777:5:1:943:17901 length=200
+!%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%!!!%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%@D?GGG=EGGBGDDB@:D:GB<EEEGD:@8>EEEDA7BB36B?:=A?+;>=:7>7B3D>,?3?=BB<DAADD8;+?%%%%%%%%%%%%%%%%%%%%%%%%
+)";
+const char SMALL_SEQ[] = R"(@ERR024163.1 EAS51_210:1:1:1072:4554/1
+AGGAGGTAA
++
+EFFDEFFFF
+)";
+
+/// Generate comma seperated a CSV file.
+std::string generate_csv(uint64_t num_rows, uint64_t num_cols = 3) {
+  std::string csv;
+  for (uint64_t row = 0; row < num_rows; row++) {
+    std::vector<uint64_t> fields;
+    for (uint64_t col = 0; col < num_cols; col++) {
+      fields.push_back(row + col * col);
+    }
+    csv += absl::StrJoin(fields, ",");
+    csv += '\n';
+  }
+  return csv;
+}
+
+/// Read every partition of `reader` and return the values in order.
+template <typename Reader, typename Input>
+std::vector<std::string> read_all(Input input, uint64_t num_parts) {
+  std::vector<std::string> out;
+  for (uint64_t part_id = 0; part_id < num_parts; part_id++) {
+    Reader reader(input(), part_id, num_parts);
+    for (std::string_view line; reader.next(&line);) {
+      out.emplace_back(line);
+    }
+  }
+  return out;
+}
+
+TEST(FindCharTest, AllOffsets) {
+  // Cover the vector loop, the tail and every position of the match.
+  std::string str(300, 'a');
+  const char* begin = str.data();
+  for (size_t len = 0; len < str.size(); len++) {
+    const char* end = begin + len;
+    EXPECT_EQ(end, find_char(begin, end, '\n'));
+    for (size_t pos = 0; pos < len; pos++) {
+      str[pos] = '\n';
+      ASSERT_EQ(begin + pos, find_char(begin, end, '\n'))
+          << "len " << len << ", pos " << pos;
+      str[pos] = 'a';
+    }
+  }
+}
+
+TEST(MmapFileTest, SimplePartitionTest) {
+  const char* data = R"(line 1
+this is line 2
+3
+
+line 4 is me)";
+
+  MmapFileReader reader(MappedFile::from_memory(data));
+  std::string_view str;
+  EXPECT_TRUE(reader.next(&str));
+  EXPECT_EQ("line 1", str);
+  EXPECT_TRUE(reader.next(&str));
+  EXPECT_EQ("this is line 2", str);
+  EXPECT_TRUE(reader.next(&str));
+  EXPECT_EQ("3", str);
+  EXPECT_TRUE(reader.next(&str));
+  EXPECT_EQ("", str);
+  EXPECT_TRUE(reader.next(&str));
+  EXPECT_EQ("line 4 is me", str);
+  EXPECT_FALSE(reader.next(&str));
+}
+
+TEST(MmapFileTest, SameAsFileReader) {
+  constexpr auto num_liness = std::to_array({1, 2, 3, 9, 17, 100, 1000});
+  constexpr auto num_partss = std::to_array({1, 2, 3, 5, 13, 64});
+
+  for (const auto num_lines : num_liness) {
+    const std::string csv = generate_csv(num_lines);
+    for (const auto num_parts : num_partss) {
+      const auto expected = read_all<FileReader>(
+          [&csv]() -> std::unique_ptr<std::istream> {
+            return std::make_unique<std::istringstream>(csv);
+          },
+          num_parts);
+      const auto actual = read_all<MmapFileReader>(
+          [&csv]() { return MappedFile::from_memory(csv); }, num_parts);
+      ASSERT_EQ(num_lines, actual.size()) << num_parts << " partitions";
+      ASSERT_EQ(expected, actual) << num_parts << " partitions";
+    }
+  }
+}
+
+TEST(MmapFastqTest, SameAsFastqReader) {
+  constexpr auto num_seqss = std::to_array({1, 2, 3, 9, 17, 100});
+  constexpr auto num_partss = std::to_array({1, 2, 3, 5, 13, 64});
+
+  for (const auto num_seqs : num_seqss) {
+    std::string seqs;
+    for (int i = 0; i < num_seqs; i++) {
+      seqs += ONE_SEQ;
+    }
+    for (const auto num_parts : num_partss) {
+      const auto expected = read_all<FastqReader>(
+          [&seqs]() -> std::unique_ptr<std::istream> {
+            return std::make_unique<std::istringstream>(seqs);
+          },
+          num_parts);
+      const auto actual = read_all<MmapFastqReader>(
+          [&seqs]() { return MappedFile::from_memory(seqs); }, num_parts);
+      ASSERT_EQ(num_seqs, actual.size()) << num_parts << " partitions";
+      ASSERT_EQ(expected, actual) << num_parts << " partitions";
+    }
+  }
+}
+
+TEST(FastqKMerMmapReader, SinglePartitionTest) {
+  constexpr size_t K = 4;
+  FastqKMerMmapReader<K> reader(MappedFile::from_memory(SMALL_SEQ));
+  uint64_t kmer;
+  // AGGAGGTAA
+  for (const char* expected : {"AGGA", "GGAG", "GAGG", "AGGT", "GGTA", "GTAA"}) {
+    ASSERT_TRUE(reader.next(&kmer));
+    EXPECT_EQ(std::string(expected), DNAKMer<K>::decode(kmer));
+  }
+  EXPECT_FALSE(reader.next(&kmer));
+}
+
+/// The shards map the file and fault in only their partition, which must not
+/// change what they read.
+TEST(FastqKMerMmapReader, FilePartitionTest) {
+  constexpr size_t K = 15;
+  std::string text;
+  for (uint64_t i = 0; i < 3000; i++) {
+    std::string seq;
+    for (uint64_t j = 0; j < 40 + i % 200; j++) {
+      seq += "ACGT"[(i * 7 + j * j) % 4];
+    }
+    text += "@seq" + std::to_string(i) + "\n" + seq + "\n+\n" +
+            std::string(seq.size(), 'E') + "\n";
+  }
+  const std::string path = testing::TempDir() + "mmap_file_test.fq";
+  std::ofstream(path, std::ios::trunc) << text;
+
+  auto read_kmers = [](FastqKMerMmapReader<K>& reader,
+                       std::vector<uint64_t>* out) {
+    for (uint64_t kmer; reader.next(&kmer);) {
+      out->push_back(kmer);
+    }
+  };
+  std::vector<uint64_t> expected;
+  FastqKMerMmapReader<K> whole(MappedFile::from_memory(text));
+  read_kmers(whole, &expected);
+  ASSERT_FALSE(expected.empty());
+
+  for (const uint64_t num_parts : {1, 3, 16}) {
+    std::vector<uint64_t> actual;
+    for (uint64_t part_id = 0; part_id < num_parts; part_id++) {
+      FastqKMerMmapReader<K> reader(path, part_id, num_parts);
+      read_kmers(reader, &actual);
+    }
+    EXPECT_EQ(expected, actual) << num_parts << " partitions";
+  }
+}
+
+}  // namespace
+}  // namespace input_reader
+}  // namespace kmercounter
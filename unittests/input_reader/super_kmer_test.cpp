@@ -0,0 +1,193 @@
+#include "input_reader/super_kmer.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "input_reader/file.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+namespace {
+uint64_t encode(std::string_view bases) {
+  uint64_t code = 0;
+  for (const char c : bases) {
+    code = code << 2 | std::string_view("ACGT").find(c);
+  }
+  return code;
+}
+
+std::string rc_bases(std::string_view bases) {
+  std::string rc(bases.rbegin(), bases.rend());
+  for (char& c : rc) {
+    c = "TGCA"[std::string_view("ACGT").find(c)];
+  }
+  return rc;
+}
+
+uint64_t canonical(std::string_view bases) {
+  return std::min(encode(bases), encode(rc_bases(bases)));
+}
+
+/// The k-mers of `seqs` and their minimizers, one k-mer at a time.
+std::vector<std::pair<uint64_t, uint64_t>> brute_force(
+    const std::vector<std::string>& seqs, uint32_t K, uint32_t m,
+    bool canonical_kmers) {
+  std::vector<std::pair<uint64_t, uint64_t>> out;
+  for (const auto& seq : seqs) {
+    for (size_t i = 0; i + K <= seq.size(); i++) {
+      const std::string_view kmer = std::string_view(seq).substr(i, K);
+      if (kmer.find_first_not_of("ACGT") != std::string_view::npos) {
+        continue;
+      }
+      uint64_t minimizer = ~0ull;
+      for (size_t j = 0; m > 0 && j + m <= K; j++) {
+        minimizer =
+            std::min(minimizer, minimizer_hash(canonical(kmer.substr(j, m))));
+      }
+      out.emplace_back(canonical_kmers ? canonical(kmer) : encode(kmer),
+                       m > 0 ? minimizer : 0);
+    }
+  }
+  return out;
+}
+
+template <size_t K>
+SuperKMerReader make_reader(const std::vector<std::string>& seqs,
+                            bool canonical_kmers, uint32_t m) {
+  std::string lines;
+  for (const auto& seq : seqs) {
+    lines += seq + "\n";
+  }
+  std::unique_ptr<std::istream> input =
+      std::make_unique<std::istringstream>(lines);
+  auto file = std::make_unique<FileReader>(std::move(input), 0, 1);
+  return SuperKMerReader(
+      std::make_unique<KMerReader<K, std::string_view>>(std::move(file)), K,
+      canonical_kmers, m);
+}
+
+/// The super-k-mers of `seqs`, flattened.
+template <size_t K>
+std::vector<std::pair<uint64_t, uint64_t>> read_super_kmers(
+    const std::vector<std::string>& seqs, bool canonical_kmers, uint32_t m,
+    size_t* num_super_kmers) {
+  SuperKMerReader reader = make_reader<K>(seqs, canonical_kmers, m);
+  std::vector<std::pair<uint64_t, uint64_t>> out;
+  std::span<const uint64_t> kmers;
+  uint64_t minimizer;
+  *num_super_kmers = 0;
+  while (reader.next_super_kmer(&kmers, &minimizer)) {
+    EXPECT_FALSE(kmers.empty());
+    for (const uint64_t kmer : kmers) {
+      out.emplace_back(kmer, minimizer);
+    }
+    (*num_super_kmers)++;
+  }
+  return out;
+}
+
+std::vector<std::string> random_seqs(size_t num_seqs, const char* alphabet) {
+  std::mt19937_64 rng(7);
+  std::vector<std::string> seqs;
+  for (size_t i = 0; i < num_seqs; i++) {
+    std::string seq(rng() % 300, 'A');
+    for (char& c : seq) {
+      c = alphabet[rng() % strlen(alphabet)];
+    }
+    seqs.push_back(seq);
+  }
+  return seqs;
+}
+
+template <size_t K>
+void check_super_kmers(const std::vector<std::string>& seqs) {
+  for (const uint32_t m : {0u, 1u, 7u, (uint32_t)K / 2, (uint32_t)K}) {
+    if (m > K) {
+      continue;
+    }
+    for (const bool canonical_kmers : {false, true}) {
+      const auto expected = brute_force(seqs, K, m, canonical_kmers);
+      size_t num_super_kmers;
+      ASSERT_EQ(expected,
+                read_super_kmers<K>(seqs, canonical_kmers, m, &num_super_kmers))
+          << "K=" << K << " m=" << m << " canonical " << canonical_kmers;
+      if (m > 0 && m < K) {
+        // Runs, not one k-mer each.
+        EXPECT_LT(num_super_kmers, expected.size()) << "K=" << K << " m=" << m;
+      }
+    }
+  }
+}
+
+TEST(SuperKMerTest, ReverseComplement) {
+  std::mt19937_64 rng(1);
+  for (uint32_t k = 1; k <= DNAKMer<1>::MAX_K; k++) {
+    std::string kmer(k, 'A');
+    for (char& c : kmer) {
+      c = "ACGT"[rng() % 4];
+    }
+    EXPECT_EQ(encode(rc_bases(kmer)),
+              reverse_complement(encode(kmer), k))
+        << kmer;
+  }
+}
+
+TEST(SuperKMerTest, SameAsBruteForce) {
+  for (const char* alphabet : {"ACGT", "ACGTN", "AAAAAAAC"}) {
+    const auto seqs = random_seqs(40, alphabet);
+    check_super_kmers<1>(seqs);
+    check_super_kmers<2>(seqs);
+    check_super_kmers<5>(seqs);
+    check_super_kmers<21>(seqs);
+    check_super_kmers<31>(seqs);
+    check_super_kmers<32>(seqs);
+  }
+}
+
+TEST(SuperKMerTest, BothStrandsAgree) {
+  constexpr size_t K = 21;
+  const auto seqs = random_seqs(40, "ACGTN");
+  std::vector<std::string> rc_seqs;
+  for (const auto& seq : seqs) {
+    std::string rc = seq;
+    std::reverse(rc.begin(), rc.end());
+    for (char& c : rc) {
+      c = c == 'N' ? 'N' : "TGCA"[std::string_view("ACGT").find(c)];
+    }
+    rc_seqs.push_back(rc);
+  }
+  size_t num_super_kmers;
+  auto forward = read_super_kmers<K>(seqs, true, 11, &num_super_kmers);
+  auto backward = read_super_kmers<K>(rc_seqs, true, 11, &num_super_kmers);
+  std::sort(forward.begin(), forward.end());
+  std::sort(backward.begin(), backward.end());
+  EXPECT_EQ(forward, backward);
+}
+
+TEST(SuperKMerTest, NextAndNextSpan) {
+  constexpr size_t K = 15;
+  const auto seqs = random_seqs(20, "ACGTN");
+  SuperKMerReader one = make_reader<K>(seqs, true, 0);
+  SuperKMerReader spans = make_reader<K>(seqs, true, 0);
+  std::vector<uint64_t> expected, actual;
+  for (uint64_t kmer; one.next(&kmer);) {
+    expected.push_back(kmer);
+  }
+  for (std::span<const uint64_t> kmers; spans.next_span(&kmers);) {
+    actual.insert(actual.end(), kmers.begin(), kmers.end());
+  }
+  EXPECT_EQ(brute_force(seqs, K, 0, true).size(), expected.size());
+  EXPECT_EQ(expected, actual);
+}
+
+}  // namespace
+}  // namespace input_reader
+}  // namespace kmercounter
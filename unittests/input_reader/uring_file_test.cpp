@@ -0,0 +1,127 @@
+#include "input_reader/uring_file.hpp"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "input_reader/fastq.hpp"
+
+namespace kmercounter {
+namespace input_reader {
+namespace {
+/// Write `num_seqs` records of different lengths to a temporary file.
+std::string write_fastq(uint64_t num_seqs, bool trailing_newline = true) {
+  const std::string path = testing::TempDir() + "uring_file_test.fq";
+  std::ofstream file(path, std::ios::trunc);
+  for (uint64_t i = 0; i < num_seqs; i++) {
+    const std::string seq(50 + (i * 37) % 400, "ACGTN"[i % 5]);
+    file << "@seq" << i << "\n" << seq << "\n+\n" << std::string(seq.size(), 'E');
+    if (i + 1 < num_seqs || trailing_newline) {
+      file << "\n";
+    }
+  }
+  return path;
+}
+
+template <typename Reader, typename... Args>
+std::vector<std::string> read_all(uint64_t num_parts, Args... args) {
+  std::vector<std::string> out;
+  for (uint64_t part_id = 0; part_id < num_parts; part_id++) {
+    Reader reader(args..., part_id, num_parts);
+    for (std::string_view seq; reader.next(&seq);) {
+      out.emplace_back(seq);
+    }
+  }
+  return out;
+}
+
+/// Add the io_uring parameters after the partition.
+struct Uring : UringFastqReader {
+  static inline uint32_t chunk_size;
+  static inline uint32_t depth;
+  static inline bool direct;
+  Uring(const std::string& path, uint64_t part_id, uint64_t num_parts)
+      : UringFastqReader(path, part_id, num_parts, chunk_size, depth, direct) {}
+};
+
+TEST(UringFastqReaderTest, SameAsFastqReader) {
+  constexpr auto num_seqss = std::to_array({1, 3, 100, 5000});
+  constexpr auto num_partss = std::to_array({1, 2, 5, 13});
+  constexpr auto chunk_sizes = std::to_array({4096u, 64u * 1024});
+  constexpr auto depths = std::to_array({1u, 2u, 3u});
+
+  for (const auto num_seqs : num_seqss) {
+    for (const bool trailing_newline : {true, false}) {
+      const std::string path = write_fastq(num_seqs, trailing_newline);
+      for (const auto num_parts : num_partss) {
+        const auto expected = read_all<FastqReader>(num_parts, path);
+        ASSERT_EQ(num_seqs, expected.size());
+        for (const auto chunk_size : chunk_sizes) {
+          for (const auto depth : depths) {
+            Uring::chunk_size = chunk_size;
+            Uring::depth = depth;
+            Uring::direct = false;
+            ASSERT_EQ(expected, read_all<Uring>(num_parts, path))
+                << num_seqs << " seqs, " << num_parts << " partitions, chunk "
+                << chunk_size << ", depth " << depth;
+          }
+        }
+      }
+    }
+  }
+}
+
+/// Records without quality lines end where the next header starts. Whatever
+/// the alignment of the records, one sequence line ends right at the end of
+/// a chunk, and the next header is the first byte of the next chunk.
+TEST(UringFastqReaderTest, NoQuality) {
+  constexpr uint64_t seq_len = 61;
+  constexpr uint64_t num_seqs = 200;
+  const std::string path = testing::TempDir() + "uring_file_test_nq.fq";
+  Uring::chunk_size = 4096;
+  Uring::direct = false;
+  // "@s<i>\n" is 4 to 6 bytes, so one record or another ends at every
+  // offset mod 4096 as the first sequence grows.
+  for (uint64_t shift = 0; shift < seq_len + 8; shift++) {
+    {
+      std::ofstream file(path, std::ios::trunc);
+      for (uint64_t i = 0; i < num_seqs; i++) {
+        file << "@s" << i << "\n"
+             << std::string(i == 0 ? 1 + shift : seq_len, "ACGT"[i % 4])
+             << "\n";
+      }
+    }
+    // One partition: the partition bounds are found from the quality
+    // headers.
+    const auto expected = read_all<FastqReader>(1, path);
+    ASSERT_EQ(num_seqs, expected.size());
+    for (const uint32_t depth : {1u, 3u}) {
+      Uring::depth = depth;
+      ASSERT_EQ(expected, read_all<Uring>(1, path))
+          << "shift " << shift << ", depth " << depth;
+    }
+  }
+}
+
+TEST(UringFastqReaderTest, Direct) {
+  const std::string path = write_fastq(1000);
+  const int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    GTEST_SKIP() << "O_DIRECT is not supported by " << testing::TempDir();
+  }
+  close(fd);
+  Uring::chunk_size = 4096;
+  Uring::depth = 3;
+  Uring::direct = true;
+  for (const uint64_t num_parts : {1, 3, 7}) {
+    EXPECT_EQ(read_all<FastqReader>(num_parts, path),
+              read_all<Uring>(num_parts, path));
+  }
+}
+
+}  // namespace
+}  // namespace input_reader
+}  // namespace kmercounter
@@ -0,0 +1,293 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "types.hpp"
+
+#include "queues/section_queues.hpp"
+#include "queues/bqueue_aligned.hpp"
+#include "queues/lynxq_portable.hpp"
+#include "queues/mpmc_queue.hpp"
+
+namespace kmercounter {
+namespace {
+/// Entries 1 to `n`. None of them is the zero entry, which BQueueAligned
+/// uses for free slots.
+std::vector<data_t> make_entries(uint64_t n) {
+  std::vector<data_t> entries;
+  for (uint64_t i = 1; i <= n; i++) {
+    entries.emplace_back(i, i * 3);
+  }
+  return entries;
+}
+
+/// Odd sizes, so that the copies start and end anywhere in a cacheline, a
+/// section and the queue.
+constexpr size_t ENQ_SIZES[] = {1, 37, 255, 7, 130, 64};
+constexpr size_t DEQ_SIZES[] = {29, 3, 100, 1, 513};
+
+constexpr size_t SECTION_ENTRIES = SECTION_SIZE / sizeof(data_t);
+
+TEST(SectionQueueTest, BULK_ROUND_TRIP_TEST) {
+  constexpr size_t NUM_SECTIONS = 4;
+  SectionQueue q(1, 1, NUM_SECTIONS, std::vector<uint32_t>{0});
+  auto pq = &q.all_pqueues[0][0];
+  auto cq = &q.all_cqueues[0][0];
+
+  // Several laps around the queue, ending on a section boundary so that
+  // everything is published.
+  const auto entries = make_entries(SECTION_ENTRIES * NUM_SECTIONS * 5);
+  std::vector<data_t> out;
+  std::vector<data_t> buf(*std::max_element(std::begin(DEQ_SIZES),
+                                            std::end(DEQ_SIZES)));
+
+  data_t value;
+  ASSERT_EQ(q.dequeue_bulk(cq, 0, 0, buf), 0);
+  ASSERT_EQ(q.dequeue(cq, 0, 0, &value), RETRY);
+
+  size_t sent = 0;
+  for (size_t i = 0; sent < entries.size(); i++) {
+    const size_t n =
+        std::min(ENQ_SIZES[i % std::size(ENQ_SIZES)], entries.size() - sent);
+    ASSERT_EQ(q.enqueue_bulk(pq, 0, 0,
+                             std::span<const data_t>(&entries[sent], n)),
+              n);
+    sent += n;
+
+    // Drain what was published, so that the producer never waits on the
+    // consumer (both run on this thread).
+    for (size_t j = 0;; j++) {
+      const size_t want = DEQ_SIZES[(i + j) % std::size(DEQ_SIZES)];
+      const size_t got =
+          q.dequeue_bulk(cq, 0, 0, std::span<data_t>(buf.data(), want));
+      out.insert(out.end(), buf.begin(), buf.begin() + got);
+      if (got < want) {
+        break;
+      }
+    }
+    // Only whole sections are published.
+    ASSERT_EQ(out.size(), sent - sent % SECTION_ENTRIES);
+  }
+
+  ASSERT_EQ(out, entries);
+  ASSERT_EQ(q.dequeue_bulk(cq, 0, 0, buf), 0);
+}
+
+TEST(SectionQueueTest, BULK_AND_SINGLE_TEST) {
+  constexpr size_t NUM_SECTIONS = 2;
+  SectionQueue q(1, 1, NUM_SECTIONS, std::vector<uint32_t>{0});
+  auto pq = &q.all_pqueues[0][0];
+  auto cq = &q.all_cqueues[0][0];
+
+  // A bulk enqueue that picks up where single enqueues left off, and the
+  // other way around, across the wrap of the queue.
+  const auto entries = make_entries(SECTION_ENTRIES * NUM_SECTIONS * 3);
+  std::vector<data_t> out(entries.size());
+  size_t sent = 0, received = 0;
+  for (size_t i = 0; sent < entries.size(); i++) {
+    const size_t n =
+        std::min(ENQ_SIZES[i % std::size(ENQ_SIZES)], entries.size() - sent);
+    if (i % 2) {
+      for (size_t j = 0; j < n; j++) {
+        ASSERT_EQ(q.enqueue(pq, 0, 0, entries[sent + j]), SUCCESS);
+      }
+    } else {
+      ASSERT_EQ(q.enqueue_bulk(pq, 0, 0,
+                               std::span<const data_t>(&entries[sent], n)),
+                n);
+    }
+    sent += n;
+
+    if (i % 3) {
+      while (q.dequeue(cq, 0, 0, &out[received]) == SUCCESS) {
+        received++;
+      }
+    } else {
+      received += q.dequeue_bulk(
+          cq, 0, 0,
+          std::span<data_t>(&out[received], out.size() - received));
+    }
+  }
+
+  ASSERT_EQ(received, entries.size());
+  ASSERT_EQ(out, entries);
+}
+
+TEST(BQueueAlignedTest, IS_EMPTY_TEST) {
+  EXPECT_TRUE(BQueueAligned::is_empty(data_t{}));
+  EXPECT_FALSE(BQueueAligned::is_empty(data_t(1, 0)));
+  EXPECT_FALSE(BQueueAligned::is_empty(data_t(0, 1)));
+
+  // A fresh queue is all free slots: the producer can reserve a batch and
+  // the consumer finds nothing.
+  BQueueAligned q(1, 1, 256);
+  data_t value;
+  ASSERT_EQ(q.dequeue(0, 0, &value), RETRY);
+  ASSERT_EQ(q.enqueue(0, 0, data_t(1, 2)), SUCCESS);
+  q.push_done(0, 0);
+  ASSERT_EQ(q.dequeue(0, 0, &value), SUCCESS);
+  EXPECT_EQ(value, data_t(1, 2));
+  ASSERT_EQ(q.dequeue(0, 0, &value), RETRY);
+}
+
+TEST(BQueueAlignedTest, BULK_ROUND_TRIP_TEST) {
+  constexpr size_t QUEUE_SIZE = 512;
+  BQueueAligned q(1, 1, QUEUE_SIZE);
+
+  const auto entries = make_entries(QUEUE_SIZE * 6 + 17);
+  std::vector<data_t> out(entries.size());
+  size_t sent = 0, received = 0;
+  for (size_t i = 0; received < entries.size(); i++) {
+    const size_t n =
+        std::min(ENQ_SIZES[i % std::size(ENQ_SIZES)], entries.size() - sent);
+    sent += q.enqueue_bulk(0, 0, std::span<const data_t>(&entries[sent], n));
+    if (sent == entries.size()) {
+      // let the consumer take the last, partial batch
+      q.push_done(0, 0);
+    }
+
+    const size_t want = std::min(DEQ_SIZES[i % std::size(DEQ_SIZES)],
+                                 out.size() - received);
+    received +=
+        q.dequeue_bulk(0, 0, std::span<data_t>(&out[received], want));
+    ASSERT_LT(i, entries.size()) << "no progress at " << received;
+  }
+
+  ASSERT_EQ(out, entries);
+  data_t value;
+  ASSERT_EQ(q.dequeue(0, 0, &value), RETRY);
+}
+
+TEST(MPMCQueueTest, EXACTLY_ONCE_TEST) {
+  constexpr uint32_t NPROD = 3;
+  constexpr uint32_t NCONS = 2;
+  // Two cursors on every ring, so that chunks of one ring are claimed
+  // concurrently.
+  constexpr uint32_t CURSORS = 2;
+  constexpr uint64_t PER_QUEUE = 5000;
+  // A small ring, so that it wraps many times and the producers wait on it.
+  MPMCQueue q(NPROD, NCONS, 2, std::vector<uint32_t>{0, 0});
+
+  std::vector<std::thread> threads;
+  for (uint32_t p = 0; p < NPROD; p++) {
+    threads.emplace_back([&q, p]() {
+      for (uint64_t i = 0; i < PER_QUEUE; i++) {
+        for (uint32_t c = 0; c < NCONS; c++) {
+          q.enqueue(&q.all_pqueues[p][c], p, c,
+                    data_t(p * PER_QUEUE + i + 1, c));
+        }
+      }
+      for (uint32_t c = 0; c < NCONS; c++) {
+        q.push_done(p, c);
+      }
+    });
+  }
+
+  // Once a ring has handed out the push_done() of every producer, all of
+  // its chunks have been claimed, but they may still be being drained.
+  std::atomic<uint32_t> done[NCONS] = {};
+  std::vector<data_t> received[NCONS][CURSORS];
+  for (uint32_t c = 0; c < NCONS; c++) {
+    for (uint32_t k = 0; k < CURSORS; k++) {
+      threads.emplace_back([&, c, k]() {
+        auto cq = &q.all_cqueues[c][k];
+        data_t value;
+        while (done[c] < NPROD || cq->chunk) {
+          if (q.dequeue(cq, k, c, &value) != SUCCESS) {
+            std::this_thread::yield();
+          } else if (value == MPMCQueue::BQ_MAGIC_KV) {
+            done[c]++;
+          } else {
+            received[c][k].push_back(value);
+          }
+        }
+      });
+    }
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (uint32_t c = 0; c < NCONS; c++) {
+    std::vector<uint32_t> seen(NPROD * PER_QUEUE);
+    uint64_t count = 0, sum = 0;
+    for (uint32_t k = 0; k < CURSORS; k++) {
+      for (const auto &kv : received[c][k]) {
+        ASSERT_EQ(kv.value, c);
+        ASSERT_GE(kv.key, 1);
+        ASSERT_LE(kv.key, seen.size());
+        seen[kv.key - 1]++;
+        count++;
+        sum += kv.key;
+      }
+    }
+    EXPECT_EQ(count, seen.size()) << "consumer " << c;
+    EXPECT_EQ(sum, seen.size() * (seen.size() + 1) / 2) << "consumer " << c;
+    EXPECT_EQ(std::count(seen.begin(), seen.end(), 1), seen.size())
+        << "consumer " << c;
+    EXPECT_FALSE(q.has_data(&q.all_cqueues[c][0], 0, c));
+  }
+}
+
+TEST(LynxQueueTest, WRAP_ORDER_TEST) {
+  constexpr uint32_t NPROD = 2;
+  constexpr uint32_t NCONS = 2;
+  // 32 entries a section, so that every queue wraps around its two sections
+  // 64 times and ends in the middle of one.
+  constexpr size_t QUEUE_SIZE = 1024;
+  constexpr uint64_t PER_QUEUE = 64 * QUEUE_SIZE / sizeof(data_t) + 21;
+  LynxQueue q(NPROD, NCONS, QUEUE_SIZE, std::vector<uint32_t>{0, 0});
+
+  std::vector<std::thread> producers;
+  for (uint32_t p = 0; p < NPROD; p++) {
+    producers.emplace_back([&q, p]() {
+      for (uint64_t i = 1; i <= PER_QUEUE; i++) {
+        for (uint32_t c = 0; c < NCONS; c++) {
+          q.enqueue(&q.all_pqueues[p][c], p, c, data_t(i, p * NCONS + c));
+        }
+      }
+      for (uint32_t c = 0; c < NCONS; c++) {
+        q.push_done(p, c);
+      }
+    });
+  }
+
+  // The consumers take turns on this thread, and check that every queue
+  // comes out in order.
+  uint64_t next[NPROD][NCONS];
+  std::fill(&next[0][0], &next[0][0] + NPROD * NCONS, 1);
+  uint32_t done = 0;
+  while (done < NPROD * NCONS) {
+    for (uint32_t c = 0; c < NCONS; c++) {
+      for (uint32_t p = 0; p < NPROD; p++) {
+        auto cq = &q.all_cqueues[c][p];
+        data_t value;
+        if (next[p][c] > PER_QUEUE + 1) {
+          continue;
+        }
+        while (q.dequeue(cq, p, c, &value) == SUCCESS) {
+          if (value == LynxQueue::BQ_MAGIC_KV) {
+            EXPECT_EQ(next[p][c], PER_QUEUE + 1);
+            next[p][c] = PER_QUEUE + 2;
+            done++;
+            break;
+          }
+          // not ASSERT: the producers have to be joined
+          EXPECT_EQ(value, data_t(next[p][c], p * NCONS + c))
+              << "producer " << p << " consumer " << c;
+          next[p][c] = value.key + 1;
+        }
+      }
+    }
+    std::this_thread::yield();
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+}
+}  // namespace
+}  // namespace kmercounter